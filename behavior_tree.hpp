@@ -3,11 +3,17 @@
 #define BEHAVIOR_TREE_H
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <deque>
-#include <iostream>
+#include <limits>
 #include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
 #include <vector>
 
 
@@ -18,7 +24,7 @@
 namespace bt
 {
 
-enum class Status
+enum class Status : uint8_t
 {
     Initial,
     Running,
@@ -27,855 +33,4259 @@ enum class Status
     Suspended,
 };
 
-inline std::ostream& operator<<(std::ostream& os, const Status& s)
+inline const char* statusName(Status s) noexcept
 {
-    if (s == Status::Success) os << "Success";
-    if (s == Status::Running) os << "Running";
-    if (s == Status::Failure) os << "Failure";
-    if (s == Status::Initial) os << "Initial";
-    if (s == Status::Suspended) os << "Suspended";
-    return os;
+    switch (s)
+    {
+        case Status::Initial: return "Initial";
+        case Status::Running: return "Running";
+        case Status::Success: return "Success";
+        case Status::Failure: return "Failure";
+        case Status::Suspended: return "Suspended";
+    }
+    return "";
 }
 
 }
 
 #endif
 
-#ifndef BEHAVIOR_TREE_NODES_H
-#define BEHAVIOR_TREE_NODES_H
+#ifndef BEHAVIOR_TREE_ERRORS_H
+#define BEHAVIOR_TREE_ERRORS_H
 
 
+// Defining BEHAVIOR_TREE_NO_EXCEPTIONS, or compiling without exception support, reports errors
+// to the error handler instead of throwing them. Failing calls return nullptr or false and
+// user functions are called without a try/catch around them:
+#if !defined(BEHAVIOR_TREE_NO_EXCEPTIONS) && !(defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND))
+#define BEHAVIOR_TREE_NO_EXCEPTIONS
+#endif
+
+// Guards user functions, whose exceptions fail the node calling them:
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+#define BEHAVIOR_TREE_TRY if (true)
+#define BEHAVIOR_TREE_CATCH else
+#else
+#define BEHAVIOR_TREE_TRY try
+#define BEHAVIOR_TREE_CATCH catch (...)
+#endif
+
 namespace bt
 {
 
-class Node
-{
-public:
-    virtual const char* name() const noexcept { return "Node"; }
-    Status status() const noexcept { return nodeStatus; }
-    virtual void traverse(class Visitor& visitor) const;
-    virtual ~Node() {}
-    friend class Scheduler;
-protected:
-    virtual void start(class Scheduler& scheduler) noexcept {}
-    virtual Status update() noexcept = 0;
-    virtual void stop(class Scheduler& scheduler) noexcept {}
-private:
-    void tick(class Scheduler& scheduler) noexcept
-    {
-        if (nodeStatus != Status::Running)
-            start(scheduler);
-        nodeStatus = update();
-        // std::cout << "Tick Node: " << name() << " " << nodeStatus << std::endl;
-    }
-    Status nodeStatus = Status::Initial;
-    class Observer* observer = nullptr;
-};
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+constexpr bool ThrowsErrors = false;
+#else
+constexpr bool ThrowsErrors = true;
+#endif
 
+typedef void (*ErrorHandler) (const char* message);
 
-class Observer
+inline ErrorHandler& errorHandler() noexcept
 {
-public:
-    friend class Scheduler;
-protected:
-    virtual void onComplete(class Scheduler& scheduler, const Node& node, Status status) noexcept = 0;
-};
-
+    static ErrorHandler handler = nullptr;
+    return handler;
+}
 
-class NamedNode: public Node
+// Sets the handler errors are reported to without exceptions, returns the previous one:
+inline ErrorHandler setErrorHandler(ErrorHandler handler) noexcept
 {
-public:
-    NamedNode(const char* name) : nodeName(name) {}
-    virtual const char* name() const noexcept override { return nodeName; }
-private:
-    const char* nodeName;
-};
-
+    ErrorHandler previous = errorHandler();
+    errorHandler() = handler;
+    return previous;
+}
 
-class SubTree : public NamedNode, public Observer
+// Throws the error, or reports it and returns so the caller can return its failure value:
+inline void raise(const char* message)
 {
-public:
-    SubTree(const char* name, const std::shared_ptr<class BehaviorTree>& tree)
-        : NamedNode(name), tree(tree) {}
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+    if (ErrorHandler handler = errorHandler())
+        handler(message);
+#else
+    throw std::runtime_error(message);
+#endif
+}
 
-    virtual void traverse(Visitor& visitor) const override;
-    void traverseSubTree(Visitor& visitor) const;
-protected:
-    virtual void start(class Scheduler& scheduler) noexcept override;
-    virtual Status update() noexcept override { return Status::Suspended; }
-    virtual void stop(class Scheduler& scheduler) noexcept override;
-    virtual void onComplete(class Scheduler& scheduler, const Node& root, Status status) noexcept override;
-private:
-    std::shared_ptr<class BehaviorTree> tree;
-};
+}
 
+#endif
 
-typedef bool (*ConditionFunction) ();
+#ifndef BEHAVIOR_TREE_STATE_H
+#define BEHAVIOR_TREE_STATE_H
 
-class Condition: public NamedNode
-{
-public:
-    Condition(const char* name, ConditionFunction check)
-        : NamedNode(name), check(check) {}
-protected:
-    virtual Status update() noexcept override
-    {
-        try
-        {
-            return check() ? Status::Success : Status::Failure;
-        }
-        catch (...)
-        {
-            return Status::Failure;
-        }
-    }
-private:
-    ConditionFunction check;
-};
 
+namespace bt
+{
 
-typedef Status (*ActionFunction) ();
+class Node;
 
-class Action : public NamedNode
+class StateWriter
 {
 public:
-    Action(const char* name, ActionFunction action)
-        : NamedNode(name), action(action) {}
-protected:
-    virtual Status update() noexcept override
+    explicit StateWriter(std::vector<uint8_t>& buffer) : buffer(buffer) { buffer.clear(); }
+
+    template <typename T>
+    void write(T value)
     {
-        try
-        {
-            return action();
-        }
-        catch (...)
-        {
-            return Status::Failure;
-        }
+        size_t offset = buffer.size();
+        buffer.resize(offset + sizeof(T));
+        memcpy(buffer.data() + offset, &value, sizeof(T));
     }
 private:
-    ActionFunction action;
+    std::vector<uint8_t>& buffer;
 };
 
 
-class AsyncNode: public Node
+// Restoring reads a blob twice: the first pass only validates it and collects its nodes, so a
+// corrupt blob is rejected before the first node changes. The second pass applies it.
+class StateReader
 {
 public:
-    virtual const char* name() const noexcept override { return "Async Node"; }
-    void succeeded() noexcept;
-    void failed() noexcept;
-protected:
-    virtual void start() noexcept = 0;
-    virtual void start(class Scheduler& scheduler) noexcept override;
-    virtual Status update() noexcept override { return Status::Suspended; }
-private:
-    class Scheduler* scheduler;
-};
-
+    enum class Pass { Validate, Apply };
 
-typedef void (*AsyncActionFunction) (class AsyncAction&);
+    StateReader(const uint8_t* data, size_t size, Pass pass = Pass::Apply) : data(data), size(size), pass(pass) {}
 
-class AsyncAction : public AsyncNode
-{
-public:
-    AsyncAction(const char* name, AsyncActionFunction onStart, AsyncActionFunction onStop = nullptr)
-        : nodeName(name), onStart(onStart), onStop(onStop) {}
-    virtual const char* name() const noexcept override { return nodeName; }
-protected:
-    virtual void start() noexcept override
+    template <typename T>
+    T read()
     {
-        try
-        {
-            onStart(*this);
-        }
-        catch (...)
+        T value = T();
+        if (offset + sizeof(T) > size)
         {
-            failed();
+            failed = true;
+            return value;
         }
+        memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
     }
 
-    virtual void stop(class Scheduler& scheduler) noexcept override
-    {
-        try
-        {
-            if (onStop)
-                onStop(*this);
-        }
-        catch (...)
-        {
-        }
-    }
+    // Marks the blob as corrupt, restoring it fails:
+    void reject() noexcept { failed = true; }
+    bool valid() const noexcept { return !failed; }
+    bool validating() const noexcept { return pass == Pass::Validate; }
+    bool complete() const noexcept { return !failed && offset == size; }
+
+    // Every node read by the validation pass, in traversal order:
+    std::vector<Node*> nodes;
 private:
-    const char* nodeName;
-    AsyncActionFunction onStart;
-    AsyncActionFunction onStop;
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+    Pass pass;
+    bool failed = false;
 };
 
 }
 
 #endif
 
-#ifndef BEHAVIOR_TREE_DECORATORS_H
-#define BEHAVIOR_TREE_DECORATORS_H
+#ifndef BEHAVIOR_TREE_LINKS_H
+#define BEHAVIOR_TREE_LINKS_H
 
 
 namespace bt
 {
 
-class Decorator : public Node, public Observer
+#if defined(BEHAVIOR_TREE_RELATIVE_LINKS)
+
+// 32-bit pointer relative to its own address, used for the links between objects in
+// a Memory arena. A finished arena holds no absolute pointers between its nodes, so it
+// can be copied or mapped at another address within the same process image.
+template <typename T>
+class Link
 {
 public:
-    void setChild(Node* child) { childNode = child; }
-    Node* child() const { return childNode; }
-    virtual void traverse(class Visitor& visitor) const override;
-    virtual ~Decorator() override;
-protected:
-    virtual void start(class Scheduler& scheduler) noexcept override;
-    virtual Status update() noexcept override { return Status::Suspended; }
-    virtual void stop(class Scheduler& scheduler) noexcept override;
+    Link(T* target = nullptr) { set(target); }
+    Link(const Link& link) { set(link.get()); }
+
+    Link& operator=(const Link& link) { set(link.get()); return *this; }
+    Link& operator=(T* target) { set(target); return *this; }
+
+    T* get() const noexcept { return offset ? (T*)((intptr_t)this + offset) : nullptr; }
+    operator T*() const noexcept { return get(); }
+    T* operator->() const noexcept { return get(); }
+    T& operator*() const noexcept { return *get(); }
 private:
-    Node* childNode = nullptr;
+    void set(T* target)
+    {
+        intptr_t distance = target ? (intptr_t)target - (intptr_t)this : 0;
+        if (distance != (int32_t)distance)
+        {
+            raise("BehaviorTree link target is outside of the link's Memory.");
+            distance = 0;
+        }
+        offset = (int32_t)distance;
+    }
+
+    int32_t offset = 0;
 };
 
+#else
 
-class Negate : public Decorator
+template <typename T>
+using Link = T*;
+
+#endif
+
+// Whether a node can link to a target at this address, compact nodes only have 16-bit offsets:
+inline bool reachable(const void* from, const void* to) noexcept
 {
-public:
-    virtual const char* name() const noexcept override { return "Not"; }
-protected:
-    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
-};
+#if defined(BEHAVIOR_TREE_COMPACT)
+    intptr_t offset = (intptr_t)to - (intptr_t)from;
+    return offset >= INT16_MIN && offset <= INT16_MAX;
+#else
+    return true;
+#endif
+}
 
 }
 
 #endif
 
-#ifndef BEHAVIOR_TREE_COMPOSITES_H
-#define BEHAVIOR_TREE_COMPOSITES_H
+#ifndef BEHAVIOR_TREE_OWNERSHIP_H
+#define BEHAVIOR_TREE_OWNERSHIP_H
 
 
 namespace bt
 {
 
-class Composite : public Node, public Observer
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+
+// Reference count stored in the owned object itself. Defining
+// BEHAVIOR_TREE_SINGLE_THREADED makes the count a plain integer.
+class RefCounted
 {
 public:
-    Composite(Node** children, uint16_t childCount)
-        : children(children), childCount(childCount) {}
+    typedef void (*Disposer)(RefCounted* object);
 
-    void addChild(Node* child);
-    virtual void traverse(class Visitor& visitor) const override;
-    void traverseChildren(class Visitor& visitor) const;
-    virtual ~Composite() override;
-protected:
-    virtual void start(class Scheduler& scheduler) noexcept override;
-    virtual Status update() noexcept override { return Status::Suspended; }
-    virtual void stop(class Scheduler& scheduler) noexcept override;
-    Node** children;
-    const uint16_t childCount;
-    uint16_t currentIndex = 0;
-};
+    void retain() const noexcept
+    {
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        ++references;
+#else
+        references.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
 
+    void release() const noexcept
+    {
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        if (--references == 0)
+#else
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+#endif
+            disposer(const_cast<RefCounted*>(this));
+    }
 
-class Sequence : public Composite
-{
-public:
-    using Composite::Composite;
-    virtual const char* name() const noexcept override { return "Sequence"; }
+    void setDisposer(Disposer dispose) noexcept { disposer = dispose; }
 protected:
-    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
+    RefCounted() = default;
+    RefCounted(const RefCounted&) : references(0) {}
+    RefCounted& operator=(const RefCounted&) { return *this; }
+private:
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+    mutable uint32_t references = 0;
+#else
+    mutable std::atomic<uint32_t> references{0};
+#endif
+    Disposer disposer = nullptr;
 };
 
 
-class Selector : public Composite
+template <typename T>
+class IntrusivePtr
 {
 public:
-    using Composite::Composite;
-    virtual const char* name() const noexcept override { return "Selector"; }
-protected:
-    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
-};
-
-
-class Parallel : public Composite {
-public:
-    enum class Policy { RequireOne, RequireAll };
-
-    Parallel(Node** children, uint16_t childCount, Policy success, Policy failure = Policy::RequireAll)
-        : Composite(children, childCount), successPolicy(success), failurePolicy(failure) {}
+    IntrusivePtr() noexcept : object(nullptr) {}
+    IntrusivePtr(std::nullptr_t) noexcept : object(nullptr) {}
+    explicit IntrusivePtr(T* object) noexcept : object(object) { if (object) object->retain(); }
+    IntrusivePtr(const IntrusivePtr& p) noexcept : object(p.object) { if (object) object->retain(); }
+    IntrusivePtr(IntrusivePtr&& p) noexcept : object(p.object) { p.object = nullptr; }
+    template <typename U>
+    IntrusivePtr(const IntrusivePtr<U>& p) noexcept : object(p.get()) { if (object) object->retain(); }
+    ~IntrusivePtr() { if (object) object->release(); }
+
+    IntrusivePtr& operator=(IntrusivePtr p) noexcept
+    {
+        T* previous = object;
+        object = p.object;
+        p.object = previous;
+        return *this;
+    }
 
-    virtual const char* name() const noexcept override { return "Parallel"; }
-protected:
-    virtual void start(class Scheduler& scheduler) noexcept override;
-    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
+    T* get() const noexcept { return object; }
+    T* operator->() const noexcept { return object; }
+    T& operator*() const noexcept { return *object; }
+    explicit operator bool() const noexcept { return object != nullptr; }
+    bool operator==(std::nullptr_t) const noexcept { return object == nullptr; }
+    bool operator!=(std::nullptr_t) const noexcept { return object != nullptr; }
 private:
-    uint16_t successCount = 0;
-    uint16_t failureCount = 0;
-    Policy successPolicy;
-    Policy failurePolicy;
+    T* object;
 };
 
+template <typename T>
+using Ref = IntrusivePtr<T>;
+
+template <typename T, void (*Dispose)(T*)>
+void disposeRefCounted(RefCounted* object) { Dispose(static_cast<T*>(object)); }
+
+// Takes ownership of an object, Dispose is called once the last reference is released:
+template <typename T, void (*Dispose)(T*)>
+Ref<T> adopt(T* object)
+{
+    object->setDisposer(&disposeRefCounted<T, Dispose>);
+    return Ref<T>(object);
 }
 
-#endif
+#else
 
-#ifndef BEHAVIOR_TREE_VISITORS_H
-#define BEHAVIOR_TREE_VISITORS_H
+// Ownership goes through std::shared_ptr, the base is left empty:
+class RefCounted {};
 
+template <typename T>
+using Ref = std::shared_ptr<T>;
 
-namespace bt
+template <typename T, void (*Dispose)(T*)>
+Ref<T> adopt(T* object)
 {
+    return Ref<T>(object, Dispose);
+}
 
-class Visitor
-{
-public:
-    virtual void begin() {}
-    virtual void beforeChildNodes(const Composite& node) {}
-    virtual void visit(const Node& node) = 0;
-    virtual void visit(const Composite& node) { visit((Node&)node); }
-    virtual void visit(const Decorator& node) { visit((Node&)node); }
-    virtual void visit(const SubTree& tree) { visit((Node&)tree); }
-    virtual void afterChildNodes(const Composite& node) {}
-    virtual void end() {}
-};
+#endif
 
+// Dispose functions for heap objects and objects placed in an arena:
+template <typename T>
+void deleteObject(T* object) { delete object; }
 
-class TextSerializer : public Visitor
+template <typename T>
+void destroyInPlace(T* object) { object->~T(); }
+
+template <typename T, typename... Args>
+Ref<T> makeRef(Args&&... args)
 {
-public:
-    TextSerializer(std::ostream& out, bool expand = false) : out{out}, expand{expand} {}
-    virtual void begin() override { depth = 0; }
-    virtual void beforeChildNodes(const Composite& node) override { ++depth; }
-    virtual void visit(const Node& node) override { print(node.name(), node.status()); }
-    virtual void afterChildNodes(const Composite& node) override { --depth; }
-    virtual void visit(const Decorator& node) override;
-    virtual void visit(const SubTree& tree) override;
-protected:
-    virtual void print(const char* name, Status status, const char* prefix = nullptr);
-private:
-    int depth = 0;
-    bool expand;
-    std::ostream& out;
-};
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    return adopt<T, &deleteObject<T>>(new T(std::forward<Args>(args)...));
+#else
+    return std::make_shared<T>(std::forward<Args>(args)...);
+#endif
+}
 
 }
 
 #endif
 
-#ifndef BEHAVIOR_TREE_MEMORY_H
-#define BEHAVIOR_TREE_MEMORY_H
+#ifndef BEHAVIOR_TREE_HANDLES_H
+#define BEHAVIOR_TREE_HANDLES_H
 
 
 namespace bt
 {
 
-class Memory
+// Weak 32-bit reference to a tree or an async node. The low bits index a slot of the handle
+// table, the next bit holds the kind of the object and the high bits hold the generation of
+// the slot, 0 is never a valid handle.
+typedef uint32_t Handle;
+
+enum class HandleKind : uint32_t
+{
+    Tree,
+    Async
+};
+
+// Process-wide table resolving handles. Releasing a handle bumps the generation of its slot,
+// so a handle that outlived its object resolves to nullptr after a single compare, without
+// reference counting. Released slots wait in FIFO order until more than MinimumFree of them
+// are free, the table grows instead until then, so a stale handle can only match again after
+// its slot went through all generations, millions of acquisitions later.
+// Slots are added in chunks, the first one in static storage so the first trees don't allocate.
+// Each thread takes fresh slots and gives back released ones in batches, so only one acquire
+// or release per batch takes the spin lock of the table, BEHAVIOR_TREE_SINGLE_THREADED leaves
+// it out. Resolving a handle never locks.
+class Handles
 {
 public:
-    Memory(const size_t maxBytes)
-        : buffer(new uint8_t[maxBytes]), maxBytes(maxBytes) {}
+    static const uint32_t IndexBits = 20;
+    static const uint32_t Capacity = 1u << IndexBits;
+    static const uint32_t MinimumFree = 1024;
 
-    Memory(const Memory& m)
-        : buffer(new uint8_t[m.maxBytes]), maxBytes(m.maxBytes), offset(m.offset)
+    // Returns 0 once all slots are in use:
+    static Handle acquire(void* object, HandleKind kind) noexcept
     {
-        if (offset > 0)
-            memcpy(buffer, m.buffer, offset);
+        Cache& cache = threadCache();
+        if (!cache.freeCount && !refill(cache))
+            return 0;
+
+        Table& table = instance();
+        Slot& slot = *table.slot(cache.free[--cache.freeCount]);
+        Handle handle = slot.handle.load(std::memory_order_relaxed) | (uint32_t)kind << KindShift;
+        slot.object.store(object, std::memory_order_release);
+        slot.handle.store(handle, std::memory_order_release);
+        ++table.used;
+        return handle;
     }
 
-    Memory(Memory&& m) noexcept
-        : buffer(m.buffer), offset(m.offset), maxBytes(m.maxBytes)
+    // Invalidates the handle, released and invalid handles are ignored:
+    static void release(Handle handle) noexcept
     {
-        m.buffer = nullptr;
-    }
+        Table& table = instance();
+        Slot* slot = handle ? table.slot(handle & IndexMask) : nullptr;
+        if (!slot || !slot->object.load(std::memory_order_relaxed))
+            return;
 
-    ~Memory() { delete[] buffer; }
+        // The generation is bumped before the object is cleared, so get() never returns it for the new handle:
+        uint32_t generation = (handle >> GenerationShift) + 1;
+        Handle next = (generation > GenerationMask ? 1 : generation) << GenerationShift | (handle & IndexMask);
+        if (!slot->handle.compare_exchange_strong(handle, next, std::memory_order_acq_rel))
+            return;
+        slot->object.store(nullptr, std::memory_order_release);
+        --table.used;
 
-    size_t size() const { return offset; }
-    size_t maxSize() const { return maxBytes; }
+        Cache& cache = threadCache();
+        cache.released[cache.releasedCount++] = handle & IndexMask;
+        if (cache.releasedCount == Batch || cache.exited)
+            flush(cache);
+    }
 
-    template <typename T, typename... Args>
+    // Returns the object while its handle is valid, nullptr once it was released or for handles
+    // of another kind:
+    static void* get(Handle handle, HandleKind kind) noexcept
+    {
+        if (!handle || (handle >> KindShift & 1) != (uint32_t)kind)
+            return nullptr;
+        const Slot* slot = instance().slot(handle & IndexMask);
+        if (!slot || slot->handle.load(std::memory_order_acquire) != handle)
+            return nullptr;
+        void* object = slot->object.load(std::memory_order_acquire);
+        return slot->handle.load(std::memory_order_acquire) == handle ? object : nullptr;
+    }
+
+    // Number of handles in use:
+    static size_t size() noexcept { return instance().used; }
+private:
+    static const uint32_t IndexMask = Capacity - 1;
+    static const uint32_t KindShift = IndexBits;
+    static const uint32_t GenerationShift = IndexBits + 1;
+    static const uint32_t GenerationMask = UINT32_MAX >> GenerationShift;
+    static const uint32_t ChunkBits = 12;
+    static const uint32_t ChunkSize = 1u << ChunkBits;
+    static const uint32_t Batch = 32;
+    static const uint32_t None = UINT32_MAX;
+
+    // Free slots hold the handle they will be acquired with next, without kind, and no object:
+    struct Slot
+    {
+        std::atomic<void*> object{nullptr};
+        std::atomic<Handle> handle{0};
+        uint32_t nextFree = None;
+    };
+
+    // Fresh or recycled slots a thread acquires from, and slots it released since its last flush.
+    // Exiting threads give all of them back, later releases by their static destructors are flushed
+    // one by one:
+    struct Cache
+    {
+        uint32_t free[Batch];
+        uint32_t freeCount = 0;
+        uint32_t released[Batch];
+        uint32_t releasedCount = 0;
+        bool exited = false;
+
+        ~Cache()
+        {
+            flush(*this);
+            for (uint32_t i = 0; i < freeCount; ++i)
+                released[i] = free[i];
+            releasedCount = freeCount;
+            freeCount = 0;
+            flush(*this);
+            exited = true;
+        }
+    };
+
+    // Slots past the top were never used, the chunks they need are allocated when the top reaches them:
+    struct Table
+    {
+        std::atomic<Slot*> chunks[Capacity / ChunkSize];
+        uint32_t top = 0;
+        uint32_t firstFree = None;
+        uint32_t lastFree = None;
+        uint32_t freeCount = 0;
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        size_t used = 0;
+#else
+        std::atomic<size_t> used{0};
+        std::atomic<bool> locked{false};
+#endif
+
+        explicit Table(Slot* first) noexcept
+        {
+            chunks[0].store(first, std::memory_order_relaxed);
+            for (uint32_t i = 1; i < Capacity / ChunkSize; ++i)
+                chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        Slot* slot(uint32_t index) const noexcept
+        {
+            Slot* chunk = chunks[index >> ChunkBits].load(std::memory_order_acquire);
+            return chunk ? chunk + (index & (ChunkSize - 1)) : nullptr;
+        }
+    };
+
+    struct Lock
+    {
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        explicit Lock(Table& table) noexcept {}
+#else
+        explicit Lock(Table& table) noexcept : table(table)
+        {
+            while (table.locked.exchange(true, std::memory_order_acquire))
+                while (table.locked.load(std::memory_order_relaxed)) {}
+        }
+        ~Lock() { table.locked.store(false, std::memory_order_release); }
+        Table& table;
+#endif
+    };
+
+    // Released slots are only reused once enough of them are free, the table grows until then:
+    static bool refill(Cache& cache) noexcept
+    {
+        Table& table = instance();
+        Lock lock(table);
+        while (cache.freeCount < Batch)
+        {
+            uint32_t index = table.firstFree;
+            if (index != None && (table.freeCount > MinimumFree || table.top == Capacity))
+            {
+                table.firstFree = table.slot(index)->nextFree;
+                if (table.firstFree == None)
+                    table.lastFree = None;
+                --table.freeCount;
+            }
+            else if (table.top < Capacity)
+            {
+                index = table.top;
+                Slot* chunk = table.chunks[index >> ChunkBits].load(std::memory_order_relaxed);
+                if (!chunk)
+                {
+                    chunk = new (std::nothrow) Slot[ChunkSize];
+                    if (!chunk)
+                        break;
+                    table.chunks[index >> ChunkBits].store(chunk, std::memory_order_release);
+                }
+                chunk[index & (ChunkSize - 1)].handle.store(1u << GenerationShift | index, std::memory_order_relaxed);
+                ++table.top;
+            }
+            else
+                break;
+            cache.free[cache.freeCount++] = index;
+        }
+        return cache.freeCount != 0;
+    }
+
+    static void flush(Cache& cache) noexcept
+    {
+        if (!cache.releasedCount)
+            return;
+
+        Table& table = instance();
+        Lock lock(table);
+        for (uint32_t i = 0; i < cache.releasedCount; ++i)
+        {
+            uint32_t index = cache.released[i];
+            table.slot(index)->nextFree = None;
+            if (table.lastFree != None)
+                table.slot(table.lastFree)->nextFree = index;
+            else
+                table.firstFree = index;
+            table.lastFree = index;
+        }
+        table.freeCount += cache.releasedCount;
+        cache.releasedCount = 0;
+    }
+
+    // Chunks are never freed, trees destroyed by static destructors can still release their handles:
+    static Table& instance() noexcept
+    {
+        static Slot first[ChunkSize];
+        static Table table(first);
+        return table;
+    }
+
+    // The table is created first, so it outlives the cache:
+    static Cache& threadCache() noexcept
+    {
+        instance();
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        static Cache cache;
+#else
+        static thread_local Cache cache;
+#endif
+        return cache;
+    }
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_NODES_H
+#define BEHAVIOR_TREE_NODES_H
+
+
+namespace bt
+{
+
+// Run queue of a Scheduler a node is queued in, one per tree. Compact nodes only have a byte
+// left for it, so a compact scheduler with more than 255 live trees shares partitions:
+#if defined(BEHAVIOR_TREE_COMPACT)
+typedef uint8_t Partition;
+#else
+typedef uint16_t Partition;
+#endif
+
+
+class Observer
+{
+public:
+    friend class Scheduler;
+protected:
+    virtual void onComplete(class Scheduler& scheduler, const class Node& node, Status status) noexcept = 0;
+};
+
+
+// Nodes are their own observers so composites and decorators need a single vtable pointer:
+class Node : public Observer
+{
+public:
+    virtual const char* name() const noexcept { return "Node"; }
+    Status status() const noexcept { return nodeStatus; }
+    virtual void traverse(class Visitor& visitor) const;
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, class Observer* observer);
+    virtual ~Node() {}
+    friend class Scheduler;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept {}
+    virtual Status update() noexcept = 0;
+    virtual void stop(class Scheduler& scheduler) noexcept {}
+    // Synchronous nodes only complete from update() and can be ticked in place by their parent:
+    virtual bool synchronous() const noexcept { return false; }
+    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override {}
+private:
+    void tick(class Scheduler& scheduler) noexcept
+    {
+        if (nodeStatus != Status::Running)
+            start(scheduler);
+        nodeStatus = update();
+        // std::cout << "Tick Node: " << name() << " " << nodeStatus << std::endl;
+    }
+    // The status and partition are last so derived classes can pack small members into the padding after them:
+    Link<Observer> observer = nullptr;
+    Status nodeStatus = Status::Initial;
+    Partition partition = 0;
+};
+
+
+// Defining BEHAVIOR_TREE_STRIP_NAMES compiles node names out of release builds:
+class NamedNode: public Node
+{
+public:
+#if defined(BEHAVIOR_TREE_STRIP_NAMES)
+    NamedNode(const char* name) {}
+#else
+    NamedNode(const char* name) : nodeName(name) {}
+    virtual const char* name() const noexcept override { return nodeName; }
+private:
+    const char* nodeName;
+#endif
+};
+
+
+class SubTree : public NamedNode
+{
+public:
+    SubTree(const char* name, const Ref<class BehaviorTree>& tree)
+        : NamedNode(name), tree(tree) {}
+
+    virtual void traverse(Visitor& visitor) const override;
+    void traverseSubTree(Visitor& visitor) const;
+    virtual void saveState(StateWriter& writer, const Scheduler& scheduler) const override;
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override { return Status::Suspended; }
+    virtual void stop(class Scheduler& scheduler) noexcept override;
+private:
+    Ref<class BehaviorTree> tree;
+};
+
+
+typedef bool (*ConditionFunction) ();
+
+class Condition: public NamedNode
+{
+public:
+    Condition(const char* name, ConditionFunction check)
+        : NamedNode(name), check(check) {}
+    friend class Builder;
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return check() ? Status::Success : Status::Failure;
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+
+    ConditionFunction check;
+};
+
+
+// Condition without side effects whose result can only change between ticks. Its check
+// runs at most once per tick through the scheduler's ConditionCache when it has one:
+class PureCondition : public Condition
+{
+public:
+    using Condition::Condition;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override { return result; }
+private:
+    Status result = Status::Failure;
+};
+
+
+// Leaf with a fixed result, the Optimizer folds it into its parents:
+class Constant : public Node
+{
+public:
+    explicit Constant(Status status) : result(status) {}
+    virtual const char* name() const noexcept override { return statusName(result); }
+    friend class Optimizer;
+    friend class Builder;
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override { return result; }
+private:
+    Status result;
+};
+
+
+typedef Status (*ActionFunction) ();
+
+class Action : public NamedNode
+{
+public:
+    Action(const char* name, ActionFunction action)
+        : NamedNode(name), action(action) {}
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return action();
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    ActionFunction action;
+};
+
+
+class AsyncNode: public Node
+{
+public:
+    virtual ~AsyncNode() override { Handles::release(asyncHandle); }
+    virtual const char* name() const noexcept override { return "Async Node"; }
+    void succeeded() noexcept;
+    void failed() noexcept;
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+
+    // Valid until the node completes or is stopped, so work that outlives the node, or its
+    // run, completes through the handle instead of a reference. Late completions return false:
+    Handle handle() const noexcept { return asyncHandle; }
+    static AsyncNode* find(Handle handle) noexcept { return (AsyncNode*)Handles::get(handle, HandleKind::Async); }
+    static bool succeeded(Handle handle) noexcept;
+    static bool failed(Handle handle) noexcept;
+protected:
+    virtual void start() noexcept = 0;
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override { return asyncHandle ? Status::Suspended : Status::Failure; }
+    virtual void stop(class Scheduler& scheduler) noexcept override { release(); }
+    void release() noexcept;
+private:
+
+    class Scheduler* scheduler;
+    Handle asyncHandle = 0;
+};
+
+
+typedef void (*AsyncActionFunction) (class AsyncAction&);
+
+class AsyncAction : public AsyncNode
+{
+public:
+#if defined(BEHAVIOR_TREE_STRIP_NAMES)
+    AsyncAction(const char* name, AsyncActionFunction onStart, AsyncActionFunction onStop = nullptr)
+        : onStart(onStart), onStop(onStop) {}
+#else
+    AsyncAction(const char* name, AsyncActionFunction onStart, AsyncActionFunction onStop = nullptr)
+        : nodeName(name), onStart(onStart), onStop(onStop) {}
+    virtual const char* name() const noexcept override { return nodeName; }
+#endif
+protected:
+    virtual void start() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            onStart(*this);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            failed();
+        }
+    }
+
+    virtual void stop(class Scheduler& scheduler) noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            if (onStop)
+                onStop(*this);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+        }
+        AsyncNode::stop(scheduler);
+    }
+private:
+#if !defined(BEHAVIOR_TREE_STRIP_NAMES)
+    const char* nodeName;
+#endif
+    AsyncActionFunction onStart;
+    AsyncActionFunction onStop;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_DECORATORS_H
+#define BEHAVIOR_TREE_DECORATORS_H
+
+
+namespace bt
+{
+
+class Decorator : public Node
+{
+public:
+    // Returns false when a compact child is out of reach of the decorator:
+    bool setChild(Node* child);
+    Node* child() const
+    {
+#if defined(BEHAVIOR_TREE_COMPACT)
+        return childOffset ? (Node*)((uintptr_t)this + childOffset) : nullptr;
+#else
+        return childNode;
+#endif
+    }
+    virtual void traverse(class Visitor& visitor) const override;
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const override;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, Observer* observer) override;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override { return Status::Suspended; }
+    virtual void stop(class Scheduler& scheduler) noexcept override;
+private:
+#if defined(BEHAVIOR_TREE_COMPACT)
+    // Compact decorators find their child, allocated right after them, through a small offset:
+    int16_t childOffset = 0;
+#else
+    Link<Node> childNode = nullptr;
+#endif
+};
+
+
+class Negate : public Decorator
+{
+public:
+    virtual const char* name() const noexcept override { return "Not"; }
+protected:
+    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
+};
+
+
+#if defined(BEHAVIOR_TREE_COMPACT)
+static_assert(sizeof(Decorator) == sizeof(Node), "Compact decorators should fit in the padding of Node.");
+static_assert(sizeof(Negate) == sizeof(Node), "Compact decorators should fit in the padding of Node.");
+#endif
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_COMPOSITES_H
+#define BEHAVIOR_TREE_COMPOSITES_H
+
+
+namespace bt
+{
+
+class Composite : public Node
+{
+public:
+    Composite(Link<Node>* children, uint16_t childCount)
+        : childCount(childCount) { setChildren(children); }
+
+    // Returns false when compact children are out of reach of the composite:
+    bool setChildren(Link<Node>* children);
+    void addChild(Node* child);
+    virtual void traverse(class Visitor& visitor) const override;
+    void traverseChildren(class Visitor& visitor) const;
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const override;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, Observer* observer) override;
+    friend class Optimizer;
+    friend class Builder;
+    friend class Lockstep;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override { return Status::Suspended; }
+    virtual void stop(class Scheduler& scheduler) noexcept override;
+
+    Link<Node>* children() const noexcept
+    {
+#if defined(BEHAVIOR_TREE_COMPACT)
+        return childrenOffset ? (Link<Node>*)((uintptr_t)this + childrenOffset) : nullptr;
+#else
+        return childNodes;
+#endif
+    }
+
+    uint16_t childCount;
+    uint16_t currentIndex = 0;
+private:
+#if defined(BEHAVIOR_TREE_COMPACT)
+    // Compact composites find their child array, allocated right after them, through a small offset:
+    int16_t childrenOffset = 0;
+#else
+    Link<Link<Node>> childNodes = nullptr;
+#endif
+};
+
+
+class Sequence : public Composite
+{
+public:
+    using Composite::Composite;
+    virtual const char* name() const noexcept override { return "Sequence"; }
+protected:
+    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
+};
+
+
+class Selector : public Composite
+{
+public:
+    using Composite::Composite;
+    virtual const char* name() const noexcept override { return "Selector"; }
+protected:
+    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
+};
+
+
+class Parallel : public Composite {
+public:
+    enum class Policy : uint8_t { RequireOne, RequireAll };
+
+    Parallel(Link<Node>* children, uint16_t childCount, Policy success, Policy failure = Policy::RequireAll)
+        : Composite(children, childCount), successPolicy(success), failurePolicy(failure) {}
+
+    virtual const char* name() const noexcept override { return "Parallel"; }
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const override;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, Observer* observer) override;
+    friend class Lockstep;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
+private:
+    uint16_t successCount = 0;
+    uint16_t failureCount = 0;
+    Policy successPolicy;
+    Policy failurePolicy;
+};
+
+
+#if defined(BEHAVIOR_TREE_COMPACT)
+static_assert(sizeof(Composite) <= 3 * sizeof(void*), "Compact composites should only add their counters to Node.");
+static_assert(sizeof(Sequence) <= 3 * sizeof(void*), "Compact sequences should only add their counters to Node.");
+static_assert(sizeof(Selector) <= 3 * sizeof(void*), "Compact selectors should only add their counters to Node.");
+static_assert(sizeof(Parallel) <= 4 * sizeof(void*), "Compact parallels should only add their counters and policies.");
+#endif
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_VISITORS_H
+#define BEHAVIOR_TREE_VISITORS_H
+
+
+namespace bt
+{
+
+class Visitor
+{
+public:
+    virtual void begin() {}
+    virtual void beforeChildNodes(const Composite& node) {}
+    virtual void visit(const Node& node) = 0;
+    virtual void visit(const Composite& node) { visit((Node&)node); }
+    virtual void visit(const Decorator& node) { visit((Node&)node); }
+    virtual void visit(const SubTree& tree) { visit((Node&)tree); }
+    virtual void afterChildNodes(const Composite& node) {}
+    virtual void end() {}
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_MEMORY_H
+#define BEHAVIOR_TREE_MEMORY_H
+
+
+#ifndef BEHAVIOR_TREE_SCHEDULER_H
+#define BEHAVIOR_TREE_SCHEDULER_H
+
+
+namespace bt
+{
+
+// Results of pure conditions for the current tick generation, in a small direct mapped
+// table keyed by the condition's function. Colliding functions simply evict each other:
+class ConditionCache
+{
+public:
+    bool evaluate(ConditionFunction check, uint32_t generation)
+    {
+        Entry& entry = entries[((uintptr_t)check >> 4 ^ (uintptr_t)check >> 10) % Size];
+        if (entry.check == check && entry.generation == generation)
+        {
+            ++hitCount;
+            return entry.result;
+        }
+
+        ++missCount;
+        bool result = check();
+        entry = Entry{check, generation, result};
+        return result;
+    }
+
+    size_t hits() const noexcept { return hitCount; }
+    size_t misses() const noexcept { return missCount; }
+private:
+    struct Entry
+    {
+        ConditionFunction check;
+        uint32_t generation;
+        bool result;
+    };
+
+    static const size_t Size = 32;
+    Entry entries[Size] = {};
+    size_t hitCount = 0;
+    size_t missCount = 0;
+};
+
+
+class Scheduler : public RefCounted
+{
+public:
+    explicit Scheduler(size_t initialSize) {}
+
+    // Sweeps the run queues of all partitions:
+    void tick()
+    {
+        ++tickGeneration;
+        for (size_t partition = 0; partition < queues.size(); ++partition)
+            tickPartition((Partition)partition);
+    }
+
+    // Only updates the nodes queued in one partition, usually a tree's:
+    void tick(Partition partition)
+    {
+        ++tickGeneration;
+        if (partition < queues.size())
+            tickPartition(partition);
+    }
+
+    // Returns a partition for a new tree. Partition 0 holds nodes started outside of trees.
+    // Partitions of destroyed trees are reused first, trees only share partitions while all
+    // of them are in use:
+    Partition createPartition()
+    {
+        if (Partition partition = firstFreePartition)
+        {
+            RunQueue& queue = queues[partition];
+            firstFreePartition = queue.nextFree;
+            queue.nextFree = 0;
+            clear(queue);
+            return partition;
+        }
+
+        Partition partition = nextPartition;
+        if (partitionsExhausted)
+            ++queueOf(partition).sharers;
+        if (nextPartition == std::numeric_limits<Partition>::max())
+        {
+            nextPartition = 1;
+            partitionsExhausted = true;
+        }
+        else
+            ++nextPartition;
+        return partition;
+    }
+
+    // Called by destroyed trees, the partition is reused once its last tree released it and its
+    // queue is reset. Without memory for the queue, it is only reused once the partitions wrap:
+    void releasePartition(Partition partition) noexcept
+    {
+        if (partition == 0)
+            return;
+        BEHAVIOR_TREE_TRY
+        {
+            queueOf(partition);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return;
+        }
+
+        RunQueue& queue = queues[partition];
+        if (queue.sharers)
+        {
+            --queue.sharers;
+            return;
+        }
+        clear(queue);
+        queue.nextFree = firstFreePartition;
+        firstFreePartition = partition;
+    }
+
+    // Nodes started outside of a tick, or restored, go to the current partition:
+    Partition currentPartition() const noexcept { return current; }
+    Partition enterPartition(Partition partition) noexcept
+    {
+        Partition previous = current;
+        current = partition;
+        return previous;
+    }
+
+    void start(Node& node, Observer& observer) noexcept
+    {
+        node.observer = &observer;
+        node.partition = current;
+        pushFront(queueOf(node.partition), &node);
+        RunQueue& queue = queues[node.partition];
+        if (queue.sleepers)
+            wakeSleepers(queue);
+    }
+
+    // Starts the node like start(), but synchronous nodes started during a tick are
+    // updated in place and their status returned without notifying the observer.
+    // Returns Suspended when the node was queued instead.
+    Status run(Node& node, Observer& observer) noexcept
+    {
+        if (!ticking || !node.synchronous())
+        {
+            start(node, observer);
+            return Status::Suspended;
+        }
+
+        node.observer = &observer;
+        node.partition = current;
+        tickNode(node);
+        if (node.nodeStatus == Status::Running)
+            pushBack(queueOf(node.partition), &node);
+        return node.nodeStatus;
+    }
+
+    // Observers are notified in the node's partition, which the nodes they start inherit:
+    void completed(Node& node, Status result) noexcept
+    {
+        setStatus(node, result);
+        if (node.observer)
+            notify(node);
+    }
+
+    // Changes the status without notifying the observer, used to restore saved nodes. The change
+    // is recorded like the ones of ticks:
+    void setStatus(Node& node, Status status) noexcept
+    {
+        if (!statusRecorders.empty() && node.nodeStatus != status)
+            recordStatusChange(node);
+        node.nodeStatus = status;
+    }
+
+    // Re-queues a suspended node so it is updated again on the next tick:
+    void resume(Node& node)
+    {
+        setStatus(node, Status::Running);
+        enqueue(node);
+    }
+
+    void stop(Node& node) noexcept
+    {
+        if (node.nodeStatus == Status::Running || node.nodeStatus == Status::Suspended)
+        {
+            node.stop(*this);
+            setStatus(node, Status::Failure);
+        }
+
+        // Remove the node from the queue if it exists:
+        dequeue(node);
+    }
+
+    // Calls the function with the nodes queued in the partition, in the order they are updated:
+    template <typename Function>
+    void forEachQueued(Partition partition, Function function) const
+    {
+        if (partition >= queues.size())
+            return;
+        const RunQueue& queue = queues[partition];
+        for (uint32_t block = queue.first; block != NoBlock; block = blocks[block].next)
+        {
+            uint32_t end = block == queue.last ? queue.end : BlockSize;
+            for (uint32_t i = block == queue.first ? queue.begin : 0; i < end; ++i)
+            {
+                Node* node = blocks[block].nodes[i];
+                if (node && node != endOfTick())
+                    function(*node);
+            }
+        }
+    }
+
+    // Replaces the run queue of the partition, used to restore a saved tree:
+    void restoreQueue(Partition partition, const std::vector<Node*>& nodes)
+    {
+        clear(queueOf(partition));
+        for (Node* node : nodes)
+            pushBack(queues[partition], node);
+        RunQueue& queue = queues[partition];
+        if (queue.sleepers && !nodes.empty())
+            wakeSleepers(queue);
+    }
+
+    void enqueue(Node& node)
+    {
+        pushBack(queueOf(node.partition), &node);
+        RunQueue& queue = queues[node.partition];
+        if (queue.sleepers)
+            wakeSleepers(queue);
+    }
+
+    // The node's entry is cleared and dropped once its queue reaches it:
+    void dequeue(Node& node) noexcept
+    {
+        if (node.partition >= queues.size())
+            return;
+        RunQueue& queue = queues[node.partition];
+        for (uint32_t block = queue.first; block != NoBlock; block = blocks[block].next)
+        {
+            uint32_t end = block == queue.last ? queue.end : BlockSize;
+            for (uint32_t i = block == queue.first ? queue.begin : 0; i < end; ++i)
+            {
+                if (blocks[block].nodes[i] == &node)
+                {
+                    blocks[block].nodes[i] = nullptr;
+                    --queue.count;
+                    return;
+                }
+            }
+        }
+    }
+    // Incremented by every tick that updates nodes:
+    uint32_t generation() const noexcept { return tickGeneration; }
+
+    // The cache is only created for schedulers running pure conditions:
+    void enableConditionCache()
+    {
+        if (!cache)
+            cache.reset(new ConditionCache());
+    }
+    ConditionCache* conditionCache() const noexcept { return cache.get(); }
+
+    // Appends the nodes whose status changes to the vector, so debug output only costs the changes.
+    // A node changing several times is appended each time. Every recording vector gets all changes
+    // of the scheduler until it stops recording:
+    void recordStatusChanges(std::vector<const Node*>& changes) { statusRecorders.push_back(&changes); }
+    void stopRecordingStatusChanges(std::vector<const Node*>& changes) noexcept
+    {
+        auto found = std::find(statusRecorders.begin(), statusRecorders.end(), &changes);
+        if (found != statusRecorders.end())
+            statusRecorders.erase(found);
+    }
+
+    // Nothing is queued to run on the next tick of the partition:
+    bool idle(Partition partition) const noexcept { return partition >= queues.size() || !queues[partition].count; }
+    friend class World;
+    friend class MemoryPool;
+private:
+    // The run queues of all partitions are chains of blocks taken from one shared list, so only
+    // partitions with queued nodes hold storage, and blocks emptied by one are reused by all:
+    static const uint32_t BlockSize = 15;
+    static const uint32_t NoBlock = UINT32_MAX;
+
+    struct Block
+    {
+        Node* nodes[BlockSize];
+        uint32_t next;
+    };
+
+    struct RunQueue
+    {
+        // Nodes are queued from begin in the first block to end in the last one:
+        uint32_t first = NoBlock;
+        uint32_t last = NoBlock;
+        uint16_t begin = 0;
+        uint16_t end = 0;
+        // Queued nodes, without the dequeued entries still in the blocks:
+        uint32_t count = 0;
+        // Trees of a World sleeping until this partition gets work:
+        class BehaviorTree* sleepers = nullptr;
+        // Trees sharing the partition besides the first one, and the next free partition once released:
+        uint32_t sharers = 0;
+        Partition nextFree = 0;
+    };
+
+    // Partitions only take a few bytes until they queue nodes, building trees doesn't allocate:
+    RunQueue& queueOf(Partition partition)
+    {
+        if (partition >= queues.size())
+            queues.resize(partition + 1);
+        return queues[partition];
+    }
+
+    // Once all trees of the scheduler are destroyed, only nodes started outside of trees can
+    // be left, a recycled scheduler forgets them:
+    void recycle() noexcept
+    {
+        if (!queues.empty())
+            clear(queues[0]);
+        current = 0;
+    }
+
+    // Marks the end of the nodes a tick updates, it can't be the address of a node:
+    Node* endOfTick() const noexcept { return (Node*)(const void*)this; }
+
+    uint32_t allocateBlock()
+    {
+        uint32_t block = firstFreeBlock;
+        if (block != NoBlock)
+            firstFreeBlock = blocks[block].next;
+        else
+        {
+            blocks.emplace_back();
+            block = (uint32_t)blocks.size() - 1;
+        }
+        blocks[block].next = NoBlock;
+        return block;
+    }
+
+    void freeBlock(uint32_t block) noexcept
+    {
+        blocks[block].next = firstFreeBlock;
+        firstFreeBlock = block;
+    }
+
+    // Empty queues start in the middle of a block, nodes are started at the front and requeued at the back:
+    void pushBack(RunQueue& queue, Node* node)
+    {
+        if (queue.first == NoBlock)
+        {
+            queue.first = queue.last = allocateBlock();
+            queue.begin = queue.end = BlockSize / 2;
+        }
+        else if (queue.end == BlockSize)
+        {
+            uint32_t block = allocateBlock();
+            blocks[queue.last].next = block;
+            queue.last = block;
+            queue.end = 0;
+        }
+        blocks[queue.last].nodes[queue.end++] = node;
+        if (node != endOfTick())
+            ++queue.count;
+    }
+
+    void pushFront(RunQueue& queue, Node* node)
+    {
+        if (queue.first == NoBlock)
+        {
+            queue.first = queue.last = allocateBlock();
+            queue.begin = queue.end = BlockSize / 2;
+        }
+        else if (queue.begin == 0)
+        {
+            uint32_t block = allocateBlock();
+            blocks[block].next = queue.first;
+            queue.first = block;
+            queue.begin = BlockSize;
+        }
+        blocks[queue.first].nodes[--queue.begin] = node;
+        ++queue.count;
+    }
+
+    // The queue must not be empty, its blocks are freed as they are emptied:
+    Node* popFront(RunQueue& queue) noexcept
+    {
+        Node* node = blocks[queue.first].nodes[queue.begin++];
+        if (node && node != endOfTick())
+            --queue.count;
+        if (queue.first == queue.last && queue.begin == queue.end)
+        {
+            freeBlock(queue.first);
+            queue.first = queue.last = NoBlock;
+        }
+        else if (queue.begin == BlockSize)
+        {
+            uint32_t next = blocks[queue.first].next;
+            freeBlock(queue.first);
+            queue.first = next;
+            queue.begin = 0;
+        }
+        return node;
+    }
+
+    void clear(RunQueue& queue) noexcept
+    {
+        while (queue.first != NoBlock)
+        {
+            uint32_t next = queue.first == queue.last ? NoBlock : blocks[queue.first].next;
+            freeBlock(queue.first);
+            queue.first = next;
+        }
+        queue.last = NoBlock;
+        queue.count = 0;
+    }
+
+    void tickPartition(Partition partition)
+    {
+        if (!queues[partition].count)
+            return;
+
+        // Insert an end-of-update marker into the list of tasks. Queues are looked
+        // up on every access since nodes may start others in new partitions:
+        pushBack(queues[partition], endOfTick());
+        ticking = true;
+        Partition previous = enterPartition(partition);
+
+        // Keep going updating tasks until we encounter the marker, skipping dequeued ones:
+        while (true)
+        {
+            Node* node = popFront(queues[partition]);
+
+            if (node == endOfTick())
+            {
+                ticking = false;
+                enterPartition(previous);
+                return;
+            }
+            if (!node)
+                continue;
+
+            tickNode(*node);
+
+            // If currently running, drop it into the queue for next tick:
+            if (node->nodeStatus == Status::Running)
+            {
+                pushBack(queues[partition], node);
+            }
+            else if (node->nodeStatus != Status::Suspended)
+            {
+                // Notify observer that task completed:
+                if (node->observer)
+                    notify(*node);
+            }
+        }
+    }
+
+    // Observers complete their own node last, so completions travel up the tree through a
+    // worklist instead of recursing once per level. The first completion drains it, the ones
+    // it causes are queued behind it and the node's status is read once it is its turn. A full
+    // worklist falls back to notifying in place:
+    void notify(Node& node) noexcept
+    {
+        if (completionCount == CompletionCapacity)
+        {
+            notifyObserver(node);
+            return;
+        }
+
+        completions[(completionStart + completionCount++) % CompletionCapacity] = &node;
+        if (propagating)
+            return;
+
+        propagating = true;
+        while (completionCount)
+        {
+            Node* completed = completions[completionStart];
+            completionStart = (completionStart + 1) % CompletionCapacity;
+            --completionCount;
+            notifyObserver(*completed);
+        }
+        propagating = false;
+    }
+
+    void notifyObserver(Node& node) noexcept
+    {
+        Partition previous = enterPartition(node.partition);
+        node.observer->onComplete(*this, node, node.nodeStatus);
+        enterPartition(previous);
+    }
+
+    void wakeSleepers(RunQueue& queue) noexcept;
+
+    void tickNode(Node& node) noexcept
+    {
+        Status previous = node.nodeStatus;
+        node.tick(*this);
+        if (!statusRecorders.empty() && node.nodeStatus != previous)
+            recordStatusChange(node);
+    }
+
+    void recordStatusChange(const Node& node) noexcept
+    {
+        for (std::vector<const Node*>* changes : statusRecorders)
+            changes->push_back(&node);
+    }
+
+    static const uint8_t CompletionCapacity = 8;
+    Node* completions[CompletionCapacity];
+    uint8_t completionStart = 0;
+    uint8_t completionCount = 0;
+    bool propagating = false;
+
+    std::vector<RunQueue> queues;
+    std::vector<Block> blocks;
+    uint32_t firstFreeBlock = NoBlock;
+    Partition current = 0;
+    Partition nextPartition = 1;
+    Partition firstFreePartition = 0;
+    bool partitionsExhausted = false;
+    bool ticking = false;
+    uint32_t tickGeneration = 0;
+    std::unique_ptr<ConditionCache> cache;
+    std::vector<std::vector<const Node*>*> statusRecorders;
+};
+
+}
+
+#endif
+
+namespace bt
+{
+
+class Memory : public RefCounted
+{
+    // Precedes every object with a non-trivial destructor in the buffer:
+    struct Destructor
+    {
+        void (*destroy)(Destructor* entry);
+        Link<Destructor> previous;
+    };
+public:
+    typedef const Destructor* Marker;
+
+    Memory(const size_t maxBytes)
+        : buffer(new uint8_t[maxBytes]), maxBytes(maxBytes) {}
+
+    // A measuring Memory has no buffer, it only counts the bytes its allocations would take:
+    struct Measure {};
+    explicit Memory(Measure)
+        : buffer(nullptr), maxBytes(SIZE_MAX) {}
+
+    // Objects in the buffer are not relocatable, so a Memory can't be copied:
+    Memory(const Memory& m) = delete;
+
+    Memory(Memory&& m) noexcept
+        : buffer(m.buffer), offset(m.offset), maxBytes(m.maxBytes), destructors(m.destructors)
+    {
+        m.buffer = nullptr;
+        m.destructors = nullptr;
+    }
+
+    ~Memory()
+    {
+        reset();
+        delete[] buffer;
+    }
+
+    size_t size() const { return offset; }
+    size_t maxSize() const { return maxBytes; }
+    const uint8_t* data() const { return buffer; }
+    bool measuring() const noexcept { return buffer == nullptr; }
+
+    // Returns nullptr without constructing anything when measuring:
+    template <typename T, typename... Args>
     T* allocate(Args&&... args)
     {
-        size_t size = sizeof(T);
-        if ((offset + size) >= maxBytes)
-            throw std::runtime_error("BehaviorTree Memory capacity exceeded.");
-		T* instance = new ((void*)((uintptr_t)buffer + offset)) T(std::forward<Args>(args)...);
-        offset += size;
-        return instance;
+        const bool trivial = std::is_trivially_destructible<T>::value;
+        void* entryMemory = trivial ? nullptr : allocateBytes(sizeof(Destructor), alignof(Destructor));
+        void* instanceMemory = allocateBytes(sizeof(T), alignof(T));
+        if (measuring() || !instanceMemory || (!trivial && !entryMemory))
+            return nullptr;
+
+        T* instance = new (instanceMemory) T(std::forward<Args>(args)...);
+        if (!trivial)
+            destructors = new (entryMemory) Destructor{&destroy<T>, destructors};
+        return instance;
+    }
+
+    template <typename T>
+    T* allocateArray(int length)
+    {
+        void* arrayMemory = allocateBytes(sizeof(T) * length, alignof(T));
+        return arrayMemory ? new (arrayMemory) T [length] : nullptr;
+    }
+
+    // Measuring aligns offsets from address zero, which matches any buffer aligned to max_align_t:
+    void* allocateBytes(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        void* address = tryAllocateBytes(size, alignment);
+        if (!address && !measuring())
+            raise("BehaviorTree Memory capacity exceeded.");
+        return address;
+    }
+
+    // Like allocateBytes(), but returns nullptr without reporting an error once the buffer is full:
+    void* tryAllocateBytes(size_t size, size_t alignment = alignof(std::max_align_t)) noexcept
+    {
+        uintptr_t address = align((uintptr_t)buffer + offset, alignment);
+        size_t start = address - (uintptr_t)buffer;
+        if (start + size > maxBytes)
+            return nullptr;
+        offset = start + size;
+        return measuring() ? nullptr : (void*)address;
+    }
+
+    // Marks the current end of the objects allocated so far:
+    Marker mark() const noexcept { return destructors; }
+
+    // Destroys the objects allocated between the two marks, their memory is reclaimed by reset():
+    void destroy(Marker begin, Marker end) noexcept
+    {
+        for (Destructor* entry = const_cast<Destructor*>(end); entry && entry != begin; entry = entry->previous)
+        {
+            if (entry->destroy)
+                entry->destroy(entry);
+            entry->destroy = nullptr;
+        }
+    }
+
+    // Position of the next allocation, rewind() releases everything allocated after it:
+    struct Position
+    {
+        size_t offset;
+        Marker marker;
+    };
+
+    Position position() const noexcept { return Position{offset, destructors}; }
+
+    void rewind(const Position& position) noexcept
+    {
+        destroy(position.marker, destructors);
+        destructors = const_cast<Destructor*>(position.marker);
+        offset = position.offset;
+    }
+
+    // Destroys all objects still alive in the buffer and rewinds it so it can be reused:
+    void reset() noexcept
+    {
+        destroy(nullptr, destructors);
+        destructors = nullptr;
+        offset = 0;
+    }
+
+private:
+    static uintptr_t align(uintptr_t address, size_t alignment) noexcept
+    {
+        return (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+
+    template <typename T>
+    static void destroy(Destructor* entry) noexcept
+    {
+        T* instance = (T*)align((uintptr_t)(entry + 1), alignof(T));
+        destroyObject(instance, std::is_base_of<Node, T>());
+    }
+
+    // Nodes are destroyed through their public virtual destructor, derived ones may be protected:
+    static void destroyObject(Node* node, std::true_type) noexcept { node->~Node(); }
+
+    template <typename T>
+    static void destroyObject(T* instance, std::false_type) noexcept { instance->~T(); }
+
+	uint8_t* buffer;
+    size_t offset = 0;
+    const size_t maxBytes;
+    Destructor* destructors = nullptr;
+};
+
+
+// Standard allocator handing out Memory from an arena, deallocation is a no-op:
+template <typename T>
+class MemoryAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit MemoryAllocator(Memory& memory) noexcept : memory(&memory) {}
+
+    template <typename U>
+    MemoryAllocator(const MemoryAllocator<U>& allocator) noexcept : memory(allocator.memory) {}
+
+    T* allocate(size_t length) { return (T*)memory->allocateBytes(sizeof(T) * length, alignof(T)); }
+    void deallocate(T* instance, size_t length) noexcept {}
+
+    template <typename U>
+    bool operator==(const MemoryAllocator<U>& allocator) const noexcept { return memory == allocator.memory; }
+    template <typename U>
+    bool operator!=(const MemoryAllocator<U>& allocator) const noexcept { return memory != allocator.memory; }
+
+    Memory* memory;
+};
+
+
+// Recycles Memory arenas in power of two size classes, each with the scheduler of its
+// trees. Released arenas are reset and kept for the next acquire(), and the control blocks
+// of references to them, their scheduler and their trees are taken from the arena, so
+// building, ticking and destroying short lived trees doesn't allocate once the pool is warm.
+// The pool must outlive its arenas.
+class MemoryPool
+{
+public:
+    MemoryPool() = default;
+    MemoryPool(const MemoryPool&) = delete;
+
+    // Standard allocator for control blocks, taken from the arena while it has room and from
+    // the heap after. Pooled arenas outlive the control blocks they hold:
+    template <typename T>
+    class ControlBlockAllocator
+    {
+    public:
+        typedef T value_type;
+
+        explicit ControlBlockAllocator(Memory& memory) noexcept : memory(&memory) {}
+
+        template <typename U>
+        ControlBlockAllocator(const ControlBlockAllocator<U>& allocator) noexcept : memory(allocator.memory) {}
+
+        T* allocate(size_t length)
+        {
+            if (void* block = memory->tryAllocateBytes(sizeof(T) * length, alignof(T)))
+                return (T*)block;
+            return (T*)::operator new(sizeof(T) * length);
+        }
+
+        void deallocate(T* instance, size_t length) noexcept
+        {
+            const uint8_t* address = (const uint8_t*)instance;
+            if (address < memory->data() || address >= memory->data() + memory->maxSize())
+                ::operator delete(instance);
+        }
+
+        template <typename U>
+        bool operator==(const ControlBlockAllocator<U>& allocator) const noexcept { return memory == allocator.memory; }
+        template <typename U>
+        bool operator!=(const ControlBlockAllocator<U>& allocator) const noexcept { return memory != allocator.memory; }
+
+        Memory* memory;
+    };
+
+    ~MemoryPool()
+    {
+        for (auto& arenas : freeArenas)
+            for (PooledMemory* memory : arenas)
+                delete memory;
+    }
+
+    Ref<Memory> acquire(size_t maxBytes)
+    {
+        // Leave room for the shared_ptr control block allocated from the arena:
+        maxBytes += ControlBlockBytes;
+
+        size_t sizeClass = 0;
+        while ((MinBytes << sizeClass) < maxBytes)
+            ++sizeClass;
+        if (sizeClass >= freeArenas.size())
+            freeArenas.resize(sizeClass + 1);
+
+        PooledMemory* memory;
+        std::vector<PooledMemory*>& arenas = freeArenas[sizeClass];
+        if (arenas.size())
+        {
+            memory = arenas.back();
+            arenas.pop_back();
+        }
+        else
+        {
+            memory = new PooledMemory(MinBytes << sizeClass, *this, sizeClass);
+        }
+
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+        return adopt<PooledMemory, &MemoryPool::release>(memory);
+#else
+        // The control block lives at the start of the arena, it is only released after the
+        // deleter has reset the arena, which leaves its bytes untouched until the next acquire():
+        return std::shared_ptr<Memory>(memory, &MemoryPool::release, ControlBlockAllocator<Memory>(*memory));
+#endif
+    }
+
+    size_t available() const noexcept
+    {
+        size_t count = 0;
+        for (auto& arenas : freeArenas)
+            count += arenas.size();
+        return count;
+    }
+
+    friend class Builder;
+private:
+    struct PooledMemory : public Memory
+    {
+        PooledMemory(size_t maxBytes, MemoryPool& pool, size_t sizeClass)
+            : Memory(maxBytes), pool(&pool), sizeClass(sizeClass) {}
+
+        MemoryPool* pool;
+        size_t sizeClass;
+        // Created for the first builder of the arena, its queues keep their storage between trees:
+        std::unique_ptr<Scheduler> scheduler;
+    };
+
+    // The scheduler of an arena acquired from this pool, released before the arena by its trees:
+    Ref<Scheduler> scheduler(Memory& memory, const size_t initialSize)
+    {
+        PooledMemory& pooled = static_cast<PooledMemory&>(memory);
+        if (!pooled.scheduler)
+            pooled.scheduler.reset(new Scheduler(initialSize));
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+        return adopt<Scheduler, &MemoryPool::recycle>(pooled.scheduler.get());
+#else
+        return std::shared_ptr<Scheduler>(pooled.scheduler.get(), &MemoryPool::recycle, ControlBlockAllocator<Scheduler>(memory));
+#endif
+    }
+
+    static const size_t MinBytes = 256;
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    static const size_t ControlBlockBytes = 0;
+#else
+    // Room for the control blocks of the arena, its scheduler and one tree:
+    static const size_t ControlBlockBytes = 192;
+#endif
+
+    static void release(PooledMemory* memory) noexcept
+    {
+        memory->reset();
+        memory->pool->freeArenas[memory->sizeClass].push_back(memory);
+    }
+
+    static void recycle(Scheduler* scheduler) noexcept { scheduler->recycle(); }
+
+    std::vector<std::vector<PooledMemory*>> freeArenas;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_TREE_H
+#define BEHAVIOR_TREE_TREE_H
+
+
+namespace bt
+{
+
+class BehaviorTree : public Observer, public RefCounted
+{
+public:
+    Status tick()
+    {
+        if (schedulerStopped)
+        {
+            schedulerStopped = false;
+            Partition previous = scheduler->enterPartition(partition);
+            scheduler->start(*root, *this);
+            scheduler->enterPartition(previous);
+        }
+        scheduler->tick(partition);
+        return root->status();
+    }
+
+    void stop()
+    {
+        scheduler->stop(*root);
+    }
+
+    void traverse(Visitor& visitor) const
+    {
+        visitor.begin();
+        root->traverse(visitor);
+        visitor.end();
+    }
+
+    // Writes node statuses, composite progress and queued nodes into a packed blob:
+    void saveState(std::vector<uint8_t>& buffer) const
+    {
+        StateWriter writer(buffer);
+        writer.write<uint8_t>(StateVersion);
+        writer.write<uint8_t>(schedulerStopped);
+        root->saveState(writer, *scheduler);
+
+        // The run queue is saved once, in order, as offsets of the queued nodes from the root:
+        uint32_t count = 0;
+        scheduler->forEachQueued(partition, [&count](const Node&) { ++count; });
+        writer.write(count);
+        intptr_t base = (intptr_t)&*root;
+        scheduler->forEachQueued(partition, [&writer, base](const Node& node) { writer.write<int64_t>((intptr_t)&node - base); });
+    }
+
+    // Restores a blob saved from this tree or one built the same way. Corrupt blobs are rejected
+    // and leave the tree unchanged:
+    bool restoreState(const uint8_t* data, size_t size)
+    {
+        std::vector<Node*> queue;
+        StateReader validation(data, size, StateReader::Pass::Validate);
+        if (!readState(validation, queue))
+            return false;
+
+        StateReader reader(data, size);
+        Partition previous = scheduler->enterPartition(partition);
+        readState(reader, queue);
+        scheduler->restoreQueue(partition, queue);
+        scheduler->enterPartition(previous);
+        return true;
+    }
+
+    bool restoreState(const std::vector<uint8_t>& buffer)
+    {
+        return restoreState(buffer.data(), buffer.size());
+    }
+
+    ~BehaviorTree()
+    {
+        Handles::release(treeHandle);
+        stop();
+        scheduler->releasePartition(partition);
+        memory->destroy(nodesBegin, nodesEnd);
+        root = nullptr;
+    }
+
+    friend class Builder;
+    friend class SubTree;
+    friend class Lockstep;
+    friend class World;
+    Status status() const noexcept { return root->status(); }
+
+    // Records the nodes whose status changes, see Scheduler::recordStatusChanges(). Trees built
+    // by the same Builder share their scheduler, so the vector also gets the changes of the others:
+    void recordStatusChanges(std::vector<const Node*>& changes) { scheduler->recordStatusChanges(changes); }
+    void stopRecordingStatusChanges(std::vector<const Node*>& changes) noexcept { scheduler->stopRecordingStatusChanges(changes); }
+
+    // Valid while the tree is alive, find() returns nullptr for handles of destroyed trees:
+    Handle handle() const noexcept { return treeHandle; }
+    static BehaviorTree* find(Handle handle) noexcept { return (BehaviorTree*)Handles::get(handle, HandleKind::Tree); }
+protected:
+    virtual void onComplete(class Scheduler& scheduler, const Node& root, Status status) noexcept override
+    {
+        if (SubTree* subtree = parent)
+        {
+            parent = nullptr;
+            scheduler.completed(*subtree, status);
+            return;
+        }
+        schedulerStopped = true;
+        if (world)
+            completed(status);
+    }
+private:
+    BehaviorTree(Node& root,
+        const Ref<Memory>& memory,
+        const Ref<Scheduler>& scheduler,
+        Memory::Marker nodesBegin, Memory::Marker nodesEnd)
+        : root(&root), memory(memory), scheduler(scheduler), nodesBegin(nodesBegin), nodesEnd(nodesEnd),
+          partition(scheduler->createPartition()), treeHandle(Handles::acquire(this, HandleKind::Tree)) {}
+
+    // The tree lives in its own arena, which must stay alive until its destructor has returned:
+    static void dispose(BehaviorTree* tree) noexcept
+    {
+        Ref<Memory> memory = tree->memory;
+        tree->~BehaviorTree();
+    }
+
+    // Defined with World, which queues the completion and wakes the tree to restart its root:
+    void completed(Status status) noexcept;
+
+    static const uint8_t StateVersion = 2;
+
+    // The validation pass finds the queued nodes among the restored ones, the apply pass
+    // only changes the nodes:
+    bool readState(StateReader& reader, std::vector<Node*>& queue)
+    {
+        if (reader.read<uint8_t>() != StateVersion)
+            return false;
+        bool stopped = reader.read<uint8_t>() != 0;
+        root->restoreState(reader, *scheduler, this);
+        uint32_t count = reader.read<uint32_t>();
+        if (!reader.validating())
+        {
+            schedulerStopped = stopped;
+            return true;
+        }
+
+        auto before = [](const Node* a, const Node* b) { return (intptr_t)a < (intptr_t)b; };
+        std::sort(reader.nodes.begin(), reader.nodes.end(), before);
+        intptr_t base = (intptr_t)&*root;
+        for (uint32_t i = 0; i < count && reader.valid(); ++i)
+        {
+            Node* node = (Node*)(base + (intptr_t)reader.read<int64_t>());
+            auto found = std::lower_bound(reader.nodes.begin(), reader.nodes.end(), node, before);
+            if (found == reader.nodes.end() || *found != node)
+                reader.reject();
+            else
+                queue.push_back(node);
+        }
+        return reader.complete();
+    }
+
+
+    Link<Node> root;
+    Ref<Memory> memory;
+    Ref<Scheduler> scheduler;
+    Memory::Marker nodesBegin;
+    Memory::Marker nodesEnd;
+    SubTree* parent = nullptr;
+    // Its nodes are queued apart from the other trees sharing the scheduler:
+    Partition partition;
+    Handle treeHandle;
+    bool schedulerStopped = true;
+
+    // Membership of a World:
+    bool sleeping = false;
+    uint32_t activeSlot = 0;
+    bool completionQueued = false;
+    Status completion = Status::Initial;
+    class World* world = nullptr;
+    BehaviorTree* nextSleeping = nullptr;
+    BehaviorTree* nextCompleted = nullptr;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_WORLD_H
+#define BEHAVIOR_TREE_WORLD_H
+
+
+namespace bt
+{
+
+// Ticks a set of trees, skipping the ones with nothing to run. A tree that is left Suspended
+// with an empty run queue after its tick goes to sleep on its scheduler partition. It is woken
+// when a node of the partition is started or resumed, usually by an async completion, when its
+// root completes, or explicitly through wake() for events and timers kept by the host. A tick
+// only costs the trees that are awake.
+// Completed roots are queued, so the host polls the trees that finished instead of all of them.
+class World
+{
+public:
+    // The tree is held by its handle, BehaviorTree::find() returns nullptr once it was destroyed:
+    struct Completion
+    {
+        Handle tree;
+        Status status;
+    };
+
+    World() = default;
+    World(const World& world) = delete;
+    ~World();
+
+    void add(const Ref<BehaviorTree>& tree);
+    bool remove(const BehaviorTree& tree);
+
+    void tick();
+    void wake(BehaviorTree& tree) noexcept;
+
+    // Pops the trees whose root completed since they were last polled, in completion order.
+    // A tree completing again before it is polled only keeps its latest status:
+    bool poll(Completion& completion) noexcept;
+
+    size_t size() const noexcept { return trees.size(); }
+    size_t active() const noexcept { return activeTrees.size(); }
+    friend class Scheduler;
+    friend class BehaviorTree;
+private:
+    void sleep(BehaviorTree& tree) noexcept;
+    void deactivate(BehaviorTree& tree) noexcept;
+    // Wakes the trees sleeping on a partition:
+    static void wakeAll(BehaviorTree* sleepers) noexcept;
+    void queueCompletion(BehaviorTree& tree, Status status) noexcept;
+    void unqueueCompletion(BehaviorTree& tree) noexcept;
+
+    std::vector<Ref<BehaviorTree>> trees;
+    // Holds a slot for every tree, so waking never allocates:
+    std::vector<BehaviorTree*> activeTrees;
+    // Completions are linked through the trees, so queueing them never allocates:
+    BehaviorTree* firstCompleted = nullptr;
+    BehaviorTree* lastCompleted = nullptr;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_COROUTINES_H
+#define BEHAVIOR_TREE_COROUTINES_H
+
+
+// Detected from the compiler, users may also define it themselves:
+#if !defined(BEHAVIOR_TREE_COROUTINES) && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define BEHAVIOR_TREE_COROUTINES
+#endif
+#endif
+
+#if defined(BEHAVIOR_TREE_COROUTINES)
+
+#include <coroutine>
+
+namespace bt
+{
+
+class CoroutineAction;
+
+// Return type of coroutine action bodies, e.g.:
+//     Coroutine patrol(CoroutineAction& action) { co_await action.nextTick(); co_return Status::Success; }
+// Coroutine frames are reserved in the tree's Memory when the action is built and reused between runs.
+class Coroutine
+{
+public:
+    struct promise_type
+    {
+        static void* operator new(size_t size, CoroutineAction& action) noexcept;
+        static void* operator new(size_t size) = delete;
+        static void operator delete(void* frame) noexcept {}
+        // A frame that wasn't reserved fails the action:
+        static Coroutine get_return_object_on_allocation_failure() noexcept { return Coroutine(); }
+
+        Coroutine get_return_object() noexcept { return Coroutine(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(Status status) noexcept { result = status; }
+        void unhandled_exception() noexcept { result = Status::Failure; }
+
+        Status result = Status::Failure;
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Coroutine() noexcept : handle(nullptr) {}
+    Coroutine(Coroutine&& c) noexcept : handle(c.handle) { c.handle = nullptr; }
+    Coroutine& operator=(Coroutine&& c) noexcept;
+    ~Coroutine() { if (handle) handle.destroy(); }
+
+    bool done() const noexcept { return !handle || handle.done(); }
+    Status result() const noexcept { return handle ? handle.promise().result : Status::Failure; }
+    void resume() { handle.resume(); }
+private:
+    explicit Coroutine(Handle handle) : handle(handle) {}
+    Handle handle;
+};
+
+
+typedef Coroutine (*CoroutineFunction) (CoroutineAction&);
+
+class CoroutineAction : public NamedNode
+{
+public:
+    // Awaitable returned by nextTick(), wait() and suspend():
+    struct Awaiter
+    {
+        CoroutineAction& action;
+        uint32_t ticks;
+        Status status;
+
+        bool await_ready() const noexcept { return status == Status::Running && ticks == 0; }
+        void await_suspend(std::coroutine_handle<>) noexcept { action.waitTicks = ticks; action.waitStatus = status; }
+        void await_resume() const noexcept {}
+    };
+
+    CoroutineAction(const char* name, CoroutineFunction body)
+        : NamedNode(name), body(body) {}
+
+    // Creates the body once so its frame is allocated from the Memory while building, ticks never
+    // allocate. Measuring builders have no action, a probe only counts the bytes of its frame:
+    static bool reserveFrame(CoroutineAction* action, CoroutineFunction body, Memory& memory);
+
+    // Continue the body on the next tick:
+    Awaiter nextTick() noexcept { return Awaiter{*this, 1, Status::Running}; }
+    // Continue the body after the given number of ticks:
+    Awaiter wait(uint32_t ticks) noexcept { return Awaiter{*this, ticks, Status::Running}; }
+    // Suspend the node until resume() is called, e.g. from an async completion callback:
+    Awaiter suspend() noexcept { return Awaiter{*this, 0, Status::Suspended}; }
+    void resume() noexcept;
+
+    friend struct Coroutine::promise_type;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override;
+    virtual void stop(class Scheduler& scheduler) noexcept override;
+private:
+    void* allocateFrame(size_t size) noexcept;
+
+    CoroutineFunction body;
+    // Only set while the frame is reserved:
+    Memory* arena = nullptr;
+    class Scheduler* scheduler = nullptr;
+    Coroutine coroutine;
+    void* frame = nullptr;
+    size_t frameSize = 0;
+    uint32_t waitTicks = 0;
+    Status waitStatus = Status::Running;
+};
+
+}
+
+#endif
+
+#endif
+
+#ifndef BEHAVIOR_TREE_OPTIMIZER_H
+#define BEHAVIOR_TREE_OPTIMIZER_H
+
+
+namespace bt
+{
+
+// Rewrites a finished tree into an equivalent one with fewer nodes: nested sequences and
+// selectors are flattened into their parents, single child composites and double negations
+// are removed and constant children are folded. Removed nodes stay in the arena until the
+// tree is destroyed. Flattened child arrays are allocated from the Memory, composites it has
+// no room for left are kept as they are.
+class Optimizer
+{
+public:
+    // Nodes with several parents, sorted, are left as they are with their subtrees, since
+    // changing them would also change the other parents:
+    Node* optimize(Node& root, Memory& memory, const std::vector<const Node*>& shared = std::vector<const Node*>());
+
+    size_t nodesBefore() const noexcept { return before; }
+    size_t nodesAfter() const noexcept { return after; }
+private:
+    Node* optimizeNode(Node* node);
+    Node* optimizeComposite(Composite* composite);
+    Node* optimizeNegate(Negate* negate);
+    void collectChildren(Composite* composite, bool flatten, std::vector<Node*>& result, Node*& dropped) const;
+
+    bool isShared(const Node* node) const;
+    static size_t count(const Node* node);
+
+    Memory* memory = nullptr;
+    const std::vector<const Node*>* shared = nullptr;
+    size_t before = 0;
+    size_t after = 0;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_QUERIES_H
+#define BEHAVIOR_TREE_QUERIES_H
+
+
+namespace bt
+{
+
+typedef bool (*QueryCondition) (uint64_t key);
+typedef Status (*QueryAction) (uint64_t key);
+
+// Query results shared between agents, keyed by the query function and a user key such as
+// a target or a cell, and kept for a number of ticks of the cache's own clock. Lookups are
+// lock-free and may run on any number of threads. Every entry is guarded by a sequence
+// counter: readers treat a torn read as a miss, and a writer that finds the entry busy
+// skips storing its result. The clock and the sequence counters are 64-bit, so neither
+// wraps around and makes a stale or torn entry look valid.
+class QueryCache
+{
+public:
+    // The capacity is rounded up to a power of two, colliding queries evict each other.
+    // Counting hits and misses is opt-in, the shared counters are contended by every lookup:
+    explicit QueryCache(size_t capacity = 1024, bool countLookups = false) : counting(countLookups)
+    {
+        while (mask + 1 < capacity)
+            mask = (mask << 1) | 1;
+        entries.reset(new Entry[mask + 1]);
+    }
+
+    QueryCache(const QueryCache& cache) = delete;
+
+    // Advances the clock results expire by, usually once per frame:
+    void advance(uint32_t ticks = 1) noexcept { clock.fetch_add(ticks, std::memory_order_relaxed); }
+    uint64_t now() const noexcept { return clock.load(std::memory_order_relaxed); }
+
+    Status evaluate(QueryCondition query, uint64_t key, uint32_t ttl)
+    {
+        Status status;
+        if (find((uintptr_t)query, key, status))
+            return status;
+        status = query(key) ? Status::Success : Status::Failure;
+        store((uintptr_t)query, key, status, ttl);
+        return status;
+    }
+
+    Status evaluate(QueryAction query, uint64_t key, uint32_t ttl)
+    {
+        Status status;
+        if (find((uintptr_t)query, key, status))
+            return status;
+        status = query(key);
+        store((uintptr_t)query, key, status, ttl);
+        return status;
+    }
+
+    // Both stay 0 unless the cache counts its lookups:
+    size_t hits() const noexcept { return hitCount.load(std::memory_order_relaxed); }
+    size_t misses() const noexcept { return missCount.load(std::memory_order_relaxed); }
+private:
+    struct Entry
+    {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> expires{0};
+        std::atomic<uintptr_t> query{0};
+        std::atomic<uint64_t> key{0};
+        std::atomic<uint8_t> status{0};
+    };
+
+    Entry& slot(uintptr_t query, uint64_t key) const noexcept
+    {
+        uint64_t hash = (query ^ key) * 0x9E3779B97F4A7C15ull;
+        return entries[(hash ^ hash >> 29) & mask];
+    }
+
+    bool find(uintptr_t query, uint64_t key, Status& status) noexcept
+    {
+        const Entry& entry = slot(query, key);
+        uint64_t sequence = entry.sequence.load(std::memory_order_acquire);
+        uintptr_t storedQuery = entry.query.load(std::memory_order_relaxed);
+        uint64_t storedKey = entry.key.load(std::memory_order_relaxed);
+        uint64_t expires = entry.expires.load(std::memory_order_relaxed);
+        uint8_t storedStatus = entry.status.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        bool hit = !(sequence & 1) && entry.sequence.load(std::memory_order_relaxed) == sequence
+            && storedQuery == query && storedKey == key && now() < expires;
+        if (counting)
+            (hit ? hitCount : missCount).fetch_add(1, std::memory_order_relaxed);
+        status = (Status)storedStatus;
+        return hit;
+    }
+
+    void store(uintptr_t query, uint64_t key, Status status, uint32_t ttl) noexcept
+    {
+        Entry& entry = slot(query, key);
+        uint64_t sequence = entry.sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) || !entry.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        entry.query.store(query, std::memory_order_relaxed);
+        entry.key.store(key, std::memory_order_relaxed);
+        entry.expires.store(now() + ttl, std::memory_order_relaxed);
+        entry.status.store((uint8_t)status, std::memory_order_relaxed);
+        entry.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    std::unique_ptr<Entry[]> entries;
+    size_t mask = 0;
+    std::atomic<uint64_t> clock{0};
+    const bool counting;
+    std::atomic<size_t> hitCount{0};
+    std::atomic<size_t> missCount{0};
+};
+
+
+// Condition whose result is shared through a QueryCache for ttl ticks:
+class CachedCondition : public NamedNode
+{
+public:
+    CachedCondition(const char* name, QueryCache& cache, QueryCondition query, uint64_t key, uint32_t ttl)
+        : NamedNode(name), cache(&cache), query(query), key(key), ttl(ttl) {}
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return cache->evaluate(query, key, ttl);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    QueryCache* cache;
+    QueryCondition query;
+    uint64_t key;
+    uint32_t ttl;
+};
+
+
+// Action whose result is shared through a QueryCache for ttl ticks:
+class CachedAction : public NamedNode
+{
+public:
+    CachedAction(const char* name, QueryCache& cache, QueryAction query, uint64_t key, uint32_t ttl)
+        : NamedNode(name), cache(&cache), query(query), key(key), ttl(ttl) {}
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return cache->evaluate(query, key, ttl);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    QueryCache* cache;
+    QueryAction query;
+    uint64_t key;
+    uint32_t ttl;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_LOCKSTEP_H
+#define BEHAVIOR_TREE_LOCKSTEP_H
+
+
+// SSE2 is used wherever it is available, defining BEHAVIOR_TREE_NO_SIMD forces the scalar lanes:
+#if !defined(BEHAVIOR_TREE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BEHAVIOR_TREE_LOCKSTEP_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace bt
+{
+
+typedef bool (*AgentConditionFunction) (void* agent);
+typedef Status (*AgentActionFunction) (void* agent);
+
+// Leaves taking the agent they act on. A tree ticked on its own passes the agent given to the node,
+// a Lockstep batch passes the agent of each of its lanes instead:
+class AgentCondition : public NamedNode
+{
+public:
+    AgentCondition(const char* name, AgentConditionFunction check, void* agent)
+        : NamedNode(name), check(check), agent(agent) {}
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return check(agent) ? Status::Success : Status::Failure;
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    AgentConditionFunction check;
+    void* agent;
+};
+
+
+class AgentAction : public NamedNode
+{
+public:
+    AgentAction(const char* name, AgentActionFunction action, void* agent)
+        : NamedNode(name), action(action), agent(agent) {}
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return action(agent);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    AgentActionFunction action;
+    void* agent;
+};
+
+
+// Per lane values of a Lockstep block, lanes are selected by the bits of a mask:
+struct LaneStatuses
+{
+    uint16_t equal(Status status) const noexcept;
+    void assign(const LaneStatuses& statuses, uint16_t lanes) noexcept;
+    void fill(Status status, uint16_t lanes) noexcept;
+    // Swaps Success and Failure:
+    void negate(uint16_t lanes) noexcept;
+
+    alignas(16) Status values[16];
+};
+
+struct LaneCounts
+{
+    uint16_t equal(uint16_t count) const noexcept;
+    void fill(uint16_t count, uint16_t lanes) noexcept;
+    void increment(uint16_t lanes) noexcept;
+
+    alignas(16) uint16_t values[16];
+};
+
+
+// Runs one tree definition for many agents, advancing blocks of 16 agents in lockstep. Every
+// composite is visited once per block and tick, with the lanes that reach it in a mask, and
+// the progress of all 16 lanes is updated with SIMD operations. Leaves are still called once
+// per agent. The definition may only hold sequences, selectors, parallels, negations, constants
+// and synchronous conditions and actions, leaves returning neither Running nor Success fail.
+class Lockstep
+{
+public:
+    static const uint32_t Lanes = 16;
+
+    // Copies the tree's definition, it can be destroyed afterwards. Without exceptions, an
+    // unsupported definition is reported and leaves an invalid Lockstep that never ticks:
+    explicit Lockstep(const BehaviorTree& tree);
+    bool valid() const noexcept { return !program.empty(); }
+
+    // Adds an agent running the definition from its start, returns its index:
+    size_t add(void* agent);
+    size_t size() const noexcept { return agentCount; }
+
+    void tick();
+    // Abandons the progress of all agents, they start over on the next tick:
+    void stop() noexcept;
+
+    // Agents waiting on a running leaf are Running, where a tree ticked on its own is Suspended:
+    Status status(size_t agent) const noexcept { return blocks[agent / Lanes].statuses.values[agent % Lanes]; }
+private:
+    enum class Opcode : uint8_t { Sequence, Selector, Parallel, Negate, Constant, Condition, Action, AgentCondition, AgentAction };
+
+    struct Instruction
+    {
+        Opcode opcode;
+        bool successOne;
+        bool failureOne;
+        Status constant;
+        uint16_t childCount;
+        // One past the last instruction of the subtree, so the next sibling:
+        uint32_t end;
+        // First of the node's LaneCounts in a block:
+        uint32_t counters;
+        union
+        {
+            ConditionFunction condition;
+            ActionFunction action;
+            AgentConditionFunction agentCondition;
+            AgentActionFunction agentAction;
+        };
+    };
+
+    struct Block
+    {
+        uint16_t lanes = 0;
+        void* agents[Lanes] = {};
+        LaneStatuses statuses;
+        // One bit per lane for the instructions left running on the previous tick:
+        std::vector<uint16_t> running;
+        std::vector<LaneCounts> counters;
+    };
+
+    // Returns false for definitions holding unsupported nodes:
+    bool compile(const Node* node);
+    void run(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const;
+    void runLeaf(const Block& block, const Instruction& instruction, uint16_t lanes, LaneStatuses& result) const;
+    void runSequence(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const;
+    void runParallel(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const;
+
+    std::vector<Instruction> program;
+    std::vector<Block> blocks;
+    uint32_t counterCount = 0;
+    size_t agentCount = 0;
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_BATCHES_H
+#define BEHAVIOR_TREE_BATCHES_H
+
+
+namespace bt
+{
+
+// Writes the result of every agent in results, conditions write Success or Failure:
+typedef void (*BatchFunction) (void* const* agents, Status* results, size_t count);
+
+// Collects the agents of batched nodes across any number of trees and schedulers, and calls its
+// function once for all of them on flush(). Batched nodes wait Suspended until the batch is
+// flushed, usually once per frame after the trees were ticked. Running results are re-queued and
+// join the batch again on the next tick, the others complete their node.
+class CallbackBatch
+{
+public:
+    explicit CallbackBatch(BatchFunction function, size_t capacity = 0)
+        : function(function)
+    {
+        nodes.reserve(capacity);
+        agents.reserve(capacity);
+        results.reserve(capacity);
+    }
+
+    CallbackBatch(const CallbackBatch& batch) = delete;
+
+    void flush();
+    size_t pending() const noexcept { return nodes.size(); }
+    friend class BatchNode;
+private:
+    void add(class BatchNode& node);
+    void remove(class BatchNode& node) noexcept;
+
+    BatchFunction function;
+    std::vector<class BatchNode*> nodes;
+    std::vector<void*> agents;
+    // Swapped with the pending ones while flushing, so completed nodes can't change what is being flushed:
+    std::vector<class BatchNode*> flushedNodes;
+    std::vector<Status> results;
+};
+
+
+class BatchNode : public NamedNode
+{
+public:
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+    friend class CallbackBatch;
+protected:
+    BatchNode(const char* name, CallbackBatch& batch, void* agent, bool condition)
+        : NamedNode(name), batch(&batch), agent(agent), condition(condition) {}
+
+    virtual void start(class Scheduler& scheduler) noexcept override { this->scheduler = &scheduler; }
+    virtual Status update() noexcept override;
+    virtual void stop(class Scheduler& scheduler) noexcept override { batch->remove(*this); }
+private:
+    CallbackBatch* batch;
+    void* agent;
+    class Scheduler* scheduler = nullptr;
+    uint32_t slot = 0;
+    bool pending = false;
+    bool condition;
+};
+
+
+class BatchAction : public BatchNode
+{
+public:
+    BatchAction(const char* name, CallbackBatch& batch, void* agent)
+        : BatchNode(name, batch, agent, false) {}
+};
+
+
+class BatchCondition : public BatchNode
+{
+public:
+    BatchCondition(const char* name, CallbackBatch& batch, void* agent)
+        : BatchNode(name, batch, agent, true) {}
+};
+
+}
+
+#endif
+
+#ifndef BEHAVIOR_TREE_BUILDER_H
+#define BEHAVIOR_TREE_BUILDER_H
+
+
+namespace bt
+{
+
+class Builder
+{
+public:
+    explicit Builder(const size_t maxBytes = 1024, const size_t initSchedulerSize = 10)
+        : Builder(makeRef<Memory>(maxBytes), initSchedulerSize) {}
+
+    // Pooled builders reuse the scheduler of their arena:
+    Builder(MemoryPool& pool, const size_t maxBytes = 1024, const size_t initSchedulerSize = 10)
+        : Builder(pool.acquire(maxBytes), pool, initSchedulerSize) {}
+
+    Builder(const Ref<Memory>& memory, const Ref<Scheduler>& scheduler)
+        : memory(memory), scheduler(scheduler), nodesBegin(memory->mark()) {}
+
+    // Open groups point into the builder itself:
+    Builder(const Builder& builder) = delete;
+
+    // Replaying definitions on a measuring builder computes the exact maxBytes they need.
+    // It constructs no nodes, end() only accounts for the tree and returns nullptr:
+    explicit Builder(Memory::Measure measure, const size_t initSchedulerSize = 10)
+        : Builder(makeRef<Memory>(measure), initSchedulerSize) {}
+
+    // Nodes of an unfinished definition may hold subtrees sharing this Memory, so they are destroyed here:
+    ~Builder() { memory->destroy(nodesBegin, memory->mark()); }
+
+    // Identical pure subtrees built from here on, made of conditions, constants and the sequences,
+    // selectors and negations of them, are stored once per tree. Nodes keep the observer and partition
+    // of their run, so they are only shared within a tree, where one runs at a time, and never under a
+    // Parallel. Measuring builders don't deduplicate:
+    Builder& deduplicate(bool enabled = true) { deduplication = enabled; return *this; }
+
+    // Bytes used in the arena so far:
+    size_t size() const noexcept { return memory->size(); }
+
+    // Nodes:
+    Builder& action(const char* name, ActionFunction action) { return create<Action>(name, action); }
+    Builder& action(const char* name, AsyncActionFunction onStart, AsyncActionFunction onTerminate = nullptr) { return create<AsyncAction>(name, onStart, onTerminate); }
+    Builder& action(const char* name, const Ref<BehaviorTree>& tree) { return create<SubTree>(name, tree); }
+    Builder&  check(const char* name, ConditionFunction check) { return create<Condition>(name, check); }
+    Builder& pureCheck(const char* name, ConditionFunction check) { scheduler->enableConditionCache(); return create<PureCondition>(name, check); }
+    Builder&  check(const char* name, QueryCache& cache, QueryCondition query, uint64_t key, uint32_t ttl) { return create<CachedCondition>(name, cache, query, key, ttl); }
+    Builder& action(const char* name, QueryCache& cache, QueryAction query, uint64_t key, uint32_t ttl) { return create<CachedAction>(name, cache, query, key, ttl); }
+    Builder&  check(const char* name, AgentConditionFunction check, void* agent = nullptr) { return create<AgentCondition>(name, check, agent); }
+    Builder& action(const char* name, AgentActionFunction action, void* agent = nullptr) { return create<AgentAction>(name, action, agent); }
+    Builder&  check(const char* name, CallbackBatch& batch, void* agent = nullptr) { return create<BatchCondition>(name, batch, agent); }
+    Builder& action(const char* name, CallbackBatch& batch, void* agent = nullptr) { return create<BatchAction>(name, batch, agent); }
+    Builder& constant(Status status) { return create<Constant>(status); }
+#if defined(BEHAVIOR_TREE_COROUTINES)
+    Builder& action(const char* name, CoroutineFunction body)
+    {
+        if (failed)
+            return *this;
+        Memory::Position position = memory->position();
+        CoroutineAction* node = memory->allocate<CoroutineAction>(name, body);
+        if ((node || memory->measuring()) && !CoroutineAction::reserveFrame(node, body, *memory))
+            failed = true;
+        return add(node, 0, position);
+    }
+#endif
+
+    // Composites:
+    Builder& selector(uint16_t childCount) { return composite<Selector>(childCount); }
+    Builder& sequence(uint16_t childCount) { return composite<Sequence>(childCount); }
+    Builder& parallel(uint16_t childCount, Parallel::Policy success) { return composite<Parallel>(childCount, success); }
+    Builder& parallel(uint16_t childCount, Parallel::Policy success, Parallel::Policy failure) { return composite<Parallel>(childCount, success, failure); }
+
+    // Decorators:
+    Builder& negate() { return group<Negate>(1, Shape::Negate); }
+
+    template<typename T, typename... Args>
+    Builder& create(Args&&... args) { return group<T>(0, Shape::Other, std::forward<Args>(args)...); }
+
+    Ref<BehaviorTree> end() { return finish(nullptr); }
+    // Runs the optimizer on the tree before creating it. Measuring builders can't run it, they
+    // account for the most the child arrays it flattens could take instead:
+    Ref<BehaviorTree> end(Optimizer& optimizer) { return finish(&optimizer); }
+
+protected:
+    // Groups the Optimizer rewrites, known even when measuring constructs no nodes:
+    enum class Shape : uint8_t { Other, Sequence, Selector, Parallel, Negate };
+
+    template<typename T, typename... Args>
+    Builder& composite(uint16_t childCount, Args&&... args)
+    {
+        // The child array is allocated right after the composite so compact ones can reference it with an offset:
+        if (failed)
+            return *this;
+        Memory::Position position = memory->position();
+        T* node = memory->allocate<T>(nullptr, childCount, std::forward<Args>(args)...);
+        Link<Node>* children = memory->allocateArray<Link<Node>>(childCount);
+        if (node && (!children || !node->setChildren(children)))
+            failed = true;
+        Shape shape = std::is_same<T, Sequence>::value ? Shape::Sequence
+            : std::is_same<T, Selector>::value ? Shape::Selector
+            : std::is_same<T, Parallel>::value ? Shape::Parallel : Shape::Other;
+        return add(node, childCount, position, shape);
+    }
+
+    template<typename T, typename... Args>
+    Builder& group(uint16_t childCount, Shape shape, Args&&... args)
+    {
+        if (failed)
+            return *this;
+        Memory::Position position = memory->position();
+        return add(memory->allocate<T>(std::forward<Args>(args)...), childCount, position, shape);
+    }
+
+    // The node is nullptr when measuring, position is where its allocation started.
+    // Without exceptions, a node that didn't fit the Memory fails the rest of the definition:
+    Builder& add(Node* node, uint16_t childCount, const Memory::Position& position, Shape shape = Shape::Other)
+    {
+        if (!node && !memory->measuring())
+            failed = true;
+        if (failed)
+            return *this;
+        addNode(node);
+        if (failed)
+            return *this;
+        if (childCount > 0)
+            pushGroup(node, childCount, position, shape);
+        else
+            completeNode(node, position);
+        return *this;
+    }
+
+private:
+    Builder(const Ref<Memory>& memory, const size_t initSchedulerSize)
+        : Builder(memory, createScheduler(*memory, initSchedulerSize)) {}
+
+    Builder(const Ref<Memory>& memory, MemoryPool& pool, const size_t initSchedulerSize)
+        : Builder(memory, pool.scheduler(*memory, initSchedulerSize)) { pooled = true; }
+
+    static Ref<Scheduler> createScheduler(Memory& memory, const size_t initialSize)
+    {
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+        // Trees and builders release their scheduler before their Memory, so it can share the arena:
+        void* schedulerMemory = memory.allocateBytes(sizeof(Scheduler), alignof(Scheduler));
+        if (schedulerMemory)
+            return adopt<Scheduler, &destroyInPlace<Scheduler>>(new (schedulerMemory) Scheduler(initialSize));
+        return makeRef<Scheduler>(initialSize);
+#else
+        return makeRef<Scheduler>(initialSize);
+#endif
+    }
+
+    // Most links an optimized subtree can add to the child array of a parent sequence or selector.
+    // A composite can flatten its nested children of the same kind, anything else can fold into
+    // the widest of its children:
+    struct Flattening
+    {
+        uint32_t sequence;
+        uint32_t selector;
+    };
+
+    struct Group
+    {
+        Node* parent;
+        int childrenLeftToAdd;
+        Memory::Position position;
+        // Whether the children completed so far are pure, and whether the group is below a Parallel:
+        bool pure;
+        bool parallel;
+        Shape shape;
+        uint16_t childCount;
+        // Links of the children completed so far once flattened, and the widest of them:
+        uint32_t links;
+        Flattening widest;
+        Group() {}
+        Group(Node* parent, uint16_t children, const Memory::Position& position, bool parallel, Shape shape)
+            : parent(parent), childrenLeftToAdd(children), position(position), pure(true), parallel(parallel),
+              shape(shape), childCount(children), links(0), widest{1, 1} {}
+    };
+
+    Ref<BehaviorTree> finish(Optimizer* optimizer);
+    void addNode(Node* node);
+    void abandon() noexcept;
+    void pushGroup(Node* parent, uint16_t childCount, const Memory::Position& position, Shape shape);
+    void completeNode(Node* node, const Memory::Position& position);
+    void addFlattening(const Flattening& child);
+    Flattening closeFlattening(const Group& group);
+
+    // Deduplication:
+    void share(Node* node, const Memory::Position& position, bool pure);
+    void discard(const Memory::Position& position);
+    static bool pure(const Node& node, bool childrenPure);
+    static size_t hash(const Node& node);
+    static bool equal(const Node& a, const Node& b);
+
+    static const uint32_t InlineGroups = 16;
+
+    Node* root = nullptr;
+    bool defining = false;
+    // Pooled arenas also hold the control blocks of their trees:
+    bool pooled = false;
+    // Set by errors reported without exceptions, the definition ends without a tree:
+    bool failed = false;
+    Ref<Memory> memory;
+    Ref<Scheduler> scheduler;
+    Memory::Marker nodesBegin;
+
+    // Open groups live inline and spill into the arena for deeper definitions, so building doesn't touch the heap.
+    // Compact builders spill very deep ones to the heap instead, where they stay out of the offsets to children:
+    Group* groups = inlineGroups;
+    uint32_t groupCount = 0;
+    uint32_t groupCapacity = InlineGroups;
+    Group inlineGroups[InlineGroups];
+    std::vector<Group> measuredGroups;
+
+    // Links of the child arrays the Optimizer could allocate for the current definition:
+    size_t flattenedLinks = 0;
+
+    bool deduplication = false;
+    std::unordered_multimap<size_t, Node*> sharedNodes;
+    std::vector<Node*> sharedOrder;
+    // Nodes with more than one parent, which the Optimizer leaves as they are:
+    std::vector<const Node*> reusedNodes;
+};
+
+}
+
+#endif
+
+
+
+namespace bt
+{
+
+inline void Node::traverse(Visitor& visitor) const
+{
+    visitor.visit(*this);
+}
+
+inline void Node::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    writer.write(nodeStatus);
+}
+
+inline void Node::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Status status = reader.read<Status>();
+    if (status > Status::Suspended)
+        reader.reject();
+    if (reader.validating())
+    {
+        reader.nodes.push_back(this);
+        return;
+    }
+
+    // The tree restores its run queue once all nodes are restored:
+    scheduler.setStatus(*this, status);
+    this->observer = observer;
+    partition = scheduler.currentPartition();
+}
+
+inline void SubTree::start(Scheduler& scheduler) noexcept
+{
+    // The root reports to its own tree, which forwards the result to this node:
+    if (tree && tree->root)
+    {
+        tree->parent = this;
+        scheduler.start(*tree->root, *tree);
+    }
+}
+
+inline void SubTree::stop(Scheduler& scheduler) noexcept
+{
+    if (tree && tree->root)
+        scheduler.stop(*tree->root);
+}
+
+inline void SubTree::traverse(Visitor& visitor) const
+{
+    visitor.visit(*this);
+}
+
+inline void SubTree::traverseSubTree(Visitor& visitor) const
+{
+    if (tree && tree->root)
+        tree->root->traverse(visitor);
+}
+
+inline void SubTree::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    Node::saveState(writer, scheduler);
+    if (tree && tree->root)
+        tree->root->saveState(writer, scheduler);
+}
+
+inline void SubTree::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    if (tree && tree->root)
+    {
+        // Like start(), only a running subtree reports to this node:
+        if (!reader.validating() && (status() == Status::Running || status() == Status::Suspended))
+            tree->parent = this;
+        tree->root->restoreState(reader, scheduler, tree.get());
+    }
+}
+
+inline void PureCondition::start(Scheduler& scheduler) noexcept
+{
+    BEHAVIOR_TREE_TRY
+    {
+        ConditionCache* cache = scheduler.conditionCache();
+        bool value = cache ? cache->evaluate(check, scheduler.generation()) : check();
+        result = value ? Status::Success : Status::Failure;
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+        result = Status::Failure;
+    }
+}
+
+inline void AsyncNode::start(class Scheduler& scheduler) noexcept
+{
+    this->scheduler = &scheduler;
+    release();
+
+    // Without a handle nothing could complete the node, so it fails when the table is full:
+    asyncHandle = Handles::acquire(this, HandleKind::Async);
+    if (asyncHandle)
+        this->start();
+}
+
+// The handle is released first, completing may already start the node's next run:
+inline void AsyncNode::succeeded() noexcept
+{
+    if (status() == Status::Suspended && this->scheduler)
+    {
+        release();
+        this->scheduler->completed(*this, Status::Success);
+    }
+}
+
+inline void AsyncNode::failed() noexcept
+{
+    if (status() == Status::Suspended && this->scheduler)
+    {
+        release();
+        this->scheduler->completed(*this, Status::Failure);
+    }
+}
+
+inline bool AsyncNode::succeeded(Handle handle) noexcept
+{
+    AsyncNode* node = find(handle);
+    if (!node)
+        return false;
+    node->succeeded();
+    return true;
+}
+
+inline bool AsyncNode::failed(Handle handle) noexcept
+{
+    AsyncNode* node = find(handle);
+    if (!node)
+        return false;
+    node->failed();
+    return true;
+}
+
+inline void AsyncNode::release() noexcept
+{
+    Handles::release(asyncHandle);
+    asyncHandle = 0;
+}
+
+inline void AsyncNode::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    if (reader.validating())
+        return;
+    this->scheduler = &scheduler;
+    release();
+    if (status() == Status::Suspended)
+        asyncHandle = Handles::acquire(this, HandleKind::Async);
+}
+
+}
+
+
+namespace bt
+{
+
+inline bool Decorator::setChild(Node* child)
+{
+#if defined(BEHAVIOR_TREE_COMPACT)
+    intptr_t offset = child ? (intptr_t)child - (intptr_t)this : 0;
+    if (offset < INT16_MIN || offset > INT16_MAX)
+    {
+        raise("BehaviorTree compact decorator child must be allocated next to it.");
+        return false;
+    }
+    childOffset = (int16_t)offset;
+#else
+    childNode = child;
+#endif
+    return true;
+}
+
+inline void Decorator::traverse(Visitor& visitor) const
+{
+    visitor.visit(*this);
+    if (Composite* composite = dynamic_cast<Composite*>(child()))
+        composite->traverseChildren(visitor);
+}
+
+inline void Decorator::start(Scheduler& scheduler) noexcept
+{
+    scheduler.start(*child(), *this);
+}
+
+inline void Decorator::stop(Scheduler& scheduler) noexcept
+{
+    if (Node* childNode = child())
+        scheduler.stop(*childNode);
+}
+
+inline void Decorator::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    Node::saveState(writer, scheduler);
+    if (Node* childNode = child())
+        childNode->saveState(writer, scheduler);
+}
+
+inline void Decorator::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    if (Node* childNode = child())
+        childNode->restoreState(reader, scheduler, this);
+}
+
+inline void Negate::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+{
+    if (status == Status::Success)
+        status = Status::Failure;
+    else if (status == Status::Failure)
+        status = Status::Success;
+    scheduler.completed(*this, status);
+}
+
+}
+
+
+namespace bt
+{
+
+inline bool Composite::setChildren(Link<Node>* children)
+{
+#if defined(BEHAVIOR_TREE_COMPACT)
+    intptr_t offset = children ? (intptr_t)children - (intptr_t)this : 0;
+    if (offset < INT16_MIN || offset > INT16_MAX)
+    {
+        raise("BehaviorTree compact composite children must be allocated next to it.");
+        return false;
+    }
+    childrenOffset = (int16_t)offset;
+#else
+    childNodes = children;
+#endif
+    return true;
+}
+
+inline void Composite::addChild(Node* child)
+{
+    if (child && currentIndex < childCount)
+    {
+        children()[currentIndex] = child;
+        ++currentIndex;
+    }
+}
+
+inline void Composite::start(Scheduler& scheduler) noexcept
+{
+    currentIndex = 0;
+    scheduler.start(*children()[0], *this);
+}
+
+inline void Composite::traverse(Visitor& visitor) const
+{
+    visitor.visit(*this);
+    traverseChildren(visitor);
+}
+
+inline void Composite::traverseChildren(Visitor& visitor) const
+{
+    visitor.beforeChildNodes(*this);
+    for (int i = 0; i < childCount; ++i)
+        children()[i]->traverse(visitor);
+    visitor.afterChildNodes(*this);
+}
+
+inline void Composite::stop(Scheduler& scheduler) noexcept
+{
+    if (children())
+    {
+        for (uint16_t i = 0; i < childCount; ++i)
+            if (Node* child = children()[i])
+                scheduler.stop(*child);
+    }
+}
+
+inline void Composite::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    Node::saveState(writer, scheduler);
+    // Completed composites are past their last child, start() resets the index anyway:
+    writer.write<uint16_t>(currentIndex < childCount ? currentIndex : 0);
+    for (uint16_t i = 0; i < childCount; ++i)
+        children()[i]->saveState(writer, scheduler);
+}
+
+inline void Composite::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    uint16_t index = reader.read<uint16_t>();
+    if (index != 0 && index >= childCount)
+        reader.reject();
+    if (!reader.validating())
+        currentIndex = index;
+    for (uint16_t i = 0; i < childCount; ++i)
+        children()[i]->restoreState(reader, scheduler, this);
+}
+
+inline void Sequence::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+{
+    // Synchronous children are ticked in place until one doesn't succeed:
+    while (status == Status::Success && ++currentIndex < childCount)
+        status = scheduler.run(*children()[currentIndex], *this);
+
+    if (status == Status::Success || status == Status::Failure)
+        scheduler.completed(*this, status);
+}
+
+inline void Selector::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+{
+    // Synchronous children are ticked in place until one doesn't fail:
+    while (status == Status::Failure && ++currentIndex < childCount)
+        status = scheduler.run(*children()[currentIndex], *this);
+
+    if (status == Status::Success || status == Status::Failure)
+        scheduler.completed(*this, status);
+}
+
+inline void Parallel::start(Scheduler& scheduler) noexcept
+{
+    successCount = 0;
+    failureCount = 0;
+    currentIndex = 0;
+
+    // Queue the children in reverse order so they end up being ran in the correct order (first->last):
+    for (uint16_t i = childCount - 1; i < childCount; --i)
+        scheduler.start(*children()[i], *this);
+}
+
+inline void Parallel::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+{
+    if (status == Status::Success)
+    {
+        ++successCount;
+        if (successPolicy == Policy::RequireOne)
+        {
+            stop(scheduler);  // Stop the other running children
+            scheduler.completed(*this, Status::Success);
+            return;
+        }
     }
-
-    template <typename T>
-    T* allocateArray(int length)
+    else if (status == Status::Failure)
     {
-        size_t size = sizeof(T) * length;
-        if ((offset + size) >= maxBytes)
-            throw std::runtime_error("BehaviorTree Memory capacity exceeded.");
-		T* instance = new ((void*)((uintptr_t)buffer + offset)) T [length];
-        offset += size;
-        return instance;
+        ++failureCount;
+        if (failurePolicy == Policy::RequireOne)
+        {
+            stop(scheduler);  // Stop the other running children
+            scheduler.completed(*this, Status::Failure);
+            return;
+        }
     }
 
-private:
-	uint8_t* buffer;
-    size_t offset = 0;
-    const size_t maxBytes;
-};
+    if (failurePolicy == Policy::RequireAll && failureCount == childCount)
+        scheduler.completed(*this, Status::Failure);
+    else if (successPolicy == Policy::RequireAll && successCount == childCount)
+        scheduler.completed(*this, Status::Success);
+    // If both success and failure policies are all and some succeed, but some fail, consider it a failure:
+    else if ((successCount + failureCount) == childCount)
+        scheduler.completed(*this, Status::Failure);
+}
 
+inline void Parallel::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    Composite::saveState(writer, scheduler);
+    writer.write(successCount);
+    writer.write(failureCount);
 }
 
-#endif
+inline void Parallel::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Composite::restoreState(reader, scheduler, observer);
+    uint16_t successes = reader.read<uint16_t>();
+    uint16_t failures = reader.read<uint16_t>();
+    if (successes + failures > childCount)
+        reader.reject();
+    if (!reader.validating())
+    {
+        successCount = successes;
+        failureCount = failures;
+    }
+}
+
+}
 
-#ifndef BEHAVIOR_TREE_SCHEDULER_H
-#define BEHAVIOR_TREE_SCHEDULER_H
 
+#if defined(BEHAVIOR_TREE_COROUTINES)
 
 namespace bt
 {
 
-class Scheduler
+inline void* Coroutine::promise_type::operator new(size_t size, CoroutineAction& action) noexcept
 {
-public:
-    explicit Scheduler(size_t initialSize)
-        : runningNodes(std::deque<Node*>()) {}
+    return action.allocateFrame(size);
+}
 
-    void tick()
-    {
-        if (runningNodes.size() == 0)
-            return;
+inline Coroutine& Coroutine::operator=(Coroutine&& c) noexcept
+{
+    if (handle)
+        handle.destroy();
+    handle = c.handle;
+    c.handle = nullptr;
+    return *this;
+}
 
-        // Insert an end-of-update marker into the list of tasks.
-        runningNodes.push_back(nullptr);
+inline void* CoroutineAction::allocateFrame(size_t size) noexcept
+{
+    // The same body always needs the same frame size, so the reserved frame is reused:
+    if (size <= frameSize)
+        return frame;
+    if (!arena)
+        return nullptr;
 
-        // Keep going updating tasks until we encounter the nullptr marker:
-        while (true)
-        {
-            Node* current = runningNodes.front();
-            runningNodes.pop_front();
+    void* allocated = arena->tryAllocateBytes(size);
+    if (allocated)
+    {
+        frame = allocated;
+        frameSize = size;
+    }
+    return allocated;
+}
 
-            if (current == nullptr)
-                return;
+inline bool CoroutineAction::reserveFrame(CoroutineAction* action, CoroutineFunction body, Memory& memory)
+{
+    CoroutineAction probe("Probe", body);
+    CoroutineAction& reserving = action ? *action : probe;
+
+    // Bodies start suspended, creating one doesn't run any of its code:
+    reserving.arena = &memory;
+    reserving.coroutine = body(reserving);
+    reserving.coroutine = Coroutine();
+    reserving.arena = nullptr;
+    if (!reserving.frame && !memory.measuring())
+    {
+        raise("BehaviorTree Memory capacity exceeded.");
+        return false;
+    }
+    return true;
+}
 
-            current->tick(*this);
+inline void CoroutineAction::start(Scheduler& scheduler) noexcept
+{
+    this->scheduler = &scheduler;
+    waitTicks = 0;
+    waitStatus = Status::Running;
 
-            // If currently running, drop it into the queue for next tick:
-            if (current->nodeStatus == Status::Running)
-            {
-                runningNodes.push_back(current);
-            }
-            else if (current->nodeStatus != Status::Suspended)
-            {
-                // Notify observer that task completed:
-                if (current->observer)
-                    current->observer->onComplete(*this, *current, current->nodeStatus);
-            }
-        }
+    // Destroy the previous run's frame before its memory is reused:
+    coroutine = Coroutine();
+    BEHAVIOR_TREE_TRY
+    {
+        coroutine = body(*this);
     }
-
-    void start(Node& node, Observer& observer) noexcept
+    BEHAVIOR_TREE_CATCH
     {
-        node.observer = &observer;
-        runningNodes.push_front(&node);
     }
+}
 
-    void completed(Node& node, Status result) noexcept
+inline Status CoroutineAction::update() noexcept
+{
+    if (coroutine.done())
+        return coroutine.result();
+
+    if (waitTicks > 0 && --waitTicks > 0)
+        return Status::Running;
+
+    coroutine.resume();
+    if (coroutine.done())
     {
-        node.nodeStatus = result;
-        if (node.observer)
-            node.observer->onComplete(*this, node, result);
+        Status result = coroutine.result();
+        coroutine = Coroutine();
+        return result;
     }
+    return waitStatus;
+}
 
-    void stop(Node& node) noexcept
-    {
-        if (node.nodeStatus == Status::Running || node.nodeStatus == Status::Suspended)
-        {
-            node.stop(*this);
-            node.nodeStatus = Status::Failure;
-        }
+inline void CoroutineAction::stop(Scheduler& scheduler) noexcept
+{
+    coroutine = Coroutine();
+}
 
-        // Remove the node from the queue if it exists:
-        auto node_pos = std::find(runningNodes.begin(), runningNodes.end(), &node);
-        if (node_pos != runningNodes.end())
-            runningNodes.erase(node_pos);
-    }
-private:
-    std::deque<Node*> runningNodes;
-};
+inline void CoroutineAction::resume() noexcept
+{
+    if (status() == Status::Suspended && scheduler)
+        scheduler->resume(*this);
+}
 
 }
 
 #endif
 
-#ifndef BEHAVIOR_TREE_TREE_H
-#define BEHAVIOR_TREE_TREE_H
+namespace bt
+{
 
+inline Node* Optimizer::optimize(Node& root, Memory& memory, const std::vector<const Node*>& shared)
+{
+    this->memory = &memory;
+    this->shared = &shared;
+    before = count(&root);
+    Node* result = optimizeNode(&root);
+    after = count(result);
+    this->shared = nullptr;
+    return result;
+}
 
-namespace bt
+inline Node* Optimizer::optimizeNode(Node* node)
 {
+    if (isShared(node))
+        return node;
+    if (Composite* composite = dynamic_cast<Composite*>(node))
+        return optimizeComposite(composite);
+    if (typeid(*node) == typeid(Negate))
+        return optimizeNegate(static_cast<Negate*>(node));
+    if (Decorator* decorator = dynamic_cast<Decorator*>(node))
+    {
+        // A node that can't be relinked keeps its original child, which is still equivalent:
+        Node* child = optimizeNode(decorator->child());
+        if (reachable(decorator, child))
+            decorator->setChild(child);
+    }
+    return node;
+}
 
-class BehaviorTree : public Observer
+inline Node* Optimizer::optimizeComposite(Composite* composite)
 {
-public:
-    Status tick()
+    if (composite->childCount == 0)
+        return composite;
+
+    Link<Node>* children = composite->children();
+    for (uint16_t i = 0; i < composite->childCount; ++i)
+        children[i] = optimizeNode(children[i]);
+
+    std::vector<Node*> result;
+    Node* dropped = nullptr;
+    collectChildren(composite, true, result, dropped);
+    if (result.size() > composite->childCount)
     {
-        if (schedulerStopped)
+        Link<Node>* flattened = nullptr;
+        if (result.size() <= UINT16_MAX)
         {
-            schedulerStopped = false;
-            scheduler->start(*root, *this);
+            if (void* array = memory->tryAllocateBytes(sizeof(Link<Node>) * result.size(), alignof(Link<Node>)))
+                flattened = new (array) Link<Node>[result.size()];
+        }
+        if (flattened && reachable(composite, flattened))
+        {
+            composite->setChildren(flattened);
+            children = flattened;
+        }
+        else
+        {
+            collectChildren(composite, false, result, dropped);
         }
-        scheduler->tick();
-        return root->status();
     }
 
-    void stop()
+    // Only constants were left, the first skipped one has the composite's result:
+    if (result.empty())
+        return dropped;
+    if (result.size() == 1)
+        return result[0];
+
+    for (size_t i = 0; i < result.size(); ++i)
+        children[i] = result[i];
+    composite->childCount = (uint16_t)result.size();
+    return composite;
+}
+
+inline void Optimizer::collectChildren(Composite* composite, bool flatten, std::vector<Node*>& result, Node*& dropped) const
+{
+    result.clear();
+    dropped = nullptr;
+
+    // Sequences move past successful children and stop at failed ones, selectors the other way round:
+    const bool sequence = typeid(*composite) == typeid(Sequence);
+    const bool selector = typeid(*composite) == typeid(Selector);
+    const Status skipped = sequence ? Status::Success : Status::Failure;
+    const Status stopping = sequence ? Status::Failure : Status::Success;
+
+    Link<Node>* children = composite->children();
+    for (uint16_t i = 0; i < composite->childCount; ++i)
     {
-        scheduler->stop(*root);
+        Node* child = children[i];
+        if (sequence || selector)
+        {
+            if (Constant* constant = dynamic_cast<Constant*>(child))
+            {
+                if (constant->result == skipped)
+                {
+                    if (!dropped)
+                        dropped = constant;
+                    continue;
+                }
+                if (constant->result == stopping)
+                {
+                    result.push_back(constant);
+                    return;
+                }
+            }
+            if (flatten && typeid(*child) == typeid(*composite) && static_cast<Composite*>(child)->childCount > 0)
+            {
+                // The nested composite is already folded, so only its last child can stop it:
+                Composite* nested = static_cast<Composite*>(child);
+                for (uint16_t j = 0; j < nested->childCount; ++j)
+                    result.push_back(nested->children()[j]);
+                Constant* last = dynamic_cast<Constant*>(result.back());
+                if (last && last->result == stopping)
+                    return;
+                continue;
+            }
+        }
+        result.push_back(child);
     }
+}
 
-    void traverse(Visitor& visitor) const
+inline Node* Optimizer::optimizeNegate(Negate* negate)
+{
+    Node* child = optimizeNode(negate->child());
+    if (typeid(*child) == typeid(Negate))
+        return static_cast<Negate*>(child)->child();
+
+    // Only this negation reaches a constant that isn't shared, so it is inverted in place:
+    Constant* constant = dynamic_cast<Constant*>(child);
+    if (constant && !isShared(constant) && (constant->result == Status::Success || constant->result == Status::Failure))
     {
-        visitor.begin();
-        root->traverse(visitor);
-        visitor.end();
+        constant->result = constant->result == Status::Success ? Status::Failure : Status::Success;
+        return constant;
     }
 
-    ~BehaviorTree()
+    if (reachable(negate, child))
+        negate->setChild(child);
+    return negate;
+}
+
+inline bool Optimizer::isShared(const Node* node) const
+{
+    return shared && std::binary_search(shared->begin(), shared->end(), node);
+}
+
+inline size_t Optimizer::count(const Node* node)
+{
+    size_t nodes = 1;
+    if (const Composite* composite = dynamic_cast<const Composite*>(node))
     {
-        stop();
-        root->~Node();
-        root = nullptr;
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            nodes += count(composite->children()[i]);
     }
-
-    friend class Memory;
-    friend class SubTree;
-    Status status() const noexcept { return root->status(); }
-protected:
-    virtual void onComplete(class Scheduler& scheduler, const Node& root, Status status) noexcept override
+    else if (const Decorator* decorator = dynamic_cast<const Decorator*>(node))
     {
-        schedulerStopped = true;
+        nodes += count(decorator->child());
     }
-private:
-    BehaviorTree(Node& root,
-        const std::shared_ptr<Memory>& memory,
-        const std::shared_ptr<Scheduler>& scheduler)
-        : root(&root), memory(memory), scheduler(scheduler) {}
+    return nodes;
+}
 
-    Node* root;
-    std::shared_ptr<Memory> memory;
-    std::shared_ptr<Scheduler> scheduler;
-    bool schedulerStopped = true;
-};
+}
+
+namespace bt
+{
 
-std::ostream& operator<<(std::ostream& os, const BehaviorTree& tree)
+#if defined(BEHAVIOR_TREE_LOCKSTEP_SSE2)
+
+// Expands the bits of a lane mask to all ones bytes or words:
+inline __m128i laneBytes(uint16_t lanes) noexcept
 {
-    TextSerializer serializer(os, true);
-    tree.traverse(serializer);
-    return os;
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i mask = _mm_unpacklo_epi64(_mm_set1_epi8((char)(lanes & 0xFF)), _mm_set1_epi8((char)(lanes >> 8)));
+    return _mm_cmpeq_epi8(_mm_and_si128(mask, bits), bits);
 }
 
+inline __m128i laneWords(uint8_t lanes) noexcept
+{
+    const __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(lanes), bits), bits);
 }
 
-#endif
+inline __m128i select(__m128i mask, __m128i a, __m128i b) noexcept
+{
+    return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+}
 
-#ifndef BEHAVIOR_TREE_BUILDER_H
-#define BEHAVIOR_TREE_BUILDER_H
+inline uint16_t LaneStatuses::equal(Status status) const noexcept
+{
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)status)));
+}
 
+inline void LaneStatuses::assign(const LaneStatuses& statuses, uint16_t lanes) noexcept
+{
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    __m128i s = _mm_load_si128((const __m128i*)statuses.values);
+    _mm_store_si128((__m128i*)values, select(laneBytes(lanes), v, s));
+}
 
-namespace bt
+inline void LaneStatuses::fill(Status status, uint16_t lanes) noexcept
 {
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    _mm_store_si128((__m128i*)values, select(laneBytes(lanes), v, _mm_set1_epi8((char)status)));
+}
 
-class Builder
+inline void LaneStatuses::negate(uint16_t lanes) noexcept
 {
-public:
-    explicit Builder(const size_t maxBytes = 1024, const size_t initSchedulerSize = 10)
-        : memory(std::make_shared<Memory>(maxBytes))
-        , scheduler(std::make_shared<Scheduler>(initSchedulerSize)) {}
-        // , scheduler(std::shared_ptr<Scheduler>(memory->allocate<Scheduler>(initSchedulerSize))) {}
+    __m128i mask = laneBytes(lanes);
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    __m128i succeeded = _mm_and_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)Status::Success)));
+    __m128i failed = _mm_and_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)Status::Failure)));
+    v = select(succeeded, v, _mm_set1_epi8((char)Status::Failure));
+    v = select(failed, v, _mm_set1_epi8((char)Status::Success));
+    _mm_store_si128((__m128i*)values, v);
+}
 
-    Builder(const std::shared_ptr<Memory>& memory, const std::shared_ptr<Scheduler>& scheduler)
-        : memory(memory), scheduler(scheduler) {}
+inline uint16_t LaneCounts::equal(uint16_t count) const noexcept
+{
+    __m128i c = _mm_set1_epi16((short)count);
+    __m128i low = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)values), c);
+    __m128i high = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(values + 8)), c);
+    return (uint16_t)_mm_movemask_epi8(_mm_packs_epi16(low, high));
+}
 
-    // Nodes:
-    Builder& action(const char* name, ActionFunction action) { return create<Action>(name, action); }
-    Builder& action(const char* name, AsyncActionFunction onStart, AsyncActionFunction onTerminate = nullptr) { return create<AsyncAction>(name, onStart, onTerminate); }
-    Builder& action(const char* name, const std::shared_ptr<BehaviorTree>& tree) { return create<SubTree>(name, tree); }
-    Builder&  check(const char* name, ConditionFunction check) { return create<Condition>(name, check); }
+inline void LaneCounts::fill(uint16_t count, uint16_t lanes) noexcept
+{
+    __m128i c = _mm_set1_epi16((short)count);
+    __m128i* low = (__m128i*)values;
+    __m128i* high = (__m128i*)(values + 8);
+    _mm_store_si128(low, select(laneWords((uint8_t)lanes), _mm_load_si128(low), c));
+    _mm_store_si128(high, select(laneWords((uint8_t)(lanes >> 8)), _mm_load_si128(high), c));
+}
 
-    // Composites:
-    Builder& selector(uint16_t childCount) { return composite<Selector>(childCount); }
-    Builder& sequence(uint16_t childCount) { return composite<Sequence>(childCount); }
-    Builder& parallel(uint16_t childCount, Parallel::Policy success) { return composite<Parallel>(childCount, success); }
-    Builder& parallel(uint16_t childCount, Parallel::Policy success, Parallel::Policy failure) { return composite<Parallel>(childCount, success, failure); }
+inline void LaneCounts::increment(uint16_t lanes) noexcept
+{
+    // Selected words are all ones, subtracting them adds one:
+    __m128i* low = (__m128i*)values;
+    __m128i* high = (__m128i*)(values + 8);
+    _mm_store_si128(low, _mm_sub_epi16(_mm_load_si128(low), laneWords((uint8_t)lanes)));
+    _mm_store_si128(high, _mm_sub_epi16(_mm_load_si128(high), laneWords((uint8_t)(lanes >> 8))));
+}
 
-    // Decorators:
-    Builder& negate() { return group<Negate>(1); }
+#else
 
-    template<typename T, typename... Args>
-    Builder& create(Args&&... args) { return group<T>(0, std::forward<Args>(args)...); }
+inline uint16_t LaneStatuses::equal(Status status) const noexcept
+{
+    uint16_t lanes = 0;
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        lanes |= (uint16_t)(values[lane] == status) << lane;
+    return lanes;
+}
 
-    std::shared_ptr<BehaviorTree> end();
+inline void LaneStatuses::assign(const LaneStatuses& statuses, uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        if (lanes >> lane & 1)
+            values[lane] = statuses.values[lane];
+}
 
-protected:
-    template<typename T, typename... Args>
-    Builder& composite(uint16_t childCount, Args&&... args)
-    {
-        Node** children = memory->allocateArray<Node*>(childCount);
-        return group<T>(childCount, children, childCount, std::forward<Args>(args)...);
-    }
+inline void LaneStatuses::fill(Status status, uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        if (lanes >> lane & 1)
+            values[lane] = status;
+}
 
-    template<typename T, typename... Args>
-    Builder& group(uint16_t childCount, Args&&... args)
+inline void LaneStatuses::negate(uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
     {
-        T* node = memory->allocate<T>(std::forward<Args>(args)...);
-        addNode(node);
-        if (childCount > 0)
-            groups.push_back(Group(node, childCount));
-        return *this;
+        if (!(lanes >> lane & 1))
+            continue;
+        if (values[lane] == Status::Success)
+            values[lane] = Status::Failure;
+        else if (values[lane] == Status::Failure)
+            values[lane] = Status::Success;
     }
+}
 
-private:
-    struct Group
+inline uint16_t LaneCounts::equal(uint16_t count) const noexcept
+{
+    uint16_t lanes = 0;
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        lanes |= (uint16_t)(values[lane] == count) << lane;
+    return lanes;
+}
+
+inline void LaneCounts::fill(uint16_t count, uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        if (lanes >> lane & 1)
+            values[lane] = count;
+}
+
+inline void LaneCounts::increment(uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        values[lane] += lanes >> lane & 1;
+}
+
+#endif
+
+
+inline Lockstep::Lockstep(const BehaviorTree& tree)
+{
+    if (!compile(tree.root))
     {
-        Node* parent;
-        int childrenLeftToAdd;
-        Group(Node* parent, int children)
-            : parent(parent), childrenLeftToAdd(children) {}
-    };
+        program.clear();
+        counterCount = 0;
+    }
+}
 
-    void addNode(Node* node);
+inline bool Lockstep::compile(const Node* node)
+{
+    const uint32_t index = (uint32_t)program.size();
+    program.push_back(Instruction());
+    Instruction instruction = Instruction();
 
-    Node* root = nullptr;
-    std::shared_ptr<Memory> memory;
-    std::shared_ptr<Scheduler> scheduler;
-    std::vector<Group> groups = std::vector<Group>();
-};
+    const std::type_info& type = typeid(*node);
+    if (type == typeid(Sequence) || type == typeid(Selector) || type == typeid(Parallel))
+    {
+        const Composite* composite = static_cast<const Composite*>(node);
+        instruction.opcode = type == typeid(Sequence) ? Opcode::Sequence : type == typeid(Selector) ? Opcode::Selector : Opcode::Parallel;
+        instruction.childCount = composite->childCount;
+        instruction.counters = counterCount;
+        if (instruction.opcode == Opcode::Parallel)
+        {
+            // Successes, failures and completed children:
+            const Parallel* parallel = static_cast<const Parallel*>(node);
+            instruction.successOne = parallel->successPolicy == Parallel::Policy::RequireOne;
+            instruction.failureOne = parallel->failurePolicy == Parallel::Policy::RequireOne;
+            counterCount += 3;
+        }
+        else
+        {
+            // Index of the current child:
+            counterCount += 1;
+        }
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            if (!compile(composite->children()[i]))
+                return false;
+    }
+    else if (type == typeid(Negate))
+    {
+        instruction.opcode = Opcode::Negate;
+        instruction.childCount = 1;
+        if (!compile(static_cast<const Negate*>(node)->child()))
+            return false;
+    }
+    else if (type == typeid(Constant))
+    {
+        instruction.opcode = Opcode::Constant;
+        instruction.constant = static_cast<const Constant*>(node)->result;
+    }
+    else if (type == typeid(Condition) || type == typeid(PureCondition))
+    {
+        instruction.opcode = Opcode::Condition;
+        instruction.condition = static_cast<const Condition*>(node)->check;
+    }
+    else if (type == typeid(Action))
+    {
+        instruction.opcode = Opcode::Action;
+        instruction.action = static_cast<const Action*>(node)->action;
+    }
+    else if (type == typeid(AgentCondition))
+    {
+        instruction.opcode = Opcode::AgentCondition;
+        instruction.agentCondition = static_cast<const AgentCondition*>(node)->check;
+    }
+    else if (type == typeid(AgentAction))
+    {
+        instruction.opcode = Opcode::AgentAction;
+        instruction.agentAction = static_cast<const AgentAction*>(node)->action;
+    }
+    else
+    {
+        raise("BehaviorTree Lockstep definitions may only hold composites, negations and synchronous leaves.");
+        return false;
+    }
 
+    instruction.end = (uint32_t)program.size();
+    program[index] = instruction;
+    return true;
 }
 
-#endif
-
-
-
-namespace bt
+inline size_t Lockstep::add(void* agent)
 {
+    if (agentCount % Lanes == 0)
+    {
+        blocks.emplace_back();
+        blocks.back().running.resize(program.size());
+        blocks.back().counters.resize(counterCount);
+    }
 
-inline void Node::traverse(Visitor& visitor) const
-{
-    visitor.visit(*this);
+    Block& block = blocks.back();
+    const uint32_t lane = agentCount % Lanes;
+    block.agents[lane] = agent;
+    block.statuses.values[lane] = Status::Initial;
+    block.lanes |= (uint16_t)(1u << lane);
+    return agentCount++;
 }
 
-inline void SubTree::start(Scheduler& scheduler) noexcept
+inline void Lockstep::tick()
 {
-    if (tree && tree->root)
-        scheduler.start(*tree->root, *this);
+    if (program.empty())
+        return;
+    for (Block& block : blocks)
+        run(block, 0, block.lanes, block.statuses);
 }
 
-inline void SubTree::stop(Scheduler& scheduler) noexcept
+inline void Lockstep::stop() noexcept
 {
-    if (tree && tree->root)
-        scheduler.stop(*tree->root);
+    for (Block& block : blocks)
+    {
+        std::fill(block.running.begin(), block.running.end(), 0);
+        block.statuses.fill(Status::Failure, block.lanes);
+    }
 }
 
-inline void SubTree::onComplete(Scheduler& scheduler, const Node& root, Status status) noexcept
+inline void Lockstep::run(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const
 {
-    scheduler.completed(*this, status);
-}
+    const Instruction& instruction = program[index];
+    switch (instruction.opcode)
+    {
+        case Opcode::Sequence:
+        case Opcode::Selector:
+            runSequence(block, index, lanes, result);
+            break;
+        case Opcode::Parallel:
+            runParallel(block, index, lanes, result);
+            break;
+        case Opcode::Negate:
+            run(block, index + 1, lanes, result);
+            result.negate(lanes);
+            break;
+        default:
+            runLeaf(block, instruction, lanes, result);
+            break;
+    }
 
-inline void SubTree::traverse(Visitor& visitor) const
-{
-    visitor.visit(*this);
+    uint16_t& running = block.running[index];
+    running = (running & ~lanes) | (lanes & result.equal(Status::Running));
 }
 
-inline void SubTree::traverseSubTree(Visitor& visitor) const
+inline void Lockstep::runLeaf(const Block& block, const Instruction& instruction, uint16_t lanes, LaneStatuses& result) const
 {
-    if (tree && tree->root)
-        tree->root->traverse(visitor);
-}
+    if (instruction.opcode == Opcode::Constant)
+    {
+        result.fill(instruction.constant, lanes);
+        return;
+    }
 
-inline void AsyncNode::start(class Scheduler& scheduler) noexcept
-{
-    this->scheduler = &scheduler;
-    this->start();
+    for (uint32_t lane = 0; lane < Lanes; ++lane)
+    {
+        if (!(lanes >> lane & 1))
+            continue;
+
+        Status status;
+        BEHAVIOR_TREE_TRY
+        {
+            switch (instruction.opcode)
+            {
+                case Opcode::Condition: status = instruction.condition() ? Status::Success : Status::Failure; break;
+                case Opcode::Action: status = instruction.action(); break;
+                case Opcode::AgentCondition: status = instruction.agentCondition(block.agents[lane]) ? Status::Success : Status::Failure; break;
+                default: status = instruction.agentAction(block.agents[lane]); break;
+            }
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            status = Status::Failure;
+        }
+        result.values[lane] = status == Status::Running || status == Status::Success ? status : Status::Failure;
+    }
 }
 
-inline void AsyncNode::succeeded() noexcept
+inline void Lockstep::runSequence(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const
 {
-    if (status() == Status::Suspended && this->scheduler)
-        this->scheduler->completed(*this, Status::Success);
+    // Sequences move on while their children succeed, selectors while they fail:
+    const Instruction& instruction = program[index];
+    const Status next = instruction.opcode == Opcode::Sequence ? Status::Success : Status::Failure;
+    LaneCounts& current = block.counters[instruction.counters];
+    current.fill(0, lanes & ~block.running[index]);
+
+    LaneStatuses statuses;
+    uint16_t pending = lanes;
+    uint32_t child = index + 1;
+    for (uint16_t i = 0; i < instruction.childCount && pending; ++i, child = program[child].end)
+    {
+        // Lanes resuming a running child join the ones that moved past the previous children:
+        const uint16_t active = pending & current.equal(i);
+        if (!active)
+            continue;
+
+        run(block, child, active, statuses);
+        const uint16_t moving = active & statuses.equal(next);
+        const uint16_t stopped = active & ~moving;
+        result.assign(statuses, stopped);
+        current.increment(moving);
+        pending &= ~stopped;
+    }
+
+    // Lanes that went through all children end with the last child's status:
+    result.fill(next, pending);
 }
 
-inline void AsyncNode::failed() noexcept
+inline void Lockstep::runParallel(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const
 {
-    if (status() == Status::Suspended && this->scheduler)
-        this->scheduler->completed(*this, Status::Failure);
-}
+    const Instruction& instruction = program[index];
+    LaneCounts& successes = block.counters[instruction.counters];
+    LaneCounts& failures = block.counters[instruction.counters + 1];
+    LaneCounts& completed = block.counters[instruction.counters + 2];
+
+    // Starting lanes run every child, resuming ones only the children that were left running:
+    const uint16_t starting = lanes & ~block.running[index];
+    successes.fill(0, starting);
+    failures.fill(0, starting);
+    completed.fill(0, starting);
+
+    LaneStatuses statuses;
+    uint16_t pending = lanes;
+    uint32_t child = index + 1;
+    for (uint16_t i = 0; i < instruction.childCount && pending; ++i, child = program[child].end)
+    {
+        const uint16_t active = pending & (starting | block.running[child]);
+        if (!active)
+            continue;
+
+        run(block, child, active, statuses);
+        const uint16_t succeeded = active & statuses.equal(Status::Success);
+        const uint16_t failed = active & statuses.equal(Status::Failure);
+        successes.increment(succeeded);
+        failures.increment(failed);
+        completed.increment(succeeded | failed);
+
+        // Same order of policies as Parallel::onComplete():
+        const uint16_t finished = active & completed.equal(instruction.childCount);
+        uint16_t success = instruction.successOne ? succeeded : 0;
+        uint16_t failure = instruction.failureOne ? failed & ~success : 0;
+        uint16_t rest = active & ~success & ~failure;
+        if (!instruction.failureOne)
+            failure |= rest & failures.equal(instruction.childCount);
+        rest &= ~failure;
+        if (!instruction.successOne)
+            success |= rest & successes.equal(instruction.childCount);
+        rest &= ~success;
+        failure |= rest & finished;
+
+        const uint16_t done = success | failure;
+        if (!done)
+            continue;
+
+        // Children still running in the finished lanes are abandoned:
+        result.fill(Status::Success, success);
+        result.fill(Status::Failure, failure);
+        pending &= ~done;
+        for (uint32_t node = index + 1; node < instruction.end; ++node)
+            block.running[node] &= ~done;
+    }
 
+    result.fill(Status::Running, pending);
 }
 
+}
 
 namespace bt
 {
 
-inline void Decorator::traverse(Visitor& visitor) const
+inline void CallbackBatch::add(BatchNode& node)
 {
-    visitor.visit(*this);
-    if (Composite* composite = dynamic_cast<Composite*>(childNode))
-        composite->traverseChildren(visitor);
+    if (node.pending)
+        return;
+    nodes.push_back(&node);
+    agents.push_back(node.agent);
+    node.slot = (uint32_t)(nodes.size() - 1);
+    node.pending = true;
 }
 
-inline void Decorator::start(Scheduler& scheduler) noexcept
+inline void CallbackBatch::remove(BatchNode& node) noexcept
 {
-    scheduler.start(*childNode, *this);
+    if (!node.pending)
+        return;
+    node.pending = false;
+
+    // Nodes being flushed are only unmarked, the others are swapped with the last pending one:
+    if (node.slot < nodes.size() && nodes[node.slot] == &node)
+    {
+        nodes[node.slot] = nodes.back();
+        agents[node.slot] = agents.back();
+        nodes[node.slot]->slot = node.slot;
+        nodes.pop_back();
+        agents.pop_back();
+    }
 }
 
-inline void Decorator::stop(Scheduler& scheduler) noexcept
+inline void CallbackBatch::flush()
 {
-    if (childNode)
-        scheduler.stop(*childNode);
+    if (nodes.empty())
+        return;
+
+    flushedNodes.swap(nodes);
+    results.assign(flushedNodes.size(), Status::Failure);
+    BEHAVIOR_TREE_TRY
+    {
+        function(agents.data(), results.data(), flushedNodes.size());
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+        results.assign(flushedNodes.size(), Status::Failure);
+    }
+    agents.clear();
+
+    // Completing a node may stop others of this batch, which are skipped:
+    for (size_t i = 0; i < flushedNodes.size(); ++i)
+    {
+        BatchNode* node = flushedNodes[i];
+        if (!node->pending)
+            continue;
+        node->pending = false;
+
+        Status status = results[i];
+        if (status == Status::Running && !node->condition)
+            node->scheduler->resume(*node);
+        else
+            node->scheduler->completed(*node, status == Status::Success ? Status::Success : Status::Failure);
+    }
+    flushedNodes.clear();
 }
 
-inline Decorator::~Decorator()
+inline Status BatchNode::update() noexcept
 {
-    if (childNode)
+    BEHAVIOR_TREE_TRY
+    {
+        batch->add(*this);
+        return Status::Suspended;
+    }
+    BEHAVIOR_TREE_CATCH
     {
-        childNode->~Node();
-        childNode = nullptr;
+        return Status::Failure;
     }
 }
 
-inline void Negate::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+inline void BatchNode::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
 {
-    if (status == Status::Success)
-        status = Status::Failure;
-    else if (status == Status::Failure)
-        status = Status::Success;
-    scheduler.completed(*this, status);
-}
+    if (reader.validating())
+    {
+        Node::restoreState(reader, scheduler, observer);
+        return;
+    }
+
+    batch->remove(*this);
+    Node::restoreState(reader, scheduler, observer);
+    this->scheduler = &scheduler;
 
+    // Pending agents of the saved tree weren't part of this batch:
+    if (status() == Status::Suspended)
+        batch->add(*this);
 }
 
+}
 
 namespace bt
 {
 
-inline void Composite::addChild(Node* child)
+inline World::~World()
 {
-    if (child && currentIndex < childCount)
+    for (auto& tree : trees)
     {
-        children[currentIndex] = child;
-        ++currentIndex;
+        if (tree->sleeping)
+            deactivate(*tree);
+        unqueueCompletion(*tree);
+        tree->world = nullptr;
     }
 }
 
-inline void Composite::start(Scheduler& scheduler) noexcept
+inline void World::add(const Ref<BehaviorTree>& tree)
 {
-    currentIndex = 0;
-    scheduler.start(*children[0], *this);
+    if (!tree || tree->world)
+    {
+        raise("BehaviorTree can only be added to one World.");
+        return;
+    }
+
+    trees.push_back(tree);
+    activeTrees.reserve(trees.size());
+    tree->world = this;
+    tree->sleeping = false;
+    tree->activeSlot = (uint32_t)activeTrees.size();
+    activeTrees.push_back(tree.get());
 }
 
-inline void Composite::traverse(Visitor& visitor) const
+inline bool World::remove(const BehaviorTree& tree)
 {
-    visitor.visit(*this);
-    traverseChildren(visitor);
+    auto found = std::find_if(trees.begin(), trees.end(), [&](const Ref<BehaviorTree>& t) { return t.get() == &tree; });
+    if (found == trees.end())
+        return false;
+
+    // The last reference may be the world's, so the tree is released last:
+    Ref<BehaviorTree> removed = *found;
+    deactivate(*removed);
+    unqueueCompletion(*removed);
+    removed->world = nullptr;
+    *found = trees.back();
+    trees.pop_back();
+    return true;
 }
 
-inline void Composite::traverseChildren(Visitor& visitor) const
+inline void World::tick()
 {
-    visitor.beforeChildNodes(*this);
-    for (int i = 0; i < childCount; ++i)
-        children[i]->traverse(visitor);
-    visitor.afterChildNodes(*this);
+    // Sleeping trees are replaced by the last active one, which is ticked next:
+    for (size_t i = 0; i < activeTrees.size();)
+    {
+        BehaviorTree& tree = *activeTrees[i];
+        tree.tick();
+        if (tree.status() == Status::Suspended && tree.scheduler->idle(tree.partition))
+            sleep(tree);
+        else
+            ++i;
+    }
 }
 
-inline void Composite::stop(Scheduler& scheduler) noexcept
+inline void World::sleep(BehaviorTree& tree) noexcept
+{
+    deactivate(tree);
+    tree.sleeping = true;
+    BehaviorTree*& sleepers = tree.scheduler->queueOf(tree.partition).sleepers;
+    tree.nextSleeping = sleepers;
+    sleepers = &tree;
+}
+
+inline void World::wake(BehaviorTree& tree) noexcept
 {
-    if (children)
+    if (tree.world != this || !tree.sleeping)
+        return;
+
+    deactivate(tree);
+    tree.activeSlot = (uint32_t)activeTrees.size();
+    activeTrees.push_back(&tree);
+}
+
+// Takes an awake tree out of the active trees, or a sleeping one off its scheduler:
+inline void World::deactivate(BehaviorTree& tree) noexcept
+{
+    if (tree.sleeping)
     {
-        for (uint16_t i = 0; i < childCount; ++i)
-            if (Node* child = children[i])
-                scheduler.stop(*child);
+        BehaviorTree** link = &tree.scheduler->queueOf(tree.partition).sleepers;
+        while (*link && *link != &tree)
+            link = &(*link)->nextSleeping;
+        if (*link)
+            *link = tree.nextSleeping;
+        tree.nextSleeping = nullptr;
+        tree.sleeping = false;
+        return;
     }
+
+    BehaviorTree* last = activeTrees.back();
+    activeTrees[tree.activeSlot] = last;
+    last->activeSlot = tree.activeSlot;
+    activeTrees.pop_back();
 }
 
-inline Composite::~Composite()
+inline bool World::poll(Completion& completion) noexcept
 {
-    if (children)
+    // Queued trees are kept alive by the world, only trees whose handle still resolves are reported:
+    while (BehaviorTree* tree = firstCompleted)
     {
-        for (uint16_t i = 0; i < childCount; ++i)
-            if (Node* child = children[i])
-                child->~Node();
-        children = nullptr;
+        unqueueCompletion(*tree);
+        if (BehaviorTree::find(tree->handle()) == tree)
+        {
+            completion = Completion{tree->handle(), tree->completion};
+            return true;
+        }
     }
+    return false;
 }
 
-inline void Sequence::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+inline void World::queueCompletion(BehaviorTree& tree, Status status) noexcept
 {
-    if (status == Status::Failure)
-    {
-        scheduler.completed(*this, status);
+    tree.completion = status;
+    if (tree.completionQueued)
         return;
-    }
 
-    if (++currentIndex == childCount)
-        scheduler.completed(*this, Status::Success);
+    tree.completionQueued = true;
+    tree.nextCompleted = nullptr;
+    if (lastCompleted)
+        lastCompleted->nextCompleted = &tree;
     else
-        scheduler.start(*children[currentIndex], *this);
+        firstCompleted = &tree;
+    lastCompleted = &tree;
 }
 
-inline void Selector::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+inline void World::unqueueCompletion(BehaviorTree& tree) noexcept
 {
-    if (status == Status::Success)
-    {
-        scheduler.completed(*this, status);
+    if (!tree.completionQueued)
         return;
+
+    BehaviorTree* previous = nullptr;
+    BehaviorTree* current = firstCompleted;
+    while (current != &tree)
+    {
+        previous = current;
+        current = current->nextCompleted;
     }
 
-    if (++currentIndex == childCount)
-        scheduler.completed(*this, Status::Failure);
-    else
-        scheduler.start(*children[currentIndex], *this);
+    (previous ? previous->nextCompleted : firstCompleted) = tree.nextCompleted;
+    if (lastCompleted == &tree)
+        lastCompleted = previous;
+    tree.nextCompleted = nullptr;
+    tree.completionQueued = false;
 }
 
-inline void Parallel::start(Scheduler& scheduler) noexcept
+inline void BehaviorTree::completed(Status status) noexcept
 {
-    successCount = 0;
-    failureCount = 0;
-    currentIndex = 0;
-
-    // Queue the children in reverse order so they end up being ran in the correct order (first->last):
-    for (uint16_t i = childCount - 1; i < childCount; --i)
-        scheduler.start(*children[i], *this);
+    world->queueCompletion(*this, status);
+    world->wake(*this);
 }
 
-inline void Parallel::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
+inline void World::wakeAll(BehaviorTree* sleepers) noexcept
 {
-    if (status == Status::Success)
-    {
-        ++successCount;
-        if (successPolicy == Policy::RequireOne)
-        {
-            stop(scheduler);  // Stop the other running children
-            scheduler.completed(*this, Status::Success);
-            return;
-        }
-    }
-    else if (status == Status::Failure)
+    while (BehaviorTree* tree = sleepers)
     {
-        ++failureCount;
-        if (failurePolicy == Policy::RequireOne)
-        {
-            stop(scheduler);  // Stop the other running children
-            scheduler.completed(*this, Status::Failure);
-            return;
-        }
+        sleepers = tree->nextSleeping;
+        tree->world->wake(*tree);
     }
+}
 
-    if (failurePolicy == Policy::RequireAll && failureCount == childCount)
-        scheduler.completed(*this, Status::Failure);
-    else if (successPolicy == Policy::RequireAll && successCount == childCount)
-        scheduler.completed(*this, Status::Success);
-    // If both success and failure policies are all and some succeed, but some fail, consider it a failure:
-    else if ((successCount + failureCount) == childCount)
-        scheduler.completed(*this, Status::Failure);
+inline void Scheduler::wakeSleepers(RunQueue& queue) noexcept
+{
+    World::wakeAll(queue.sleepers);
 }
 
 }
@@ -884,86 +4294,286 @@ inline void Parallel::onComplete(Scheduler& scheduler, const Node& child, Status
 namespace bt
 {
 
-inline void TextSerializer::visit(const Decorator& node)
+inline Ref<BehaviorTree> Builder::finish(Optimizer* optimizer)
 {
-    if (Node* child = node.child())
+    if (groupCount && !failed)
     {
-        Status status = node.status();
-        if (status == Status::Suspended)
-            status = child->status();
-        print(child->name(), status, node.name());
+        raise("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
+        failed = true;
     }
-    else
+    if (failed)
+    {
+        abandon();
+        return nullptr;
+    }
+    if (!defining)
+        return nullptr;
+
+    if (optimizer && root)
+    {
+        std::sort(reusedNodes.begin(), reusedNodes.end());
+        root = optimizer->optimize(*root, *memory, reusedNodes);
+    }
+    else if (optimizer && memory->measuring() && flattenedLinks)
+        memory->allocateArray<Link<Node>>((int)flattenedLinks);
+
+    // The tree destroys its own nodes, so it isn't registered for destruction with the Memory:
+    Memory::Marker nodesEnd = memory->mark();
+    void* treeMemory = memory->allocateBytes(sizeof(BehaviorTree), alignof(BehaviorTree));
+    if (!treeMemory && !memory->measuring())
+    {
+        abandon();
+        return nullptr;
+    }
+    Node* treeRoot = root;
+    root = nullptr;
+    defining = false;
+    flattenedLinks = 0;
+    sharedNodes.clear();
+    sharedOrder.clear();
+    reusedNodes.clear();
+    if (memory->measuring())
+        return nullptr;
+
+    BehaviorTree* treePtr = new (treeMemory) BehaviorTree(*treeRoot, memory, scheduler, nodesBegin, nodesEnd);
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    Ref<BehaviorTree> tree = adopt<BehaviorTree, &BehaviorTree::dispose>(treePtr);
+#else
+    Ref<BehaviorTree> tree = pooled
+        ? Ref<BehaviorTree>(treePtr, &BehaviorTree::dispose, MemoryPool::ControlBlockAllocator<BehaviorTree>(*memory))
+        : adopt<BehaviorTree, &BehaviorTree::dispose>(treePtr);
+#endif
+    nodesBegin = nodesEnd;
+    if (!tree->handle())
     {
-        print(node.name(), node.status());
+        raise("BehaviorTree handle table is full.");
+        return nullptr;
     }
+    return tree;
 }
 
-inline void TextSerializer::visit(const SubTree& tree)
+inline void Builder::addNode(Node* node)
 {
-    if (expand)
-        tree.traverseSubTree(*this);
-    else
-        visit((Node&) tree);
+    if (!defining)
+    {
+        root = node;
+        defining = true;
+        return;
+    }
+    if (!groupCount)
+    {
+        raise("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
+        failed = true;
+        return;
+    }
+
+    Group& group = groups[groupCount - 1];
+    if (Composite* parent = dynamic_cast<Composite*>(group.parent))
+        parent->addChild(node);
+    else if (Decorator* parent = dynamic_cast<Decorator*>(group.parent))
+        failed = !parent->setChild(node);
+    group.childrenLeftToAdd -= 1;
 }
 
-inline void TextSerializer::print(const char* name, Status status, const char* prefix)
+// Drops a definition that failed, its nodes are destroyed and their bytes stay in the Memory until it is reset:
+inline void Builder::abandon() noexcept
 {
-    for (int i = 0; i < depth; i++)
-        out << "\t";
-    if (prefix)
-        out << prefix << " ";
-    out << name;
-    if (status != Status::Initial)
-        out << ": " << status;
-    out << std::endl;
+    Memory::Marker nodesEnd = memory->mark();
+    memory->destroy(nodesBegin, nodesEnd);
+    nodesBegin = nodesEnd;
+    flattenedLinks = 0;
+    sharedNodes.clear();
+    sharedOrder.clear();
+    reusedNodes.clear();
+    root = nullptr;
+    defining = false;
+    failed = false;
+    groupCount = 0;
 }
 
+inline void Builder::pushGroup(Node* parent, uint16_t childCount, const Memory::Position& position, Shape shape)
+{
+    if (groupCount == groupCapacity)
+    {
+        // Spilled groups are abandoned in the arena. Measuring only counts their bytes and keeps them on the heap,
+        // and so do compact builders once a spill would push the next child out of reach of its parent's offset:
+        uint32_t capacity = groupCapacity * 2;
+        Group* spilled = nullptr;
+#if defined(BEHAVIOR_TREE_COMPACT)
+        if (capacity * sizeof(Group) <= INT16_MAX / 2)
+#endif
+            spilled = memory->allocateArray<Group>(capacity);
+        std::vector<Group> measured;
+        if (!spilled)
+        {
+            measured.resize(capacity);
+            spilled = measured.data();
+        }
+        std::copy(groups, groups + groupCount, spilled);
+        if (!measured.empty())
+            measuredGroups.swap(measured);
+        groups = spilled;
+        groupCapacity = capacity;
+    }
+    bool parallel = dynamic_cast<Parallel*>(parent) || (groupCount && groups[groupCount - 1].parallel);
+    groups[groupCount++] = Group(parent, childCount, position, parallel, shape);
 }
 
-
-namespace bt
+inline void Builder::completeNode(Node* node, const Memory::Position& position)
 {
+    // A group is only closed once the subtree of its last child is complete. Groups collect the
+    // purity of their children as they complete, so no subtree is walked again:
+    bool nodePure = node && pure(*node, true);
+    share(node, position, nodePure);
+    if (groupCount)
+        groups[groupCount - 1].pure &= nodePure;
+    addFlattening(Flattening{1, 1});
+    while (groupCount && groups[groupCount - 1].childrenLeftToAdd <= 0)
+    {
+        Group group = groups[--groupCount];
+        bool groupPure = group.parent && pure(*group.parent, group.pure);
+        share(group.parent, group.position, groupPure);
+        if (groupCount)
+            groups[groupCount - 1].pure &= groupPure;
+        addFlattening(closeFlattening(group));
+    }
+}
 
-inline std::shared_ptr<BehaviorTree> Builder::end()
+inline void Builder::addFlattening(const Flattening& child)
 {
-    if (!root)
-        return nullptr;
-    if (groups.size())
-        throw std::runtime_error("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
-    BehaviorTree* treePtr = memory->allocate<BehaviorTree>(*root, memory, scheduler);
-    std::shared_ptr<BehaviorTree> tree(treePtr, [](BehaviorTree* t) { t->~BehaviorTree(); });
-    root = nullptr;
-    return tree;
+    if (!groupCount)
+        return;
+    Group& group = groups[groupCount - 1];
+    group.links += group.shape == Shape::Selector ? child.selector : child.sequence;
+    group.widest.sequence = std::max(group.widest.sequence, child.sequence);
+    group.widest.selector = std::max(group.widest.selector, child.selector);
 }
 
-inline void Builder::addNode(Node* node)
+// Sequences and selectors flatten into a new child array when their nested children add links:
+inline Builder::Flattening Builder::closeFlattening(const Group& group)
 {
-    if (!root)
+    Flattening flattening = group.widest;
+    if (group.shape == Shape::Sequence || group.shape == Shape::Selector)
     {
-        root = node;
-        return;
+        if (group.links > group.childCount)
+            flattenedLinks += group.links;
+        uint32_t& own = group.shape == Shape::Sequence ? flattening.sequence : flattening.selector;
+        own = std::max(own, group.links);
     }
-    if (!groups.size())
-        throw std::runtime_error("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
+    else if (group.shape == Shape::Other)
+        flattening = Flattening{1, 1};
+    return flattening;
+}
+
+inline void Builder::share(Node* node, const Memory::Position& position, bool pure)
+{
+    // A Parallel runs its subtrees at the same time, a node queued twice would lose one of its observers:
+    if (!deduplication || !node || !groupCount || !pure || groups[groupCount - 1].parallel)
+        return;
+
+    Node* parent = groups[groupCount - 1].parent;
 
-    Group& group = groups.back();
-    if (group.parent && group.childrenLeftToAdd > 0)
+    // Children are already shared, so comparing their addresses compares whole subtrees:
+    size_t key = hash(*node);
+    auto range = sharedNodes.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
     {
-        if (Composite* parent = dynamic_cast<Composite*>(group.parent))
+        Node* shared = it->second;
+        if (!equal(*shared, *node))
+            continue;
+
+        if (Composite* composite = dynamic_cast<Composite*>(parent))
+            composite->children()[composite->currentIndex - 1] = shared;
+        else if (Decorator* decorator = dynamic_cast<Decorator*>(parent))
         {
-            parent->addChild(node);
-            group.childrenLeftToAdd -= 1;
+            if (!reachable(decorator, shared))
+                return;
+            decorator->setChild(shared);
         }
-        else if (Decorator* parent = dynamic_cast<Decorator*>(group.parent))
+        reusedNodes.push_back(shared);
+        discard(position);
+        return;
+    }
+    sharedNodes.emplace(key, node);
+    sharedOrder.push_back(node);
+}
+
+inline void Builder::discard(const Memory::Position& position)
+{
+    // The duplicate is the last thing in the arena, unless the open groups spilled in after it:
+    const uint8_t* end = memory->data() + position.offset;
+    if (groups != inlineGroups && groups != measuredGroups.data() && (const uint8_t*)groups >= end)
+        return;
+
+    while (sharedOrder.size() && (const uint8_t*)sharedOrder.back() >= end)
+    {
+        Node* node = sharedOrder.back();
+        auto range = sharedNodes.equal_range(hash(*node));
+        for (auto it = range.first; it != range.second; ++it)
         {
-            parent->setChild(node);
-            group.childrenLeftToAdd -= 1;
+            if (it->second == node)
+            {
+                sharedNodes.erase(it);
+                break;
+            }
         }
+        sharedOrder.pop_back();
+    }
+    memory->rewind(position);
+}
+
+inline bool Builder::pure(const Node& node, bool childrenPure)
+{
+    const std::type_info& type = typeid(node);
+    if (type == typeid(Condition) || type == typeid(PureCondition) || type == typeid(Constant))
+        return true;
+    if (type == typeid(Sequence) || type == typeid(Selector) || type == typeid(Negate))
+        return childrenPure;
+    return false;
+}
+
+inline size_t Builder::hash(const Node& node)
+{
+    size_t value = typeid(node).hash_code();
+    auto combine = [&value](size_t v) { value ^= v + 0x9e3779b9 + (value << 6) + (value >> 2); };
+
+    for (const char* c = node.name(); *c; ++c)
+        combine((size_t)*c);
+    if (const Condition* condition = dynamic_cast<const Condition*>(&node))
+        combine((size_t)condition->check);
+    else if (const Constant* constant = dynamic_cast<const Constant*>(&node))
+        combine((size_t)constant->result);
+    else if (const Composite* composite = dynamic_cast<const Composite*>(&node))
+    {
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            combine((size_t)(Node*)composite->children()[i]);
+    }
+    else if (const Decorator* decorator = dynamic_cast<const Decorator*>(&node))
+        combine((size_t)decorator->child());
+    return value;
+}
 
-        if (group.childrenLeftToAdd <= 0)
-            groups.pop_back();
+inline bool Builder::equal(const Node& a, const Node& b)
+{
+    if (typeid(a) != typeid(b) || strcmp(a.name(), b.name()) != 0)
+        return false;
+    if (const Condition* condition = dynamic_cast<const Condition*>(&a))
+        return condition->check == static_cast<const Condition&>(b).check;
+    if (const Constant* constant = dynamic_cast<const Constant*>(&a))
+        return constant->result == static_cast<const Constant&>(b).result;
+    if (const Composite* composite = dynamic_cast<const Composite*>(&a))
+    {
+        const Composite& other = static_cast<const Composite&>(b);
+        if (composite->childCount != other.childCount)
+            return false;
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            if ((Node*)composite->children()[i] != (Node*)other.children()[i])
+                return false;
+        return true;
     }
+    if (const Decorator* decorator = dynamic_cast<const Decorator*>(&a))
+        return decorator->child() == static_cast<const Decorator&>(b).child();
+    return true;
 }
 
 }
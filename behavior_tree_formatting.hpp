@@ -0,0 +1,301 @@
+
+#ifndef BEHAVIOR_TREE_FORMATTING_ALL_H
+#define BEHAVIOR_TREE_FORMATTING_ALL_H
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "behavior_tree.hpp"
+
+#ifndef BEHAVIOR_TREE_FORMATTING_H
+#define BEHAVIOR_TREE_FORMATTING_H
+
+
+namespace bt
+{
+
+// Text output of statuses and trees. The engine itself doesn't depend on iostream, this is
+// only included by include/formatting.hpp and behavior_tree_formatting.hpp.
+
+class TextSerializer : public Visitor
+{
+public:
+    TextSerializer(std::ostream& out, bool expand = false) : out{out}, expand{expand} {}
+    virtual void begin() override { depth = 0; }
+    virtual void beforeChildNodes(const Composite& node) override { ++depth; }
+    virtual void visit(const Node& node) override { print(node.name(), node.status()); }
+    virtual void afterChildNodes(const Composite& node) override { --depth; }
+    virtual void visit(const Decorator& node) override;
+    virtual void visit(const SubTree& tree) override;
+protected:
+    virtual void print(const char* name, Status status, const char* prefix = nullptr);
+    int depth = 0;
+    bool expand;
+    std::ostream& out;
+};
+
+
+// Formats the whole tree into a reusable in-memory buffer and writes it to the
+// stream in a single call at end(), flushing once per dump instead of per node.
+class BufferedTextSerializer : public TextSerializer
+{
+public:
+    using TextSerializer::TextSerializer;
+    virtual void begin() override;
+    virtual void end() override;
+    const std::string& text() const noexcept { return buffer; }
+protected:
+    virtual void print(const char* name, Status status, const char* prefix = nullptr) override;
+    std::string buffer;
+private:
+    std::string indentation;
+};
+
+
+// Writes only the nodes whose status changed since the previous write, one "<index> <name>: <status>"
+// line each, ordered by the index of the node in traversal order. The tree's scheduler records the
+// nodes it changes, so a write costs the changes instead of the tree. The tree is only traversed
+// once to number its nodes, a decorator shares its line with its child like in TextSerializer.
+class StatusDiffSerializer
+{
+public:
+    explicit StatusDiffSerializer(const Ref<BehaviorTree>& tree);
+    StatusDiffSerializer(const StatusDiffSerializer& serializer) = delete;
+    ~StatusDiffSerializer();
+
+    // Formats whole lines into the buffer and returns their length. Changes that don't fit stay
+    // pending for the next write:
+    size_t write(char* buffer, size_t size);
+    // Writes every node that isn't Initial again:
+    void reset();
+private:
+    struct Line
+    {
+        const Node* node;
+        // Decorated child, whose name is printed after the decorator's:
+        const Node* child;
+        Status previous;
+        bool pending;
+    };
+
+    class Numbering;
+    void collect();
+
+    Ref<BehaviorTree> tree;
+    std::vector<Line> lines;
+    std::unordered_map<const Node*, uint32_t> indices;
+    std::vector<const Node*> changes;
+    std::vector<uint32_t> pending;
+};
+
+
+std::ostream& operator<<(std::ostream& os, const Status& s);
+std::ostream& operator<<(std::ostream& os, const BehaviorTree& tree);
+
+}
+
+#endif
+
+namespace bt
+{
+
+inline void TextSerializer::visit(const Decorator& node)
+{
+    if (Node* child = node.child())
+    {
+        Status status = node.status();
+        if (status == Status::Suspended)
+            status = child->status();
+        print(child->name(), status, node.name());
+    }
+    else
+    {
+        print(node.name(), node.status());
+    }
+}
+
+inline void TextSerializer::visit(const SubTree& tree)
+{
+    if (expand)
+        tree.traverseSubTree(*this);
+    else
+        visit((Node&) tree);
+}
+
+inline void TextSerializer::print(const char* name, Status status, const char* prefix)
+{
+    for (int i = 0; i < depth; i++)
+        out << "\t";
+    if (prefix)
+        out << prefix << " ";
+    out << name;
+    if (status != Status::Initial)
+        out << ": " << status;
+    out << std::endl;
+}
+
+inline void BufferedTextSerializer::begin()
+{
+    TextSerializer::begin();
+    buffer.clear();
+}
+
+inline void BufferedTextSerializer::end()
+{
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+}
+
+inline void BufferedTextSerializer::print(const char* name, Status status, const char* prefix)
+{
+    if (depth > (int)indentation.size())
+        indentation.resize(depth * 2, '\t');
+    buffer.append(indentation.data(), depth);
+    if (prefix)
+        buffer.append(prefix).append(" ");
+    buffer.append(name);
+    if (status != Status::Initial)
+        buffer.append(": ").append(statusName(status));
+    buffer.push_back('\n');
+}
+
+class StatusDiffSerializer::Numbering : public Visitor
+{
+public:
+    Numbering(StatusDiffSerializer& serializer) : serializer(serializer) {}
+    virtual void visit(const Node& node) override { add(node, nullptr); }
+    virtual void visit(const Decorator& node) override { add(node, node.child()); }
+private:
+    void add(const Node& node, const Node* child)
+    {
+        uint32_t index = (uint32_t)serializer.lines.size();
+        serializer.lines.push_back(Line{&node, child, Status::Initial, false});
+        serializer.indices.emplace(&node, index);
+        if (child)
+            serializer.indices.emplace(child, index);
+    }
+
+    StatusDiffSerializer& serializer;
+};
+
+inline StatusDiffSerializer::StatusDiffSerializer(const Ref<BehaviorTree>& tree)
+    : tree(tree)
+{
+    Numbering numbering(*this);
+    tree->traverse(numbering);
+    changes.reserve(lines.size() * 2);
+    tree->recordStatusChanges(changes);
+    reset();
+}
+
+inline StatusDiffSerializer::~StatusDiffSerializer()
+{
+    tree->stopRecordingStatusChanges(changes);
+}
+
+inline void StatusDiffSerializer::reset()
+{
+    for (uint32_t i = 0; i < lines.size(); ++i)
+    {
+        lines[i].previous = Status::Initial;
+        if (!lines[i].pending)
+        {
+            lines[i].pending = true;
+            pending.push_back(i);
+        }
+    }
+}
+
+// Moves the recorded changes of the serialized tree to the pending lines, once per line:
+inline void StatusDiffSerializer::collect()
+{
+    for (const Node* node : changes)
+    {
+        auto found = indices.find(node);
+        if (found == indices.end() || lines[found->second].pending)
+            continue;
+        lines[found->second].pending = true;
+        pending.push_back(found->second);
+    }
+    changes.clear();
+}
+
+inline size_t StatusDiffSerializer::write(char* buffer, size_t size)
+{
+    collect();
+    std::sort(pending.begin(), pending.end());
+
+    size_t length = 0;
+    size_t written = 0;
+    for (; written < pending.size(); ++written)
+    {
+        Line& line = lines[pending[written]];
+        Status status = line.node->status();
+        if (line.child && status == Status::Suspended)
+            status = line.child->status();
+        if (status == line.previous)
+        {
+            line.pending = false;
+            continue;
+        }
+
+        // The index is formatted backwards into a small scratch buffer:
+        char digits[10];
+        size_t digitCount = 0;
+        for (uint32_t index = pending[written]; digitCount == 0 || index; index /= 10)
+            digits[digitCount++] = (char)('0' + index % 10);
+
+        const char* prefix = line.child ? line.node->name() : nullptr;
+        const char* name = line.child ? line.child->name() : line.node->name();
+        const char* statusText = statusName(status);
+        size_t prefixLength = prefix ? strlen(prefix) + 1 : 0;
+        size_t nameLength = strlen(name);
+        size_t statusLength = strlen(statusText);
+        size_t lineLength = digitCount + 1 + prefixLength + nameLength + 2 + statusLength + 1;
+        if (length + lineLength > size)
+            break;
+
+        char* out = buffer + length;
+        while (digitCount)
+            *out++ = digits[--digitCount];
+        *out++ = ' ';
+        if (prefix)
+        {
+            memcpy(out, prefix, prefixLength - 1);
+            out += prefixLength - 1;
+            *out++ = ' ';
+        }
+        memcpy(out, name, nameLength);
+        out += nameLength;
+        *out++ = ':';
+        *out++ = ' ';
+        memcpy(out, statusText, statusLength);
+        out += statusLength;
+        *out++ = '\n';
+        length += lineLength;
+
+        line.previous = status;
+        line.pending = false;
+    }
+    pending.erase(pending.begin(), pending.begin() + written);
+    return length;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Status& s)
+{
+    return os << statusName(s);
+}
+
+inline std::ostream& operator<<(std::ostream& os, const BehaviorTree& tree)
+{
+    TextSerializer serializer(os, true);
+    tree.traverse(serializer);
+    return os;
+}
+
+}
+
+#endif
@@ -0,0 +1,302 @@
+
+#ifndef BEHAVIOR_TREE_THREADS_ALL_H
+#define BEHAVIOR_TREE_THREADS_ALL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "behavior_tree.hpp"
+
+#ifndef BEHAVIOR_TREE_THREADS_H
+#define BEHAVIOR_TREE_THREADS_H
+
+
+namespace bt
+{
+
+// Runs on a thread of the pool, long running work should return early once cancelled is set.
+// Running results run the function again, others complete the action:
+typedef Status (*ThreadedActionFunction) (void* agent, const std::atomic<bool>& cancelled);
+
+// Fixed-size pool of worker threads running threaded actions, so expensive work doesn't block the
+// thread ticking the trees. Finished jobs are pushed on a lock-free stack and only complete their
+// actions in complete(), called on the ticking thread, usually once per frame before the trees
+// are ticked. Actions must be destroyed before their pool.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+    ThreadPool(const ThreadPool& pool) = delete;
+    ~ThreadPool();
+
+    // Completes the actions whose jobs finished, returns how many jobs were collected. Waiting
+    // blocks until a job finished first, unless none is pending:
+    size_t complete(bool wait = false);
+    // Jobs submitted and not collected yet, including cancelled ones:
+    size_t pending() const noexcept { return submitted; }
+    size_t size() const noexcept { return threads.size(); }
+    friend class ThreadedAction;
+private:
+    struct Job
+    {
+        ThreadedActionFunction function;
+        void* agent;
+        Handle action;
+        std::atomic<bool> cancelled;
+        Status result;
+        // Recycled jobs get a new run, so actions don't cancel a job that was reused:
+        uint32_t run = 0;
+        Job* next = nullptr;
+    };
+
+    Job* submit(class ThreadedAction& action);
+    void work() noexcept;
+    void finish(Job& job) noexcept;
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<Job*> queued;
+    bool stopping = false;
+
+    // Pushed by the workers and taken as a whole by complete(), so there is no ABA problem:
+    std::atomic<Job*> finished{nullptr};
+
+    // Jobs are only allocated and recycled on the ticking thread:
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::vector<Job*> freeJobs;
+    size_t submitted = 0;
+};
+
+
+// Action running its function on a ThreadPool. It waits Suspended until the pool completes it,
+// stopping it cancels its job and drops the result. It fails without memory for the job. Built with
+// builder.create<ThreadedAction>(name, pool, function, agent).
+class ThreadedAction : public AsyncNode
+{
+public:
+#if defined(BEHAVIOR_TREE_STRIP_NAMES)
+    ThreadedAction(const char* name, ThreadPool& pool, ThreadedActionFunction function, void* agent = nullptr)
+        : pool(&pool), function(function), agent(agent) {}
+#else
+    ThreadedAction(const char* name, ThreadPool& pool, ThreadedActionFunction function, void* agent = nullptr)
+        : nodeName(name), pool(&pool), function(function), agent(agent) {}
+    virtual const char* name() const noexcept override { return nodeName; }
+#endif
+    virtual ~ThreadedAction() override { cancel(); }
+    // Actions restored while waiting submit their job again:
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+    friend class ThreadPool;
+protected:
+    virtual void start() noexcept override;
+    virtual void stop(class Scheduler& scheduler) noexcept override
+    {
+        cancel();
+        AsyncNode::stop(scheduler);
+    }
+private:
+    void cancel() noexcept;
+
+#if !defined(BEHAVIOR_TREE_STRIP_NAMES)
+    const char* nodeName;
+#endif
+    ThreadPool* pool;
+    ThreadedActionFunction function;
+    void* agent;
+    ThreadPool::Job* job = nullptr;
+    uint32_t jobRun = 0;
+};
+
+}
+
+#endif
+
+namespace bt
+{
+
+inline ThreadPool::ThreadPool(size_t threadCount)
+{
+    threadCount = threadCount ? threadCount : 1;
+    threads.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i)
+        threads.emplace_back(&ThreadPool::work, this);
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (Job* job : queued)
+            job->cancelled.store(true, std::memory_order_relaxed);
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+inline ThreadPool::Job* ThreadPool::submit(ThreadedAction& action)
+{
+    Job* job;
+    if (freeJobs.empty())
+    {
+        jobs.emplace_back(new Job());
+        job = jobs.back().get();
+    }
+    else
+    {
+        job = freeJobs.back();
+        freeJobs.pop_back();
+    }
+
+    job->function = action.function;
+    job->agent = action.agent;
+    job->action = action.handle();
+    job->cancelled.store(false, std::memory_order_relaxed);
+    job->result = Status::Failure;
+    ++submitted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.push_back(job);
+    }
+    wake.notify_one();
+    return job;
+}
+
+inline void ThreadPool::work() noexcept
+{
+    for (;;)
+    {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queued.empty(); });
+            if (queued.empty())
+                return;
+            job = queued.front();
+            queued.pop_front();
+        }
+
+        if (!job->cancelled.load(std::memory_order_relaxed))
+        {
+            BEHAVIOR_TREE_TRY
+            {
+                job->result = job->function(job->agent, job->cancelled);
+            }
+            BEHAVIOR_TREE_CATCH
+            {
+                job->result = Status::Failure;
+            }
+        }
+        finish(*job);
+    }
+}
+
+inline void ThreadPool::finish(Job& job) noexcept
+{
+    job.next = finished.load(std::memory_order_relaxed);
+    while (!finished.compare_exchange_weak(job.next, &job, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+
+    // Taking the lock orders the push before a waiting complete() checks the stack:
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    done.notify_all();
+}
+
+inline size_t ThreadPool::complete(bool wait)
+{
+    if (wait && submitted)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return finished.load(std::memory_order_relaxed) != nullptr; });
+    }
+
+    // The stack holds the most recent job first, it is reversed so actions complete in order:
+    Job* stack = finished.exchange(nullptr, std::memory_order_acquire);
+    Job* ordered = nullptr;
+    while (Job* job = stack)
+    {
+        stack = job->next;
+        job->next = ordered;
+        ordered = job;
+    }
+
+    size_t count = 0;
+    while (Job* job = ordered)
+    {
+        ordered = job->next;
+        ++job->run;
+        freeJobs.push_back(job);
+        --submitted;
+        ++count;
+
+        // Jobs of stopped or destroyed actions are dropped, their handle was released:
+        AsyncNode* node = AsyncNode::find(job->action);
+        if (!node || job->cancelled.load(std::memory_order_relaxed))
+            continue;
+
+        ThreadedAction* action = static_cast<ThreadedAction*>(node);
+        action->job = nullptr;
+        if (job->result == Status::Running)
+            action->start();
+        else if (job->result == Status::Success)
+            action->succeeded();
+        else
+            action->failed();
+    }
+    return count;
+}
+
+inline void ThreadedAction::start() noexcept
+{
+    BEHAVIOR_TREE_TRY
+    {
+        job = pool->submit(*this);
+        jobRun = job->run;
+        return;
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+    }
+
+    // Actions rerun by complete() are suspended, while ticked ones fail like without a handle:
+    job = nullptr;
+    if (status() == Status::Suspended)
+        failed();
+    else
+        release();
+}
+
+inline void ThreadedAction::cancel() noexcept
+{
+    if (job && job->run == jobRun)
+        job->cancelled.store(true, std::memory_order_relaxed);
+    job = nullptr;
+}
+
+inline void ThreadedAction::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    if (reader.validating())
+    {
+        AsyncNode::restoreState(reader, scheduler, observer);
+        return;
+    }
+
+    cancel();
+    AsyncNode::restoreState(reader, scheduler, observer);
+    if (status() == Status::Suspended)
+        start();
+}
+
+}
+
+#endif
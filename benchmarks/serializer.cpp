@@ -0,0 +1,62 @@
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include "../include/formatting.hpp"
+
+using namespace bt;
+using Clock = std::chrono::high_resolution_clock;
+
+Status succeed() { return Status::Success; }
+bool check() { return true; }
+
+
+Ref<BehaviorTree> create(uint16_t branches, uint16_t leaves)
+{
+    Builder builder(1024 * 1024);
+    builder.parallel(branches, Parallel::Policy::RequireAll);
+    for (uint16_t i = 0; i < branches; ++i)
+    {
+        builder.sequence(leaves);
+        for (uint16_t j = 0; j < leaves; ++j)
+        {
+            if (j % 2)
+                builder.negate().check("Check", check);
+            else
+                builder.action("Action", succeed);
+        }
+    }
+    return builder.end();
+}
+
+
+template <typename Serializer>
+double measure(const BehaviorTree& tree, std::ostream& out, int iterations)
+{
+    Serializer serializer(out);
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; ++i)
+        tree.traverse(serializer);
+    std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+
+int main(int argc, char** argv)
+{
+    const int iterations = 500;
+    const char* path = argc > 1 ? argv[1] : "/dev/null";
+
+    // Roughly 2k nodes:
+    auto tree = create(100, 20);
+    tree->tick();
+
+    std::ofstream out(path);
+    double text = measure<TextSerializer>(*tree, out, iterations);
+    double buffered = measure<BufferedTextSerializer>(*tree, out, iterations);
+
+    std::cout << "TextSerializer:         " << text << " ms/dump" << std::endl;
+    std::cout << "BufferedTextSerializer: " << buffered << " ms/dump" << std::endl;
+    std::cout << "Speedup:                " << text / buffered << "x" << std::endl;
+    return 0;
+}
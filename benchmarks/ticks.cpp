@@ -0,0 +1,54 @@
+
+#include <chrono>
+#include <iostream>
+#include "../include/all.hpp"
+
+using namespace bt;
+using Clock = std::chrono::high_resolution_clock;
+
+static int calls = 0;
+
+Status succeed() { ++calls; return Status::Success; }
+bool check() { ++calls; return true; }
+
+
+Ref<BehaviorTree> create(uint16_t branches, uint16_t leaves)
+{
+    Builder builder(1024 * 1024);
+    builder.parallel(branches, Parallel::Policy::RequireAll);
+    for (uint16_t i = 0; i < branches; ++i)
+    {
+        builder.sequence(leaves);
+        for (uint16_t j = 0; j < leaves; ++j)
+        {
+            if (j % 2)
+                builder.check("Check", check);
+            else
+                builder.action("Action", succeed);
+        }
+    }
+    return builder.end();
+}
+
+
+int main(int argc, char** argv)
+{
+    const int iterations = 2000;
+
+    // Roughly 2k nodes, every leaf call goes through the error handling of its node:
+    auto tree = create(100, 20);
+    tree->tick();
+
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; ++i)
+        tree->tick();
+    std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+    std::cout << "Without exceptions: ";
+#else
+    std::cout << "With exceptions:    ";
+#endif
+    std::cout << elapsed.count() / iterations << " ms/tick, " << calls / (iterations + 1) << " leaves/tick" << std::endl;
+    return 0;
+}
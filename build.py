@@ -1,21 +1,30 @@
 #!/usr/bin/env python3
 
 import sys
+from io import StringIO
 from shutil import copyfileobj
 from os.path import abspath, dirname, join
 from tempfile import TemporaryFile
 
 
-def preprocess(destination_file, source_file):
+# External headers map the source of another single header to the name it is built as, including
+# that source includes the other header instead of another copy of everything it contains.
+def preprocess(destination_file, source_file, external_headers=()):
     if not destination_file:
         raise Exception('No destination file specified.')
     if not source_file:
         raise Exception('No source file specified.')
 
     source_file = abspath(source_file)
+    externals = {}
+    for external in external_headers:
+        header, _, external_source = external.partition('=')
+        if not header or not external_source:
+            raise Exception(f'Expected <header>=<source>, got {external}.')
+        externals[abspath(external_source)] = header
     lib_headers, local_headers = set(), set()
     with TemporaryFile(mode='w+') as temp:
-        first_header_pos = preprocess_file(temp, source_file, lib_headers, local_headers)
+        first_header_pos = preprocess_file(temp, source_file, lib_headers, local_headers, externals)
         temp.seek(0)
         with open(destination_file, mode='w') as dest:
             dest.write(temp.read(first_header_pos))
@@ -24,28 +33,44 @@ def preprocess(destination_file, source_file):
             copyfileobj(temp, dest)
 
 
-def preprocess_file(out, source_file, lib_headers, local_headers):
+def preprocess_file(out, source_file, lib_headers, local_headers, externals):
     if source_file in local_headers:
         return
     local_headers.add(source_file)
+    if source_file in externals:
+        # Everything the external header contains is already included, so it is skipped:
+        out.write(f'#include "{externals[source_file]}"\n')
+        local_headers.remove(source_file)
+        preprocess_file(StringIO(), source_file, set(), local_headers, {})
+        return
     first_header_pos, pos = None, 0
+    conditionals = []
     with open(source_file) as f:
         for line in f:
             stripped_line = line.strip()
+            if stripped_line.startswith('#if'):
+                conditionals.append(stripped_line.startswith('#if '))
+            elif stripped_line.startswith('#endif') and conditionals:
+                conditionals.pop()
             if not stripped_line.startswith('#include'):
                 out.write(line)
                 pos += len(line)
                 continue
+            included_file = substr(line, '<', '>')
+            if included_file and any(conditionals):
+                # Library headers inside #if blocks are feature dependent, keep them in place:
+                out.write(line)
+                pos += len(line)
+                continue
             if first_header_pos is None:
                 first_header_pos = pos
-            included_file = substr(line, '<', '>')
             if included_file:
                 lib_headers.add(included_file.strip())
                 continue
             included_file = substr(line, '"', '"')
             if included_file:
                 full_path = abspath(join(dirname(source_file), included_file.strip()))
-                preprocess_file(out, full_path, lib_headers, local_headers)
+                preprocess_file(out, full_path, lib_headers, local_headers, externals)
     return first_header_pos
 
 
@@ -62,7 +87,7 @@ if __name__ == '__main__':
     try:
         dest = sys.argv[1] if len(sys.argv) > 1 else None
         src = sys.argv[2] if len(sys.argv) > 2 else None
-        preprocess(dest, src)
+        preprocess(dest, src, sys.argv[3:])
     except Exception as e:
         print(e)
         sys.exit(1)
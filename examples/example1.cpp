@@ -4,10 +4,9 @@
 #include <initializer_list>
 #include <memory>
 #include <array>
-#include "../include/all.hpp"
+#include "../include/formatting.hpp"
 
 using namespace bt;
-using std::shared_ptr;
 
 
 Status attackPlayer() { return Status::Failure; }
@@ -16,11 +15,12 @@ Status mockRunningAction() { return Status::Running; }
 Status mockFailureAction() { return Status::Failure; }
 bool canSeePlayer() { return true; }
 
-AsyncNode* testAsyncAction = nullptr;
+// The action is completed through its handle, which is ignored once the tree is gone:
+Handle testAsyncAction = 0;
 
 void mockAsyncAction(AsyncAction& action)
 {
-    testAsyncAction = &action;
+    testAsyncAction = action.handle();
 }
 
 
@@ -43,18 +43,18 @@ private:
 };
 
 
-shared_ptr<BehaviorTree> create()
+Ref<BehaviorTree> create()
 {
-    Builder builder(1024);
+    Builder builder(2048);
 
-    shared_ptr<BehaviorTree> attack = builder
+    Ref<BehaviorTree> attack = builder
         .sequence(3)
             .negate().check("CanSeePlayer", canSeePlayer)
             .action("GoToPlayer", mockSuccessAction)
             .action("AttackPlayer", mockFailureAction)
         .end();
 
-    shared_ptr<BehaviorTree> patrol = builder
+    Ref<BehaviorTree> patrol = builder
         .parallel(5, Parallel::Policy::RequireAll, Parallel::Policy::RequireOne)
             .action("GoToPointA", mockSuccessAction)
             .negate().create<Custom, std::initializer_list<Status>>({Status::Running, Status::Success})
@@ -0,0 +1,9 @@
+
+#ifndef BEHAVIOR_TREE_FORMATTING_ALL_H
+#define BEHAVIOR_TREE_FORMATTING_ALL_H
+
+#include "all.hpp"
+#include "../source/formatting.hpp"
+#include "../source/formatting.cpp"
+
+#endif
@@ -1,5 +1,10 @@
 
 #include "../source/status.hpp"
+#include "../source/errors.hpp"
+#include "../source/state.hpp"
+#include "../source/links.hpp"
+#include "../source/ownership.hpp"
+#include "../source/handles.hpp"
 #include "../source/nodes.hpp"
 #include "../source/decorators.hpp"
 #include "../source/composites.hpp"
@@ -7,4 +12,10 @@
 #include "../source/memory.hpp"
 #include "../source/scheduler.hpp"
 #include "../source/tree.hpp"
+#include "../source/world.hpp"
+#include "../source/coroutines.hpp"
+#include "../source/optimizer.hpp"
+#include "../source/queries.hpp"
+#include "../source/lockstep.hpp"
+#include "../source/batches.hpp"
 #include "../source/builder.hpp"
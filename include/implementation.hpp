@@ -2,5 +2,9 @@
 #include "../source/nodes.cpp"
 #include "../source/decorators.cpp"
 #include "../source/composites.cpp"
-#include "../source/visitors.cpp"
+#include "../source/coroutines.cpp"
+#include "../source/optimizer.cpp"
+#include "../source/lockstep.cpp"
+#include "../source/batches.cpp"
+#include "../source/world.cpp"
 #include "../source/builder.cpp"
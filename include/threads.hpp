@@ -0,0 +1,9 @@
+
+#ifndef BEHAVIOR_TREE_THREADS_ALL_H
+#define BEHAVIOR_TREE_THREADS_ALL_H
+
+#include "all.hpp"
+#include "../source/threads.hpp"
+#include "../source/threads.cpp"
+
+#endif
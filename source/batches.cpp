@@ -0,0 +1,99 @@
+#include "batches.hpp"
+#include "scheduler.hpp"
+#include "state.hpp"
+
+namespace bt
+{
+
+inline void CallbackBatch::add(BatchNode& node)
+{
+    if (node.pending)
+        return;
+    nodes.push_back(&node);
+    agents.push_back(node.agent);
+    node.slot = (uint32_t)(nodes.size() - 1);
+    node.pending = true;
+}
+
+inline void CallbackBatch::remove(BatchNode& node) noexcept
+{
+    if (!node.pending)
+        return;
+    node.pending = false;
+
+    // Nodes being flushed are only unmarked, the others are swapped with the last pending one:
+    if (node.slot < nodes.size() && nodes[node.slot] == &node)
+    {
+        nodes[node.slot] = nodes.back();
+        agents[node.slot] = agents.back();
+        nodes[node.slot]->slot = node.slot;
+        nodes.pop_back();
+        agents.pop_back();
+    }
+}
+
+inline void CallbackBatch::flush()
+{
+    if (nodes.empty())
+        return;
+
+    flushedNodes.swap(nodes);
+    results.assign(flushedNodes.size(), Status::Failure);
+    BEHAVIOR_TREE_TRY
+    {
+        function(agents.data(), results.data(), flushedNodes.size());
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+        results.assign(flushedNodes.size(), Status::Failure);
+    }
+    agents.clear();
+
+    // Completing a node may stop others of this batch, which are skipped:
+    for (size_t i = 0; i < flushedNodes.size(); ++i)
+    {
+        BatchNode* node = flushedNodes[i];
+        if (!node->pending)
+            continue;
+        node->pending = false;
+
+        Status status = results[i];
+        if (status == Status::Running && !node->condition)
+            node->scheduler->resume(*node);
+        else
+            node->scheduler->completed(*node, status == Status::Success ? Status::Success : Status::Failure);
+    }
+    flushedNodes.clear();
+}
+
+inline Status BatchNode::update() noexcept
+{
+    BEHAVIOR_TREE_TRY
+    {
+        batch->add(*this);
+        return Status::Suspended;
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+        return Status::Failure;
+    }
+}
+
+inline void BatchNode::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    if (reader.validating())
+    {
+        Node::restoreState(reader, scheduler, observer);
+        return;
+    }
+
+    batch->remove(*this);
+    Node::restoreState(reader, scheduler, observer);
+    this->scheduler = &scheduler;
+
+    // Pending agents of the saved tree weren't part of this batch:
+    if (status() == Status::Suspended)
+        batch->add(*this);
+}
+
+}
@@ -0,0 +1,87 @@
+
+#ifndef BEHAVIOR_TREE_BATCHES_H
+#define BEHAVIOR_TREE_BATCHES_H
+
+#include <cstdint>
+#include <vector>
+#include "nodes.hpp"
+
+namespace bt
+{
+
+// Writes the result of every agent in results, conditions write Success or Failure:
+typedef void (*BatchFunction) (void* const* agents, Status* results, size_t count);
+
+// Collects the agents of batched nodes across any number of trees and schedulers, and calls its
+// function once for all of them on flush(). Batched nodes wait Suspended until the batch is
+// flushed, usually once per frame after the trees were ticked. Running results are re-queued and
+// join the batch again on the next tick, the others complete their node.
+class CallbackBatch
+{
+public:
+    explicit CallbackBatch(BatchFunction function, size_t capacity = 0)
+        : function(function)
+    {
+        nodes.reserve(capacity);
+        agents.reserve(capacity);
+        results.reserve(capacity);
+    }
+
+    CallbackBatch(const CallbackBatch& batch) = delete;
+
+    void flush();
+    size_t pending() const noexcept { return nodes.size(); }
+    friend class BatchNode;
+private:
+    void add(class BatchNode& node);
+    void remove(class BatchNode& node) noexcept;
+
+    BatchFunction function;
+    std::vector<class BatchNode*> nodes;
+    std::vector<void*> agents;
+    // Swapped with the pending ones while flushing, so completed nodes can't change what is being flushed:
+    std::vector<class BatchNode*> flushedNodes;
+    std::vector<Status> results;
+};
+
+
+class BatchNode : public NamedNode
+{
+public:
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+    friend class CallbackBatch;
+protected:
+    BatchNode(const char* name, CallbackBatch& batch, void* agent, bool condition)
+        : NamedNode(name), batch(&batch), agent(agent), condition(condition) {}
+
+    virtual void start(class Scheduler& scheduler) noexcept override { this->scheduler = &scheduler; }
+    virtual Status update() noexcept override;
+    virtual void stop(class Scheduler& scheduler) noexcept override { batch->remove(*this); }
+private:
+    CallbackBatch* batch;
+    void* agent;
+    class Scheduler* scheduler = nullptr;
+    uint32_t slot = 0;
+    bool pending = false;
+    bool condition;
+};
+
+
+class BatchAction : public BatchNode
+{
+public:
+    BatchAction(const char* name, CallbackBatch& batch, void* agent)
+        : BatchNode(name, batch, agent, false) {}
+};
+
+
+class BatchCondition : public BatchNode
+{
+public:
+    BatchCondition(const char* name, CallbackBatch& batch, void* agent)
+        : BatchNode(name, batch, agent, true) {}
+};
+
+}
+
+#endif
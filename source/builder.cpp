@@ -1,48 +1,292 @@
 
+#include <algorithm>
+#include <cstring>
+#include <typeinfo>
 #include "builder.hpp"
 
 namespace bt
 {
 
-inline std::shared_ptr<BehaviorTree> Builder::end()
+inline Ref<BehaviorTree> Builder::finish(Optimizer* optimizer)
 {
-    if (!root)
+    if (groupCount && !failed)
+    {
+        raise("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
+        failed = true;
+    }
+    if (failed)
+    {
+        abandon();
+        return nullptr;
+    }
+    if (!defining)
         return nullptr;
-    if (groups.size())
-        throw std::runtime_error("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
-    BehaviorTree* treePtr = memory->allocate<BehaviorTree>(*root, memory, scheduler);
-    std::shared_ptr<BehaviorTree> tree(treePtr, [](BehaviorTree* t) { t->~BehaviorTree(); });
+
+    if (optimizer && root)
+    {
+        std::sort(reusedNodes.begin(), reusedNodes.end());
+        root = optimizer->optimize(*root, *memory, reusedNodes);
+    }
+    else if (optimizer && memory->measuring() && flattenedLinks)
+        memory->allocateArray<Link<Node>>((int)flattenedLinks);
+
+    // The tree destroys its own nodes, so it isn't registered for destruction with the Memory:
+    Memory::Marker nodesEnd = memory->mark();
+    void* treeMemory = memory->allocateBytes(sizeof(BehaviorTree), alignof(BehaviorTree));
+    if (!treeMemory && !memory->measuring())
+    {
+        abandon();
+        return nullptr;
+    }
+    Node* treeRoot = root;
     root = nullptr;
+    defining = false;
+    flattenedLinks = 0;
+    sharedNodes.clear();
+    sharedOrder.clear();
+    reusedNodes.clear();
+    if (memory->measuring())
+        return nullptr;
+
+    BehaviorTree* treePtr = new (treeMemory) BehaviorTree(*treeRoot, memory, scheduler, nodesBegin, nodesEnd);
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    Ref<BehaviorTree> tree = adopt<BehaviorTree, &BehaviorTree::dispose>(treePtr);
+#else
+    Ref<BehaviorTree> tree = pooled
+        ? Ref<BehaviorTree>(treePtr, &BehaviorTree::dispose, MemoryPool::ControlBlockAllocator<BehaviorTree>(*memory))
+        : adopt<BehaviorTree, &BehaviorTree::dispose>(treePtr);
+#endif
+    nodesBegin = nodesEnd;
+    if (!tree->handle())
+    {
+        raise("BehaviorTree handle table is full.");
+        return nullptr;
+    }
     return tree;
 }
 
 inline void Builder::addNode(Node* node)
 {
-    if (!root)
+    if (!defining)
     {
         root = node;
+        defining = true;
         return;
     }
-    if (!groups.size())
-        throw std::runtime_error("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
+    if (!groupCount)
+    {
+        raise("Invalid BehaviorTree definition. Number of child nodes does not match group node child counts.");
+        failed = true;
+        return;
+    }
+
+    Group& group = groups[groupCount - 1];
+    if (Composite* parent = dynamic_cast<Composite*>(group.parent))
+        parent->addChild(node);
+    else if (Decorator* parent = dynamic_cast<Decorator*>(group.parent))
+        failed = !parent->setChild(node);
+    group.childrenLeftToAdd -= 1;
+}
 
-    Group& group = groups.back();
-    if (group.parent && group.childrenLeftToAdd > 0)
+// Drops a definition that failed, its nodes are destroyed and their bytes stay in the Memory until it is reset:
+inline void Builder::abandon() noexcept
+{
+    Memory::Marker nodesEnd = memory->mark();
+    memory->destroy(nodesBegin, nodesEnd);
+    nodesBegin = nodesEnd;
+    flattenedLinks = 0;
+    sharedNodes.clear();
+    sharedOrder.clear();
+    reusedNodes.clear();
+    root = nullptr;
+    defining = false;
+    failed = false;
+    groupCount = 0;
+}
+
+inline void Builder::pushGroup(Node* parent, uint16_t childCount, const Memory::Position& position, Shape shape)
+{
+    if (groupCount == groupCapacity)
     {
-        if (Composite* parent = dynamic_cast<Composite*>(group.parent))
+        // Spilled groups are abandoned in the arena. Measuring only counts their bytes and keeps them on the heap,
+        // and so do compact builders once a spill would push the next child out of reach of its parent's offset:
+        uint32_t capacity = groupCapacity * 2;
+        Group* spilled = nullptr;
+#if defined(BEHAVIOR_TREE_COMPACT)
+        if (capacity * sizeof(Group) <= INT16_MAX / 2)
+#endif
+            spilled = memory->allocateArray<Group>(capacity);
+        std::vector<Group> measured;
+        if (!spilled)
         {
-            parent->addChild(node);
-            group.childrenLeftToAdd -= 1;
+            measured.resize(capacity);
+            spilled = measured.data();
         }
-        else if (Decorator* parent = dynamic_cast<Decorator*>(group.parent))
+        std::copy(groups, groups + groupCount, spilled);
+        if (!measured.empty())
+            measuredGroups.swap(measured);
+        groups = spilled;
+        groupCapacity = capacity;
+    }
+    bool parallel = dynamic_cast<Parallel*>(parent) || (groupCount && groups[groupCount - 1].parallel);
+    groups[groupCount++] = Group(parent, childCount, position, parallel, shape);
+}
+
+inline void Builder::completeNode(Node* node, const Memory::Position& position)
+{
+    // A group is only closed once the subtree of its last child is complete. Groups collect the
+    // purity of their children as they complete, so no subtree is walked again:
+    bool nodePure = node && pure(*node, true);
+    share(node, position, nodePure);
+    if (groupCount)
+        groups[groupCount - 1].pure &= nodePure;
+    addFlattening(Flattening{1, 1});
+    while (groupCount && groups[groupCount - 1].childrenLeftToAdd <= 0)
+    {
+        Group group = groups[--groupCount];
+        bool groupPure = group.parent && pure(*group.parent, group.pure);
+        share(group.parent, group.position, groupPure);
+        if (groupCount)
+            groups[groupCount - 1].pure &= groupPure;
+        addFlattening(closeFlattening(group));
+    }
+}
+
+inline void Builder::addFlattening(const Flattening& child)
+{
+    if (!groupCount)
+        return;
+    Group& group = groups[groupCount - 1];
+    group.links += group.shape == Shape::Selector ? child.selector : child.sequence;
+    group.widest.sequence = std::max(group.widest.sequence, child.sequence);
+    group.widest.selector = std::max(group.widest.selector, child.selector);
+}
+
+// Sequences and selectors flatten into a new child array when their nested children add links:
+inline Builder::Flattening Builder::closeFlattening(const Group& group)
+{
+    Flattening flattening = group.widest;
+    if (group.shape == Shape::Sequence || group.shape == Shape::Selector)
+    {
+        if (group.links > group.childCount)
+            flattenedLinks += group.links;
+        uint32_t& own = group.shape == Shape::Sequence ? flattening.sequence : flattening.selector;
+        own = std::max(own, group.links);
+    }
+    else if (group.shape == Shape::Other)
+        flattening = Flattening{1, 1};
+    return flattening;
+}
+
+inline void Builder::share(Node* node, const Memory::Position& position, bool pure)
+{
+    // A Parallel runs its subtrees at the same time, a node queued twice would lose one of its observers:
+    if (!deduplication || !node || !groupCount || !pure || groups[groupCount - 1].parallel)
+        return;
+
+    Node* parent = groups[groupCount - 1].parent;
+
+    // Children are already shared, so comparing their addresses compares whole subtrees:
+    size_t key = hash(*node);
+    auto range = sharedNodes.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        Node* shared = it->second;
+        if (!equal(*shared, *node))
+            continue;
+
+        if (Composite* composite = dynamic_cast<Composite*>(parent))
+            composite->children()[composite->currentIndex - 1] = shared;
+        else if (Decorator* decorator = dynamic_cast<Decorator*>(parent))
+        {
+            if (!reachable(decorator, shared))
+                return;
+            decorator->setChild(shared);
+        }
+        reusedNodes.push_back(shared);
+        discard(position);
+        return;
+    }
+    sharedNodes.emplace(key, node);
+    sharedOrder.push_back(node);
+}
+
+inline void Builder::discard(const Memory::Position& position)
+{
+    // The duplicate is the last thing in the arena, unless the open groups spilled in after it:
+    const uint8_t* end = memory->data() + position.offset;
+    if (groups != inlineGroups && groups != measuredGroups.data() && (const uint8_t*)groups >= end)
+        return;
+
+    while (sharedOrder.size() && (const uint8_t*)sharedOrder.back() >= end)
+    {
+        Node* node = sharedOrder.back();
+        auto range = sharedNodes.equal_range(hash(*node));
+        for (auto it = range.first; it != range.second; ++it)
         {
-            parent->setChild(node);
-            group.childrenLeftToAdd -= 1;
+            if (it->second == node)
+            {
+                sharedNodes.erase(it);
+                break;
+            }
         }
+        sharedOrder.pop_back();
+    }
+    memory->rewind(position);
+}
+
+inline bool Builder::pure(const Node& node, bool childrenPure)
+{
+    const std::type_info& type = typeid(node);
+    if (type == typeid(Condition) || type == typeid(PureCondition) || type == typeid(Constant))
+        return true;
+    if (type == typeid(Sequence) || type == typeid(Selector) || type == typeid(Negate))
+        return childrenPure;
+    return false;
+}
+
+inline size_t Builder::hash(const Node& node)
+{
+    size_t value = typeid(node).hash_code();
+    auto combine = [&value](size_t v) { value ^= v + 0x9e3779b9 + (value << 6) + (value >> 2); };
 
-        if (group.childrenLeftToAdd <= 0)
-            groups.pop_back();
+    for (const char* c = node.name(); *c; ++c)
+        combine((size_t)*c);
+    if (const Condition* condition = dynamic_cast<const Condition*>(&node))
+        combine((size_t)condition->check);
+    else if (const Constant* constant = dynamic_cast<const Constant*>(&node))
+        combine((size_t)constant->result);
+    else if (const Composite* composite = dynamic_cast<const Composite*>(&node))
+    {
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            combine((size_t)(Node*)composite->children()[i]);
+    }
+    else if (const Decorator* decorator = dynamic_cast<const Decorator*>(&node))
+        combine((size_t)decorator->child());
+    return value;
+}
+
+inline bool Builder::equal(const Node& a, const Node& b)
+{
+    if (typeid(a) != typeid(b) || strcmp(a.name(), b.name()) != 0)
+        return false;
+    if (const Condition* condition = dynamic_cast<const Condition*>(&a))
+        return condition->check == static_cast<const Condition&>(b).check;
+    if (const Constant* constant = dynamic_cast<const Constant*>(&a))
+        return constant->result == static_cast<const Constant&>(b).result;
+    if (const Composite* composite = dynamic_cast<const Composite*>(&a))
+    {
+        const Composite& other = static_cast<const Composite&>(b);
+        if (composite->childCount != other.childCount)
+            return false;
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            if ((Node*)composite->children()[i] != (Node*)other.children()[i])
+                return false;
+        return true;
     }
+    if (const Decorator* decorator = dynamic_cast<const Decorator*>(&a))
+        return decorator->child() == static_cast<const Decorator&>(b).child();
+    return true;
 }
 
 }
@@ -2,6 +2,8 @@
 #ifndef BEHAVIOR_TREE_BUILDER_H
 #define BEHAVIOR_TREE_BUILDER_H
 
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include "nodes.hpp"
 #include "decorators.hpp"
@@ -9,6 +11,11 @@
 #include "memory.hpp"
 #include "scheduler.hpp"
 #include "tree.hpp"
+#include "coroutines.hpp"
+#include "optimizer.hpp"
+#include "queries.hpp"
+#include "lockstep.hpp"
+#include "batches.hpp"
 
 namespace bt
 {
@@ -17,18 +24,60 @@ class Builder
 {
 public:
     explicit Builder(const size_t maxBytes = 1024, const size_t initSchedulerSize = 10)
-        : memory(std::make_shared<Memory>(maxBytes))
-        , scheduler(std::make_shared<Scheduler>(initSchedulerSize)) {}
-        // , scheduler(std::shared_ptr<Scheduler>(memory->allocate<Scheduler>(initSchedulerSize))) {}
+        : Builder(makeRef<Memory>(maxBytes), initSchedulerSize) {}
 
-    Builder(const std::shared_ptr<Memory>& memory, const std::shared_ptr<Scheduler>& scheduler)
-        : memory(memory), scheduler(scheduler) {}
+    // Pooled builders reuse the scheduler of their arena:
+    Builder(MemoryPool& pool, const size_t maxBytes = 1024, const size_t initSchedulerSize = 10)
+        : Builder(pool.acquire(maxBytes), pool, initSchedulerSize) {}
+
+    Builder(const Ref<Memory>& memory, const Ref<Scheduler>& scheduler)
+        : memory(memory), scheduler(scheduler), nodesBegin(memory->mark()) {}
+
+    // Open groups point into the builder itself:
+    Builder(const Builder& builder) = delete;
+
+    // Replaying definitions on a measuring builder computes the exact maxBytes they need.
+    // It constructs no nodes, end() only accounts for the tree and returns nullptr:
+    explicit Builder(Memory::Measure measure, const size_t initSchedulerSize = 10)
+        : Builder(makeRef<Memory>(measure), initSchedulerSize) {}
+
+    // Nodes of an unfinished definition may hold subtrees sharing this Memory, so they are destroyed here:
+    ~Builder() { memory->destroy(nodesBegin, memory->mark()); }
+
+    // Identical pure subtrees built from here on, made of conditions, constants and the sequences,
+    // selectors and negations of them, are stored once per tree. Nodes keep the observer and partition
+    // of their run, so they are only shared within a tree, where one runs at a time, and never under a
+    // Parallel. Measuring builders don't deduplicate:
+    Builder& deduplicate(bool enabled = true) { deduplication = enabled; return *this; }
+
+    // Bytes used in the arena so far:
+    size_t size() const noexcept { return memory->size(); }
 
     // Nodes:
     Builder& action(const char* name, ActionFunction action) { return create<Action>(name, action); }
     Builder& action(const char* name, AsyncActionFunction onStart, AsyncActionFunction onTerminate = nullptr) { return create<AsyncAction>(name, onStart, onTerminate); }
-    Builder& action(const char* name, const std::shared_ptr<BehaviorTree>& tree) { return create<SubTree>(name, tree); }
+    Builder& action(const char* name, const Ref<BehaviorTree>& tree) { return create<SubTree>(name, tree); }
     Builder&  check(const char* name, ConditionFunction check) { return create<Condition>(name, check); }
+    Builder& pureCheck(const char* name, ConditionFunction check) { scheduler->enableConditionCache(); return create<PureCondition>(name, check); }
+    Builder&  check(const char* name, QueryCache& cache, QueryCondition query, uint64_t key, uint32_t ttl) { return create<CachedCondition>(name, cache, query, key, ttl); }
+    Builder& action(const char* name, QueryCache& cache, QueryAction query, uint64_t key, uint32_t ttl) { return create<CachedAction>(name, cache, query, key, ttl); }
+    Builder&  check(const char* name, AgentConditionFunction check, void* agent = nullptr) { return create<AgentCondition>(name, check, agent); }
+    Builder& action(const char* name, AgentActionFunction action, void* agent = nullptr) { return create<AgentAction>(name, action, agent); }
+    Builder&  check(const char* name, CallbackBatch& batch, void* agent = nullptr) { return create<BatchCondition>(name, batch, agent); }
+    Builder& action(const char* name, CallbackBatch& batch, void* agent = nullptr) { return create<BatchAction>(name, batch, agent); }
+    Builder& constant(Status status) { return create<Constant>(status); }
+#if defined(BEHAVIOR_TREE_COROUTINES)
+    Builder& action(const char* name, CoroutineFunction body)
+    {
+        if (failed)
+            return *this;
+        Memory::Position position = memory->position();
+        CoroutineAction* node = memory->allocate<CoroutineAction>(name, body);
+        if ((node || memory->measuring()) && !CoroutineAction::reserveFrame(node, body, *memory))
+            failed = true;
+        return add(node, 0, position);
+    }
+#endif
 
     // Composites:
     Builder& selector(uint16_t childCount) { return composite<Selector>(childCount); }
@@ -37,46 +86,155 @@ public:
     Builder& parallel(uint16_t childCount, Parallel::Policy success, Parallel::Policy failure) { return composite<Parallel>(childCount, success, failure); }
 
     // Decorators:
-    Builder& negate() { return group<Negate>(1); }
+    Builder& negate() { return group<Negate>(1, Shape::Negate); }
 
     template<typename T, typename... Args>
-    Builder& create(Args&&... args) { return group<T>(0, std::forward<Args>(args)...); }
+    Builder& create(Args&&... args) { return group<T>(0, Shape::Other, std::forward<Args>(args)...); }
 
-    std::shared_ptr<BehaviorTree> end();
+    Ref<BehaviorTree> end() { return finish(nullptr); }
+    // Runs the optimizer on the tree before creating it. Measuring builders can't run it, they
+    // account for the most the child arrays it flattens could take instead:
+    Ref<BehaviorTree> end(Optimizer& optimizer) { return finish(&optimizer); }
 
 protected:
+    // Groups the Optimizer rewrites, known even when measuring constructs no nodes:
+    enum class Shape : uint8_t { Other, Sequence, Selector, Parallel, Negate };
+
     template<typename T, typename... Args>
     Builder& composite(uint16_t childCount, Args&&... args)
     {
-        Node** children = memory->allocateArray<Node*>(childCount);
-        return group<T>(childCount, children, childCount, std::forward<Args>(args)...);
+        // The child array is allocated right after the composite so compact ones can reference it with an offset:
+        if (failed)
+            return *this;
+        Memory::Position position = memory->position();
+        T* node = memory->allocate<T>(nullptr, childCount, std::forward<Args>(args)...);
+        Link<Node>* children = memory->allocateArray<Link<Node>>(childCount);
+        if (node && (!children || !node->setChildren(children)))
+            failed = true;
+        Shape shape = std::is_same<T, Sequence>::value ? Shape::Sequence
+            : std::is_same<T, Selector>::value ? Shape::Selector
+            : std::is_same<T, Parallel>::value ? Shape::Parallel : Shape::Other;
+        return add(node, childCount, position, shape);
     }
 
     template<typename T, typename... Args>
-    Builder& group(uint16_t childCount, Args&&... args)
+    Builder& group(uint16_t childCount, Shape shape, Args&&... args)
+    {
+        if (failed)
+            return *this;
+        Memory::Position position = memory->position();
+        return add(memory->allocate<T>(std::forward<Args>(args)...), childCount, position, shape);
+    }
+
+    // The node is nullptr when measuring, position is where its allocation started.
+    // Without exceptions, a node that didn't fit the Memory fails the rest of the definition:
+    Builder& add(Node* node, uint16_t childCount, const Memory::Position& position, Shape shape = Shape::Other)
     {
-        T* node = memory->allocate<T>(std::forward<Args>(args)...);
+        if (!node && !memory->measuring())
+            failed = true;
+        if (failed)
+            return *this;
         addNode(node);
+        if (failed)
+            return *this;
         if (childCount > 0)
-            groups.push_back(Group(node, childCount));
+            pushGroup(node, childCount, position, shape);
+        else
+            completeNode(node, position);
         return *this;
     }
 
 private:
+    Builder(const Ref<Memory>& memory, const size_t initSchedulerSize)
+        : Builder(memory, createScheduler(*memory, initSchedulerSize)) {}
+
+    Builder(const Ref<Memory>& memory, MemoryPool& pool, const size_t initSchedulerSize)
+        : Builder(memory, pool.scheduler(*memory, initSchedulerSize)) { pooled = true; }
+
+    static Ref<Scheduler> createScheduler(Memory& memory, const size_t initialSize)
+    {
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+        // Trees and builders release their scheduler before their Memory, so it can share the arena:
+        void* schedulerMemory = memory.allocateBytes(sizeof(Scheduler), alignof(Scheduler));
+        if (schedulerMemory)
+            return adopt<Scheduler, &destroyInPlace<Scheduler>>(new (schedulerMemory) Scheduler(initialSize));
+        return makeRef<Scheduler>(initialSize);
+#else
+        return makeRef<Scheduler>(initialSize);
+#endif
+    }
+
+    // Most links an optimized subtree can add to the child array of a parent sequence or selector.
+    // A composite can flatten its nested children of the same kind, anything else can fold into
+    // the widest of its children:
+    struct Flattening
+    {
+        uint32_t sequence;
+        uint32_t selector;
+    };
+
     struct Group
     {
         Node* parent;
         int childrenLeftToAdd;
-        Group(Node* parent, int children)
-            : parent(parent), childrenLeftToAdd(children) {}
+        Memory::Position position;
+        // Whether the children completed so far are pure, and whether the group is below a Parallel:
+        bool pure;
+        bool parallel;
+        Shape shape;
+        uint16_t childCount;
+        // Links of the children completed so far once flattened, and the widest of them:
+        uint32_t links;
+        Flattening widest;
+        Group() {}
+        Group(Node* parent, uint16_t children, const Memory::Position& position, bool parallel, Shape shape)
+            : parent(parent), childrenLeftToAdd(children), position(position), pure(true), parallel(parallel),
+              shape(shape), childCount(children), links(0), widest{1, 1} {}
     };
 
+    Ref<BehaviorTree> finish(Optimizer* optimizer);
     void addNode(Node* node);
+    void abandon() noexcept;
+    void pushGroup(Node* parent, uint16_t childCount, const Memory::Position& position, Shape shape);
+    void completeNode(Node* node, const Memory::Position& position);
+    void addFlattening(const Flattening& child);
+    Flattening closeFlattening(const Group& group);
+
+    // Deduplication:
+    void share(Node* node, const Memory::Position& position, bool pure);
+    void discard(const Memory::Position& position);
+    static bool pure(const Node& node, bool childrenPure);
+    static size_t hash(const Node& node);
+    static bool equal(const Node& a, const Node& b);
+
+    static const uint32_t InlineGroups = 16;
 
     Node* root = nullptr;
-    std::shared_ptr<Memory> memory;
-    std::shared_ptr<Scheduler> scheduler;
-    std::vector<Group> groups = std::vector<Group>();
+    bool defining = false;
+    // Pooled arenas also hold the control blocks of their trees:
+    bool pooled = false;
+    // Set by errors reported without exceptions, the definition ends without a tree:
+    bool failed = false;
+    Ref<Memory> memory;
+    Ref<Scheduler> scheduler;
+    Memory::Marker nodesBegin;
+
+    // Open groups live inline and spill into the arena for deeper definitions, so building doesn't touch the heap.
+    // Compact builders spill very deep ones to the heap instead, where they stay out of the offsets to children:
+    Group* groups = inlineGroups;
+    uint32_t groupCount = 0;
+    uint32_t groupCapacity = InlineGroups;
+    Group inlineGroups[InlineGroups];
+    std::vector<Group> measuredGroups;
+
+    // Links of the child arrays the Optimizer could allocate for the current definition:
+    size_t flattenedLinks = 0;
+
+    bool deduplication = false;
+    std::unordered_multimap<size_t, Node*> sharedNodes;
+    std::vector<Node*> sharedOrder;
+    // Nodes with more than one parent, which the Optimizer leaves as they are:
+    std::vector<const Node*> reusedNodes;
 };
 
 }
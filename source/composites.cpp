@@ -2,15 +2,32 @@
 #include "composites.hpp"
 #include "visitors.hpp"
 #include "scheduler.hpp"
+#include "state.hpp"
 
 namespace bt
 {
 
+inline bool Composite::setChildren(Link<Node>* children)
+{
+#if defined(BEHAVIOR_TREE_COMPACT)
+    intptr_t offset = children ? (intptr_t)children - (intptr_t)this : 0;
+    if (offset < INT16_MIN || offset > INT16_MAX)
+    {
+        raise("BehaviorTree compact composite children must be allocated next to it.");
+        return false;
+    }
+    childrenOffset = (int16_t)offset;
+#else
+    childNodes = children;
+#endif
+    return true;
+}
+
 inline void Composite::addChild(Node* child)
 {
     if (child && currentIndex < childCount)
     {
-        children[currentIndex] = child;
+        children()[currentIndex] = child;
         ++currentIndex;
     }
 }
@@ -18,7 +35,7 @@ inline void Composite::addChild(Node* child)
 inline void Composite::start(Scheduler& scheduler) noexcept
 {
     currentIndex = 0;
-    scheduler.start(*children[0], *this);
+    scheduler.start(*children()[0], *this);
 }
 
 inline void Composite::traverse(Visitor& visitor) const
@@ -31,57 +48,59 @@ inline void Composite::traverseChildren(Visitor& visitor) const
 {
     visitor.beforeChildNodes(*this);
     for (int i = 0; i < childCount; ++i)
-        children[i]->traverse(visitor);
+        children()[i]->traverse(visitor);
     visitor.afterChildNodes(*this);
 }
 
 inline void Composite::stop(Scheduler& scheduler) noexcept
 {
-    if (children)
+    if (children())
     {
         for (uint16_t i = 0; i < childCount; ++i)
-            if (Node* child = children[i])
+            if (Node* child = children()[i])
                 scheduler.stop(*child);
     }
 }
 
-inline Composite::~Composite()
+inline void Composite::saveState(StateWriter& writer, const Scheduler& scheduler) const
 {
-    if (children)
-    {
-        for (uint16_t i = 0; i < childCount; ++i)
-            if (Node* child = children[i])
-                child->~Node();
-        children = nullptr;
-    }
+    Node::saveState(writer, scheduler);
+    // Completed composites are past their last child, start() resets the index anyway:
+    writer.write<uint16_t>(currentIndex < childCount ? currentIndex : 0);
+    for (uint16_t i = 0; i < childCount; ++i)
+        children()[i]->saveState(writer, scheduler);
+}
+
+inline void Composite::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    uint16_t index = reader.read<uint16_t>();
+    if (index != 0 && index >= childCount)
+        reader.reject();
+    if (!reader.validating())
+        currentIndex = index;
+    for (uint16_t i = 0; i < childCount; ++i)
+        children()[i]->restoreState(reader, scheduler, this);
 }
 
 inline void Sequence::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
 {
-    if (status == Status::Failure)
-    {
-        scheduler.completed(*this, status);
-        return;
-    }
+    // Synchronous children are ticked in place until one doesn't succeed:
+    while (status == Status::Success && ++currentIndex < childCount)
+        status = scheduler.run(*children()[currentIndex], *this);
 
-    if (++currentIndex == childCount)
-        scheduler.completed(*this, Status::Success);
-    else
-        scheduler.start(*children[currentIndex], *this);
+    if (status == Status::Success || status == Status::Failure)
+        scheduler.completed(*this, status);
 }
 
 inline void Selector::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
 {
-    if (status == Status::Success)
-    {
-        scheduler.completed(*this, status);
-        return;
-    }
+    // Synchronous children are ticked in place until one doesn't fail:
+    while (status == Status::Failure && ++currentIndex < childCount)
+        status = scheduler.run(*children()[currentIndex], *this);
 
-    if (++currentIndex == childCount)
-        scheduler.completed(*this, Status::Failure);
-    else
-        scheduler.start(*children[currentIndex], *this);
+    if (status == Status::Success || status == Status::Failure)
+        scheduler.completed(*this, status);
 }
 
 inline void Parallel::start(Scheduler& scheduler) noexcept
@@ -92,7 +111,7 @@ inline void Parallel::start(Scheduler& scheduler) noexcept
 
     // Queue the children in reverse order so they end up being ran in the correct order (first->last):
     for (uint16_t i = childCount - 1; i < childCount; --i)
-        scheduler.start(*children[i], *this);
+        scheduler.start(*children()[i], *this);
 }
 
 inline void Parallel::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
@@ -127,4 +146,25 @@ inline void Parallel::onComplete(Scheduler& scheduler, const Node& child, Status
         scheduler.completed(*this, Status::Failure);
 }
 
+inline void Parallel::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    Composite::saveState(writer, scheduler);
+    writer.write(successCount);
+    writer.write(failureCount);
+}
+
+inline void Parallel::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Composite::restoreState(reader, scheduler, observer);
+    uint16_t successes = reader.read<uint16_t>();
+    uint16_t failures = reader.read<uint16_t>();
+    if (successes + failures > childCount)
+        reader.reject();
+    if (!reader.validating())
+    {
+        successCount = successes;
+        failureCount = failures;
+    }
+}
+
 }
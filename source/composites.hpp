@@ -7,23 +7,45 @@
 namespace bt
 {
 
-class Composite : public Node, public Observer
+class Composite : public Node
 {
 public:
-    Composite(Node** children, uint16_t childCount)
-        : children(children), childCount(childCount) {}
+    Composite(Link<Node>* children, uint16_t childCount)
+        : childCount(childCount) { setChildren(children); }
 
+    // Returns false when compact children are out of reach of the composite:
+    bool setChildren(Link<Node>* children);
     void addChild(Node* child);
     virtual void traverse(class Visitor& visitor) const override;
     void traverseChildren(class Visitor& visitor) const;
-    virtual ~Composite() override;
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const override;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, Observer* observer) override;
+    friend class Optimizer;
+    friend class Builder;
+    friend class Lockstep;
 protected:
     virtual void start(class Scheduler& scheduler) noexcept override;
     virtual Status update() noexcept override { return Status::Suspended; }
     virtual void stop(class Scheduler& scheduler) noexcept override;
-    Node** children;
-    const uint16_t childCount;
+
+    Link<Node>* children() const noexcept
+    {
+#if defined(BEHAVIOR_TREE_COMPACT)
+        return childrenOffset ? (Link<Node>*)((uintptr_t)this + childrenOffset) : nullptr;
+#else
+        return childNodes;
+#endif
+    }
+
+    uint16_t childCount;
     uint16_t currentIndex = 0;
+private:
+#if defined(BEHAVIOR_TREE_COMPACT)
+    // Compact composites find their child array, allocated right after them, through a small offset:
+    int16_t childrenOffset = 0;
+#else
+    Link<Link<Node>> childNodes = nullptr;
+#endif
 };
 
 
@@ -49,12 +71,15 @@ protected:
 
 class Parallel : public Composite {
 public:
-    enum class Policy { RequireOne, RequireAll };
+    enum class Policy : uint8_t { RequireOne, RequireAll };
 
-    Parallel(Node** children, uint16_t childCount, Policy success, Policy failure = Policy::RequireAll)
+    Parallel(Link<Node>* children, uint16_t childCount, Policy success, Policy failure = Policy::RequireAll)
         : Composite(children, childCount), successPolicy(success), failurePolicy(failure) {}
 
     virtual const char* name() const noexcept override { return "Parallel"; }
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const override;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, Observer* observer) override;
+    friend class Lockstep;
 protected:
     virtual void start(class Scheduler& scheduler) noexcept override;
     virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
@@ -65,6 +90,14 @@ private:
     Policy failurePolicy;
 };
 
+
+#if defined(BEHAVIOR_TREE_COMPACT)
+static_assert(sizeof(Composite) <= 3 * sizeof(void*), "Compact composites should only add their counters to Node.");
+static_assert(sizeof(Sequence) <= 3 * sizeof(void*), "Compact sequences should only add their counters to Node.");
+static_assert(sizeof(Selector) <= 3 * sizeof(void*), "Compact selectors should only add their counters to Node.");
+static_assert(sizeof(Parallel) <= 4 * sizeof(void*), "Compact parallels should only add their counters and policies.");
+#endif
+
 }
 
 #endif
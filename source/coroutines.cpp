@@ -0,0 +1,107 @@
+
+#include "coroutines.hpp"
+#include "scheduler.hpp"
+
+#if defined(BEHAVIOR_TREE_COROUTINES)
+
+namespace bt
+{
+
+inline void* Coroutine::promise_type::operator new(size_t size, CoroutineAction& action) noexcept
+{
+    return action.allocateFrame(size);
+}
+
+inline Coroutine& Coroutine::operator=(Coroutine&& c) noexcept
+{
+    if (handle)
+        handle.destroy();
+    handle = c.handle;
+    c.handle = nullptr;
+    return *this;
+}
+
+inline void* CoroutineAction::allocateFrame(size_t size) noexcept
+{
+    // The same body always needs the same frame size, so the reserved frame is reused:
+    if (size <= frameSize)
+        return frame;
+    if (!arena)
+        return nullptr;
+
+    void* allocated = arena->tryAllocateBytes(size);
+    if (allocated)
+    {
+        frame = allocated;
+        frameSize = size;
+    }
+    return allocated;
+}
+
+inline bool CoroutineAction::reserveFrame(CoroutineAction* action, CoroutineFunction body, Memory& memory)
+{
+    CoroutineAction probe("Probe", body);
+    CoroutineAction& reserving = action ? *action : probe;
+
+    // Bodies start suspended, creating one doesn't run any of its code:
+    reserving.arena = &memory;
+    reserving.coroutine = body(reserving);
+    reserving.coroutine = Coroutine();
+    reserving.arena = nullptr;
+    if (!reserving.frame && !memory.measuring())
+    {
+        raise("BehaviorTree Memory capacity exceeded.");
+        return false;
+    }
+    return true;
+}
+
+inline void CoroutineAction::start(Scheduler& scheduler) noexcept
+{
+    this->scheduler = &scheduler;
+    waitTicks = 0;
+    waitStatus = Status::Running;
+
+    // Destroy the previous run's frame before its memory is reused:
+    coroutine = Coroutine();
+    BEHAVIOR_TREE_TRY
+    {
+        coroutine = body(*this);
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+    }
+}
+
+inline Status CoroutineAction::update() noexcept
+{
+    if (coroutine.done())
+        return coroutine.result();
+
+    if (waitTicks > 0 && --waitTicks > 0)
+        return Status::Running;
+
+    coroutine.resume();
+    if (coroutine.done())
+    {
+        Status result = coroutine.result();
+        coroutine = Coroutine();
+        return result;
+    }
+    return waitStatus;
+}
+
+inline void CoroutineAction::stop(Scheduler& scheduler) noexcept
+{
+    coroutine = Coroutine();
+}
+
+inline void CoroutineAction::resume() noexcept
+{
+    if (status() == Status::Suspended && scheduler)
+        scheduler->resume(*this);
+}
+
+}
+
+#endif
@@ -0,0 +1,118 @@
+
+#ifndef BEHAVIOR_TREE_COROUTINES_H
+#define BEHAVIOR_TREE_COROUTINES_H
+
+#include "nodes.hpp"
+#include "memory.hpp"
+
+// Detected from the compiler, users may also define it themselves:
+#if !defined(BEHAVIOR_TREE_COROUTINES) && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define BEHAVIOR_TREE_COROUTINES
+#endif
+#endif
+
+#if defined(BEHAVIOR_TREE_COROUTINES)
+
+#include <coroutine>
+
+namespace bt
+{
+
+class CoroutineAction;
+
+// Return type of coroutine action bodies, e.g.:
+//     Coroutine patrol(CoroutineAction& action) { co_await action.nextTick(); co_return Status::Success; }
+// Coroutine frames are reserved in the tree's Memory when the action is built and reused between runs.
+class Coroutine
+{
+public:
+    struct promise_type
+    {
+        static void* operator new(size_t size, CoroutineAction& action) noexcept;
+        static void* operator new(size_t size) = delete;
+        static void operator delete(void* frame) noexcept {}
+        // A frame that wasn't reserved fails the action:
+        static Coroutine get_return_object_on_allocation_failure() noexcept { return Coroutine(); }
+
+        Coroutine get_return_object() noexcept { return Coroutine(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(Status status) noexcept { result = status; }
+        void unhandled_exception() noexcept { result = Status::Failure; }
+
+        Status result = Status::Failure;
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Coroutine() noexcept : handle(nullptr) {}
+    Coroutine(Coroutine&& c) noexcept : handle(c.handle) { c.handle = nullptr; }
+    Coroutine& operator=(Coroutine&& c) noexcept;
+    ~Coroutine() { if (handle) handle.destroy(); }
+
+    bool done() const noexcept { return !handle || handle.done(); }
+    Status result() const noexcept { return handle ? handle.promise().result : Status::Failure; }
+    void resume() { handle.resume(); }
+private:
+    explicit Coroutine(Handle handle) : handle(handle) {}
+    Handle handle;
+};
+
+
+typedef Coroutine (*CoroutineFunction) (CoroutineAction&);
+
+class CoroutineAction : public NamedNode
+{
+public:
+    // Awaitable returned by nextTick(), wait() and suspend():
+    struct Awaiter
+    {
+        CoroutineAction& action;
+        uint32_t ticks;
+        Status status;
+
+        bool await_ready() const noexcept { return status == Status::Running && ticks == 0; }
+        void await_suspend(std::coroutine_handle<>) noexcept { action.waitTicks = ticks; action.waitStatus = status; }
+        void await_resume() const noexcept {}
+    };
+
+    CoroutineAction(const char* name, CoroutineFunction body)
+        : NamedNode(name), body(body) {}
+
+    // Creates the body once so its frame is allocated from the Memory while building, ticks never
+    // allocate. Measuring builders have no action, a probe only counts the bytes of its frame:
+    static bool reserveFrame(CoroutineAction* action, CoroutineFunction body, Memory& memory);
+
+    // Continue the body on the next tick:
+    Awaiter nextTick() noexcept { return Awaiter{*this, 1, Status::Running}; }
+    // Continue the body after the given number of ticks:
+    Awaiter wait(uint32_t ticks) noexcept { return Awaiter{*this, ticks, Status::Running}; }
+    // Suspend the node until resume() is called, e.g. from an async completion callback:
+    Awaiter suspend() noexcept { return Awaiter{*this, 0, Status::Suspended}; }
+    void resume() noexcept;
+
+    friend struct Coroutine::promise_type;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override;
+    virtual void stop(class Scheduler& scheduler) noexcept override;
+private:
+    void* allocateFrame(size_t size) noexcept;
+
+    CoroutineFunction body;
+    // Only set while the frame is reserved:
+    Memory* arena = nullptr;
+    class Scheduler* scheduler = nullptr;
+    Coroutine coroutine;
+    void* frame = nullptr;
+    size_t frameSize = 0;
+    uint32_t waitTicks = 0;
+    Status waitStatus = Status::Running;
+};
+
+}
+
+#endif
+
+#endif
@@ -3,35 +3,57 @@
 #include "composites.hpp"
 #include "visitors.hpp"
 #include "scheduler.hpp"
+#include "state.hpp"
 
 namespace bt
 {
 
+inline bool Decorator::setChild(Node* child)
+{
+#if defined(BEHAVIOR_TREE_COMPACT)
+    intptr_t offset = child ? (intptr_t)child - (intptr_t)this : 0;
+    if (offset < INT16_MIN || offset > INT16_MAX)
+    {
+        raise("BehaviorTree compact decorator child must be allocated next to it.");
+        return false;
+    }
+    childOffset = (int16_t)offset;
+#else
+    childNode = child;
+#endif
+    return true;
+}
+
 inline void Decorator::traverse(Visitor& visitor) const
 {
     visitor.visit(*this);
-    if (Composite* composite = dynamic_cast<Composite*>(childNode))
+    if (Composite* composite = dynamic_cast<Composite*>(child()))
         composite->traverseChildren(visitor);
 }
 
 inline void Decorator::start(Scheduler& scheduler) noexcept
 {
-    scheduler.start(*childNode, *this);
+    scheduler.start(*child(), *this);
 }
 
 inline void Decorator::stop(Scheduler& scheduler) noexcept
 {
-    if (childNode)
+    if (Node* childNode = child())
         scheduler.stop(*childNode);
 }
 
-inline Decorator::~Decorator()
+inline void Decorator::saveState(StateWriter& writer, const Scheduler& scheduler) const
 {
-    if (childNode)
-    {
-        childNode->~Node();
-        childNode = nullptr;
-    }
+    Node::saveState(writer, scheduler);
+    if (Node* childNode = child())
+        childNode->saveState(writer, scheduler);
+}
+
+inline void Decorator::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    if (Node* childNode = child())
+        childNode->restoreState(reader, scheduler, this);
 }
 
 inline void Negate::onComplete(Scheduler& scheduler, const Node& child, Status status) noexcept
@@ -7,19 +7,33 @@
 namespace bt
 {
 
-class Decorator : public Node, public Observer
+class Decorator : public Node
 {
 public:
-    void setChild(Node* child) { childNode = child; }
-    Node* child() const { return childNode; }
+    // Returns false when a compact child is out of reach of the decorator:
+    bool setChild(Node* child);
+    Node* child() const
+    {
+#if defined(BEHAVIOR_TREE_COMPACT)
+        return childOffset ? (Node*)((uintptr_t)this + childOffset) : nullptr;
+#else
+        return childNode;
+#endif
+    }
     virtual void traverse(class Visitor& visitor) const override;
-    virtual ~Decorator() override;
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const override;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, Observer* observer) override;
 protected:
     virtual void start(class Scheduler& scheduler) noexcept override;
     virtual Status update() noexcept override { return Status::Suspended; }
     virtual void stop(class Scheduler& scheduler) noexcept override;
 private:
-    Node* childNode = nullptr;
+#if defined(BEHAVIOR_TREE_COMPACT)
+    // Compact decorators find their child, allocated right after them, through a small offset:
+    int16_t childOffset = 0;
+#else
+    Link<Node> childNode = nullptr;
+#endif
 };
 
 
@@ -31,6 +45,12 @@ protected:
     virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override;
 };
 
+
+#if defined(BEHAVIOR_TREE_COMPACT)
+static_assert(sizeof(Decorator) == sizeof(Node), "Compact decorators should fit in the padding of Node.");
+static_assert(sizeof(Negate) == sizeof(Node), "Compact decorators should fit in the padding of Node.");
+#endif
+
 }
 
 #endif
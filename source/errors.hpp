@@ -0,0 +1,61 @@
+
+#ifndef BEHAVIOR_TREE_ERRORS_H
+#define BEHAVIOR_TREE_ERRORS_H
+
+#include <stdexcept>
+
+// Defining BEHAVIOR_TREE_NO_EXCEPTIONS, or compiling without exception support, reports errors
+// to the error handler instead of throwing them. Failing calls return nullptr or false and
+// user functions are called without a try/catch around them:
+#if !defined(BEHAVIOR_TREE_NO_EXCEPTIONS) && !(defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND))
+#define BEHAVIOR_TREE_NO_EXCEPTIONS
+#endif
+
+// Guards user functions, whose exceptions fail the node calling them:
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+#define BEHAVIOR_TREE_TRY if (true)
+#define BEHAVIOR_TREE_CATCH else
+#else
+#define BEHAVIOR_TREE_TRY try
+#define BEHAVIOR_TREE_CATCH catch (...)
+#endif
+
+namespace bt
+{
+
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+constexpr bool ThrowsErrors = false;
+#else
+constexpr bool ThrowsErrors = true;
+#endif
+
+typedef void (*ErrorHandler) (const char* message);
+
+inline ErrorHandler& errorHandler() noexcept
+{
+    static ErrorHandler handler = nullptr;
+    return handler;
+}
+
+// Sets the handler errors are reported to without exceptions, returns the previous one:
+inline ErrorHandler setErrorHandler(ErrorHandler handler) noexcept
+{
+    ErrorHandler previous = errorHandler();
+    errorHandler() = handler;
+    return previous;
+}
+
+// Throws the error, or reports it and returns so the caller can return its failure value:
+inline void raise(const char* message)
+{
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+    if (ErrorHandler handler = errorHandler())
+        handler(message);
+#else
+    throw std::runtime_error(message);
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cstring>
+#include "formatting.hpp"
+
+namespace bt
+{
+
+inline void TextSerializer::visit(const Decorator& node)
+{
+    if (Node* child = node.child())
+    {
+        Status status = node.status();
+        if (status == Status::Suspended)
+            status = child->status();
+        print(child->name(), status, node.name());
+    }
+    else
+    {
+        print(node.name(), node.status());
+    }
+}
+
+inline void TextSerializer::visit(const SubTree& tree)
+{
+    if (expand)
+        tree.traverseSubTree(*this);
+    else
+        visit((Node&) tree);
+}
+
+inline void TextSerializer::print(const char* name, Status status, const char* prefix)
+{
+    for (int i = 0; i < depth; i++)
+        out << "\t";
+    if (prefix)
+        out << prefix << " ";
+    out << name;
+    if (status != Status::Initial)
+        out << ": " << status;
+    out << std::endl;
+}
+
+inline void BufferedTextSerializer::begin()
+{
+    TextSerializer::begin();
+    buffer.clear();
+}
+
+inline void BufferedTextSerializer::end()
+{
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+}
+
+inline void BufferedTextSerializer::print(const char* name, Status status, const char* prefix)
+{
+    if (depth > (int)indentation.size())
+        indentation.resize(depth * 2, '\t');
+    buffer.append(indentation.data(), depth);
+    if (prefix)
+        buffer.append(prefix).append(" ");
+    buffer.append(name);
+    if (status != Status::Initial)
+        buffer.append(": ").append(statusName(status));
+    buffer.push_back('\n');
+}
+
+class StatusDiffSerializer::Numbering : public Visitor
+{
+public:
+    Numbering(StatusDiffSerializer& serializer) : serializer(serializer) {}
+    virtual void visit(const Node& node) override { add(node, nullptr); }
+    virtual void visit(const Decorator& node) override { add(node, node.child()); }
+private:
+    void add(const Node& node, const Node* child)
+    {
+        uint32_t index = (uint32_t)serializer.lines.size();
+        serializer.lines.push_back(Line{&node, child, Status::Initial, false});
+        serializer.indices.emplace(&node, index);
+        if (child)
+            serializer.indices.emplace(child, index);
+    }
+
+    StatusDiffSerializer& serializer;
+};
+
+inline StatusDiffSerializer::StatusDiffSerializer(const Ref<BehaviorTree>& tree)
+    : tree(tree)
+{
+    Numbering numbering(*this);
+    tree->traverse(numbering);
+    changes.reserve(lines.size() * 2);
+    tree->recordStatusChanges(changes);
+    reset();
+}
+
+inline StatusDiffSerializer::~StatusDiffSerializer()
+{
+    tree->stopRecordingStatusChanges(changes);
+}
+
+inline void StatusDiffSerializer::reset()
+{
+    for (uint32_t i = 0; i < lines.size(); ++i)
+    {
+        lines[i].previous = Status::Initial;
+        if (!lines[i].pending)
+        {
+            lines[i].pending = true;
+            pending.push_back(i);
+        }
+    }
+}
+
+// Moves the recorded changes of the serialized tree to the pending lines, once per line:
+inline void StatusDiffSerializer::collect()
+{
+    for (const Node* node : changes)
+    {
+        auto found = indices.find(node);
+        if (found == indices.end() || lines[found->second].pending)
+            continue;
+        lines[found->second].pending = true;
+        pending.push_back(found->second);
+    }
+    changes.clear();
+}
+
+inline size_t StatusDiffSerializer::write(char* buffer, size_t size)
+{
+    collect();
+    std::sort(pending.begin(), pending.end());
+
+    size_t length = 0;
+    size_t written = 0;
+    for (; written < pending.size(); ++written)
+    {
+        Line& line = lines[pending[written]];
+        Status status = line.node->status();
+        if (line.child && status == Status::Suspended)
+            status = line.child->status();
+        if (status == line.previous)
+        {
+            line.pending = false;
+            continue;
+        }
+
+        // The index is formatted backwards into a small scratch buffer:
+        char digits[10];
+        size_t digitCount = 0;
+        for (uint32_t index = pending[written]; digitCount == 0 || index; index /= 10)
+            digits[digitCount++] = (char)('0' + index % 10);
+
+        const char* prefix = line.child ? line.node->name() : nullptr;
+        const char* name = line.child ? line.child->name() : line.node->name();
+        const char* statusText = statusName(status);
+        size_t prefixLength = prefix ? strlen(prefix) + 1 : 0;
+        size_t nameLength = strlen(name);
+        size_t statusLength = strlen(statusText);
+        size_t lineLength = digitCount + 1 + prefixLength + nameLength + 2 + statusLength + 1;
+        if (length + lineLength > size)
+            break;
+
+        char* out = buffer + length;
+        while (digitCount)
+            *out++ = digits[--digitCount];
+        *out++ = ' ';
+        if (prefix)
+        {
+            memcpy(out, prefix, prefixLength - 1);
+            out += prefixLength - 1;
+            *out++ = ' ';
+        }
+        memcpy(out, name, nameLength);
+        out += nameLength;
+        *out++ = ':';
+        *out++ = ' ';
+        memcpy(out, statusText, statusLength);
+        out += statusLength;
+        *out++ = '\n';
+        length += lineLength;
+
+        line.previous = status;
+        line.pending = false;
+    }
+    pending.erase(pending.begin(), pending.begin() + written);
+    return length;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Status& s)
+{
+    return os << statusName(s);
+}
+
+inline std::ostream& operator<<(std::ostream& os, const BehaviorTree& tree)
+{
+    TextSerializer serializer(os, true);
+    tree.traverse(serializer);
+    return os;
+}
+
+}
@@ -0,0 +1,96 @@
+
+#ifndef BEHAVIOR_TREE_FORMATTING_H
+#define BEHAVIOR_TREE_FORMATTING_H
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "status.hpp"
+#include "visitors.hpp"
+#include "tree.hpp"
+
+namespace bt
+{
+
+// Text output of statuses and trees. The engine itself doesn't depend on iostream, this is
+// only included by include/formatting.hpp and behavior_tree_formatting.hpp.
+
+class TextSerializer : public Visitor
+{
+public:
+    TextSerializer(std::ostream& out, bool expand = false) : out{out}, expand{expand} {}
+    virtual void begin() override { depth = 0; }
+    virtual void beforeChildNodes(const Composite& node) override { ++depth; }
+    virtual void visit(const Node& node) override { print(node.name(), node.status()); }
+    virtual void afterChildNodes(const Composite& node) override { --depth; }
+    virtual void visit(const Decorator& node) override;
+    virtual void visit(const SubTree& tree) override;
+protected:
+    virtual void print(const char* name, Status status, const char* prefix = nullptr);
+    int depth = 0;
+    bool expand;
+    std::ostream& out;
+};
+
+
+// Formats the whole tree into a reusable in-memory buffer and writes it to the
+// stream in a single call at end(), flushing once per dump instead of per node.
+class BufferedTextSerializer : public TextSerializer
+{
+public:
+    using TextSerializer::TextSerializer;
+    virtual void begin() override;
+    virtual void end() override;
+    const std::string& text() const noexcept { return buffer; }
+protected:
+    virtual void print(const char* name, Status status, const char* prefix = nullptr) override;
+    std::string buffer;
+private:
+    std::string indentation;
+};
+
+
+// Writes only the nodes whose status changed since the previous write, one "<index> <name>: <status>"
+// line each, ordered by the index of the node in traversal order. The tree's scheduler records the
+// nodes it changes, so a write costs the changes instead of the tree. The tree is only traversed
+// once to number its nodes, a decorator shares its line with its child like in TextSerializer.
+class StatusDiffSerializer
+{
+public:
+    explicit StatusDiffSerializer(const Ref<BehaviorTree>& tree);
+    StatusDiffSerializer(const StatusDiffSerializer& serializer) = delete;
+    ~StatusDiffSerializer();
+
+    // Formats whole lines into the buffer and returns their length. Changes that don't fit stay
+    // pending for the next write:
+    size_t write(char* buffer, size_t size);
+    // Writes every node that isn't Initial again:
+    void reset();
+private:
+    struct Line
+    {
+        const Node* node;
+        // Decorated child, whose name is printed after the decorator's:
+        const Node* child;
+        Status previous;
+        bool pending;
+    };
+
+    class Numbering;
+    void collect();
+
+    Ref<BehaviorTree> tree;
+    std::vector<Line> lines;
+    std::unordered_map<const Node*, uint32_t> indices;
+    std::vector<const Node*> changes;
+    std::vector<uint32_t> pending;
+};
+
+
+std::ostream& operator<<(std::ostream& os, const Status& s);
+std::ostream& operator<<(std::ostream& os, const BehaviorTree& tree);
+
+}
+
+#endif
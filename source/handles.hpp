@@ -0,0 +1,259 @@
+
+#ifndef BEHAVIOR_TREE_HANDLES_H
+#define BEHAVIOR_TREE_HANDLES_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "errors.hpp"
+
+namespace bt
+{
+
+// Weak 32-bit reference to a tree or an async node. The low bits index a slot of the handle
+// table, the next bit holds the kind of the object and the high bits hold the generation of
+// the slot, 0 is never a valid handle.
+typedef uint32_t Handle;
+
+enum class HandleKind : uint32_t
+{
+    Tree,
+    Async
+};
+
+// Process-wide table resolving handles. Releasing a handle bumps the generation of its slot,
+// so a handle that outlived its object resolves to nullptr after a single compare, without
+// reference counting. Released slots wait in FIFO order until more than MinimumFree of them
+// are free, the table grows instead until then, so a stale handle can only match again after
+// its slot went through all generations, millions of acquisitions later.
+// Slots are added in chunks, the first one in static storage so the first trees don't allocate.
+// Each thread takes fresh slots and gives back released ones in batches, so only one acquire
+// or release per batch takes the spin lock of the table, BEHAVIOR_TREE_SINGLE_THREADED leaves
+// it out. Resolving a handle never locks.
+class Handles
+{
+public:
+    static const uint32_t IndexBits = 20;
+    static const uint32_t Capacity = 1u << IndexBits;
+    static const uint32_t MinimumFree = 1024;
+
+    // Returns 0 once all slots are in use:
+    static Handle acquire(void* object, HandleKind kind) noexcept
+    {
+        Cache& cache = threadCache();
+        if (!cache.freeCount && !refill(cache))
+            return 0;
+
+        Table& table = instance();
+        Slot& slot = *table.slot(cache.free[--cache.freeCount]);
+        Handle handle = slot.handle.load(std::memory_order_relaxed) | (uint32_t)kind << KindShift;
+        slot.object.store(object, std::memory_order_release);
+        slot.handle.store(handle, std::memory_order_release);
+        ++table.used;
+        return handle;
+    }
+
+    // Invalidates the handle, released and invalid handles are ignored:
+    static void release(Handle handle) noexcept
+    {
+        Table& table = instance();
+        Slot* slot = handle ? table.slot(handle & IndexMask) : nullptr;
+        if (!slot || !slot->object.load(std::memory_order_relaxed))
+            return;
+
+        // The generation is bumped before the object is cleared, so get() never returns it for the new handle:
+        uint32_t generation = (handle >> GenerationShift) + 1;
+        Handle next = (generation > GenerationMask ? 1 : generation) << GenerationShift | (handle & IndexMask);
+        if (!slot->handle.compare_exchange_strong(handle, next, std::memory_order_acq_rel))
+            return;
+        slot->object.store(nullptr, std::memory_order_release);
+        --table.used;
+
+        Cache& cache = threadCache();
+        cache.released[cache.releasedCount++] = handle & IndexMask;
+        if (cache.releasedCount == Batch || cache.exited)
+            flush(cache);
+    }
+
+    // Returns the object while its handle is valid, nullptr once it was released or for handles
+    // of another kind:
+    static void* get(Handle handle, HandleKind kind) noexcept
+    {
+        if (!handle || (handle >> KindShift & 1) != (uint32_t)kind)
+            return nullptr;
+        const Slot* slot = instance().slot(handle & IndexMask);
+        if (!slot || slot->handle.load(std::memory_order_acquire) != handle)
+            return nullptr;
+        void* object = slot->object.load(std::memory_order_acquire);
+        return slot->handle.load(std::memory_order_acquire) == handle ? object : nullptr;
+    }
+
+    // Number of handles in use:
+    static size_t size() noexcept { return instance().used; }
+private:
+    static const uint32_t IndexMask = Capacity - 1;
+    static const uint32_t KindShift = IndexBits;
+    static const uint32_t GenerationShift = IndexBits + 1;
+    static const uint32_t GenerationMask = UINT32_MAX >> GenerationShift;
+    static const uint32_t ChunkBits = 12;
+    static const uint32_t ChunkSize = 1u << ChunkBits;
+    static const uint32_t Batch = 32;
+    static const uint32_t None = UINT32_MAX;
+
+    // Free slots hold the handle they will be acquired with next, without kind, and no object:
+    struct Slot
+    {
+        std::atomic<void*> object{nullptr};
+        std::atomic<Handle> handle{0};
+        uint32_t nextFree = None;
+    };
+
+    // Fresh or recycled slots a thread acquires from, and slots it released since its last flush.
+    // Exiting threads give all of them back, later releases by their static destructors are flushed
+    // one by one:
+    struct Cache
+    {
+        uint32_t free[Batch];
+        uint32_t freeCount = 0;
+        uint32_t released[Batch];
+        uint32_t releasedCount = 0;
+        bool exited = false;
+
+        ~Cache()
+        {
+            flush(*this);
+            for (uint32_t i = 0; i < freeCount; ++i)
+                released[i] = free[i];
+            releasedCount = freeCount;
+            freeCount = 0;
+            flush(*this);
+            exited = true;
+        }
+    };
+
+    // Slots past the top were never used, the chunks they need are allocated when the top reaches them:
+    struct Table
+    {
+        std::atomic<Slot*> chunks[Capacity / ChunkSize];
+        uint32_t top = 0;
+        uint32_t firstFree = None;
+        uint32_t lastFree = None;
+        uint32_t freeCount = 0;
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        size_t used = 0;
+#else
+        std::atomic<size_t> used{0};
+        std::atomic<bool> locked{false};
+#endif
+
+        explicit Table(Slot* first) noexcept
+        {
+            chunks[0].store(first, std::memory_order_relaxed);
+            for (uint32_t i = 1; i < Capacity / ChunkSize; ++i)
+                chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        Slot* slot(uint32_t index) const noexcept
+        {
+            Slot* chunk = chunks[index >> ChunkBits].load(std::memory_order_acquire);
+            return chunk ? chunk + (index & (ChunkSize - 1)) : nullptr;
+        }
+    };
+
+    struct Lock
+    {
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        explicit Lock(Table& table) noexcept {}
+#else
+        explicit Lock(Table& table) noexcept : table(table)
+        {
+            while (table.locked.exchange(true, std::memory_order_acquire))
+                while (table.locked.load(std::memory_order_relaxed)) {}
+        }
+        ~Lock() { table.locked.store(false, std::memory_order_release); }
+        Table& table;
+#endif
+    };
+
+    // Released slots are only reused once enough of them are free, the table grows until then:
+    static bool refill(Cache& cache) noexcept
+    {
+        Table& table = instance();
+        Lock lock(table);
+        while (cache.freeCount < Batch)
+        {
+            uint32_t index = table.firstFree;
+            if (index != None && (table.freeCount > MinimumFree || table.top == Capacity))
+            {
+                table.firstFree = table.slot(index)->nextFree;
+                if (table.firstFree == None)
+                    table.lastFree = None;
+                --table.freeCount;
+            }
+            else if (table.top < Capacity)
+            {
+                index = table.top;
+                Slot* chunk = table.chunks[index >> ChunkBits].load(std::memory_order_relaxed);
+                if (!chunk)
+                {
+                    chunk = new (std::nothrow) Slot[ChunkSize];
+                    if (!chunk)
+                        break;
+                    table.chunks[index >> ChunkBits].store(chunk, std::memory_order_release);
+                }
+                chunk[index & (ChunkSize - 1)].handle.store(1u << GenerationShift | index, std::memory_order_relaxed);
+                ++table.top;
+            }
+            else
+                break;
+            cache.free[cache.freeCount++] = index;
+        }
+        return cache.freeCount != 0;
+    }
+
+    static void flush(Cache& cache) noexcept
+    {
+        if (!cache.releasedCount)
+            return;
+
+        Table& table = instance();
+        Lock lock(table);
+        for (uint32_t i = 0; i < cache.releasedCount; ++i)
+        {
+            uint32_t index = cache.released[i];
+            table.slot(index)->nextFree = None;
+            if (table.lastFree != None)
+                table.slot(table.lastFree)->nextFree = index;
+            else
+                table.firstFree = index;
+            table.lastFree = index;
+        }
+        table.freeCount += cache.releasedCount;
+        cache.releasedCount = 0;
+    }
+
+    // Chunks are never freed, trees destroyed by static destructors can still release their handles:
+    static Table& instance() noexcept
+    {
+        static Slot first[ChunkSize];
+        static Table table(first);
+        return table;
+    }
+
+    // The table is created first, so it outlives the cache:
+    static Cache& threadCache() noexcept
+    {
+        instance();
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        static Cache cache;
+#else
+        static thread_local Cache cache;
+#endif
+        return cache;
+    }
+};
+
+}
+
+#endif
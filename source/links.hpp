@@ -0,0 +1,65 @@
+
+#ifndef BEHAVIOR_TREE_LINKS_H
+#define BEHAVIOR_TREE_LINKS_H
+
+#include <cstdint>
+#include "errors.hpp"
+
+namespace bt
+{
+
+#if defined(BEHAVIOR_TREE_RELATIVE_LINKS)
+
+// 32-bit pointer relative to its own address, used for the links between objects in
+// a Memory arena. A finished arena holds no absolute pointers between its nodes, so it
+// can be copied or mapped at another address within the same process image.
+template <typename T>
+class Link
+{
+public:
+    Link(T* target = nullptr) { set(target); }
+    Link(const Link& link) { set(link.get()); }
+
+    Link& operator=(const Link& link) { set(link.get()); return *this; }
+    Link& operator=(T* target) { set(target); return *this; }
+
+    T* get() const noexcept { return offset ? (T*)((intptr_t)this + offset) : nullptr; }
+    operator T*() const noexcept { return get(); }
+    T* operator->() const noexcept { return get(); }
+    T& operator*() const noexcept { return *get(); }
+private:
+    void set(T* target)
+    {
+        intptr_t distance = target ? (intptr_t)target - (intptr_t)this : 0;
+        if (distance != (int32_t)distance)
+        {
+            raise("BehaviorTree link target is outside of the link's Memory.");
+            distance = 0;
+        }
+        offset = (int32_t)distance;
+    }
+
+    int32_t offset = 0;
+};
+
+#else
+
+template <typename T>
+using Link = T*;
+
+#endif
+
+// Whether a node can link to a target at this address, compact nodes only have 16-bit offsets:
+inline bool reachable(const void* from, const void* to) noexcept
+{
+#if defined(BEHAVIOR_TREE_COMPACT)
+    intptr_t offset = (intptr_t)to - (intptr_t)from;
+    return offset >= INT16_MIN && offset <= INT16_MAX;
+#else
+    return true;
+#endif
+}
+
+}
+
+#endif
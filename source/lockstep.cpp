@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <typeinfo>
+#include "lockstep.hpp"
+#include "composites.hpp"
+#include "decorators.hpp"
+
+namespace bt
+{
+
+#if defined(BEHAVIOR_TREE_LOCKSTEP_SSE2)
+
+// Expands the bits of a lane mask to all ones bytes or words:
+inline __m128i laneBytes(uint16_t lanes) noexcept
+{
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i mask = _mm_unpacklo_epi64(_mm_set1_epi8((char)(lanes & 0xFF)), _mm_set1_epi8((char)(lanes >> 8)));
+    return _mm_cmpeq_epi8(_mm_and_si128(mask, bits), bits);
+}
+
+inline __m128i laneWords(uint8_t lanes) noexcept
+{
+    const __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(lanes), bits), bits);
+}
+
+inline __m128i select(__m128i mask, __m128i a, __m128i b) noexcept
+{
+    return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+}
+
+inline uint16_t LaneStatuses::equal(Status status) const noexcept
+{
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)status)));
+}
+
+inline void LaneStatuses::assign(const LaneStatuses& statuses, uint16_t lanes) noexcept
+{
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    __m128i s = _mm_load_si128((const __m128i*)statuses.values);
+    _mm_store_si128((__m128i*)values, select(laneBytes(lanes), v, s));
+}
+
+inline void LaneStatuses::fill(Status status, uint16_t lanes) noexcept
+{
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    _mm_store_si128((__m128i*)values, select(laneBytes(lanes), v, _mm_set1_epi8((char)status)));
+}
+
+inline void LaneStatuses::negate(uint16_t lanes) noexcept
+{
+    __m128i mask = laneBytes(lanes);
+    __m128i v = _mm_load_si128((const __m128i*)values);
+    __m128i succeeded = _mm_and_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)Status::Success)));
+    __m128i failed = _mm_and_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)Status::Failure)));
+    v = select(succeeded, v, _mm_set1_epi8((char)Status::Failure));
+    v = select(failed, v, _mm_set1_epi8((char)Status::Success));
+    _mm_store_si128((__m128i*)values, v);
+}
+
+inline uint16_t LaneCounts::equal(uint16_t count) const noexcept
+{
+    __m128i c = _mm_set1_epi16((short)count);
+    __m128i low = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)values), c);
+    __m128i high = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(values + 8)), c);
+    return (uint16_t)_mm_movemask_epi8(_mm_packs_epi16(low, high));
+}
+
+inline void LaneCounts::fill(uint16_t count, uint16_t lanes) noexcept
+{
+    __m128i c = _mm_set1_epi16((short)count);
+    __m128i* low = (__m128i*)values;
+    __m128i* high = (__m128i*)(values + 8);
+    _mm_store_si128(low, select(laneWords((uint8_t)lanes), _mm_load_si128(low), c));
+    _mm_store_si128(high, select(laneWords((uint8_t)(lanes >> 8)), _mm_load_si128(high), c));
+}
+
+inline void LaneCounts::increment(uint16_t lanes) noexcept
+{
+    // Selected words are all ones, subtracting them adds one:
+    __m128i* low = (__m128i*)values;
+    __m128i* high = (__m128i*)(values + 8);
+    _mm_store_si128(low, _mm_sub_epi16(_mm_load_si128(low), laneWords((uint8_t)lanes)));
+    _mm_store_si128(high, _mm_sub_epi16(_mm_load_si128(high), laneWords((uint8_t)(lanes >> 8))));
+}
+
+#else
+
+inline uint16_t LaneStatuses::equal(Status status) const noexcept
+{
+    uint16_t lanes = 0;
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        lanes |= (uint16_t)(values[lane] == status) << lane;
+    return lanes;
+}
+
+inline void LaneStatuses::assign(const LaneStatuses& statuses, uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        if (lanes >> lane & 1)
+            values[lane] = statuses.values[lane];
+}
+
+inline void LaneStatuses::fill(Status status, uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        if (lanes >> lane & 1)
+            values[lane] = status;
+}
+
+inline void LaneStatuses::negate(uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+    {
+        if (!(lanes >> lane & 1))
+            continue;
+        if (values[lane] == Status::Success)
+            values[lane] = Status::Failure;
+        else if (values[lane] == Status::Failure)
+            values[lane] = Status::Success;
+    }
+}
+
+inline uint16_t LaneCounts::equal(uint16_t count) const noexcept
+{
+    uint16_t lanes = 0;
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        lanes |= (uint16_t)(values[lane] == count) << lane;
+    return lanes;
+}
+
+inline void LaneCounts::fill(uint16_t count, uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        if (lanes >> lane & 1)
+            values[lane] = count;
+}
+
+inline void LaneCounts::increment(uint16_t lanes) noexcept
+{
+    for (uint32_t lane = 0; lane < 16; ++lane)
+        values[lane] += lanes >> lane & 1;
+}
+
+#endif
+
+
+inline Lockstep::Lockstep(const BehaviorTree& tree)
+{
+    if (!compile(tree.root))
+    {
+        program.clear();
+        counterCount = 0;
+    }
+}
+
+inline bool Lockstep::compile(const Node* node)
+{
+    const uint32_t index = (uint32_t)program.size();
+    program.push_back(Instruction());
+    Instruction instruction = Instruction();
+
+    const std::type_info& type = typeid(*node);
+    if (type == typeid(Sequence) || type == typeid(Selector) || type == typeid(Parallel))
+    {
+        const Composite* composite = static_cast<const Composite*>(node);
+        instruction.opcode = type == typeid(Sequence) ? Opcode::Sequence : type == typeid(Selector) ? Opcode::Selector : Opcode::Parallel;
+        instruction.childCount = composite->childCount;
+        instruction.counters = counterCount;
+        if (instruction.opcode == Opcode::Parallel)
+        {
+            // Successes, failures and completed children:
+            const Parallel* parallel = static_cast<const Parallel*>(node);
+            instruction.successOne = parallel->successPolicy == Parallel::Policy::RequireOne;
+            instruction.failureOne = parallel->failurePolicy == Parallel::Policy::RequireOne;
+            counterCount += 3;
+        }
+        else
+        {
+            // Index of the current child:
+            counterCount += 1;
+        }
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            if (!compile(composite->children()[i]))
+                return false;
+    }
+    else if (type == typeid(Negate))
+    {
+        instruction.opcode = Opcode::Negate;
+        instruction.childCount = 1;
+        if (!compile(static_cast<const Negate*>(node)->child()))
+            return false;
+    }
+    else if (type == typeid(Constant))
+    {
+        instruction.opcode = Opcode::Constant;
+        instruction.constant = static_cast<const Constant*>(node)->result;
+    }
+    else if (type == typeid(Condition) || type == typeid(PureCondition))
+    {
+        instruction.opcode = Opcode::Condition;
+        instruction.condition = static_cast<const Condition*>(node)->check;
+    }
+    else if (type == typeid(Action))
+    {
+        instruction.opcode = Opcode::Action;
+        instruction.action = static_cast<const Action*>(node)->action;
+    }
+    else if (type == typeid(AgentCondition))
+    {
+        instruction.opcode = Opcode::AgentCondition;
+        instruction.agentCondition = static_cast<const AgentCondition*>(node)->check;
+    }
+    else if (type == typeid(AgentAction))
+    {
+        instruction.opcode = Opcode::AgentAction;
+        instruction.agentAction = static_cast<const AgentAction*>(node)->action;
+    }
+    else
+    {
+        raise("BehaviorTree Lockstep definitions may only hold composites, negations and synchronous leaves.");
+        return false;
+    }
+
+    instruction.end = (uint32_t)program.size();
+    program[index] = instruction;
+    return true;
+}
+
+inline size_t Lockstep::add(void* agent)
+{
+    if (agentCount % Lanes == 0)
+    {
+        blocks.emplace_back();
+        blocks.back().running.resize(program.size());
+        blocks.back().counters.resize(counterCount);
+    }
+
+    Block& block = blocks.back();
+    const uint32_t lane = agentCount % Lanes;
+    block.agents[lane] = agent;
+    block.statuses.values[lane] = Status::Initial;
+    block.lanes |= (uint16_t)(1u << lane);
+    return agentCount++;
+}
+
+inline void Lockstep::tick()
+{
+    if (program.empty())
+        return;
+    for (Block& block : blocks)
+        run(block, 0, block.lanes, block.statuses);
+}
+
+inline void Lockstep::stop() noexcept
+{
+    for (Block& block : blocks)
+    {
+        std::fill(block.running.begin(), block.running.end(), 0);
+        block.statuses.fill(Status::Failure, block.lanes);
+    }
+}
+
+inline void Lockstep::run(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const
+{
+    const Instruction& instruction = program[index];
+    switch (instruction.opcode)
+    {
+        case Opcode::Sequence:
+        case Opcode::Selector:
+            runSequence(block, index, lanes, result);
+            break;
+        case Opcode::Parallel:
+            runParallel(block, index, lanes, result);
+            break;
+        case Opcode::Negate:
+            run(block, index + 1, lanes, result);
+            result.negate(lanes);
+            break;
+        default:
+            runLeaf(block, instruction, lanes, result);
+            break;
+    }
+
+    uint16_t& running = block.running[index];
+    running = (running & ~lanes) | (lanes & result.equal(Status::Running));
+}
+
+inline void Lockstep::runLeaf(const Block& block, const Instruction& instruction, uint16_t lanes, LaneStatuses& result) const
+{
+    if (instruction.opcode == Opcode::Constant)
+    {
+        result.fill(instruction.constant, lanes);
+        return;
+    }
+
+    for (uint32_t lane = 0; lane < Lanes; ++lane)
+    {
+        if (!(lanes >> lane & 1))
+            continue;
+
+        Status status;
+        BEHAVIOR_TREE_TRY
+        {
+            switch (instruction.opcode)
+            {
+                case Opcode::Condition: status = instruction.condition() ? Status::Success : Status::Failure; break;
+                case Opcode::Action: status = instruction.action(); break;
+                case Opcode::AgentCondition: status = instruction.agentCondition(block.agents[lane]) ? Status::Success : Status::Failure; break;
+                default: status = instruction.agentAction(block.agents[lane]); break;
+            }
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            status = Status::Failure;
+        }
+        result.values[lane] = status == Status::Running || status == Status::Success ? status : Status::Failure;
+    }
+}
+
+inline void Lockstep::runSequence(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const
+{
+    // Sequences move on while their children succeed, selectors while they fail:
+    const Instruction& instruction = program[index];
+    const Status next = instruction.opcode == Opcode::Sequence ? Status::Success : Status::Failure;
+    LaneCounts& current = block.counters[instruction.counters];
+    current.fill(0, lanes & ~block.running[index]);
+
+    LaneStatuses statuses;
+    uint16_t pending = lanes;
+    uint32_t child = index + 1;
+    for (uint16_t i = 0; i < instruction.childCount && pending; ++i, child = program[child].end)
+    {
+        // Lanes resuming a running child join the ones that moved past the previous children:
+        const uint16_t active = pending & current.equal(i);
+        if (!active)
+            continue;
+
+        run(block, child, active, statuses);
+        const uint16_t moving = active & statuses.equal(next);
+        const uint16_t stopped = active & ~moving;
+        result.assign(statuses, stopped);
+        current.increment(moving);
+        pending &= ~stopped;
+    }
+
+    // Lanes that went through all children end with the last child's status:
+    result.fill(next, pending);
+}
+
+inline void Lockstep::runParallel(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const
+{
+    const Instruction& instruction = program[index];
+    LaneCounts& successes = block.counters[instruction.counters];
+    LaneCounts& failures = block.counters[instruction.counters + 1];
+    LaneCounts& completed = block.counters[instruction.counters + 2];
+
+    // Starting lanes run every child, resuming ones only the children that were left running:
+    const uint16_t starting = lanes & ~block.running[index];
+    successes.fill(0, starting);
+    failures.fill(0, starting);
+    completed.fill(0, starting);
+
+    LaneStatuses statuses;
+    uint16_t pending = lanes;
+    uint32_t child = index + 1;
+    for (uint16_t i = 0; i < instruction.childCount && pending; ++i, child = program[child].end)
+    {
+        const uint16_t active = pending & (starting | block.running[child]);
+        if (!active)
+            continue;
+
+        run(block, child, active, statuses);
+        const uint16_t succeeded = active & statuses.equal(Status::Success);
+        const uint16_t failed = active & statuses.equal(Status::Failure);
+        successes.increment(succeeded);
+        failures.increment(failed);
+        completed.increment(succeeded | failed);
+
+        // Same order of policies as Parallel::onComplete():
+        const uint16_t finished = active & completed.equal(instruction.childCount);
+        uint16_t success = instruction.successOne ? succeeded : 0;
+        uint16_t failure = instruction.failureOne ? failed & ~success : 0;
+        uint16_t rest = active & ~success & ~failure;
+        if (!instruction.failureOne)
+            failure |= rest & failures.equal(instruction.childCount);
+        rest &= ~failure;
+        if (!instruction.successOne)
+            success |= rest & successes.equal(instruction.childCount);
+        rest &= ~success;
+        failure |= rest & finished;
+
+        const uint16_t done = success | failure;
+        if (!done)
+            continue;
+
+        // Children still running in the finished lanes are abandoned:
+        result.fill(Status::Success, success);
+        result.fill(Status::Failure, failure);
+        pending &= ~done;
+        for (uint32_t node = index + 1; node < instruction.end; ++node)
+            block.running[node] &= ~done;
+    }
+
+    result.fill(Status::Running, pending);
+}
+
+}
@@ -0,0 +1,170 @@
+
+#ifndef BEHAVIOR_TREE_LOCKSTEP_H
+#define BEHAVIOR_TREE_LOCKSTEP_H
+
+#include <cstdint>
+#include "errors.hpp"
+#include <vector>
+#include "nodes.hpp"
+#include "tree.hpp"
+
+// SSE2 is used wherever it is available, defining BEHAVIOR_TREE_NO_SIMD forces the scalar lanes:
+#if !defined(BEHAVIOR_TREE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BEHAVIOR_TREE_LOCKSTEP_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace bt
+{
+
+typedef bool (*AgentConditionFunction) (void* agent);
+typedef Status (*AgentActionFunction) (void* agent);
+
+// Leaves taking the agent they act on. A tree ticked on its own passes the agent given to the node,
+// a Lockstep batch passes the agent of each of its lanes instead:
+class AgentCondition : public NamedNode
+{
+public:
+    AgentCondition(const char* name, AgentConditionFunction check, void* agent)
+        : NamedNode(name), check(check), agent(agent) {}
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return check(agent) ? Status::Success : Status::Failure;
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    AgentConditionFunction check;
+    void* agent;
+};
+
+
+class AgentAction : public NamedNode
+{
+public:
+    AgentAction(const char* name, AgentActionFunction action, void* agent)
+        : NamedNode(name), action(action), agent(agent) {}
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return action(agent);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    AgentActionFunction action;
+    void* agent;
+};
+
+
+// Per lane values of a Lockstep block, lanes are selected by the bits of a mask:
+struct LaneStatuses
+{
+    uint16_t equal(Status status) const noexcept;
+    void assign(const LaneStatuses& statuses, uint16_t lanes) noexcept;
+    void fill(Status status, uint16_t lanes) noexcept;
+    // Swaps Success and Failure:
+    void negate(uint16_t lanes) noexcept;
+
+    alignas(16) Status values[16];
+};
+
+struct LaneCounts
+{
+    uint16_t equal(uint16_t count) const noexcept;
+    void fill(uint16_t count, uint16_t lanes) noexcept;
+    void increment(uint16_t lanes) noexcept;
+
+    alignas(16) uint16_t values[16];
+};
+
+
+// Runs one tree definition for many agents, advancing blocks of 16 agents in lockstep. Every
+// composite is visited once per block and tick, with the lanes that reach it in a mask, and
+// the progress of all 16 lanes is updated with SIMD operations. Leaves are still called once
+// per agent. The definition may only hold sequences, selectors, parallels, negations, constants
+// and synchronous conditions and actions, leaves returning neither Running nor Success fail.
+class Lockstep
+{
+public:
+    static const uint32_t Lanes = 16;
+
+    // Copies the tree's definition, it can be destroyed afterwards. Without exceptions, an
+    // unsupported definition is reported and leaves an invalid Lockstep that never ticks:
+    explicit Lockstep(const BehaviorTree& tree);
+    bool valid() const noexcept { return !program.empty(); }
+
+    // Adds an agent running the definition from its start, returns its index:
+    size_t add(void* agent);
+    size_t size() const noexcept { return agentCount; }
+
+    void tick();
+    // Abandons the progress of all agents, they start over on the next tick:
+    void stop() noexcept;
+
+    // Agents waiting on a running leaf are Running, where a tree ticked on its own is Suspended:
+    Status status(size_t agent) const noexcept { return blocks[agent / Lanes].statuses.values[agent % Lanes]; }
+private:
+    enum class Opcode : uint8_t { Sequence, Selector, Parallel, Negate, Constant, Condition, Action, AgentCondition, AgentAction };
+
+    struct Instruction
+    {
+        Opcode opcode;
+        bool successOne;
+        bool failureOne;
+        Status constant;
+        uint16_t childCount;
+        // One past the last instruction of the subtree, so the next sibling:
+        uint32_t end;
+        // First of the node's LaneCounts in a block:
+        uint32_t counters;
+        union
+        {
+            ConditionFunction condition;
+            ActionFunction action;
+            AgentConditionFunction agentCondition;
+            AgentActionFunction agentAction;
+        };
+    };
+
+    struct Block
+    {
+        uint16_t lanes = 0;
+        void* agents[Lanes] = {};
+        LaneStatuses statuses;
+        // One bit per lane for the instructions left running on the previous tick:
+        std::vector<uint16_t> running;
+        std::vector<LaneCounts> counters;
+    };
+
+    // Returns false for definitions holding unsupported nodes:
+    bool compile(const Node* node);
+    void run(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const;
+    void runLeaf(const Block& block, const Instruction& instruction, uint16_t lanes, LaneStatuses& result) const;
+    void runSequence(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const;
+    void runParallel(Block& block, uint32_t index, uint16_t lanes, LaneStatuses& result) const;
+
+    std::vector<Instruction> program;
+    std::vector<Block> blocks;
+    uint32_t counterCount = 0;
+    size_t agentCount = 0;
+};
+
+}
+
+#endif
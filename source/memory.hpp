@@ -2,62 +2,328 @@
 #ifndef BEHAVIOR_TREE_MEMORY_H
 #define BEHAVIOR_TREE_MEMORY_H
 
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "nodes.hpp"
+#include "scheduler.hpp"
+#include "links.hpp"
+#include "errors.hpp"
+#include "ownership.hpp"
 
 namespace bt
 {
 
-class Memory
+class Memory : public RefCounted
 {
+    // Precedes every object with a non-trivial destructor in the buffer:
+    struct Destructor
+    {
+        void (*destroy)(Destructor* entry);
+        Link<Destructor> previous;
+    };
 public:
+    typedef const Destructor* Marker;
+
     Memory(const size_t maxBytes)
         : buffer(new uint8_t[maxBytes]), maxBytes(maxBytes) {}
 
-    Memory(const Memory& m)
-        : buffer(new uint8_t[m.maxBytes]), maxBytes(m.maxBytes), offset(m.offset)
-    {
-        if (offset > 0)
-            memcpy(buffer, m.buffer, offset);
-    }
+    // A measuring Memory has no buffer, it only counts the bytes its allocations would take:
+    struct Measure {};
+    explicit Memory(Measure)
+        : buffer(nullptr), maxBytes(SIZE_MAX) {}
+
+    // Objects in the buffer are not relocatable, so a Memory can't be copied:
+    Memory(const Memory& m) = delete;
 
     Memory(Memory&& m) noexcept
-        : buffer(m.buffer), offset(m.offset), maxBytes(m.maxBytes)
+        : buffer(m.buffer), offset(m.offset), maxBytes(m.maxBytes), destructors(m.destructors)
     {
         m.buffer = nullptr;
+        m.destructors = nullptr;
     }
 
-    ~Memory() { delete[] buffer; }
+    ~Memory()
+    {
+        reset();
+        delete[] buffer;
+    }
 
     size_t size() const { return offset; }
     size_t maxSize() const { return maxBytes; }
+    const uint8_t* data() const { return buffer; }
+    bool measuring() const noexcept { return buffer == nullptr; }
 
+    // Returns nullptr without constructing anything when measuring:
     template <typename T, typename... Args>
     T* allocate(Args&&... args)
     {
-        size_t size = sizeof(T);
-        if ((offset + size) >= maxBytes)
-            throw std::runtime_error("BehaviorTree Memory capacity exceeded.");
-		T* instance = new ((void*)((uintptr_t)buffer + offset)) T(std::forward<Args>(args)...);
-        offset += size;
+        const bool trivial = std::is_trivially_destructible<T>::value;
+        void* entryMemory = trivial ? nullptr : allocateBytes(sizeof(Destructor), alignof(Destructor));
+        void* instanceMemory = allocateBytes(sizeof(T), alignof(T));
+        if (measuring() || !instanceMemory || (!trivial && !entryMemory))
+            return nullptr;
+
+        T* instance = new (instanceMemory) T(std::forward<Args>(args)...);
+        if (!trivial)
+            destructors = new (entryMemory) Destructor{&destroy<T>, destructors};
         return instance;
     }
 
     template <typename T>
     T* allocateArray(int length)
     {
-        size_t size = sizeof(T) * length;
-        if ((offset + size) >= maxBytes)
-            throw std::runtime_error("BehaviorTree Memory capacity exceeded.");
-		T* instance = new ((void*)((uintptr_t)buffer + offset)) T [length];
-        offset += size;
-        return instance;
+        void* arrayMemory = allocateBytes(sizeof(T) * length, alignof(T));
+        return arrayMemory ? new (arrayMemory) T [length] : nullptr;
+    }
+
+    // Measuring aligns offsets from address zero, which matches any buffer aligned to max_align_t:
+    void* allocateBytes(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        void* address = tryAllocateBytes(size, alignment);
+        if (!address && !measuring())
+            raise("BehaviorTree Memory capacity exceeded.");
+        return address;
+    }
+
+    // Like allocateBytes(), but returns nullptr without reporting an error once the buffer is full:
+    void* tryAllocateBytes(size_t size, size_t alignment = alignof(std::max_align_t)) noexcept
+    {
+        uintptr_t address = align((uintptr_t)buffer + offset, alignment);
+        size_t start = address - (uintptr_t)buffer;
+        if (start + size > maxBytes)
+            return nullptr;
+        offset = start + size;
+        return measuring() ? nullptr : (void*)address;
+    }
+
+    // Marks the current end of the objects allocated so far:
+    Marker mark() const noexcept { return destructors; }
+
+    // Destroys the objects allocated between the two marks, their memory is reclaimed by reset():
+    void destroy(Marker begin, Marker end) noexcept
+    {
+        for (Destructor* entry = const_cast<Destructor*>(end); entry && entry != begin; entry = entry->previous)
+        {
+            if (entry->destroy)
+                entry->destroy(entry);
+            entry->destroy = nullptr;
+        }
+    }
+
+    // Position of the next allocation, rewind() releases everything allocated after it:
+    struct Position
+    {
+        size_t offset;
+        Marker marker;
+    };
+
+    Position position() const noexcept { return Position{offset, destructors}; }
+
+    void rewind(const Position& position) noexcept
+    {
+        destroy(position.marker, destructors);
+        destructors = const_cast<Destructor*>(position.marker);
+        offset = position.offset;
+    }
+
+    // Destroys all objects still alive in the buffer and rewinds it so it can be reused:
+    void reset() noexcept
+    {
+        destroy(nullptr, destructors);
+        destructors = nullptr;
+        offset = 0;
     }
 
 private:
+    static uintptr_t align(uintptr_t address, size_t alignment) noexcept
+    {
+        return (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+
+    template <typename T>
+    static void destroy(Destructor* entry) noexcept
+    {
+        T* instance = (T*)align((uintptr_t)(entry + 1), alignof(T));
+        destroyObject(instance, std::is_base_of<Node, T>());
+    }
+
+    // Nodes are destroyed through their public virtual destructor, derived ones may be protected:
+    static void destroyObject(Node* node, std::true_type) noexcept { node->~Node(); }
+
+    template <typename T>
+    static void destroyObject(T* instance, std::false_type) noexcept { instance->~T(); }
+
 	uint8_t* buffer;
     size_t offset = 0;
     const size_t maxBytes;
+    Destructor* destructors = nullptr;
+};
+
+
+// Standard allocator handing out Memory from an arena, deallocation is a no-op:
+template <typename T>
+class MemoryAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit MemoryAllocator(Memory& memory) noexcept : memory(&memory) {}
+
+    template <typename U>
+    MemoryAllocator(const MemoryAllocator<U>& allocator) noexcept : memory(allocator.memory) {}
+
+    T* allocate(size_t length) { return (T*)memory->allocateBytes(sizeof(T) * length, alignof(T)); }
+    void deallocate(T* instance, size_t length) noexcept {}
+
+    template <typename U>
+    bool operator==(const MemoryAllocator<U>& allocator) const noexcept { return memory == allocator.memory; }
+    template <typename U>
+    bool operator!=(const MemoryAllocator<U>& allocator) const noexcept { return memory != allocator.memory; }
+
+    Memory* memory;
+};
+
+
+// Recycles Memory arenas in power of two size classes, each with the scheduler of its
+// trees. Released arenas are reset and kept for the next acquire(), and the control blocks
+// of references to them, their scheduler and their trees are taken from the arena, so
+// building, ticking and destroying short lived trees doesn't allocate once the pool is warm.
+// The pool must outlive its arenas.
+class MemoryPool
+{
+public:
+    MemoryPool() = default;
+    MemoryPool(const MemoryPool&) = delete;
+
+    // Standard allocator for control blocks, taken from the arena while it has room and from
+    // the heap after. Pooled arenas outlive the control blocks they hold:
+    template <typename T>
+    class ControlBlockAllocator
+    {
+    public:
+        typedef T value_type;
+
+        explicit ControlBlockAllocator(Memory& memory) noexcept : memory(&memory) {}
+
+        template <typename U>
+        ControlBlockAllocator(const ControlBlockAllocator<U>& allocator) noexcept : memory(allocator.memory) {}
+
+        T* allocate(size_t length)
+        {
+            if (void* block = memory->tryAllocateBytes(sizeof(T) * length, alignof(T)))
+                return (T*)block;
+            return (T*)::operator new(sizeof(T) * length);
+        }
+
+        void deallocate(T* instance, size_t length) noexcept
+        {
+            const uint8_t* address = (const uint8_t*)instance;
+            if (address < memory->data() || address >= memory->data() + memory->maxSize())
+                ::operator delete(instance);
+        }
+
+        template <typename U>
+        bool operator==(const ControlBlockAllocator<U>& allocator) const noexcept { return memory == allocator.memory; }
+        template <typename U>
+        bool operator!=(const ControlBlockAllocator<U>& allocator) const noexcept { return memory != allocator.memory; }
+
+        Memory* memory;
+    };
+
+    ~MemoryPool()
+    {
+        for (auto& arenas : freeArenas)
+            for (PooledMemory* memory : arenas)
+                delete memory;
+    }
+
+    Ref<Memory> acquire(size_t maxBytes)
+    {
+        // Leave room for the shared_ptr control block allocated from the arena:
+        maxBytes += ControlBlockBytes;
+
+        size_t sizeClass = 0;
+        while ((MinBytes << sizeClass) < maxBytes)
+            ++sizeClass;
+        if (sizeClass >= freeArenas.size())
+            freeArenas.resize(sizeClass + 1);
+
+        PooledMemory* memory;
+        std::vector<PooledMemory*>& arenas = freeArenas[sizeClass];
+        if (arenas.size())
+        {
+            memory = arenas.back();
+            arenas.pop_back();
+        }
+        else
+        {
+            memory = new PooledMemory(MinBytes << sizeClass, *this, sizeClass);
+        }
+
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+        return adopt<PooledMemory, &MemoryPool::release>(memory);
+#else
+        // The control block lives at the start of the arena, it is only released after the
+        // deleter has reset the arena, which leaves its bytes untouched until the next acquire():
+        return std::shared_ptr<Memory>(memory, &MemoryPool::release, ControlBlockAllocator<Memory>(*memory));
+#endif
+    }
+
+    size_t available() const noexcept
+    {
+        size_t count = 0;
+        for (auto& arenas : freeArenas)
+            count += arenas.size();
+        return count;
+    }
+
+    friend class Builder;
+private:
+    struct PooledMemory : public Memory
+    {
+        PooledMemory(size_t maxBytes, MemoryPool& pool, size_t sizeClass)
+            : Memory(maxBytes), pool(&pool), sizeClass(sizeClass) {}
+
+        MemoryPool* pool;
+        size_t sizeClass;
+        // Created for the first builder of the arena, its queues keep their storage between trees:
+        std::unique_ptr<Scheduler> scheduler;
+    };
+
+    // The scheduler of an arena acquired from this pool, released before the arena by its trees:
+    Ref<Scheduler> scheduler(Memory& memory, const size_t initialSize)
+    {
+        PooledMemory& pooled = static_cast<PooledMemory&>(memory);
+        if (!pooled.scheduler)
+            pooled.scheduler.reset(new Scheduler(initialSize));
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+        return adopt<Scheduler, &MemoryPool::recycle>(pooled.scheduler.get());
+#else
+        return std::shared_ptr<Scheduler>(pooled.scheduler.get(), &MemoryPool::recycle, ControlBlockAllocator<Scheduler>(memory));
+#endif
+    }
+
+    static const size_t MinBytes = 256;
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    static const size_t ControlBlockBytes = 0;
+#else
+    // Room for the control blocks of the arena, its scheduler and one tree:
+    static const size_t ControlBlockBytes = 192;
+#endif
+
+    static void release(PooledMemory* memory) noexcept
+    {
+        memory->reset();
+        memory->pool->freeArenas[memory->sizeClass].push_back(memory);
+    }
+
+    static void recycle(Scheduler* scheduler) noexcept { scheduler->recycle(); }
+
+    std::vector<std::vector<PooledMemory*>> freeArenas;
 };
 
 }
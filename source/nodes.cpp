@@ -1,5 +1,6 @@
 
 #include "nodes.hpp"
+#include "state.hpp"
 #include "visitors.hpp"
 #include "scheduler.hpp"
 #include "tree.hpp"
@@ -12,10 +13,36 @@ inline void Node::traverse(Visitor& visitor) const
     visitor.visit(*this);
 }
 
+inline void Node::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    writer.write(nodeStatus);
+}
+
+inline void Node::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Status status = reader.read<Status>();
+    if (status > Status::Suspended)
+        reader.reject();
+    if (reader.validating())
+    {
+        reader.nodes.push_back(this);
+        return;
+    }
+
+    // The tree restores its run queue once all nodes are restored:
+    scheduler.setStatus(*this, status);
+    this->observer = observer;
+    partition = scheduler.currentPartition();
+}
+
 inline void SubTree::start(Scheduler& scheduler) noexcept
 {
+    // The root reports to its own tree, which forwards the result to this node:
     if (tree && tree->root)
-        scheduler.start(*tree->root, *this);
+    {
+        tree->parent = this;
+        scheduler.start(*tree->root, *tree);
+    }
 }
 
 inline void SubTree::stop(Scheduler& scheduler) noexcept
@@ -24,11 +51,6 @@ inline void SubTree::stop(Scheduler& scheduler) noexcept
         scheduler.stop(*tree->root);
 }
 
-inline void SubTree::onComplete(Scheduler& scheduler, const Node& root, Status status) noexcept
-{
-    scheduler.completed(*this, status);
-}
-
 inline void SubTree::traverse(Visitor& visitor) const
 {
     visitor.visit(*this);
@@ -40,22 +62,102 @@ inline void SubTree::traverseSubTree(Visitor& visitor) const
         tree->root->traverse(visitor);
 }
 
+inline void SubTree::saveState(StateWriter& writer, const Scheduler& scheduler) const
+{
+    Node::saveState(writer, scheduler);
+    if (tree && tree->root)
+        tree->root->saveState(writer, scheduler);
+}
+
+inline void SubTree::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    if (tree && tree->root)
+    {
+        // Like start(), only a running subtree reports to this node:
+        if (!reader.validating() && (status() == Status::Running || status() == Status::Suspended))
+            tree->parent = this;
+        tree->root->restoreState(reader, scheduler, tree.get());
+    }
+}
+
+inline void PureCondition::start(Scheduler& scheduler) noexcept
+{
+    BEHAVIOR_TREE_TRY
+    {
+        ConditionCache* cache = scheduler.conditionCache();
+        bool value = cache ? cache->evaluate(check, scheduler.generation()) : check();
+        result = value ? Status::Success : Status::Failure;
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+        result = Status::Failure;
+    }
+}
+
 inline void AsyncNode::start(class Scheduler& scheduler) noexcept
 {
     this->scheduler = &scheduler;
-    this->start();
+    release();
+
+    // Without a handle nothing could complete the node, so it fails when the table is full:
+    asyncHandle = Handles::acquire(this, HandleKind::Async);
+    if (asyncHandle)
+        this->start();
 }
 
+// The handle is released first, completing may already start the node's next run:
 inline void AsyncNode::succeeded() noexcept
 {
     if (status() == Status::Suspended && this->scheduler)
+    {
+        release();
         this->scheduler->completed(*this, Status::Success);
+    }
 }
 
 inline void AsyncNode::failed() noexcept
 {
     if (status() == Status::Suspended && this->scheduler)
+    {
+        release();
         this->scheduler->completed(*this, Status::Failure);
+    }
+}
+
+inline bool AsyncNode::succeeded(Handle handle) noexcept
+{
+    AsyncNode* node = find(handle);
+    if (!node)
+        return false;
+    node->succeeded();
+    return true;
+}
+
+inline bool AsyncNode::failed(Handle handle) noexcept
+{
+    AsyncNode* node = find(handle);
+    if (!node)
+        return false;
+    node->failed();
+    return true;
+}
+
+inline void AsyncNode::release() noexcept
+{
+    Handles::release(asyncHandle);
+    asyncHandle = 0;
+}
+
+inline void AsyncNode::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    Node::restoreState(reader, scheduler, observer);
+    if (reader.validating())
+        return;
+    this->scheduler = &scheduler;
+    release();
+    if (status() == Status::Suspended)
+        asyncHandle = Handles::acquire(this, HandleKind::Async);
 }
 
 }
@@ -4,22 +4,50 @@
 
 #include <memory>
 #include "status.hpp"
+#include "errors.hpp"
+#include "links.hpp"
+#include "ownership.hpp"
+#include "handles.hpp"
 
 namespace bt
 {
 
-class Node
+// Run queue of a Scheduler a node is queued in, one per tree. Compact nodes only have a byte
+// left for it, so a compact scheduler with more than 255 live trees shares partitions:
+#if defined(BEHAVIOR_TREE_COMPACT)
+typedef uint8_t Partition;
+#else
+typedef uint16_t Partition;
+#endif
+
+
+class Observer
+{
+public:
+    friend class Scheduler;
+protected:
+    virtual void onComplete(class Scheduler& scheduler, const class Node& node, Status status) noexcept = 0;
+};
+
+
+// Nodes are their own observers so composites and decorators need a single vtable pointer:
+class Node : public Observer
 {
 public:
     virtual const char* name() const noexcept { return "Node"; }
     Status status() const noexcept { return nodeStatus; }
     virtual void traverse(class Visitor& visitor) const;
+    virtual void saveState(class StateWriter& writer, const class Scheduler& scheduler) const;
+    virtual void restoreState(class StateReader& reader, class Scheduler& scheduler, class Observer* observer);
     virtual ~Node() {}
     friend class Scheduler;
 protected:
     virtual void start(class Scheduler& scheduler) noexcept {}
     virtual Status update() noexcept = 0;
     virtual void stop(class Scheduler& scheduler) noexcept {}
+    // Synchronous nodes only complete from update() and can be ticked in place by their parent:
+    virtual bool synchronous() const noexcept { return false; }
+    virtual void onComplete(class Scheduler& scheduler, const Node& child, Status status) noexcept override {}
 private:
     void tick(class Scheduler& scheduler) noexcept
     {
@@ -28,45 +56,44 @@ private:
         nodeStatus = update();
         // std::cout << "Tick Node: " << name() << " " << nodeStatus << std::endl;
     }
+    // The status and partition are last so derived classes can pack small members into the padding after them:
+    Link<Observer> observer = nullptr;
     Status nodeStatus = Status::Initial;
-    class Observer* observer = nullptr;
-};
-
-
-class Observer
-{
-public:
-    friend class Scheduler;
-protected:
-    virtual void onComplete(class Scheduler& scheduler, const Node& node, Status status) noexcept = 0;
+    Partition partition = 0;
 };
 
 
+// Defining BEHAVIOR_TREE_STRIP_NAMES compiles node names out of release builds:
 class NamedNode: public Node
 {
 public:
+#if defined(BEHAVIOR_TREE_STRIP_NAMES)
+    NamedNode(const char* name) {}
+#else
     NamedNode(const char* name) : nodeName(name) {}
     virtual const char* name() const noexcept override { return nodeName; }
 private:
     const char* nodeName;
+#endif
 };
 
 
-class SubTree : public NamedNode, public Observer
+class SubTree : public NamedNode
 {
 public:
-    SubTree(const char* name, const std::shared_ptr<class BehaviorTree>& tree)
+    SubTree(const char* name, const Ref<class BehaviorTree>& tree)
         : NamedNode(name), tree(tree) {}
 
     virtual void traverse(Visitor& visitor) const override;
     void traverseSubTree(Visitor& visitor) const;
+    virtual void saveState(StateWriter& writer, const Scheduler& scheduler) const override;
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
 protected:
     virtual void start(class Scheduler& scheduler) noexcept override;
     virtual Status update() noexcept override { return Status::Suspended; }
     virtual void stop(class Scheduler& scheduler) noexcept override;
-    virtual void onComplete(class Scheduler& scheduler, const Node& root, Status status) noexcept override;
 private:
-    std::shared_ptr<class BehaviorTree> tree;
+    Ref<class BehaviorTree> tree;
 };
 
 
@@ -77,23 +104,57 @@ class Condition: public NamedNode
 public:
     Condition(const char* name, ConditionFunction check)
         : NamedNode(name), check(check) {}
+    friend class Builder;
+    friend class Lockstep;
 protected:
+    virtual bool synchronous() const noexcept override { return true; }
     virtual Status update() noexcept override
     {
-        try
+        BEHAVIOR_TREE_TRY
         {
             return check() ? Status::Success : Status::Failure;
         }
-        catch (...)
+        BEHAVIOR_TREE_CATCH
         {
             return Status::Failure;
         }
     }
-private:
+
     ConditionFunction check;
 };
 
 
+// Condition without side effects whose result can only change between ticks. Its check
+// runs at most once per tick through the scheduler's ConditionCache when it has one:
+class PureCondition : public Condition
+{
+public:
+    using Condition::Condition;
+protected:
+    virtual void start(class Scheduler& scheduler) noexcept override;
+    virtual Status update() noexcept override { return result; }
+private:
+    Status result = Status::Failure;
+};
+
+
+// Leaf with a fixed result, the Optimizer folds it into its parents:
+class Constant : public Node
+{
+public:
+    explicit Constant(Status status) : result(status) {}
+    virtual const char* name() const noexcept override { return statusName(result); }
+    friend class Optimizer;
+    friend class Builder;
+    friend class Lockstep;
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override { return result; }
+private:
+    Status result;
+};
+
+
 typedef Status (*ActionFunction) ();
 
 class Action : public NamedNode
@@ -101,14 +162,16 @@ class Action : public NamedNode
 public:
     Action(const char* name, ActionFunction action)
         : NamedNode(name), action(action) {}
+    friend class Lockstep;
 protected:
+    virtual bool synchronous() const noexcept override { return true; }
     virtual Status update() noexcept override
     {
-        try
+        BEHAVIOR_TREE_TRY
         {
             return action();
         }
-        catch (...)
+        BEHAVIOR_TREE_CATCH
         {
             return Status::Failure;
         }
@@ -121,15 +184,28 @@ private:
 class AsyncNode: public Node
 {
 public:
+    virtual ~AsyncNode() override { Handles::release(asyncHandle); }
     virtual const char* name() const noexcept override { return "Async Node"; }
     void succeeded() noexcept;
     void failed() noexcept;
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+
+    // Valid until the node completes or is stopped, so work that outlives the node, or its
+    // run, completes through the handle instead of a reference. Late completions return false:
+    Handle handle() const noexcept { return asyncHandle; }
+    static AsyncNode* find(Handle handle) noexcept { return (AsyncNode*)Handles::get(handle, HandleKind::Async); }
+    static bool succeeded(Handle handle) noexcept;
+    static bool failed(Handle handle) noexcept;
 protected:
     virtual void start() noexcept = 0;
     virtual void start(class Scheduler& scheduler) noexcept override;
-    virtual Status update() noexcept override { return Status::Suspended; }
+    virtual Status update() noexcept override { return asyncHandle ? Status::Suspended : Status::Failure; }
+    virtual void stop(class Scheduler& scheduler) noexcept override { release(); }
+    void release() noexcept;
 private:
+
     class Scheduler* scheduler;
+    Handle asyncHandle = 0;
 };
 
 
@@ -138,17 +214,22 @@ typedef void (*AsyncActionFunction) (class AsyncAction&);
 class AsyncAction : public AsyncNode
 {
 public:
+#if defined(BEHAVIOR_TREE_STRIP_NAMES)
+    AsyncAction(const char* name, AsyncActionFunction onStart, AsyncActionFunction onStop = nullptr)
+        : onStart(onStart), onStop(onStop) {}
+#else
     AsyncAction(const char* name, AsyncActionFunction onStart, AsyncActionFunction onStop = nullptr)
         : nodeName(name), onStart(onStart), onStop(onStop) {}
     virtual const char* name() const noexcept override { return nodeName; }
+#endif
 protected:
     virtual void start() noexcept override
     {
-        try
+        BEHAVIOR_TREE_TRY
         {
             onStart(*this);
         }
-        catch (...)
+        BEHAVIOR_TREE_CATCH
         {
             failed();
         }
@@ -156,17 +237,20 @@ protected:
 
     virtual void stop(class Scheduler& scheduler) noexcept override
     {
-        try
+        BEHAVIOR_TREE_TRY
         {
             if (onStop)
                 onStop(*this);
         }
-        catch (...)
+        BEHAVIOR_TREE_CATCH
         {
         }
+        AsyncNode::stop(scheduler);
     }
 private:
+#if !defined(BEHAVIOR_TREE_STRIP_NAMES)
     const char* nodeName;
+#endif
     AsyncActionFunction onStart;
     AsyncActionFunction onStop;
 };
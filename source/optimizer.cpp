@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <typeinfo>
+#include "optimizer.hpp"
+
+namespace bt
+{
+
+inline Node* Optimizer::optimize(Node& root, Memory& memory, const std::vector<const Node*>& shared)
+{
+    this->memory = &memory;
+    this->shared = &shared;
+    before = count(&root);
+    Node* result = optimizeNode(&root);
+    after = count(result);
+    this->shared = nullptr;
+    return result;
+}
+
+inline Node* Optimizer::optimizeNode(Node* node)
+{
+    if (isShared(node))
+        return node;
+    if (Composite* composite = dynamic_cast<Composite*>(node))
+        return optimizeComposite(composite);
+    if (typeid(*node) == typeid(Negate))
+        return optimizeNegate(static_cast<Negate*>(node));
+    if (Decorator* decorator = dynamic_cast<Decorator*>(node))
+    {
+        // A node that can't be relinked keeps its original child, which is still equivalent:
+        Node* child = optimizeNode(decorator->child());
+        if (reachable(decorator, child))
+            decorator->setChild(child);
+    }
+    return node;
+}
+
+inline Node* Optimizer::optimizeComposite(Composite* composite)
+{
+    if (composite->childCount == 0)
+        return composite;
+
+    Link<Node>* children = composite->children();
+    for (uint16_t i = 0; i < composite->childCount; ++i)
+        children[i] = optimizeNode(children[i]);
+
+    std::vector<Node*> result;
+    Node* dropped = nullptr;
+    collectChildren(composite, true, result, dropped);
+    if (result.size() > composite->childCount)
+    {
+        Link<Node>* flattened = nullptr;
+        if (result.size() <= UINT16_MAX)
+        {
+            if (void* array = memory->tryAllocateBytes(sizeof(Link<Node>) * result.size(), alignof(Link<Node>)))
+                flattened = new (array) Link<Node>[result.size()];
+        }
+        if (flattened && reachable(composite, flattened))
+        {
+            composite->setChildren(flattened);
+            children = flattened;
+        }
+        else
+        {
+            collectChildren(composite, false, result, dropped);
+        }
+    }
+
+    // Only constants were left, the first skipped one has the composite's result:
+    if (result.empty())
+        return dropped;
+    if (result.size() == 1)
+        return result[0];
+
+    for (size_t i = 0; i < result.size(); ++i)
+        children[i] = result[i];
+    composite->childCount = (uint16_t)result.size();
+    return composite;
+}
+
+inline void Optimizer::collectChildren(Composite* composite, bool flatten, std::vector<Node*>& result, Node*& dropped) const
+{
+    result.clear();
+    dropped = nullptr;
+
+    // Sequences move past successful children and stop at failed ones, selectors the other way round:
+    const bool sequence = typeid(*composite) == typeid(Sequence);
+    const bool selector = typeid(*composite) == typeid(Selector);
+    const Status skipped = sequence ? Status::Success : Status::Failure;
+    const Status stopping = sequence ? Status::Failure : Status::Success;
+
+    Link<Node>* children = composite->children();
+    for (uint16_t i = 0; i < composite->childCount; ++i)
+    {
+        Node* child = children[i];
+        if (sequence || selector)
+        {
+            if (Constant* constant = dynamic_cast<Constant*>(child))
+            {
+                if (constant->result == skipped)
+                {
+                    if (!dropped)
+                        dropped = constant;
+                    continue;
+                }
+                if (constant->result == stopping)
+                {
+                    result.push_back(constant);
+                    return;
+                }
+            }
+            if (flatten && typeid(*child) == typeid(*composite) && static_cast<Composite*>(child)->childCount > 0)
+            {
+                // The nested composite is already folded, so only its last child can stop it:
+                Composite* nested = static_cast<Composite*>(child);
+                for (uint16_t j = 0; j < nested->childCount; ++j)
+                    result.push_back(nested->children()[j]);
+                Constant* last = dynamic_cast<Constant*>(result.back());
+                if (last && last->result == stopping)
+                    return;
+                continue;
+            }
+        }
+        result.push_back(child);
+    }
+}
+
+inline Node* Optimizer::optimizeNegate(Negate* negate)
+{
+    Node* child = optimizeNode(negate->child());
+    if (typeid(*child) == typeid(Negate))
+        return static_cast<Negate*>(child)->child();
+
+    // Only this negation reaches a constant that isn't shared, so it is inverted in place:
+    Constant* constant = dynamic_cast<Constant*>(child);
+    if (constant && !isShared(constant) && (constant->result == Status::Success || constant->result == Status::Failure))
+    {
+        constant->result = constant->result == Status::Success ? Status::Failure : Status::Success;
+        return constant;
+    }
+
+    if (reachable(negate, child))
+        negate->setChild(child);
+    return negate;
+}
+
+inline bool Optimizer::isShared(const Node* node) const
+{
+    return shared && std::binary_search(shared->begin(), shared->end(), node);
+}
+
+inline size_t Optimizer::count(const Node* node)
+{
+    size_t nodes = 1;
+    if (const Composite* composite = dynamic_cast<const Composite*>(node))
+    {
+        for (uint16_t i = 0; i < composite->childCount; ++i)
+            nodes += count(composite->children()[i]);
+    }
+    else if (const Decorator* decorator = dynamic_cast<const Decorator*>(node))
+    {
+        nodes += count(decorator->child());
+    }
+    return nodes;
+}
+
+}
@@ -0,0 +1,45 @@
+
+#ifndef BEHAVIOR_TREE_OPTIMIZER_H
+#define BEHAVIOR_TREE_OPTIMIZER_H
+
+#include <vector>
+#include "nodes.hpp"
+#include "decorators.hpp"
+#include "composites.hpp"
+#include "memory.hpp"
+
+namespace bt
+{
+
+// Rewrites a finished tree into an equivalent one with fewer nodes: nested sequences and
+// selectors are flattened into their parents, single child composites and double negations
+// are removed and constant children are folded. Removed nodes stay in the arena until the
+// tree is destroyed. Flattened child arrays are allocated from the Memory, composites it has
+// no room for left are kept as they are.
+class Optimizer
+{
+public:
+    // Nodes with several parents, sorted, are left as they are with their subtrees, since
+    // changing them would also change the other parents:
+    Node* optimize(Node& root, Memory& memory, const std::vector<const Node*>& shared = std::vector<const Node*>());
+
+    size_t nodesBefore() const noexcept { return before; }
+    size_t nodesAfter() const noexcept { return after; }
+private:
+    Node* optimizeNode(Node* node);
+    Node* optimizeComposite(Composite* composite);
+    Node* optimizeNegate(Negate* negate);
+    void collectChildren(Composite* composite, bool flatten, std::vector<Node*>& result, Node*& dropped) const;
+
+    bool isShared(const Node* node) const;
+    static size_t count(const Node* node);
+
+    Memory* memory = nullptr;
+    const std::vector<const Node*>* shared = nullptr;
+    size_t before = 0;
+    size_t after = 0;
+};
+
+}
+
+#endif
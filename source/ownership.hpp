@@ -0,0 +1,135 @@
+
+#ifndef BEHAVIOR_TREE_OWNERSHIP_H
+#define BEHAVIOR_TREE_OWNERSHIP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace bt
+{
+
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+
+// Reference count stored in the owned object itself. Defining
+// BEHAVIOR_TREE_SINGLE_THREADED makes the count a plain integer.
+class RefCounted
+{
+public:
+    typedef void (*Disposer)(RefCounted* object);
+
+    void retain() const noexcept
+    {
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        ++references;
+#else
+        references.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+    void release() const noexcept
+    {
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+        if (--references == 0)
+#else
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+#endif
+            disposer(const_cast<RefCounted*>(this));
+    }
+
+    void setDisposer(Disposer dispose) noexcept { disposer = dispose; }
+protected:
+    RefCounted() = default;
+    RefCounted(const RefCounted&) : references(0) {}
+    RefCounted& operator=(const RefCounted&) { return *this; }
+private:
+#if defined(BEHAVIOR_TREE_SINGLE_THREADED)
+    mutable uint32_t references = 0;
+#else
+    mutable std::atomic<uint32_t> references{0};
+#endif
+    Disposer disposer = nullptr;
+};
+
+
+template <typename T>
+class IntrusivePtr
+{
+public:
+    IntrusivePtr() noexcept : object(nullptr) {}
+    IntrusivePtr(std::nullptr_t) noexcept : object(nullptr) {}
+    explicit IntrusivePtr(T* object) noexcept : object(object) { if (object) object->retain(); }
+    IntrusivePtr(const IntrusivePtr& p) noexcept : object(p.object) { if (object) object->retain(); }
+    IntrusivePtr(IntrusivePtr&& p) noexcept : object(p.object) { p.object = nullptr; }
+    template <typename U>
+    IntrusivePtr(const IntrusivePtr<U>& p) noexcept : object(p.get()) { if (object) object->retain(); }
+    ~IntrusivePtr() { if (object) object->release(); }
+
+    IntrusivePtr& operator=(IntrusivePtr p) noexcept
+    {
+        T* previous = object;
+        object = p.object;
+        p.object = previous;
+        return *this;
+    }
+
+    T* get() const noexcept { return object; }
+    T* operator->() const noexcept { return object; }
+    T& operator*() const noexcept { return *object; }
+    explicit operator bool() const noexcept { return object != nullptr; }
+    bool operator==(std::nullptr_t) const noexcept { return object == nullptr; }
+    bool operator!=(std::nullptr_t) const noexcept { return object != nullptr; }
+private:
+    T* object;
+};
+
+template <typename T>
+using Ref = IntrusivePtr<T>;
+
+template <typename T, void (*Dispose)(T*)>
+void disposeRefCounted(RefCounted* object) { Dispose(static_cast<T*>(object)); }
+
+// Takes ownership of an object, Dispose is called once the last reference is released:
+template <typename T, void (*Dispose)(T*)>
+Ref<T> adopt(T* object)
+{
+    object->setDisposer(&disposeRefCounted<T, Dispose>);
+    return Ref<T>(object);
+}
+
+#else
+
+// Ownership goes through std::shared_ptr, the base is left empty:
+class RefCounted {};
+
+template <typename T>
+using Ref = std::shared_ptr<T>;
+
+template <typename T, void (*Dispose)(T*)>
+Ref<T> adopt(T* object)
+{
+    return Ref<T>(object, Dispose);
+}
+
+#endif
+
+// Dispose functions for heap objects and objects placed in an arena:
+template <typename T>
+void deleteObject(T* object) { delete object; }
+
+template <typename T>
+void destroyInPlace(T* object) { object->~T(); }
+
+template <typename T, typename... Args>
+Ref<T> makeRef(Args&&... args)
+{
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    return adopt<T, &deleteObject<T>>(new T(std::forward<Args>(args)...));
+#else
+    return std::make_shared<T>(std::forward<Args>(args)...);
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,176 @@
+
+#ifndef BEHAVIOR_TREE_QUERIES_H
+#define BEHAVIOR_TREE_QUERIES_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "nodes.hpp"
+
+namespace bt
+{
+
+typedef bool (*QueryCondition) (uint64_t key);
+typedef Status (*QueryAction) (uint64_t key);
+
+// Query results shared between agents, keyed by the query function and a user key such as
+// a target or a cell, and kept for a number of ticks of the cache's own clock. Lookups are
+// lock-free and may run on any number of threads. Every entry is guarded by a sequence
+// counter: readers treat a torn read as a miss, and a writer that finds the entry busy
+// skips storing its result. The clock and the sequence counters are 64-bit, so neither
+// wraps around and makes a stale or torn entry look valid.
+class QueryCache
+{
+public:
+    // The capacity is rounded up to a power of two, colliding queries evict each other.
+    // Counting hits and misses is opt-in, the shared counters are contended by every lookup:
+    explicit QueryCache(size_t capacity = 1024, bool countLookups = false) : counting(countLookups)
+    {
+        while (mask + 1 < capacity)
+            mask = (mask << 1) | 1;
+        entries.reset(new Entry[mask + 1]);
+    }
+
+    QueryCache(const QueryCache& cache) = delete;
+
+    // Advances the clock results expire by, usually once per frame:
+    void advance(uint32_t ticks = 1) noexcept { clock.fetch_add(ticks, std::memory_order_relaxed); }
+    uint64_t now() const noexcept { return clock.load(std::memory_order_relaxed); }
+
+    Status evaluate(QueryCondition query, uint64_t key, uint32_t ttl)
+    {
+        Status status;
+        if (find((uintptr_t)query, key, status))
+            return status;
+        status = query(key) ? Status::Success : Status::Failure;
+        store((uintptr_t)query, key, status, ttl);
+        return status;
+    }
+
+    Status evaluate(QueryAction query, uint64_t key, uint32_t ttl)
+    {
+        Status status;
+        if (find((uintptr_t)query, key, status))
+            return status;
+        status = query(key);
+        store((uintptr_t)query, key, status, ttl);
+        return status;
+    }
+
+    // Both stay 0 unless the cache counts its lookups:
+    size_t hits() const noexcept { return hitCount.load(std::memory_order_relaxed); }
+    size_t misses() const noexcept { return missCount.load(std::memory_order_relaxed); }
+private:
+    struct Entry
+    {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> expires{0};
+        std::atomic<uintptr_t> query{0};
+        std::atomic<uint64_t> key{0};
+        std::atomic<uint8_t> status{0};
+    };
+
+    Entry& slot(uintptr_t query, uint64_t key) const noexcept
+    {
+        uint64_t hash = (query ^ key) * 0x9E3779B97F4A7C15ull;
+        return entries[(hash ^ hash >> 29) & mask];
+    }
+
+    bool find(uintptr_t query, uint64_t key, Status& status) noexcept
+    {
+        const Entry& entry = slot(query, key);
+        uint64_t sequence = entry.sequence.load(std::memory_order_acquire);
+        uintptr_t storedQuery = entry.query.load(std::memory_order_relaxed);
+        uint64_t storedKey = entry.key.load(std::memory_order_relaxed);
+        uint64_t expires = entry.expires.load(std::memory_order_relaxed);
+        uint8_t storedStatus = entry.status.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        bool hit = !(sequence & 1) && entry.sequence.load(std::memory_order_relaxed) == sequence
+            && storedQuery == query && storedKey == key && now() < expires;
+        if (counting)
+            (hit ? hitCount : missCount).fetch_add(1, std::memory_order_relaxed);
+        status = (Status)storedStatus;
+        return hit;
+    }
+
+    void store(uintptr_t query, uint64_t key, Status status, uint32_t ttl) noexcept
+    {
+        Entry& entry = slot(query, key);
+        uint64_t sequence = entry.sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) || !entry.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        entry.query.store(query, std::memory_order_relaxed);
+        entry.key.store(key, std::memory_order_relaxed);
+        entry.expires.store(now() + ttl, std::memory_order_relaxed);
+        entry.status.store((uint8_t)status, std::memory_order_relaxed);
+        entry.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    std::unique_ptr<Entry[]> entries;
+    size_t mask = 0;
+    std::atomic<uint64_t> clock{0};
+    const bool counting;
+    std::atomic<size_t> hitCount{0};
+    std::atomic<size_t> missCount{0};
+};
+
+
+// Condition whose result is shared through a QueryCache for ttl ticks:
+class CachedCondition : public NamedNode
+{
+public:
+    CachedCondition(const char* name, QueryCache& cache, QueryCondition query, uint64_t key, uint32_t ttl)
+        : NamedNode(name), cache(&cache), query(query), key(key), ttl(ttl) {}
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return cache->evaluate(query, key, ttl);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    QueryCache* cache;
+    QueryCondition query;
+    uint64_t key;
+    uint32_t ttl;
+};
+
+
+// Action whose result is shared through a QueryCache for ttl ticks:
+class CachedAction : public NamedNode
+{
+public:
+    CachedAction(const char* name, QueryCache& cache, QueryAction query, uint64_t key, uint32_t ttl)
+        : NamedNode(name), cache(&cache), query(query), key(key), ttl(ttl) {}
+protected:
+    virtual bool synchronous() const noexcept override { return true; }
+    virtual Status update() noexcept override
+    {
+        BEHAVIOR_TREE_TRY
+        {
+            return cache->evaluate(query, key, ttl);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return Status::Failure;
+        }
+    }
+private:
+    QueryCache* cache;
+    QueryAction query;
+    uint64_t key;
+    uint32_t ttl;
+};
+
+}
+
+#endif
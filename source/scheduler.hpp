@@ -2,63 +2,186 @@
 #ifndef BEHAVIOR_TREE_SCHEDULER_H
 #define BEHAVIOR_TREE_SCHEDULER_H
 
-#include <deque>
+#include <limits>
+#include <vector>
 #include <algorithm>
+#include <memory>
 #include "nodes.hpp"
 
 namespace bt
 {
 
-class Scheduler
+// Results of pure conditions for the current tick generation, in a small direct mapped
+// table keyed by the condition's function. Colliding functions simply evict each other:
+class ConditionCache
 {
 public:
-    explicit Scheduler(size_t initialSize)
-        : runningNodes(std::deque<Node*>()) {}
+    bool evaluate(ConditionFunction check, uint32_t generation)
+    {
+        Entry& entry = entries[((uintptr_t)check >> 4 ^ (uintptr_t)check >> 10) % Size];
+        if (entry.check == check && entry.generation == generation)
+        {
+            ++hitCount;
+            return entry.result;
+        }
+
+        ++missCount;
+        bool result = check();
+        entry = Entry{check, generation, result};
+        return result;
+    }
+
+    size_t hits() const noexcept { return hitCount; }
+    size_t misses() const noexcept { return missCount; }
+private:
+    struct Entry
+    {
+        ConditionFunction check;
+        uint32_t generation;
+        bool result;
+    };
+
+    static const size_t Size = 32;
+    Entry entries[Size] = {};
+    size_t hitCount = 0;
+    size_t missCount = 0;
+};
+
 
+class Scheduler : public RefCounted
+{
+public:
+    explicit Scheduler(size_t initialSize) {}
+
+    // Sweeps the run queues of all partitions:
     void tick()
     {
-        if (runningNodes.size() == 0)
-            return;
+        ++tickGeneration;
+        for (size_t partition = 0; partition < queues.size(); ++partition)
+            tickPartition((Partition)partition);
+    }
 
-        // Insert an end-of-update marker into the list of tasks.
-        runningNodes.push_back(nullptr);
+    // Only updates the nodes queued in one partition, usually a tree's:
+    void tick(Partition partition)
+    {
+        ++tickGeneration;
+        if (partition < queues.size())
+            tickPartition(partition);
+    }
 
-        // Keep going updating tasks until we encounter the nullptr marker:
-        while (true)
+    // Returns a partition for a new tree. Partition 0 holds nodes started outside of trees.
+    // Partitions of destroyed trees are reused first, trees only share partitions while all
+    // of them are in use:
+    Partition createPartition()
+    {
+        if (Partition partition = firstFreePartition)
         {
-            Node* current = runningNodes.front();
-            runningNodes.pop_front();
+            RunQueue& queue = queues[partition];
+            firstFreePartition = queue.nextFree;
+            queue.nextFree = 0;
+            clear(queue);
+            return partition;
+        }
 
-            if (current == nullptr)
-                return;
+        Partition partition = nextPartition;
+        if (partitionsExhausted)
+            ++queueOf(partition).sharers;
+        if (nextPartition == std::numeric_limits<Partition>::max())
+        {
+            nextPartition = 1;
+            partitionsExhausted = true;
+        }
+        else
+            ++nextPartition;
+        return partition;
+    }
 
-            current->tick(*this);
+    // Called by destroyed trees, the partition is reused once its last tree released it and its
+    // queue is reset. Without memory for the queue, it is only reused once the partitions wrap:
+    void releasePartition(Partition partition) noexcept
+    {
+        if (partition == 0)
+            return;
+        BEHAVIOR_TREE_TRY
+        {
+            queueOf(partition);
+        }
+        BEHAVIOR_TREE_CATCH
+        {
+            return;
+        }
 
-            // If currently running, drop it into the queue for next tick:
-            if (current->nodeStatus == Status::Running)
-            {
-                runningNodes.push_back(current);
-            }
-            else if (current->nodeStatus != Status::Suspended)
-            {
-                // Notify observer that task completed:
-                if (current->observer)
-                    current->observer->onComplete(*this, *current, current->nodeStatus);
-            }
+        RunQueue& queue = queues[partition];
+        if (queue.sharers)
+        {
+            --queue.sharers;
+            return;
         }
+        clear(queue);
+        queue.nextFree = firstFreePartition;
+        firstFreePartition = partition;
+    }
+
+    // Nodes started outside of a tick, or restored, go to the current partition:
+    Partition currentPartition() const noexcept { return current; }
+    Partition enterPartition(Partition partition) noexcept
+    {
+        Partition previous = current;
+        current = partition;
+        return previous;
     }
 
     void start(Node& node, Observer& observer) noexcept
     {
         node.observer = &observer;
-        runningNodes.push_front(&node);
+        node.partition = current;
+        pushFront(queueOf(node.partition), &node);
+        RunQueue& queue = queues[node.partition];
+        if (queue.sleepers)
+            wakeSleepers(queue);
     }
 
+    // Starts the node like start(), but synchronous nodes started during a tick are
+    // updated in place and their status returned without notifying the observer.
+    // Returns Suspended when the node was queued instead.
+    Status run(Node& node, Observer& observer) noexcept
+    {
+        if (!ticking || !node.synchronous())
+        {
+            start(node, observer);
+            return Status::Suspended;
+        }
+
+        node.observer = &observer;
+        node.partition = current;
+        tickNode(node);
+        if (node.nodeStatus == Status::Running)
+            pushBack(queueOf(node.partition), &node);
+        return node.nodeStatus;
+    }
+
+    // Observers are notified in the node's partition, which the nodes they start inherit:
     void completed(Node& node, Status result) noexcept
     {
-        node.nodeStatus = result;
+        setStatus(node, result);
         if (node.observer)
-            node.observer->onComplete(*this, node, result);
+            notify(node);
+    }
+
+    // Changes the status without notifying the observer, used to restore saved nodes. The change
+    // is recorded like the ones of ticks:
+    void setStatus(Node& node, Status status) noexcept
+    {
+        if (!statusRecorders.empty() && node.nodeStatus != status)
+            recordStatusChange(node);
+        node.nodeStatus = status;
+    }
+
+    // Re-queues a suspended node so it is updated again on the next tick:
+    void resume(Node& node)
+    {
+        setStatus(node, Status::Running);
+        enqueue(node);
     }
 
     void stop(Node& node) noexcept
@@ -66,16 +189,344 @@ public:
         if (node.nodeStatus == Status::Running || node.nodeStatus == Status::Suspended)
         {
             node.stop(*this);
-            node.nodeStatus = Status::Failure;
+            setStatus(node, Status::Failure);
         }
 
         // Remove the node from the queue if it exists:
-        auto node_pos = std::find(runningNodes.begin(), runningNodes.end(), &node);
-        if (node_pos != runningNodes.end())
-            runningNodes.erase(node_pos);
+        dequeue(node);
     }
+
+    // Calls the function with the nodes queued in the partition, in the order they are updated:
+    template <typename Function>
+    void forEachQueued(Partition partition, Function function) const
+    {
+        if (partition >= queues.size())
+            return;
+        const RunQueue& queue = queues[partition];
+        for (uint32_t block = queue.first; block != NoBlock; block = blocks[block].next)
+        {
+            uint32_t end = block == queue.last ? queue.end : BlockSize;
+            for (uint32_t i = block == queue.first ? queue.begin : 0; i < end; ++i)
+            {
+                Node* node = blocks[block].nodes[i];
+                if (node && node != endOfTick())
+                    function(*node);
+            }
+        }
+    }
+
+    // Replaces the run queue of the partition, used to restore a saved tree:
+    void restoreQueue(Partition partition, const std::vector<Node*>& nodes)
+    {
+        clear(queueOf(partition));
+        for (Node* node : nodes)
+            pushBack(queues[partition], node);
+        RunQueue& queue = queues[partition];
+        if (queue.sleepers && !nodes.empty())
+            wakeSleepers(queue);
+    }
+
+    void enqueue(Node& node)
+    {
+        pushBack(queueOf(node.partition), &node);
+        RunQueue& queue = queues[node.partition];
+        if (queue.sleepers)
+            wakeSleepers(queue);
+    }
+
+    // The node's entry is cleared and dropped once its queue reaches it:
+    void dequeue(Node& node) noexcept
+    {
+        if (node.partition >= queues.size())
+            return;
+        RunQueue& queue = queues[node.partition];
+        for (uint32_t block = queue.first; block != NoBlock; block = blocks[block].next)
+        {
+            uint32_t end = block == queue.last ? queue.end : BlockSize;
+            for (uint32_t i = block == queue.first ? queue.begin : 0; i < end; ++i)
+            {
+                if (blocks[block].nodes[i] == &node)
+                {
+                    blocks[block].nodes[i] = nullptr;
+                    --queue.count;
+                    return;
+                }
+            }
+        }
+    }
+    // Incremented by every tick that updates nodes:
+    uint32_t generation() const noexcept { return tickGeneration; }
+
+    // The cache is only created for schedulers running pure conditions:
+    void enableConditionCache()
+    {
+        if (!cache)
+            cache.reset(new ConditionCache());
+    }
+    ConditionCache* conditionCache() const noexcept { return cache.get(); }
+
+    // Appends the nodes whose status changes to the vector, so debug output only costs the changes.
+    // A node changing several times is appended each time. Every recording vector gets all changes
+    // of the scheduler until it stops recording:
+    void recordStatusChanges(std::vector<const Node*>& changes) { statusRecorders.push_back(&changes); }
+    void stopRecordingStatusChanges(std::vector<const Node*>& changes) noexcept
+    {
+        auto found = std::find(statusRecorders.begin(), statusRecorders.end(), &changes);
+        if (found != statusRecorders.end())
+            statusRecorders.erase(found);
+    }
+
+    // Nothing is queued to run on the next tick of the partition:
+    bool idle(Partition partition) const noexcept { return partition >= queues.size() || !queues[partition].count; }
+    friend class World;
+    friend class MemoryPool;
 private:
-    std::deque<Node*> runningNodes;
+    // The run queues of all partitions are chains of blocks taken from one shared list, so only
+    // partitions with queued nodes hold storage, and blocks emptied by one are reused by all:
+    static const uint32_t BlockSize = 15;
+    static const uint32_t NoBlock = UINT32_MAX;
+
+    struct Block
+    {
+        Node* nodes[BlockSize];
+        uint32_t next;
+    };
+
+    struct RunQueue
+    {
+        // Nodes are queued from begin in the first block to end in the last one:
+        uint32_t first = NoBlock;
+        uint32_t last = NoBlock;
+        uint16_t begin = 0;
+        uint16_t end = 0;
+        // Queued nodes, without the dequeued entries still in the blocks:
+        uint32_t count = 0;
+        // Trees of a World sleeping until this partition gets work:
+        class BehaviorTree* sleepers = nullptr;
+        // Trees sharing the partition besides the first one, and the next free partition once released:
+        uint32_t sharers = 0;
+        Partition nextFree = 0;
+    };
+
+    // Partitions only take a few bytes until they queue nodes, building trees doesn't allocate:
+    RunQueue& queueOf(Partition partition)
+    {
+        if (partition >= queues.size())
+            queues.resize(partition + 1);
+        return queues[partition];
+    }
+
+    // Once all trees of the scheduler are destroyed, only nodes started outside of trees can
+    // be left, a recycled scheduler forgets them:
+    void recycle() noexcept
+    {
+        if (!queues.empty())
+            clear(queues[0]);
+        current = 0;
+    }
+
+    // Marks the end of the nodes a tick updates, it can't be the address of a node:
+    Node* endOfTick() const noexcept { return (Node*)(const void*)this; }
+
+    uint32_t allocateBlock()
+    {
+        uint32_t block = firstFreeBlock;
+        if (block != NoBlock)
+            firstFreeBlock = blocks[block].next;
+        else
+        {
+            blocks.emplace_back();
+            block = (uint32_t)blocks.size() - 1;
+        }
+        blocks[block].next = NoBlock;
+        return block;
+    }
+
+    void freeBlock(uint32_t block) noexcept
+    {
+        blocks[block].next = firstFreeBlock;
+        firstFreeBlock = block;
+    }
+
+    // Empty queues start in the middle of a block, nodes are started at the front and requeued at the back:
+    void pushBack(RunQueue& queue, Node* node)
+    {
+        if (queue.first == NoBlock)
+        {
+            queue.first = queue.last = allocateBlock();
+            queue.begin = queue.end = BlockSize / 2;
+        }
+        else if (queue.end == BlockSize)
+        {
+            uint32_t block = allocateBlock();
+            blocks[queue.last].next = block;
+            queue.last = block;
+            queue.end = 0;
+        }
+        blocks[queue.last].nodes[queue.end++] = node;
+        if (node != endOfTick())
+            ++queue.count;
+    }
+
+    void pushFront(RunQueue& queue, Node* node)
+    {
+        if (queue.first == NoBlock)
+        {
+            queue.first = queue.last = allocateBlock();
+            queue.begin = queue.end = BlockSize / 2;
+        }
+        else if (queue.begin == 0)
+        {
+            uint32_t block = allocateBlock();
+            blocks[block].next = queue.first;
+            queue.first = block;
+            queue.begin = BlockSize;
+        }
+        blocks[queue.first].nodes[--queue.begin] = node;
+        ++queue.count;
+    }
+
+    // The queue must not be empty, its blocks are freed as they are emptied:
+    Node* popFront(RunQueue& queue) noexcept
+    {
+        Node* node = blocks[queue.first].nodes[queue.begin++];
+        if (node && node != endOfTick())
+            --queue.count;
+        if (queue.first == queue.last && queue.begin == queue.end)
+        {
+            freeBlock(queue.first);
+            queue.first = queue.last = NoBlock;
+        }
+        else if (queue.begin == BlockSize)
+        {
+            uint32_t next = blocks[queue.first].next;
+            freeBlock(queue.first);
+            queue.first = next;
+            queue.begin = 0;
+        }
+        return node;
+    }
+
+    void clear(RunQueue& queue) noexcept
+    {
+        while (queue.first != NoBlock)
+        {
+            uint32_t next = queue.first == queue.last ? NoBlock : blocks[queue.first].next;
+            freeBlock(queue.first);
+            queue.first = next;
+        }
+        queue.last = NoBlock;
+        queue.count = 0;
+    }
+
+    void tickPartition(Partition partition)
+    {
+        if (!queues[partition].count)
+            return;
+
+        // Insert an end-of-update marker into the list of tasks. Queues are looked
+        // up on every access since nodes may start others in new partitions:
+        pushBack(queues[partition], endOfTick());
+        ticking = true;
+        Partition previous = enterPartition(partition);
+
+        // Keep going updating tasks until we encounter the marker, skipping dequeued ones:
+        while (true)
+        {
+            Node* node = popFront(queues[partition]);
+
+            if (node == endOfTick())
+            {
+                ticking = false;
+                enterPartition(previous);
+                return;
+            }
+            if (!node)
+                continue;
+
+            tickNode(*node);
+
+            // If currently running, drop it into the queue for next tick:
+            if (node->nodeStatus == Status::Running)
+            {
+                pushBack(queues[partition], node);
+            }
+            else if (node->nodeStatus != Status::Suspended)
+            {
+                // Notify observer that task completed:
+                if (node->observer)
+                    notify(*node);
+            }
+        }
+    }
+
+    // Observers complete their own node last, so completions travel up the tree through a
+    // worklist instead of recursing once per level. The first completion drains it, the ones
+    // it causes are queued behind it and the node's status is read once it is its turn. A full
+    // worklist falls back to notifying in place:
+    void notify(Node& node) noexcept
+    {
+        if (completionCount == CompletionCapacity)
+        {
+            notifyObserver(node);
+            return;
+        }
+
+        completions[(completionStart + completionCount++) % CompletionCapacity] = &node;
+        if (propagating)
+            return;
+
+        propagating = true;
+        while (completionCount)
+        {
+            Node* completed = completions[completionStart];
+            completionStart = (completionStart + 1) % CompletionCapacity;
+            --completionCount;
+            notifyObserver(*completed);
+        }
+        propagating = false;
+    }
+
+    void notifyObserver(Node& node) noexcept
+    {
+        Partition previous = enterPartition(node.partition);
+        node.observer->onComplete(*this, node, node.nodeStatus);
+        enterPartition(previous);
+    }
+
+    void wakeSleepers(RunQueue& queue) noexcept;
+
+    void tickNode(Node& node) noexcept
+    {
+        Status previous = node.nodeStatus;
+        node.tick(*this);
+        if (!statusRecorders.empty() && node.nodeStatus != previous)
+            recordStatusChange(node);
+    }
+
+    void recordStatusChange(const Node& node) noexcept
+    {
+        for (std::vector<const Node*>* changes : statusRecorders)
+            changes->push_back(&node);
+    }
+
+    static const uint8_t CompletionCapacity = 8;
+    Node* completions[CompletionCapacity];
+    uint8_t completionStart = 0;
+    uint8_t completionCount = 0;
+    bool propagating = false;
+
+    std::vector<RunQueue> queues;
+    std::vector<Block> blocks;
+    uint32_t firstFreeBlock = NoBlock;
+    Partition current = 0;
+    Partition nextPartition = 1;
+    Partition firstFreePartition = 0;
+    bool partitionsExhausted = false;
+    bool ticking = false;
+    uint32_t tickGeneration = 0;
+    std::unique_ptr<ConditionCache> cache;
+    std::vector<std::vector<const Node*>*> statusRecorders;
 };
 
 }
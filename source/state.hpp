@@ -0,0 +1,72 @@
+
+#ifndef BEHAVIOR_TREE_STATE_H
+#define BEHAVIOR_TREE_STATE_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace bt
+{
+
+class Node;
+
+class StateWriter
+{
+public:
+    explicit StateWriter(std::vector<uint8_t>& buffer) : buffer(buffer) { buffer.clear(); }
+
+    template <typename T>
+    void write(T value)
+    {
+        size_t offset = buffer.size();
+        buffer.resize(offset + sizeof(T));
+        memcpy(buffer.data() + offset, &value, sizeof(T));
+    }
+private:
+    std::vector<uint8_t>& buffer;
+};
+
+
+// Restoring reads a blob twice: the first pass only validates it and collects its nodes, so a
+// corrupt blob is rejected before the first node changes. The second pass applies it.
+class StateReader
+{
+public:
+    enum class Pass { Validate, Apply };
+
+    StateReader(const uint8_t* data, size_t size, Pass pass = Pass::Apply) : data(data), size(size), pass(pass) {}
+
+    template <typename T>
+    T read()
+    {
+        T value = T();
+        if (offset + sizeof(T) > size)
+        {
+            failed = true;
+            return value;
+        }
+        memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    // Marks the blob as corrupt, restoring it fails:
+    void reject() noexcept { failed = true; }
+    bool valid() const noexcept { return !failed; }
+    bool validating() const noexcept { return pass == Pass::Validate; }
+    bool complete() const noexcept { return !failed && offset == size; }
+
+    // Every node read by the validation pass, in traversal order:
+    std::vector<Node*> nodes;
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+    Pass pass;
+    bool failed = false;
+};
+
+}
+
+#endif
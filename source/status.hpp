@@ -2,12 +2,12 @@
 #ifndef BEHAVIOR_TREE_STATUS_H
 #define BEHAVIOR_TREE_STATUS_H
 
-#include <iostream>
+#include <cstdint>
 
 namespace bt
 {
 
-enum class Status
+enum class Status : uint8_t
 {
     Initial,
     Running,
@@ -16,14 +16,17 @@ enum class Status
     Suspended,
 };
 
-inline std::ostream& operator<<(std::ostream& os, const Status& s)
+inline const char* statusName(Status s) noexcept
 {
-    if (s == Status::Success) os << "Success";
-    if (s == Status::Running) os << "Running";
-    if (s == Status::Failure) os << "Failure";
-    if (s == Status::Initial) os << "Initial";
-    if (s == Status::Suspended) os << "Suspended";
-    return os;
+    switch (s)
+    {
+        case Status::Initial: return "Initial";
+        case Status::Running: return "Running";
+        case Status::Success: return "Success";
+        case Status::Failure: return "Failure";
+        case Status::Suspended: return "Suspended";
+    }
+    return "";
 }
 
 }
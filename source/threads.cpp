@@ -0,0 +1,185 @@
+#include "threads.hpp"
+#include "scheduler.hpp"
+#include "state.hpp"
+
+namespace bt
+{
+
+inline ThreadPool::ThreadPool(size_t threadCount)
+{
+    threadCount = threadCount ? threadCount : 1;
+    threads.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i)
+        threads.emplace_back(&ThreadPool::work, this);
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (Job* job : queued)
+            job->cancelled.store(true, std::memory_order_relaxed);
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+inline ThreadPool::Job* ThreadPool::submit(ThreadedAction& action)
+{
+    Job* job;
+    if (freeJobs.empty())
+    {
+        jobs.emplace_back(new Job());
+        job = jobs.back().get();
+    }
+    else
+    {
+        job = freeJobs.back();
+        freeJobs.pop_back();
+    }
+
+    job->function = action.function;
+    job->agent = action.agent;
+    job->action = action.handle();
+    job->cancelled.store(false, std::memory_order_relaxed);
+    job->result = Status::Failure;
+    ++submitted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.push_back(job);
+    }
+    wake.notify_one();
+    return job;
+}
+
+inline void ThreadPool::work() noexcept
+{
+    for (;;)
+    {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queued.empty(); });
+            if (queued.empty())
+                return;
+            job = queued.front();
+            queued.pop_front();
+        }
+
+        if (!job->cancelled.load(std::memory_order_relaxed))
+        {
+            BEHAVIOR_TREE_TRY
+            {
+                job->result = job->function(job->agent, job->cancelled);
+            }
+            BEHAVIOR_TREE_CATCH
+            {
+                job->result = Status::Failure;
+            }
+        }
+        finish(*job);
+    }
+}
+
+inline void ThreadPool::finish(Job& job) noexcept
+{
+    job.next = finished.load(std::memory_order_relaxed);
+    while (!finished.compare_exchange_weak(job.next, &job, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+
+    // Taking the lock orders the push before a waiting complete() checks the stack:
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    done.notify_all();
+}
+
+inline size_t ThreadPool::complete(bool wait)
+{
+    if (wait && submitted)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return finished.load(std::memory_order_relaxed) != nullptr; });
+    }
+
+    // The stack holds the most recent job first, it is reversed so actions complete in order:
+    Job* stack = finished.exchange(nullptr, std::memory_order_acquire);
+    Job* ordered = nullptr;
+    while (Job* job = stack)
+    {
+        stack = job->next;
+        job->next = ordered;
+        ordered = job;
+    }
+
+    size_t count = 0;
+    while (Job* job = ordered)
+    {
+        ordered = job->next;
+        ++job->run;
+        freeJobs.push_back(job);
+        --submitted;
+        ++count;
+
+        // Jobs of stopped or destroyed actions are dropped, their handle was released:
+        AsyncNode* node = AsyncNode::find(job->action);
+        if (!node || job->cancelled.load(std::memory_order_relaxed))
+            continue;
+
+        ThreadedAction* action = static_cast<ThreadedAction*>(node);
+        action->job = nullptr;
+        if (job->result == Status::Running)
+            action->start();
+        else if (job->result == Status::Success)
+            action->succeeded();
+        else
+            action->failed();
+    }
+    return count;
+}
+
+inline void ThreadedAction::start() noexcept
+{
+    BEHAVIOR_TREE_TRY
+    {
+        job = pool->submit(*this);
+        jobRun = job->run;
+        return;
+    }
+    BEHAVIOR_TREE_CATCH
+    {
+    }
+
+    // Actions rerun by complete() are suspended, while ticked ones fail like without a handle:
+    job = nullptr;
+    if (status() == Status::Suspended)
+        failed();
+    else
+        release();
+}
+
+inline void ThreadedAction::cancel() noexcept
+{
+    if (job && job->run == jobRun)
+        job->cancelled.store(true, std::memory_order_relaxed);
+    job = nullptr;
+}
+
+inline void ThreadedAction::restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer)
+{
+    if (reader.validating())
+    {
+        AsyncNode::restoreState(reader, scheduler, observer);
+        return;
+    }
+
+    cancel();
+    AsyncNode::restoreState(reader, scheduler, observer);
+    if (status() == Status::Suspended)
+        start();
+}
+
+}
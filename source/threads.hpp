@@ -0,0 +1,114 @@
+
+#ifndef BEHAVIOR_TREE_THREADS_H
+#define BEHAVIOR_TREE_THREADS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "nodes.hpp"
+
+namespace bt
+{
+
+// Runs on a thread of the pool, long running work should return early once cancelled is set.
+// Running results run the function again, others complete the action:
+typedef Status (*ThreadedActionFunction) (void* agent, const std::atomic<bool>& cancelled);
+
+// Fixed-size pool of worker threads running threaded actions, so expensive work doesn't block the
+// thread ticking the trees. Finished jobs are pushed on a lock-free stack and only complete their
+// actions in complete(), called on the ticking thread, usually once per frame before the trees
+// are ticked. Actions must be destroyed before their pool.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+    ThreadPool(const ThreadPool& pool) = delete;
+    ~ThreadPool();
+
+    // Completes the actions whose jobs finished, returns how many jobs were collected. Waiting
+    // blocks until a job finished first, unless none is pending:
+    size_t complete(bool wait = false);
+    // Jobs submitted and not collected yet, including cancelled ones:
+    size_t pending() const noexcept { return submitted; }
+    size_t size() const noexcept { return threads.size(); }
+    friend class ThreadedAction;
+private:
+    struct Job
+    {
+        ThreadedActionFunction function;
+        void* agent;
+        Handle action;
+        std::atomic<bool> cancelled;
+        Status result;
+        // Recycled jobs get a new run, so actions don't cancel a job that was reused:
+        uint32_t run = 0;
+        Job* next = nullptr;
+    };
+
+    Job* submit(class ThreadedAction& action);
+    void work() noexcept;
+    void finish(Job& job) noexcept;
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<Job*> queued;
+    bool stopping = false;
+
+    // Pushed by the workers and taken as a whole by complete(), so there is no ABA problem:
+    std::atomic<Job*> finished{nullptr};
+
+    // Jobs are only allocated and recycled on the ticking thread:
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::vector<Job*> freeJobs;
+    size_t submitted = 0;
+};
+
+
+// Action running its function on a ThreadPool. It waits Suspended until the pool completes it,
+// stopping it cancels its job and drops the result. It fails without memory for the job. Built with
+// builder.create<ThreadedAction>(name, pool, function, agent).
+class ThreadedAction : public AsyncNode
+{
+public:
+#if defined(BEHAVIOR_TREE_STRIP_NAMES)
+    ThreadedAction(const char* name, ThreadPool& pool, ThreadedActionFunction function, void* agent = nullptr)
+        : pool(&pool), function(function), agent(agent) {}
+#else
+    ThreadedAction(const char* name, ThreadPool& pool, ThreadedActionFunction function, void* agent = nullptr)
+        : nodeName(name), pool(&pool), function(function), agent(agent) {}
+    virtual const char* name() const noexcept override { return nodeName; }
+#endif
+    virtual ~ThreadedAction() override { cancel(); }
+    // Actions restored while waiting submit their job again:
+    virtual void restoreState(StateReader& reader, Scheduler& scheduler, Observer* observer) override;
+    friend class ThreadPool;
+protected:
+    virtual void start() noexcept override;
+    virtual void stop(class Scheduler& scheduler) noexcept override
+    {
+        cancel();
+        AsyncNode::stop(scheduler);
+    }
+private:
+    void cancel() noexcept;
+
+#if !defined(BEHAVIOR_TREE_STRIP_NAMES)
+    const char* nodeName;
+#endif
+    ThreadPool* pool;
+    ThreadedActionFunction function;
+    void* agent;
+    ThreadPool::Job* job = nullptr;
+    uint32_t jobRun = 0;
+};
+
+}
+
+#endif
@@ -6,11 +6,14 @@
 #include "visitors.hpp"
 #include "memory.hpp"
 #include "scheduler.hpp"
+#include "state.hpp"
+#include "ownership.hpp"
+#include "handles.hpp"
 
 namespace bt
 {
 
-class BehaviorTree : public Observer
+class BehaviorTree : public Observer, public RefCounted
 {
 public:
     Status tick()
@@ -18,9 +21,11 @@ public:
         if (schedulerStopped)
         {
             schedulerStopped = false;
+            Partition previous = scheduler->enterPartition(partition);
             scheduler->start(*root, *this);
+            scheduler->enterPartition(previous);
         }
-        scheduler->tick();
+        scheduler->tick(partition);
         return root->status();
     }
 
@@ -36,39 +41,151 @@ public:
         visitor.end();
     }
 
+    // Writes node statuses, composite progress and queued nodes into a packed blob:
+    void saveState(std::vector<uint8_t>& buffer) const
+    {
+        StateWriter writer(buffer);
+        writer.write<uint8_t>(StateVersion);
+        writer.write<uint8_t>(schedulerStopped);
+        root->saveState(writer, *scheduler);
+
+        // The run queue is saved once, in order, as offsets of the queued nodes from the root:
+        uint32_t count = 0;
+        scheduler->forEachQueued(partition, [&count](const Node&) { ++count; });
+        writer.write(count);
+        intptr_t base = (intptr_t)&*root;
+        scheduler->forEachQueued(partition, [&writer, base](const Node& node) { writer.write<int64_t>((intptr_t)&node - base); });
+    }
+
+    // Restores a blob saved from this tree or one built the same way. Corrupt blobs are rejected
+    // and leave the tree unchanged:
+    bool restoreState(const uint8_t* data, size_t size)
+    {
+        std::vector<Node*> queue;
+        StateReader validation(data, size, StateReader::Pass::Validate);
+        if (!readState(validation, queue))
+            return false;
+
+        StateReader reader(data, size);
+        Partition previous = scheduler->enterPartition(partition);
+        readState(reader, queue);
+        scheduler->restoreQueue(partition, queue);
+        scheduler->enterPartition(previous);
+        return true;
+    }
+
+    bool restoreState(const std::vector<uint8_t>& buffer)
+    {
+        return restoreState(buffer.data(), buffer.size());
+    }
+
     ~BehaviorTree()
     {
+        Handles::release(treeHandle);
         stop();
-        root->~Node();
+        scheduler->releasePartition(partition);
+        memory->destroy(nodesBegin, nodesEnd);
         root = nullptr;
     }
 
-    friend class Memory;
+    friend class Builder;
     friend class SubTree;
+    friend class Lockstep;
+    friend class World;
     Status status() const noexcept { return root->status(); }
+
+    // Records the nodes whose status changes, see Scheduler::recordStatusChanges(). Trees built
+    // by the same Builder share their scheduler, so the vector also gets the changes of the others:
+    void recordStatusChanges(std::vector<const Node*>& changes) { scheduler->recordStatusChanges(changes); }
+    void stopRecordingStatusChanges(std::vector<const Node*>& changes) noexcept { scheduler->stopRecordingStatusChanges(changes); }
+
+    // Valid while the tree is alive, find() returns nullptr for handles of destroyed trees:
+    Handle handle() const noexcept { return treeHandle; }
+    static BehaviorTree* find(Handle handle) noexcept { return (BehaviorTree*)Handles::get(handle, HandleKind::Tree); }
 protected:
     virtual void onComplete(class Scheduler& scheduler, const Node& root, Status status) noexcept override
     {
+        if (SubTree* subtree = parent)
+        {
+            parent = nullptr;
+            scheduler.completed(*subtree, status);
+            return;
+        }
         schedulerStopped = true;
+        if (world)
+            completed(status);
     }
 private:
     BehaviorTree(Node& root,
-        const std::shared_ptr<Memory>& memory,
-        const std::shared_ptr<Scheduler>& scheduler)
-        : root(&root), memory(memory), scheduler(scheduler) {}
+        const Ref<Memory>& memory,
+        const Ref<Scheduler>& scheduler,
+        Memory::Marker nodesBegin, Memory::Marker nodesEnd)
+        : root(&root), memory(memory), scheduler(scheduler), nodesBegin(nodesBegin), nodesEnd(nodesEnd),
+          partition(scheduler->createPartition()), treeHandle(Handles::acquire(this, HandleKind::Tree)) {}
 
-    Node* root;
-    std::shared_ptr<Memory> memory;
-    std::shared_ptr<Scheduler> scheduler;
+    // The tree lives in its own arena, which must stay alive until its destructor has returned:
+    static void dispose(BehaviorTree* tree) noexcept
+    {
+        Ref<Memory> memory = tree->memory;
+        tree->~BehaviorTree();
+    }
+
+    // Defined with World, which queues the completion and wakes the tree to restart its root:
+    void completed(Status status) noexcept;
+
+    static const uint8_t StateVersion = 2;
+
+    // The validation pass finds the queued nodes among the restored ones, the apply pass
+    // only changes the nodes:
+    bool readState(StateReader& reader, std::vector<Node*>& queue)
+    {
+        if (reader.read<uint8_t>() != StateVersion)
+            return false;
+        bool stopped = reader.read<uint8_t>() != 0;
+        root->restoreState(reader, *scheduler, this);
+        uint32_t count = reader.read<uint32_t>();
+        if (!reader.validating())
+        {
+            schedulerStopped = stopped;
+            return true;
+        }
+
+        auto before = [](const Node* a, const Node* b) { return (intptr_t)a < (intptr_t)b; };
+        std::sort(reader.nodes.begin(), reader.nodes.end(), before);
+        intptr_t base = (intptr_t)&*root;
+        for (uint32_t i = 0; i < count && reader.valid(); ++i)
+        {
+            Node* node = (Node*)(base + (intptr_t)reader.read<int64_t>());
+            auto found = std::lower_bound(reader.nodes.begin(), reader.nodes.end(), node, before);
+            if (found == reader.nodes.end() || *found != node)
+                reader.reject();
+            else
+                queue.push_back(node);
+        }
+        return reader.complete();
+    }
+
+
+    Link<Node> root;
+    Ref<Memory> memory;
+    Ref<Scheduler> scheduler;
+    Memory::Marker nodesBegin;
+    Memory::Marker nodesEnd;
+    SubTree* parent = nullptr;
+    // Its nodes are queued apart from the other trees sharing the scheduler:
+    Partition partition;
+    Handle treeHandle;
     bool schedulerStopped = true;
-};
 
-std::ostream& operator<<(std::ostream& os, const BehaviorTree& tree)
-{
-    TextSerializer serializer(os, true);
-    tree.traverse(serializer);
-    return os;
-}
+    // Membership of a World:
+    bool sleeping = false;
+    uint32_t activeSlot = 0;
+    bool completionQueued = false;
+    Status completion = Status::Initial;
+    class World* world = nullptr;
+    BehaviorTree* nextSleeping = nullptr;
+    BehaviorTree* nextCompleted = nullptr;
+};
 
 }
 
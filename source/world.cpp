@@ -0,0 +1,174 @@
+#include <algorithm>
+#include "world.hpp"
+
+namespace bt
+{
+
+inline World::~World()
+{
+    for (auto& tree : trees)
+    {
+        if (tree->sleeping)
+            deactivate(*tree);
+        unqueueCompletion(*tree);
+        tree->world = nullptr;
+    }
+}
+
+inline void World::add(const Ref<BehaviorTree>& tree)
+{
+    if (!tree || tree->world)
+    {
+        raise("BehaviorTree can only be added to one World.");
+        return;
+    }
+
+    trees.push_back(tree);
+    activeTrees.reserve(trees.size());
+    tree->world = this;
+    tree->sleeping = false;
+    tree->activeSlot = (uint32_t)activeTrees.size();
+    activeTrees.push_back(tree.get());
+}
+
+inline bool World::remove(const BehaviorTree& tree)
+{
+    auto found = std::find_if(trees.begin(), trees.end(), [&](const Ref<BehaviorTree>& t) { return t.get() == &tree; });
+    if (found == trees.end())
+        return false;
+
+    // The last reference may be the world's, so the tree is released last:
+    Ref<BehaviorTree> removed = *found;
+    deactivate(*removed);
+    unqueueCompletion(*removed);
+    removed->world = nullptr;
+    *found = trees.back();
+    trees.pop_back();
+    return true;
+}
+
+inline void World::tick()
+{
+    // Sleeping trees are replaced by the last active one, which is ticked next:
+    for (size_t i = 0; i < activeTrees.size();)
+    {
+        BehaviorTree& tree = *activeTrees[i];
+        tree.tick();
+        if (tree.status() == Status::Suspended && tree.scheduler->idle(tree.partition))
+            sleep(tree);
+        else
+            ++i;
+    }
+}
+
+inline void World::sleep(BehaviorTree& tree) noexcept
+{
+    deactivate(tree);
+    tree.sleeping = true;
+    BehaviorTree*& sleepers = tree.scheduler->queueOf(tree.partition).sleepers;
+    tree.nextSleeping = sleepers;
+    sleepers = &tree;
+}
+
+inline void World::wake(BehaviorTree& tree) noexcept
+{
+    if (tree.world != this || !tree.sleeping)
+        return;
+
+    deactivate(tree);
+    tree.activeSlot = (uint32_t)activeTrees.size();
+    activeTrees.push_back(&tree);
+}
+
+// Takes an awake tree out of the active trees, or a sleeping one off its scheduler:
+inline void World::deactivate(BehaviorTree& tree) noexcept
+{
+    if (tree.sleeping)
+    {
+        BehaviorTree** link = &tree.scheduler->queueOf(tree.partition).sleepers;
+        while (*link && *link != &tree)
+            link = &(*link)->nextSleeping;
+        if (*link)
+            *link = tree.nextSleeping;
+        tree.nextSleeping = nullptr;
+        tree.sleeping = false;
+        return;
+    }
+
+    BehaviorTree* last = activeTrees.back();
+    activeTrees[tree.activeSlot] = last;
+    last->activeSlot = tree.activeSlot;
+    activeTrees.pop_back();
+}
+
+inline bool World::poll(Completion& completion) noexcept
+{
+    // Queued trees are kept alive by the world, only trees whose handle still resolves are reported:
+    while (BehaviorTree* tree = firstCompleted)
+    {
+        unqueueCompletion(*tree);
+        if (BehaviorTree::find(tree->handle()) == tree)
+        {
+            completion = Completion{tree->handle(), tree->completion};
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void World::queueCompletion(BehaviorTree& tree, Status status) noexcept
+{
+    tree.completion = status;
+    if (tree.completionQueued)
+        return;
+
+    tree.completionQueued = true;
+    tree.nextCompleted = nullptr;
+    if (lastCompleted)
+        lastCompleted->nextCompleted = &tree;
+    else
+        firstCompleted = &tree;
+    lastCompleted = &tree;
+}
+
+inline void World::unqueueCompletion(BehaviorTree& tree) noexcept
+{
+    if (!tree.completionQueued)
+        return;
+
+    BehaviorTree* previous = nullptr;
+    BehaviorTree* current = firstCompleted;
+    while (current != &tree)
+    {
+        previous = current;
+        current = current->nextCompleted;
+    }
+
+    (previous ? previous->nextCompleted : firstCompleted) = tree.nextCompleted;
+    if (lastCompleted == &tree)
+        lastCompleted = previous;
+    tree.nextCompleted = nullptr;
+    tree.completionQueued = false;
+}
+
+inline void BehaviorTree::completed(Status status) noexcept
+{
+    world->queueCompletion(*this, status);
+    world->wake(*this);
+}
+
+inline void World::wakeAll(BehaviorTree* sleepers) noexcept
+{
+    while (BehaviorTree* tree = sleepers)
+    {
+        sleepers = tree->nextSleeping;
+        tree->world->wake(*tree);
+    }
+}
+
+inline void Scheduler::wakeSleepers(RunQueue& queue) noexcept
+{
+    World::wakeAll(queue.sleepers);
+}
+
+}
@@ -0,0 +1,64 @@
+
+#ifndef BEHAVIOR_TREE_WORLD_H
+#define BEHAVIOR_TREE_WORLD_H
+
+#include <vector>
+#include "tree.hpp"
+#include "ownership.hpp"
+
+namespace bt
+{
+
+// Ticks a set of trees, skipping the ones with nothing to run. A tree that is left Suspended
+// with an empty run queue after its tick goes to sleep on its scheduler partition. It is woken
+// when a node of the partition is started or resumed, usually by an async completion, when its
+// root completes, or explicitly through wake() for events and timers kept by the host. A tick
+// only costs the trees that are awake.
+// Completed roots are queued, so the host polls the trees that finished instead of all of them.
+class World
+{
+public:
+    // The tree is held by its handle, BehaviorTree::find() returns nullptr once it was destroyed:
+    struct Completion
+    {
+        Handle tree;
+        Status status;
+    };
+
+    World() = default;
+    World(const World& world) = delete;
+    ~World();
+
+    void add(const Ref<BehaviorTree>& tree);
+    bool remove(const BehaviorTree& tree);
+
+    void tick();
+    void wake(BehaviorTree& tree) noexcept;
+
+    // Pops the trees whose root completed since they were last polled, in completion order.
+    // A tree completing again before it is polled only keeps its latest status:
+    bool poll(Completion& completion) noexcept;
+
+    size_t size() const noexcept { return trees.size(); }
+    size_t active() const noexcept { return activeTrees.size(); }
+    friend class Scheduler;
+    friend class BehaviorTree;
+private:
+    void sleep(BehaviorTree& tree) noexcept;
+    void deactivate(BehaviorTree& tree) noexcept;
+    // Wakes the trees sleeping on a partition:
+    static void wakeAll(BehaviorTree* sleepers) noexcept;
+    void queueCompletion(BehaviorTree& tree, Status status) noexcept;
+    void unqueueCompletion(BehaviorTree& tree) noexcept;
+
+    std::vector<Ref<BehaviorTree>> trees;
+    // Holds a slot for every tree, so waking never allocates:
+    std::vector<BehaviorTree*> activeTrees;
+    // Completions are linked through the trees, so queueing them never allocates:
+    BehaviorTree* firstCompleted = nullptr;
+    BehaviorTree* lastCompleted = nullptr;
+};
+
+}
+
+#endif
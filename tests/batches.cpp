@@ -0,0 +1,88 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+struct Walker
+{
+    int id;
+    int distance;
+};
+
+static int batchCalls = 0;
+static size_t lastBatchSize = 0;
+
+static void alive(void* const* agents, Status* results, size_t count)
+{
+    ++batchCalls;
+    lastBatchSize = count;
+    for (size_t i = 0; i < count; ++i)
+        results[i] = ((Walker*)agents[i])->id % 4 ? Status::Success : Status::Failure;
+}
+
+static void walk(void* const* agents, Status* results, size_t count)
+{
+    ++batchCalls;
+    lastBatchSize = count;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Walker* walker = (Walker*)agents[i];
+        results[i] = --walker->distance > 0 ? Status::Running : Status::Success;
+    }
+}
+
+
+TEST_CASE("Callback Batches")
+{
+    CallbackBatch aliveBatch(alive, 64);
+    CallbackBatch walkBatch(walk, 64);
+
+    const int count = 40;
+    vector<Walker> walkers;
+    for (int i = 0; i < count; ++i)
+        walkers.push_back(Walker{i, 2});
+
+    vector<Ref<BehaviorTree>> trees;
+    for (int i = 0; i < count; ++i)
+    {
+        trees.push_back(Builder(2014)
+            .sequence(2)
+                .check("Alive", aliveBatch, &walkers[i])
+                .action("Walk", walkBatch, &walkers[i])
+            .end());
+    }
+
+    // Every agent waits on the condition, which is called once for all of them:
+    for (auto& tree : trees)
+        CHECK(tree->tick() == Status::Suspended);
+    CHECK(aliveBatch.pending() == count);
+    aliveBatch.flush();
+    CHECK(batchCalls == 1);
+    CHECK(lastBatchSize == count);
+    CHECK(aliveBatch.pending() == 0);
+    CHECK(trees[0]->status() == Status::Failure);
+    CHECK(trees[1]->status() == Status::Suspended);
+
+    // Running results join the batch again on the next tick:
+    for (auto& tree : trees)
+        tree->tick();
+    CHECK(walkBatch.pending() == 30);
+    walkBatch.flush();
+    CHECK(lastBatchSize == 30);
+    CHECK(trees[1]->status() == Status::Suspended);
+
+    // Stopped trees leave the batch:
+    for (auto& tree : trees)
+        tree->tick();
+    CHECK(walkBatch.pending() == 30);
+    trees[1]->stop();
+    CHECK(walkBatch.pending() == 29);
+    walkBatch.flush();
+    CHECK(batchCalls == 3);
+    CHECK(walkers[1].distance == 1);
+    CHECK(walkers[2].distance == 0);
+    CHECK(trees[2]->status() == Status::Success);
+    CHECK(trees[1]->status() == Status::Failure);
+}
@@ -578,3 +578,52 @@ TEST_CASE("Parallel Success 4")
     CHECK(info.updateCount == 3);
     CHECK(info.destroyCount == 3);
 }
+
+
+int synchronousUpdates = 0;
+Status synchronousSuccess() { ++synchronousUpdates; return Status::Success; }
+bool synchronousFalse() { ++synchronousUpdates; return false; }
+Status synchronousRunning() { ++synchronousUpdates; return Status::Running; }
+
+TEST_CASE("Synchronous Children")
+{
+    synchronousUpdates = 0;
+    MockNodeInfo info;
+    {
+        auto tree = Builder(2014)
+            .sequence(4)
+                .action("Action1", synchronousSuccess)
+                .selector(3)
+                    .check("Check1", synchronousFalse)
+                    .check("Check2", synchronousFalse)
+                    .action("Action2", synchronousSuccess)
+                .action("Action3", synchronousSuccess)
+                .create<MockNode>(info, vector<Status>{ Status::Running, Status::Success })
+            .end();
+
+        CHECK(tree->tick() == Status::Suspended);
+        CHECK(synchronousUpdates == 5);
+        CHECK(info.updateCount == 1);
+
+        CHECK(tree->tick() == Status::Success);
+        CHECK(synchronousUpdates == 5);
+        CHECK(info.updateCount == 2);
+    }
+}
+
+
+TEST_CASE("Synchronous Running Child")
+{
+    synchronousUpdates = 0;
+    auto tree = Builder(2014)
+        .selector(3)
+            .check("Check", synchronousFalse)
+            .action("Running", synchronousRunning)
+            .action("Action", synchronousSuccess)
+        .end();
+
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(synchronousUpdates == 2);
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(synchronousUpdates == 3);
+}
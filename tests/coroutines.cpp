@@ -0,0 +1,95 @@
+
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+
+#if defined(BEHAVIOR_TREE_COROUTINES)
+
+using namespace bt;
+
+int coroutineSteps = 0;
+CoroutineAction* suspendedCoroutine = nullptr;
+
+Coroutine waitingCoroutine(CoroutineAction& action)
+{
+    ++coroutineSteps;
+    co_await action.nextTick();
+    ++coroutineSteps;
+    co_await action.wait(2);
+    ++coroutineSteps;
+    co_return Status::Success;
+}
+
+Coroutine suspendingCoroutine(CoroutineAction& action)
+{
+    suspendedCoroutine = &action;
+    co_await action.suspend();
+    co_return Status::Failure;
+}
+
+
+TEST_CASE("Coroutine Action Ticks")
+{
+    coroutineSteps = 0;
+    MockNodeInfo info;
+    auto tree = Builder(2014)
+        .sequence(2)
+            .action("Coroutine", waitingCoroutine)
+            .create<MockNode>(info, Status::Success)
+        .end();
+
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(coroutineSteps == 1);
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(coroutineSteps == 2);
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(coroutineSteps == 2);
+    CHECK(tree->tick() == Status::Success);
+    CHECK(coroutineSteps == 3);
+    CHECK(info.updateCount == 1);
+
+    // Running the tree again reuses the coroutine frame:
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(coroutineSteps == 4);
+}
+
+
+TEST_CASE("Coroutine Action Suspends")
+{
+    suspendedCoroutine = nullptr;
+    auto tree = Builder(2014)
+        .negate().action("Coroutine", suspendingCoroutine)
+        .end();
+
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(tree->tick() == Status::Suspended);
+    REQUIRE(suspendedCoroutine != nullptr);
+    CHECK(suspendedCoroutine->status() == Status::Suspended);
+
+    suspendedCoroutine->resume();
+    CHECK(tree->tick() == Status::Success);
+}
+
+TEST_CASE("Coroutine Frames Are Reserved When Building")
+{
+    coroutineSteps = 0;
+    auto define = [](Builder& builder) { return builder.sequence(2).action("First", waitingCoroutine).action("Second", waitingCoroutine).end(); };
+
+    // Measuring counts the frames, and ticking allocates nothing more:
+    Builder measure{Memory::Measure()};
+    CHECK(define(measure) == nullptr);
+    CHECK(coroutineSteps == 0);
+    size_t bytes = measure.size();
+
+    Builder builder(bytes);
+    auto tree = define(builder);
+    REQUIRE(tree);
+    CHECK(builder.size() == bytes);
+    CHECK(coroutineSteps == 0);
+    for (int i = 0; i < 16 && tree->tick() == Status::Suspended; ++i) {}
+    CHECK(tree->status() == Status::Success);
+    CHECK(coroutineSteps == 6);
+    CHECK(builder.size() == bytes);
+}
+
+#endif
@@ -0,0 +1,66 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+static void startWaiting(AsyncAction& action) {}
+static bool ready() { return true; }
+
+
+TEST_CASE("Error Reporting")
+{
+    MockNodeInfo info;
+
+    // Definitions that don't fit their Memory create no tree and destroy their nodes:
+    auto define = [&info](Builder&& builder)
+    {
+        builder.sequence(32);
+        for (int i = 0; i < 32; ++i)
+            builder.create<MockNode>(info, Status::Success);
+        return builder.end();
+    };
+    Ref<BehaviorTree> tree;
+    CHECK_REPORTS(tree = define(Builder(1024)));
+    CHECK(tree == nullptr);
+    CHECK(info.createCount > 0);
+    CHECK(info.destroyCount == info.createCount);
+
+    // Malformed definitions:
+    CHECK_REPORTS(tree = Builder().sequence(2).check("Ready", ready).end());
+    CHECK(tree == nullptr);
+    CHECK_REPORTS(tree = Builder().check("Ready", ready).check("Ready", ready).end());
+    CHECK(tree == nullptr);
+
+    World world;
+    tree = Builder().check("Ready", ready).end();
+    world.add(tree);
+    CHECK_REPORTS(world.add(tree));
+    CHECK(world.size() == 1);
+
+    bool valid = false;
+    auto async = Builder().sequence(1).action("Wait", startWaiting).end();
+    CHECK_REPORTS(valid = Lockstep(*async).valid());
+    CHECK_FALSE(valid);
+}
+
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+TEST_CASE("Builder After Errors")
+{
+    // A failed definition is dropped and the builder starts the next one:
+    Builder builder(1024);
+    CHECK(builder.sequence(2).check("Ready", ready).end() == nullptr);
+    auto tree = builder.sequence(2).check("Ready", ready).check("Ready", ready).end();
+    REQUIRE(tree);
+    CHECK(tree->tick() == Status::Success);
+
+    // Invalid lockstep definitions are never ticked:
+    auto async = Builder().sequence(1).action("Wait", startWaiting).end();
+    Lockstep lockstep(*async);
+    lockstep.add(nullptr);
+    lockstep.tick();
+    CHECK(lockstep.status(0) == Status::Initial);
+}
+#endif
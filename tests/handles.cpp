@@ -0,0 +1,152 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+static vector<Handle> pendingRequests;
+
+static void startRequest(AsyncAction& action) { pendingRequests.push_back(action.handle()); }
+
+
+TEST_CASE("Async Node Handles")
+{
+    pendingRequests.clear();
+    auto tree = Builder(2014).action("Request", startRequest).end();
+    size_t handles = Handles::size();
+
+    tree->tick();
+    REQUIRE(pendingRequests.size() == 1);
+    CHECK(pendingRequests[0] != 0);
+    CHECK(Handles::size() == handles + 1);
+
+    // Completing through the handle invalidates it, late completions are dropped:
+    CHECK(AsyncNode::succeeded(pendingRequests[0]));
+    CHECK(tree->status() == Status::Success);
+    CHECK(Handles::size() == handles);
+    CHECK_FALSE(AsyncNode::failed(pendingRequests[0]));
+    CHECK(tree->status() == Status::Success);
+
+    // A handle of a previous run doesn't complete the next one:
+    tree->tick();
+    REQUIRE(pendingRequests.size() == 2);
+    CHECK(pendingRequests[1] != pendingRequests[0]);
+    CHECK_FALSE(AsyncNode::failed(pendingRequests[0]));
+    CHECK(tree->status() == Status::Suspended);
+
+    // Destroyed nodes release their handles, and so does their tree:
+    tree = nullptr;
+    CHECK_FALSE(AsyncNode::succeeded(pendingRequests[1]));
+    CHECK(Handles::size() == handles - 1);
+
+    // So do stopped ones:
+    tree = Builder(2014).action("Request", startRequest).end();
+    tree->tick();
+    REQUIRE(pendingRequests.size() == 3);
+    tree->stop();
+    CHECK_FALSE(AsyncNode::succeeded(pendingRequests[2]));
+    CHECK(tree->status() == Status::Failure);
+}
+
+TEST_CASE("Tree Handles")
+{
+    auto tree = Builder(2014).constant(Status::Success).end();
+    Handle handle = tree->handle();
+    CHECK(BehaviorTree::find(handle) == tree.get());
+    CHECK(BehaviorTree::find(0) == nullptr);
+
+    // Released slots are reused with a new generation:
+    tree = nullptr;
+    CHECK(BehaviorTree::find(handle) == nullptr);
+    auto next = Builder(2014).constant(Status::Success).end();
+    CHECK(next->handle() != handle);
+    CHECK(BehaviorTree::find(handle) == nullptr);
+    CHECK(BehaviorTree::find(next->handle()) == next.get());
+}
+
+TEST_CASE("Handle Kinds")
+{
+    pendingRequests.clear();
+    auto tree = Builder(2014).action("Request", startRequest).end();
+    tree->tick();
+    REQUIRE(pendingRequests.size() == 1);
+
+    // Handles only resolve to objects of their own kind:
+    CHECK(AsyncNode::find(tree->handle()) == nullptr);
+    CHECK_FALSE(AsyncNode::succeeded(tree->handle()));
+    CHECK(BehaviorTree::find(pendingRequests[0]) == nullptr);
+    CHECK(tree->status() == Status::Suspended);
+    CHECK(AsyncNode::succeeded(pendingRequests[0]));
+    CHECK(tree->status() == Status::Success);
+}
+
+TEST_CASE("Stale Handles Stay Invalid")
+{
+    // Released slots wait until many others are free, and reusing one bumps its generation:
+    int object = 0;
+    Handle stale = Handles::acquire(&object, HandleKind::Async);
+    REQUIRE(stale != 0);
+    Handles::release(stale);
+
+    int reuses = 0;
+    int firstReuse = 0;
+    bool matched = false;
+    for (int i = 1; i < (1 << 22) && reuses < 1000; ++i)
+    {
+        Handle handle = Handles::acquire(&object, HandleKind::Async);
+        if (!handle)
+            break;
+        matched = matched || handle == stale;
+        if ((handle & (Handles::Capacity - 1)) == (stale & (Handles::Capacity - 1)) && !reuses++)
+            firstReuse = i;
+        Handles::release(handle);
+    }
+    CHECK(reuses == 1000);
+    CHECK(firstReuse > (int)Handles::MinimumFree);
+    CHECK_FALSE(matched);
+    CHECK(Handles::get(stale, HandleKind::Async) == nullptr);
+}
+
+TEST_CASE("Handle Table Grows")
+{
+    // Far more trees than fit in the first chunk of slots, each with a waiting async node:
+    pendingRequests.clear();
+    Builder builder(1 << 24);
+    vector<Ref<BehaviorTree>> trees;
+    for (int i = 0; i < 70000; ++i)
+    {
+        trees.push_back(builder.action("Request", startRequest).end());
+        trees.back()->tick();
+    }
+    REQUIRE(pendingRequests.size() == trees.size());
+    bool found = true;
+    for (size_t i = 0; i < trees.size(); ++i)
+        found = found && BehaviorTree::find(trees[i]->handle()) == trees[i].get() && AsyncNode::find(pendingRequests[i]);
+    CHECK(found);
+}
+
+TEST_CASE("Full Handle Table")
+{
+    pendingRequests.clear();
+    auto tree = Builder(2014).action("Request", startRequest).end();
+
+    int object = 0;
+    size_t used = Handles::size();
+    vector<Handle> taken;
+    while (Handle handle = Handles::acquire(&object, HandleKind::Async))
+        taken.push_back(handle);
+    // Other threads may keep a few free slots:
+    size_t capacity = Handles::Capacity;
+    CHECK(used + taken.size() <= capacity);
+    CHECK(used + taken.size() > capacity - Handles::MinimumFree);
+
+    // Async nodes that can't get a handle fail instead of waiting forever:
+    CHECK(tree->tick() == Status::Failure);
+    CHECK(pendingRequests.empty());
+
+    for (Handle handle : taken)
+        Handles::release(handle);
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(pendingRequests.size() == 1);
+}
@@ -0,0 +1,64 @@
+
+#include "doctest.h"
+#include "../behavior_tree_formatting.hpp"
+#include <sstream>
+
+#if defined(BEHAVIOR_TREE_RELATIVE_LINKS)
+
+using namespace bt;
+
+Status linkedSuccess() { return Status::Success; }
+bool linkedFalse() { return false; }
+
+
+// Finds the root, the first node a traversal visits:
+class RootFinder : public Visitor
+{
+public:
+    virtual void visit(const Node& node) override { if (!root) root = &node; }
+    const Node* root = nullptr;
+};
+
+class LinkedObserver : public Observer
+{
+protected:
+    virtual void onComplete(Scheduler& scheduler, const Node& node, Status status) noexcept override {}
+};
+
+
+TEST_CASE("Relative Links Survive Copying The Memory")
+{
+    auto memory = makeRef<Memory>(2014);
+    auto scheduler = makeRef<Scheduler>(10);
+    auto tree = Builder(memory, scheduler)
+        .sequence(2)
+            .negate().check("Check", linkedFalse)
+            .selector(2)
+                .action("Action1", linkedSuccess)
+                .action("Action2", linkedSuccess)
+        .end();
+    RootFinder finder;
+    tree->traverse(finder);
+    REQUIRE(finder.root != nullptr);
+
+    // Copy the arena to another address. Only the nodes are used from the copy, they hold plain values
+    // and relative links. The tree holds references to its Memory and Scheduler and stays in place:
+    alignas(std::max_align_t) uint8_t copy[2014];
+    memcpy(copy, memory->data(), memory->size());
+    Node& copiedRoot = *(Node*)(copy + ((const uint8_t*)finder.root - memory->data()));
+
+    std::ostringstream original, copied;
+    TextSerializer originalSerializer(original), copiedSerializer(copied);
+    finder.root->traverse(originalSerializer);
+    copiedRoot.traverse(copiedSerializer);
+    CHECK(copied.str() == original.str());
+
+    // The copy has its own nodes:
+    LinkedObserver observer;
+    scheduler->start(copiedRoot, observer);
+    scheduler->tick();
+    CHECK(copiedRoot.status() == Status::Success);
+    CHECK(tree->status() == Status::Initial);
+}
+
+#endif
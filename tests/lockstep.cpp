@@ -0,0 +1,98 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+struct Soldier
+{
+    int id;
+    int steps;
+    int calls;
+};
+
+static bool enemyInSight(void* agent) { Soldier* s = (Soldier*)agent; ++s->calls; return s->id % 5 != 0; }
+static bool wounded(void* agent) { Soldier* s = (Soldier*)agent; ++s->calls; return s->id % 3 == 0; }
+static Status attack(void* agent) { Soldier* s = (Soldier*)agent; ++s->calls; return s->id % 2 ? Status::Success : Status::Failure; }
+
+static Status patrol(void* agent)
+{
+    Soldier* s = (Soldier*)agent;
+    ++s->calls;
+    if (s->steps-- > 0)
+        return Status::Running;
+    s->steps = s->id % 4;
+    return Status::Success;
+}
+
+static Status listen(void* agent)
+{
+    Soldier* s = (Soldier*)agent;
+    ++s->calls;
+    return s->calls % 7 == 0 ? Status::Failure : Status::Running;
+}
+
+static Ref<BehaviorTree> defineSoldier(void* agent)
+{
+    return Builder(4096)
+        .selector(3)
+            .sequence(3)
+                .check("EnemyInSight", enemyInSight, agent)
+                .negate()
+                    .check("Wounded", wounded, agent)
+                .action("Attack", attack, agent)
+            .parallel(2, Parallel::Policy::RequireOne)
+                .action("Patrol", patrol, agent)
+                .action("Listen", listen, agent)
+            .constant(Status::Success)
+        .end();
+}
+
+static void startMoving(AsyncAction& action) { action.succeeded(); }
+
+
+TEST_CASE("Lockstep Batches")
+{
+    // Two blocks, the second one partially filled:
+    const int count = 21;
+    vector<Soldier> alone, batched;
+    for (int i = 0; i < count; ++i)
+    {
+        alone.push_back(Soldier{i, i % 4, 0});
+        batched.push_back(Soldier{i, i % 4, 0});
+    }
+
+    vector<Ref<BehaviorTree>> trees;
+    for (int i = 0; i < count; ++i)
+        trees.push_back(defineSoldier(&alone[i]));
+
+    Lockstep lockstep(*defineSoldier(nullptr));
+    for (int i = 0; i < count; ++i)
+        CHECK(lockstep.add(&batched[i]) == (size_t)i);
+    CHECK(lockstep.size() == (size_t)count);
+
+    // Lanes take the same path through the tree as the agents ticked on their own:
+    for (int tick = 0; tick < 12; ++tick)
+    {
+        lockstep.tick();
+        for (int i = 0; i < count; ++i)
+        {
+            // Trees waiting on a running leaf are Suspended, lanes report them as Running:
+            Status status = trees[i]->tick();
+            CHECK(lockstep.status(i) == (status == Status::Suspended ? Status::Running : status));
+            CHECK(batched[i].calls == alone[i].calls);
+            CHECK(batched[i].steps == alone[i].steps);
+        }
+    }
+
+    lockstep.stop();
+    CHECK(lockstep.status(0) == Status::Failure);
+}
+
+TEST_CASE("Lockstep Unsupported Nodes")
+{
+    auto tree = Builder().sequence(1).action("Async", startMoving).end();
+    CHECK_REPORTS(Lockstep(*tree));
+}
@@ -0,0 +1,332 @@
+
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+static bool countAllocations = false;
+static int allocationCount = 0;
+
+void* operator new(size_t size)
+{
+    if (countAllocations)
+        ++allocationCount;
+    if (void* memory = malloc(size ? size : 1))
+        return memory;
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+    abort();
+#else
+    throw std::bad_alloc();
+#endif
+}
+
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t size) noexcept { free(memory); }
+
+bool allocationFreeCheck() { return true; }
+Status allocationFreeRunning() { return Status::Running; }
+
+
+TEST_CASE("Memory Reset")
+{
+    MockNodeInfo info;
+    auto memory = makeRef<Memory>(2014);
+    auto scheduler = makeRef<Scheduler>(10);
+
+    // Nodes of an unfinished definition are still destroyed by the Memory:
+    Builder(memory, scheduler)
+        .sequence(3)
+            .create<MockNode>(info, Status::Success)
+            .create<MockNode>(info, Status::Success);
+
+    CHECK(memory->size() > 0);
+    memory->reset();
+
+    CHECK(memory->size() == 0);
+    CHECK(info.createCount == 2);
+    CHECK(info.destroyCount == 2);
+}
+
+
+TEST_CASE("Memory Destroys Shared SubTrees")
+{
+    MockNodeInfo info;
+    {
+        Builder builder(2014);
+        auto subtree = builder
+            .sequence(2)
+                .create<MockNode>(info, Status::Success)
+                .create<MockNode>(info, Status::Success)
+            .end();
+
+        auto tree = builder
+            .selector(2)
+                .create<MockNode>(info, Status::Failure)
+                .action("SubTree", subtree)
+            .end();
+
+        CHECK(tree->tick() == Status::Success);
+    }
+
+    CHECK(info.createCount == 3);
+    CHECK(info.destroyCount == 3);
+}
+
+
+TEST_CASE("Tree Outlives Builder")
+{
+    MockNodeInfo info;
+    MemoryPool pool;
+    Ref<BehaviorTree> copy;
+    {
+        auto tree = Builder(pool, 1024)
+            .sequence(2)
+                .create<MockNode>(info, Status::Success)
+                .create<MockNode>(info, Status::Success)
+            .end();
+        copy = tree;
+    }
+
+    // The last reference keeps the arena, the scheduler and the nodes alive:
+    CHECK(pool.available() == 0);
+    CHECK(copy->tick() == Status::Success);
+    CHECK(info.destroyCount == 0);
+
+    copy = nullptr;
+    CHECK(info.destroyCount == 2);
+    CHECK(pool.available() == 1);
+}
+
+
+Ref<BehaviorTree> defineMeasuredTree(Builder& builder, MockNodeInfo& info)
+{
+    auto subtree = builder
+        .sequence(2)
+            .create<MockNode>(info, Status::Success)
+            .negate().create<MockNode>(info, Status::Failure)
+        .end();
+
+    return builder
+        .selector(2)
+            .create<MockNode>(info, Status::Failure)
+            .parallel(2, Parallel::Policy::RequireAll)
+                .action("SubTree", subtree)
+                .create<MockNode>(info, Status::Success)
+        .end();
+}
+
+
+TEST_CASE("Measured Memory")
+{
+    MockNodeInfo info;
+    Builder measure{Memory::Measure()};
+    CHECK(defineMeasuredTree(measure, info) == nullptr);
+    CHECK(info.createCount == 0);
+    size_t bytes = measure.size();
+
+    Builder builder(bytes);
+    auto tree = defineMeasuredTree(builder, info);
+    CHECK(builder.size() == bytes);
+    CHECK(tree->tick() == Status::Success);
+
+    Builder tooSmall(bytes - 1);
+    CHECK_REPORTS(defineMeasuredTree(tooSmall, info));
+}
+
+
+TEST_CASE("Building Without Heap Allocations")
+{
+    auto memory = makeRef<Memory>(8192);
+    auto scheduler = makeRef<Scheduler>(10);
+    Ref<BehaviorTree> tree;
+
+    allocationCount = 0;
+    countAllocations = true;
+    {
+        // Deep enough for the open groups to spill out of the builder into the arena:
+        Builder builder(memory, scheduler);
+        builder.sequence(2).check("Check", allocationFreeCheck);
+        for (int i = 0; i < 40; ++i)
+            builder.negate();
+        tree = builder.check("Check", allocationFreeCheck).end();
+    }
+    countAllocations = false;
+
+    // Without intrusive ownership the tree still needs a shared_ptr control block:
+#if defined(BEHAVIOR_TREE_INTRUSIVE_OWNERSHIP)
+    CHECK(allocationCount == 0);
+#else
+    CHECK(allocationCount == 1);
+#endif
+    CHECK(tree->tick() == Status::Success);
+}
+
+
+TEST_CASE("Pooled Trees Without Heap Allocations")
+{
+    MemoryPool pool;
+    auto buildAndTick = [&]()
+    {
+        Builder builder(pool, 1024);
+        auto tree = builder.sequence(2).check("Check", allocationFreeCheck).action("Run", allocationFreeRunning).end();
+        CHECK(tree->tick() == Status::Suspended);
+        CHECK(tree->tick() == Status::Suspended);
+    };
+
+    // The first loop creates the arena and its scheduler, which keeps its queues after:
+    buildAndTick();
+    allocationCount = 0;
+    countAllocations = true;
+    for (int i = 0; i < 3; ++i)
+        buildAndTick();
+    countAllocations = false;
+    CHECK(allocationCount == 0);
+}
+
+
+TEST_CASE("Run Queues Only Take Storage When Used")
+{
+    MockNodeInfo info;
+    auto scheduler = makeRef<Scheduler>(10);
+    Builder builder(makeRef<Memory>(1 << 17), scheduler);
+    vector<Ref<BehaviorTree>> trees;
+    for (int i = 0; i < 200; ++i)
+        trees.push_back(builder.create<MockNode>(info, Status::Running).end());
+
+    // The partitions of the trees that never ran don't allocate queues:
+    allocationCount = 0;
+    countAllocations = true;
+    CHECK(trees.back()->tick() == Status::Running);
+    countAllocations = false;
+    CHECK(allocationCount <= 2);
+
+    for (auto& tree : trees)
+        CHECK(tree->tick() == Status::Running);
+    CHECK(info.updateCount == 201);
+}
+
+
+bool sharedFalse() { return false; }
+bool sharedTrue() { return true; }
+static vector<AsyncAction*> sharedWaiting;
+static void startSharedWait(AsyncAction& action) { sharedWaiting.push_back(&action); }
+
+Ref<BehaviorTree> createSharedTree(Builder& builder, MockNodeInfo& info)
+{
+    return builder
+        .selector(3)
+            .sequence(2)
+                .check("Check", sharedFalse)
+                .create<MockNode>(info, Status::Success)
+            .sequence(2)
+                .negate().check("Check", sharedFalse)
+                .check("Check", sharedFalse)
+            .sequence(2)
+                .negate().check("Check", sharedFalse)
+                .check("Check", sharedTrue)
+        .end();
+}
+
+
+TEST_CASE("Shared Subtrees")
+{
+    MockNodeInfo info;
+    Builder plain(2014);
+    auto tree = createSharedTree(plain, info);
+    size_t plainSize = plain.size();
+
+    Builder builder(4096);
+    builder.deduplicate();
+    size_t schedulerSize = builder.size();
+    auto first = createSharedTree(builder, info);
+    size_t firstSize = builder.size();
+    auto second = createSharedTree(builder, info);
+    CHECK(firstSize < plainSize);
+
+    // Nodes hold the observer and partition of their run, so trees don't share them:
+    CHECK(builder.size() - firstSize == firstSize - schedulerSize);
+    first = nullptr;
+    for (int i = 0; i < 3; ++i)
+        CHECK(second->tick() == tree->tick());
+
+    // Trees completing outside of a tick each get their own result:
+    auto defineWaiting = [](Builder& builder)
+    {
+        return builder
+            .sequence(2)
+                .action("Wait", startSharedWait)
+                .sequence(2)
+                    .check("Check", sharedTrue)
+                    .check("Check", sharedTrue)
+            .end();
+    };
+    sharedWaiting.clear();
+    auto firstWaiting = defineWaiting(builder);
+    auto secondWaiting = defineWaiting(builder);
+    CHECK(firstWaiting->tick() == Status::Suspended);
+    CHECK(secondWaiting->tick() == Status::Suspended);
+    REQUIRE(sharedWaiting.size() == 2);
+    sharedWaiting[0]->succeeded();
+    sharedWaiting[1]->succeeded();
+    CHECK(firstWaiting->tick() == Status::Success);
+    CHECK(secondWaiting->tick() == Status::Success);
+
+    // Parallel children are queued together and are never shared:
+    auto parallel = builder
+        .parallel(2, Parallel::Policy::RequireAll)
+            .check("Check", sharedTrue)
+            .check("Check", sharedTrue)
+        .end();
+    CHECK(parallel->tick() == Status::Success);
+
+    // Nor are nodes deeper below a Parallel:
+    auto defineNested = [](Builder& builder)
+    {
+        return builder
+            .parallel(2, Parallel::Policy::RequireAll)
+                .negate().negate().check("Check", sharedTrue)
+                .negate().negate().check("Check", sharedTrue)
+            .end();
+    };
+    Builder nestedPlain(2014), nestedShared(2014);
+    nestedShared.deduplicate();
+    defineNested(nestedPlain);
+    auto nested = defineNested(nestedShared);
+    CHECK(nestedShared.size() == nestedPlain.size());
+    CHECK(nested->tick() == Status::Success);
+}
+
+
+TEST_CASE("Memory Pool")
+{
+    MockNodeInfo info;
+    MemoryPool pool;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        auto tree = Builder(pool, 1000)
+            .sequence(2)
+                .create<MockNode>(info, Status::Success)
+                .create<MockNode>(info, Status::Success)
+            .end();
+
+        CHECK(pool.available() == 0);
+        CHECK(tree->tick() == Status::Success);
+    }
+
+    // The same arena was recycled for every tree:
+    CHECK(pool.available() == 1);
+    CHECK(info.createCount == 6);
+    CHECK(info.destroyCount == 6);
+
+    auto small = pool.acquire(100);
+    auto large = pool.acquire(1000);
+    CHECK(small->maxSize() < large->maxSize());
+    CHECK(large->maxSize() >= 1000);
+    CHECK(pool.available() == 0);
+}
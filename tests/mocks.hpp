@@ -27,6 +27,7 @@ public:
         : MockNode(info, std::vector<bt::Status>{result}, name) { }
 
 protected:
+    virtual bool synchronous() const noexcept override { return true; }
     virtual bt::Status update() noexcept override
     {
         ++info->updateCount;
@@ -44,4 +45,21 @@ private:
     int index = -1;
 };
 
+
+inline size_t& reportedErrorCount() { static size_t count = 0; return count; }
+inline void countReportedError(const char*) { ++reportedErrorCount(); }
+
+// Errors are thrown, or reported to the error handler without exceptions:
+#if defined(BEHAVIOR_TREE_NO_EXCEPTIONS)
+#define CHECK_REPORTS(statement) do { \
+        bt::ErrorHandler previousHandler = bt::setErrorHandler(countReportedError); \
+        size_t reported = reportedErrorCount(); \
+        static_cast<void>(statement); \
+        CHECK(reportedErrorCount() > reported); \
+        bt::setErrorHandler(previousHandler); \
+    } while (false)
+#else
+#define CHECK_REPORTS(statement) CHECK_THROWS(statement)
+#endif
+
 #endif
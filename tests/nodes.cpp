@@ -24,3 +24,86 @@ TEST_CASE("Node Update 1")
     CHECK(info.updateCount == 2);
     CHECK(info.destroyCount == 1);
 }
+
+
+static int pureCheckCount = 0;
+bool pureCheck() { ++pureCheckCount; return pureCheckCount % 2 == 1; }
+
+TEST_CASE("Pure Conditions")
+{
+    auto scheduler = makeRef<Scheduler>(10);
+    auto tree = Builder(makeRef<Memory>(2014), scheduler)
+        .selector(3)
+            .sequence(2)
+                .negate().pureCheck("Check", pureCheck)
+                .pureCheck("Check", pureCheck)
+            .pureCheck("Check", pureCheck)
+            .pureCheck("Check", pureCheck)
+        .end();
+
+    // Evaluated once per tick and shared by every branch checking it:
+    CHECK(tree->tick() == Status::Success);
+    CHECK(pureCheckCount == 1);
+    CHECK(tree->tick() == Status::Failure);
+    CHECK(pureCheckCount == 2);
+
+    ConditionCache* cache = scheduler->conditionCache();
+    REQUIRE(cache);
+    CHECK(cache->misses() == 2);
+    CHECK(cache->hits() == 4);
+}
+
+
+TEST_CASE("Scheduler Partitions")
+{
+    MockNodeInfo first, second;
+    auto scheduler = makeRef<Scheduler>(10);
+    Builder builder(makeRef<Memory>(2014), scheduler);
+    auto a = builder.sequence(1).create<MockNode>(first, Status::Running).end();
+    auto b = builder.sequence(1).create<MockNode>(second, Status::Running).end();
+
+    // Trees sharing a scheduler only update their own nodes:
+    CHECK(a->tick() == Status::Suspended);
+    CHECK(a->tick() == Status::Suspended);
+    CHECK(b->tick() == Status::Suspended);
+    CHECK(first.updateCount == 2);
+    CHECK(second.updateCount == 1);
+
+    // The scheduler can still sweep every tree:
+    scheduler->tick();
+    CHECK(first.updateCount == 3);
+    CHECK(second.updateCount == 2);
+    CHECK(scheduler->idle(0));
+}
+
+
+TEST_CASE("Scheduler Reuses Partitions")
+{
+    MockNodeInfo running, other;
+    auto scheduler = makeRef<Scheduler>(10);
+    auto tree = Builder(makeRef<Memory>(1024), scheduler).create<MockNode>(running, Status::Running).end();
+    CHECK(tree->tick() == Status::Running);
+
+    // Partitions of destroyed trees are reused, so a live tree never shares its own:
+    for (size_t i = 0; i < std::numeric_limits<Partition>::max() + 10u; ++i)
+    {
+        auto temporary = Builder(makeRef<Memory>(1024), scheduler).create<MockNode>(other, Status::Running).end();
+        CHECK(temporary->tick() == Status::Running);
+    }
+    CHECK(running.updateCount == 1);
+    CHECK(other.updateCount == std::numeric_limits<Partition>::max() + 10);
+}
+
+
+TEST_CASE("Deep Decorator Chain")
+{
+    // Completions travel up iteratively, a recursive chain this deep would overflow the stack:
+    const int depth = 100000;
+    Builder builder(32 << 20);
+    for (int i = 0; i < depth; ++i)
+        builder.negate();
+    auto tree = builder.constant(Status::Failure).end();
+
+    CHECK(tree->tick() == Status::Failure);
+    CHECK(tree->tick() == Status::Failure);
+}
@@ -0,0 +1,156 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+
+Ref<BehaviorTree> createNestedTree(MockNodeInfo& info, Optimizer* optimizer)
+{
+    Builder builder(2014);
+    builder
+        .selector(3)
+            .sequence(3)
+                .create<MockNode>(info, vector<Status>{Status::Success, Status::Failure})
+                .sequence(2)
+                    .constant(Status::Success)
+                    .negate().negate().create<MockNode>(info, vector<Status>{Status::Running, Status::Success})
+                .sequence(1)
+                    .create<MockNode>(info, Status::Success)
+            .negate().constant(Status::Success)
+            .parallel(1, Parallel::Policy::RequireAll)
+                .selector(2)
+                    .selector(2)
+                        .create<MockNode>(info, Status::Failure)
+                        .create<MockNode>(info, Status::Failure)
+                    .create<MockNode>(info, vector<Status>{Status::Failure, Status::Success});
+    return optimizer ? builder.end(*optimizer) : builder.end();
+}
+
+
+TEST_CASE("Optimizer Keeps Results")
+{
+    MockNodeInfo info, optimizedInfo;
+    {
+        Optimizer optimizer;
+        auto tree = createNestedTree(info, nullptr);
+        auto optimized = createNestedTree(optimizedInfo, &optimizer);
+
+        CHECK(optimizer.nodesBefore() == 18);
+        CHECK(optimizer.nodesAfter() == 8);
+
+        for (int i = 0; i < 8; ++i)
+        {
+            CHECK(optimized->tick() == tree->tick());
+            CHECK(optimizedInfo.updateCount == info.updateCount);
+        }
+    }
+
+    CHECK(optimizedInfo.createCount == 6);
+    CHECK(optimizedInfo.destroyCount == 6);
+}
+
+
+TEST_CASE("Optimizer Folds Constants")
+{
+    MockNodeInfo info;
+    Optimizer optimizer;
+    Builder builder(2014);
+
+    auto constant = builder
+        .sequence(2)
+            .constant(Status::Success)
+            .negate().constant(Status::Failure)
+        .end(optimizer);
+
+    CHECK(optimizer.nodesBefore() == 4);
+    CHECK(optimizer.nodesAfter() == 1);
+    CHECK(constant->tick() == Status::Success);
+
+    auto stopped = builder
+        .sequence(3)
+            .create<MockNode>(info, Status::Success)
+            .constant(Status::Failure)
+            .create<MockNode>(info, Status::Success)
+        .end(optimizer);
+
+    CHECK(optimizer.nodesAfter() == 3);
+    CHECK(stopped->tick() == Status::Failure);
+    CHECK(info.updateCount == 1);
+}
+
+
+static int optimizedActionCount = 0;
+static Status optimizedAction() { ++optimizedActionCount; return Status::Success; }
+static bool optimizedCheck() { return true; }
+
+TEST_CASE("Optimizer Leaves Shared Nodes")
+{
+    Optimizer optimizer;
+    Builder builder(4096);
+    builder.deduplicate();
+
+    // The second constant is shared with the first one, so the negation can't invert it:
+    optimizedActionCount = 0;
+    auto tree = builder
+        .sequence(3)
+            .constant(Status::Success)
+            .action("Act", optimizedAction)
+            .negate().constant(Status::Success)
+        .end(optimizer);
+    CHECK(tree->tick() == Status::Failure);
+    CHECK(optimizedActionCount == 1);
+
+    // Optimizing a tree doesn't change the ones built before it:
+    auto define = [](Builder& builder) -> Builder&
+    {
+        return builder
+            .sequence(2)
+                .action("Act", optimizedAction)
+                .sequence(2)
+                    .check("Check", optimizedCheck)
+                    .negate().constant(Status::Success);
+    };
+    auto plain = define(builder).end();
+    auto optimized = define(builder).end(optimizer);
+    optimized = nullptr;
+    CHECK(plain->tick() == Status::Failure);
+}
+
+TEST_CASE("Optimizer Measured Memory")
+{
+    MockNodeInfo info;
+    auto define = [&info](Builder& builder, Optimizer& optimizer)
+    {
+        return builder
+            .sequence(3)
+                .sequence(2)
+                    .create<MockNode>(info, Status::Success)
+                    .negate().negate().sequence(2)
+                        .create<MockNode>(info, Status::Success)
+                        .create<MockNode>(info, Status::Success)
+                .selector(1)
+                    .sequence(3)
+                        .create<MockNode>(info, Status::Success)
+                        .negate().constant(Status::Failure)
+                        .create<MockNode>(info, Status::Success)
+                .create<MockNode>(info, Status::Success)
+            .end(optimizer);
+    };
+
+    Optimizer measuring;
+    Builder measure{Memory::Measure()};
+    CHECK(define(measure, measuring) == nullptr);
+
+    // The measured bytes hold the child arrays the optimizer flattens, so it optimizes fully:
+    Optimizer unbounded, measured;
+    Builder large(4096), exact(measure.size());
+    define(large, unbounded);
+    auto tree = define(exact, measured);
+    REQUIRE(tree != nullptr);
+    CHECK(measured.nodesAfter() == unbounded.nodesAfter());
+    CHECK(measured.nodesAfter() < measured.nodesBefore());
+    CHECK(tree->tick() == Status::Success);
+}
@@ -0,0 +1,60 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+static int lineOfSightCount = 0;
+bool lineOfSight(uint64_t target) { ++lineOfSightCount; return target == 7; }
+Status moveTo(uint64_t target) { return target == 7 ? Status::Success : Status::Failure; }
+
+
+TEST_CASE("Query Cache")
+{
+    // Colliding queries evict each other, so each cache holds one query to keep the counts exact:
+    QueryCache cache(64, true);
+    QueryCache moves(64, true);
+    vector<Ref<BehaviorTree>> agents;
+    for (int i = 0; i < 3; ++i)
+    {
+        agents.push_back(Builder(2014)
+            .sequence(2)
+                .check("LineOfSight", cache, lineOfSight, 7, 2)
+                .action("MoveTo", moves, moveTo, 7, 2)
+            .end());
+    }
+
+    // The first agent runs the queries, the others reuse its results:
+    for (auto& agent : agents)
+        CHECK(agent->tick() == Status::Success);
+    CHECK(lineOfSightCount == 1);
+    CHECK(cache.misses() == 1);
+    CHECK(cache.hits() == 2);
+    CHECK(moves.misses() == 1);
+    CHECK(moves.hits() == 2);
+
+    cache.advance();
+    moves.advance();
+    CHECK(agents[0]->tick() == Status::Success);
+    CHECK(lineOfSightCount == 1);
+
+    // Results expire after their time to live:
+    cache.advance();
+    moves.advance();
+    CHECK(agents[0]->tick() == Status::Success);
+    CHECK(lineOfSightCount == 2);
+
+    // Other keys are cached separately:
+    auto other = Builder(2014).check("LineOfSight", cache, lineOfSight, 8, 2).end();
+    CHECK(other->tick() == Status::Failure);
+    CHECK(lineOfSightCount == 3);
+
+    // Lookups are only counted on request:
+    QueryCache uncounted(64);
+    CHECK(uncounted.evaluate(lineOfSight, 7, 2) == Status::Success);
+    CHECK(uncounted.evaluate(lineOfSight, 7, 2) == Status::Success);
+    CHECK(lineOfSightCount == 4);
+    CHECK(uncounted.hits() == 0);
+    CHECK(uncounted.misses() == 0);
+}
@@ -0,0 +1,104 @@
+
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+
+Ref<BehaviorTree> createStateTree(MockNodeInfo& info1, MockNodeInfo& info2, MockNodeInfo& info3)
+{
+    return Builder(2014)
+        .parallel(2, Parallel::Policy::RequireAll)
+            .sequence(2)
+                .create<MockNode>(info1, Status::Success)
+                .create<MockNode>(info2, vector<Status>{Status::Running, Status::Failure})
+            .negate().create<MockNode>(info3, Status::Failure)
+        .end();
+}
+
+
+TEST_CASE("Save And Restore State")
+{
+    MockNodeInfo info1, info2, info3;
+    auto tree = createStateTree(info1, info2, info3);
+
+    CHECK(tree->tick() == Status::Suspended);
+
+    vector<uint8_t> state;
+    tree->saveState(state);
+    CHECK(state.size() > 0);
+
+    CHECK(tree->tick() == Status::Failure);
+    CHECK(info2.updateCount == 2);
+
+    // Roll back to the running state:
+    CHECK(tree->restoreState(state));
+    CHECK(tree->status() == Status::Suspended);
+
+    // Only the restored running node is updated, the rest of the tree is not restarted:
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(info1.updateCount == 1);
+    CHECK(info2.updateCount == 3);
+    CHECK(info3.updateCount == 1);
+
+    CHECK(tree->tick() == Status::Failure);
+    CHECK(info2.updateCount == 4);
+}
+
+
+TEST_CASE("Restore State Into New Tree")
+{
+    MockNodeInfo info1, info2, info3;
+    auto tree = createStateTree(info1, info2, info3);
+    CHECK(tree->tick() == Status::Suspended);
+
+    vector<uint8_t> state;
+    tree->saveState(state);
+
+    MockNodeInfo copy1, copy2, copy3;
+    auto copy = createStateTree(copy1, copy2, copy3);
+    CHECK(copy->restoreState(state));
+    CHECK(copy->status() == Status::Suspended);
+
+    // The copy resumes the running node without restarting the completed ones:
+    CHECK(copy->tick() == Status::Suspended);
+    CHECK(copy->tick() == Status::Failure);
+    CHECK(copy1.updateCount == 0);
+    CHECK(copy2.updateCount == 2);
+    CHECK(copy3.updateCount == 0);
+
+    vector<uint8_t> truncated(state.begin(), state.end() - 1);
+    CHECK_FALSE(copy->restoreState(truncated));
+}
+
+
+TEST_CASE("Reject Corrupt State")
+{
+    MockNodeInfo info1, info2, info3;
+    auto tree = createStateTree(info1, info2, info3);
+    CHECK(tree->tick() == Status::Suspended);
+
+    vector<uint8_t> state;
+    tree->saveState(state);
+    CHECK(tree->tick() == Status::Failure);
+
+    // Out of range status of the sequence, past its last child, and a queued node outside the tree:
+    vector<uint8_t> status(state), index(state), queued(state);
+    status[5] = 0x7f;
+    index[6] = 2;
+    queued[queued.size() - 8] += 1;
+
+    // Corrupt blobs are rejected before any node is restored:
+    CHECK_FALSE(tree->restoreState(status));
+    CHECK_FALSE(tree->restoreState(index));
+    CHECK_FALSE(tree->restoreState(queued));
+    CHECK(tree->status() == Status::Failure);
+    CHECK(tree->tick() == Status::Suspended);
+    CHECK(info2.updateCount == 3);
+
+    CHECK(tree->restoreState(state));
+    CHECK(tree->status() == Status::Suspended);
+}
@@ -2,3 +2,16 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "nodes.cpp"
 #include "composites.cpp"
+#include "visitors.cpp"
+#include "state.cpp"
+#include "coroutines.cpp"
+#include "memory.cpp"
+#include "links.cpp"
+#include "optimizer.cpp"
+#include "queries.cpp"
+#include "lockstep.cpp"
+#include "batches.cpp"
+#include "world.cpp"
+#include "errors.cpp"
+#include "handles.cpp"
+#include "threads.cpp"
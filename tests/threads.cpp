@@ -0,0 +1,125 @@
+#include "doctest.h"
+#include "../behavior_tree_threads.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+struct Route
+{
+    int id;
+    int length;
+    int searches;
+};
+
+// Counts the jobs waiting for their cancellation, so the test can wait for one to start:
+static std::mutex waitingMutex;
+static std::condition_variable waitingChanged;
+static int waitingJobs = 0;
+
+static void changeWaitingJobs(int change)
+{
+    {
+        std::lock_guard<std::mutex> lock(waitingMutex);
+        waitingJobs += change;
+    }
+    waitingChanged.notify_all();
+}
+
+static Status findPath(void* agent, const std::atomic<bool>&)
+{
+    Route* route = (Route*)agent;
+    route->length = route->id * 10;
+    return ++route->searches < 2 ? Status::Running : route->id % 3 ? Status::Success : Status::Failure;
+}
+
+static Status waitForCancel(void*, const std::atomic<bool>& cancelled)
+{
+    changeWaitingJobs(1);
+    while (!cancelled.load())
+        std::this_thread::yield();
+    changeWaitingJobs(-1);
+    return Status::Success;
+}
+
+static bool followPath() { return true; }
+
+// Collects finished jobs until the pool is idle:
+static void completeAll(ThreadPool& pool)
+{
+    while (pool.pending())
+        pool.complete(true);
+}
+
+
+TEST_CASE("Threaded Actions")
+{
+    ThreadPool pool(2);
+    CHECK(pool.size() == 2);
+
+    const int count = 12;
+    vector<Route> routes;
+    for (int i = 0; i < count; ++i)
+        routes.push_back(Route{i, 0, 0});
+
+    vector<Ref<BehaviorTree>> trees;
+    for (int i = 0; i < count; ++i)
+    {
+        trees.push_back(Builder(2014)
+            .sequence(2)
+                .create<ThreadedAction>("FindPath", pool, findPath, &routes[i])
+                .check("FollowPath", followPath)
+            .end());
+    }
+
+    // Actions wait on the pool and only complete on the thread collecting the jobs:
+    for (auto& tree : trees)
+        CHECK(tree->tick() == Status::Suspended);
+    CHECK(pool.pending() == count);
+    completeAll(pool);
+    CHECK(pool.pending() == 0);
+
+    // Running results ran again before completing, successful ones go on with the sequence:
+    for (int i = 0; i < count; ++i)
+    {
+        if (trees[i]->status() == Status::Suspended)
+            trees[i]->tick();
+        CHECK(routes[i].searches == 2);
+        CHECK(routes[i].length == i * 10);
+        CHECK(trees[i]->status() == (i % 3 ? Status::Success : Status::Failure));
+    }
+}
+
+TEST_CASE("Threaded Action Cancellation")
+{
+    ThreadPool pool(1);
+    auto waiting = Builder(2014).create<ThreadedAction>("Wait", pool, waitForCancel).end();
+    auto queued = Builder(2014).create<ThreadedAction>("Wait", pool, waitForCancel).end();
+    waiting->tick();
+    queued->tick();
+    {
+        std::unique_lock<std::mutex> lock(waitingMutex);
+        waitingChanged.wait(lock, [] { return waitingJobs > 0; });
+        CHECK(waitingJobs == 1);
+    }
+
+    // Stopping cancels the running job, destroying the tree drops the queued one:
+    waiting->stop();
+    queued = nullptr;
+    completeAll(pool);
+    CHECK(pool.pending() == 0);
+    CHECK(waitingJobs == 0);
+    CHECK(waiting->status() == Status::Failure);
+
+    // Cancelled jobs are recycled for the next run:
+    Route route{4, 0, 0};
+    auto tree = Builder(2014).create<ThreadedAction>("FindPath", pool, findPath, &route).end();
+    tree->tick();
+    completeAll(pool);
+    CHECK(route.searches == 2);
+    CHECK(tree->status() == Status::Success);
+}
@@ -0,0 +1,149 @@
+
+#include "doctest.h"
+#include "../behavior_tree_formatting.hpp"
+#include "mocks.hpp"
+#include <sstream>
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+
+TEST_CASE("Buffered Text Serializer")
+{
+    MockNodeInfo info;
+    auto tree = Builder(2014)
+        .sequence(3)
+            .create<MockNode>(info, Status::Success, "First")
+            .negate().create<MockNode>(info, Status::Failure, "Second")
+            .selector(2)
+                .create<MockNode>(info, Status::Running, "Third")
+                .create<MockNode>(info, Status::Success, "Fourth")
+        .end();
+
+    tree->tick();
+
+    std::ostringstream expected, actual;
+    TextSerializer serializer(expected);
+    BufferedTextSerializer buffered(actual);
+
+    // Serialize twice to make sure the buffer is reset between dumps:
+    tree->traverse(buffered);
+    tree->traverse(buffered);
+    tree->traverse(serializer);
+
+    CHECK(buffered.text() == expected.str());
+    CHECK(actual.str() == expected.str() + expected.str());
+}
+
+TEST_CASE("Stream Output")
+{
+    MockNodeInfo info;
+    auto tree = Builder(2014)
+        .selector(2)
+            .create<MockNode>(info, Status::Failure, "First")
+            .create<MockNode>(info, Status::Success, "Second")
+        .end();
+    tree->tick();
+
+    std::ostringstream status, expected, actual;
+    status << Status::Suspended;
+    CHECK(status.str() == "Suspended");
+
+    TextSerializer serializer(expected, true);
+    tree->traverse(serializer);
+    actual << *tree;
+    CHECK(actual.str() == expected.str());
+}
+
+
+#if !defined(BEHAVIOR_TREE_STRIP_NAMES)
+TEST_CASE("Status Diff Serializer")
+{
+    MockNodeInfo info;
+    auto tree = Builder(2014)
+        .sequence(2)
+            .create<MockNode>(info, Status::Success, "First")
+            .create<MockNode>(info, vector<Status>{Status::Running, Status::Running, Status::Failure}, "Second")
+        .end();
+
+    StatusDiffSerializer serializer(tree);
+    char buffer[256];
+    auto write = [&]() { return std::string(buffer, serializer.write(buffer, sizeof(buffer))); };
+
+    CHECK(write() == "");
+
+    tree->tick();
+    CHECK(write() == "0 Sequence: Suspended\n1 First: Success\n2 Second: Running\n");
+
+    tree->tick();
+    CHECK(write() == "");
+
+    tree->tick();
+    CHECK(write() == "0 Sequence: Failure\n2 Second: Failure\n");
+
+    serializer.reset();
+    CHECK(write() == "0 Sequence: Failure\n1 First: Success\n2 Second: Failure\n");
+
+    // Lines that don't fit the buffer are written next time:
+    serializer.reset();
+    CHECK(std::string(buffer, serializer.write(buffer, 30)) == "0 Sequence: Failure\n");
+    CHECK(write() == "1 First: Success\n2 Second: Failure\n");
+}
+
+TEST_CASE("Status Diff Serializers Sharing A Scheduler")
+{
+    MockNodeInfo info;
+    Builder builder(4096);
+    auto first = builder.create<MockNode>(info, Status::Success, "First").end();
+    auto second = builder.create<MockNode>(info, Status::Failure, "Second").end();
+
+    // Trees of the same builder share their scheduler, each serializer still gets its tree's changes:
+    StatusDiffSerializer firstSerializer(first);
+    StatusDiffSerializer secondSerializer(second);
+    char buffer[256];
+    first->tick();
+    second->tick();
+    CHECK(std::string(buffer, firstSerializer.write(buffer, sizeof(buffer))) == "0 First: Success\n");
+    CHECK(std::string(buffer, secondSerializer.write(buffer, sizeof(buffer))) == "0 Second: Failure\n");
+}
+
+TEST_CASE("Status Diff Serializer Restored State")
+{
+    MockNodeInfo info;
+    auto tree = Builder(2014)
+        .sequence(2)
+            .create<MockNode>(info, Status::Success, "First")
+            .create<MockNode>(info, vector<Status>{Status::Running, Status::Failure}, "Second")
+        .end();
+
+    StatusDiffSerializer serializer(tree);
+    char buffer[256];
+    auto write = [&]() { return std::string(buffer, serializer.write(buffer, sizeof(buffer))); };
+    tree->tick();
+    vector<uint8_t> state;
+    tree->saveState(state);
+    tree->tick();
+    write();
+
+    // Restored statuses are changes like the ones of ticks:
+    CHECK(tree->restoreState(state));
+    CHECK(write() == "0 Sequence: Suspended\n2 Second: Running\n");
+}
+
+TEST_CASE("Status Diff Serializer Decorators")
+{
+    MockNodeInfo info;
+    auto tree = Builder(2014)
+        .sequence(2)
+            .negate().create<MockNode>(info, Status::Failure, "First")
+            .create<MockNode>(info, Status::Running, "Second")
+        .end();
+
+    StatusDiffSerializer serializer(tree);
+    char buffer[256];
+    tree->tick();
+    CHECK(std::string(buffer, serializer.write(buffer, sizeof(buffer))) ==
+        "0 Sequence: Suspended\n1 Not First: Success\n2 Second: Running\n");
+}
+#endif
@@ -0,0 +1,103 @@
+#include "doctest.h"
+#include "../behavior_tree.hpp"
+#include "mocks.hpp"
+#include <vector>
+
+using std::vector;
+using namespace bt;
+
+static vector<AsyncAction*> waitingActions;
+static int arrivals = 0;
+
+static void startTravel(AsyncAction& action) { waitingActions.push_back(&action); }
+static Status arrive() { ++arrivals; return Status::Success; }
+
+
+TEST_CASE("World Active Set")
+{
+    World world;
+    waitingActions.clear();
+    for (int i = 0; i < 50; ++i)
+    {
+        world.add(Builder(2014)
+            .sequence(2)
+                .action("Travel", startTravel)
+                .action("Arrive", arrive)
+            .end());
+    }
+    CHECK(world.size() == 50);
+    CHECK(world.active() == 50);
+
+    // Every tree waits on its async action and goes to sleep:
+    world.tick();
+    CHECK(waitingActions.size() == 50);
+    CHECK(world.active() == 0);
+    world.tick();
+    CHECK(waitingActions.size() == 50);
+
+    // Completions wake their trees only:
+    waitingActions[3]->succeeded();
+    waitingActions[7]->succeeded();
+    CHECK(world.active() == 2);
+    world.tick();
+    CHECK(arrivals == 2);
+
+    // Completed trees restart and sleep on their next action:
+    CHECK(world.active() == 2);
+    world.tick();
+    CHECK(waitingActions.size() == 52);
+    CHECK(world.active() == 0);
+
+    // A failed root wakes its tree as well:
+    waitingActions[10]->failed();
+    CHECK(world.active() == 1);
+
+    auto tree = Builder(2014).action("Arrive", arrive).end();
+    world.add(tree);
+    CHECK_REPORTS(world.add(tree));
+    CHECK(world.remove(*tree));
+    CHECK_FALSE(world.remove(*tree));
+    CHECK(world.size() == 50);
+    CHECK(world.active() == 1);
+}
+
+TEST_CASE("World Completions")
+{
+    World world;
+    waitingActions.clear();
+    vector<Ref<BehaviorTree>> trees;
+    for (int i = 0; i < 4; ++i)
+    {
+        trees.push_back(Builder(2014).action("Travel", startTravel).end());
+        world.add(trees.back());
+    }
+
+    World::Completion completion;
+    world.tick();
+    CHECK_FALSE(world.poll(completion));
+
+    // Only the trees that completed are polled, in completion order:
+    waitingActions[2]->succeeded();
+    waitingActions[0]->failed();
+    CHECK(world.poll(completion));
+    CHECK(completion.tree == trees[2]->handle());
+    CHECK(completion.status == Status::Success);
+    CHECK(world.poll(completion));
+    CHECK(completion.tree == trees[0]->handle());
+    CHECK(completion.status == Status::Failure);
+    CHECK_FALSE(world.poll(completion));
+
+    // Removed trees leave the queue:
+    waitingActions[1]->succeeded();
+    waitingActions[3]->succeeded();
+    world.remove(*trees[1]);
+    CHECK(world.poll(completion));
+    CHECK(completion.tree == trees[3]->handle());
+    CHECK_FALSE(world.poll(completion));
+
+    // Completions don't keep their tree alive:
+    CHECK(BehaviorTree::find(completion.tree) == trees[3].get());
+    world.remove(*trees[3]);
+    trees[3] = nullptr;
+    CHECK(BehaviorTree::find(completion.tree) == nullptr);
+}